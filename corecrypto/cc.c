@@ -0,0 +1,26 @@
+#include <corecrypto/cc.h>
+
+void
+cc_clear(size_t len, void *dst)
+{
+    volatile unsigned char *p = dst;
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+int
+cc_cmp_safe(size_t num, const void *ptr1, const void *ptr2)
+{
+    const unsigned char *s = ptr1;
+    const unsigned char *t = ptr2;
+    unsigned char flag = 0;
+    size_t i;
+    if (!num) {
+        return 1;
+    }
+    for (i = 0; i < num; i++) {
+        flag |= s[i] ^ t[i];
+    }
+    return flag != 0;
+}
@@ -1 +1,28 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CC_H_
+#define _CORECRYPTO_CC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * a small, self-contained stand-in for the parts of corecrypto img4 uses:
+ * SHA-1, SHA-384, AES-CBC and RSA PKCS#1 v1.5 verification.  the names follow
+ * corecrypto so the USE_CORECRYPTO paths read the same either way
+ */
+
+/* number of _type_ elements needed to hold _size_ bytes */
+#define cc_ctx_n(_type_, _size_) (((_size_) + sizeof(_type_) - 1) / sizeof(_type_))
+
+/* declare a context of at least _size_ bytes, aligned like _type_ */
+#define cc_ctx_decl(_type_, _size_, _name_) _type_ _name_[cc_ctx_n(_type_, _size_)]
+
+#define cc_zero(_size_, _data_) memset((_data_), 0, (_size_))
+
+/* wipe secrets; not optimised away like a plain memset may be */
+void cc_clear(size_t len, void *dst);
+
+/* constant time, 0 if equal */
+int cc_cmp_safe(size_t num, const void *ptr1, const void *ptr2);
+
+#endif
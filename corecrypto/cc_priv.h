@@ -1 +1,40 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CC_PRIV_H_
+#define _CORECRYPTO_CC_PRIV_H_
+
+#include <corecrypto/cc.h>
+
+#define CC_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define CC_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CC_ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define CC_LOAD32_BE(p) \
+    (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#define CC_LOAD64_BE(p) (((uint64_t)CC_LOAD32_BE(p) << 32) | CC_LOAD32_BE((p) + 4))
+
+#define CC_STORE32_BE(x, p) do { \
+        (p)[0] = (unsigned char)((x) >> 24); \
+        (p)[1] = (unsigned char)((x) >> 16); \
+        (p)[2] = (unsigned char)((x) >> 8); \
+        (p)[3] = (unsigned char)(x); \
+    } while (0)
+#define CC_STORE64_BE(x, p) do { \
+        CC_STORE32_BE((uint32_t)((x) >> 32), p); \
+        CC_STORE32_BE((uint32_t)(x), (p) + 4); \
+    } while (0)
+
+/*
+ * instruction set extensions.  x86-64 picks them at run time with target
+ * attributes; arm64 uses them when the compiler is allowed to, which is
+ * always the case for Apple silicon
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CC_X86_DISPATCH
+#endif
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+#define CC_ARM_AES
+#endif
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define CC_ARM_SHA1
+#endif
+
+#endif
@@ -0,0 +1,474 @@
+#include <pthread.h>
+#include <corecrypto/ccaes.h>
+#include <corecrypto/cc_priv.h>
+#ifdef CC_X86_DISPATCH
+#include <immintrin.h>
+#endif
+#ifdef CC_ARM_AES
+#include <arm_neon.h>
+#endif
+
+/*
+ * round keys are kept as bytes in the order they are applied, which is what
+ * AES-NI and the ARMv8 instructions want.  decryption uses the equivalent
+ * inverse cipher, so its schedule is reversed with InvMixColumns applied to
+ * the inner round keys.  the portable fallback is the usual T-table code,
+ * which is not constant time; AES-NI or ARMv8 AES is used wherever present
+ */
+
+struct ccaes_ctx {
+    unsigned char rk[15][16];
+    unsigned rounds;
+    void (*cbc)(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out);
+};
+
+typedef void (*aes_cbc_t)(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out);
+
+static unsigned char sbox[256];
+static unsigned char inv_sbox[256];
+static uint32_t Te[4][256];
+static uint32_t Td[4][256];
+
+static aes_cbc_t cbc_encrypt;
+static aes_cbc_t cbc_decrypt;
+static pthread_once_t aes_once = PTHREAD_ONCE_INIT;
+
+#define ROTL8(x, s) ((unsigned char)(((x) << (s)) | ((x) >> (8 - (s)))))
+
+static unsigned
+xtime(unsigned x)
+{
+    return ((x << 1) ^ ((x & 0x80) ? 0x1B : 0)) & 0xFF;
+}
+
+static unsigned
+gmul(unsigned a, unsigned b)
+{
+    unsigned r = 0;
+    while (b) {
+        if (b & 1) {
+            r ^= a;
+        }
+        a = xtime(a);
+        b >>= 1;
+    }
+    return r;
+}
+
+static void
+aes_tables(void)
+{
+    unsigned char p = 1, q = 1;
+    unsigned i, j;
+
+    /* p walks the multiplicative group by powers of 3, q by powers of 3^-1 */
+    do {
+        p = p ^ (unsigned char)(p << 1) ^ ((p & 0x80) ? 0x1B : 0);
+        q ^= (unsigned char)(q << 1);
+        q ^= (unsigned char)(q << 2);
+        q ^= (unsigned char)(q << 4);
+        q ^= (q & 0x80) ? 0x09 : 0;
+        sbox[p] = q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^ ROTL8(q, 4) ^ 0x63;
+    } while (p != 1);
+    sbox[0] = 0x63;
+
+    for (i = 0; i < 256; i++) {
+        unsigned s = sbox[i];
+        inv_sbox[s] = i;
+    }
+    for (i = 0; i < 256; i++) {
+        unsigned s = sbox[i];
+        unsigned v = inv_sbox[i];
+        Te[0][i] = (xtime(s) << 24) | (s << 16) | (s << 8) | (xtime(s) ^ s);
+        Td[0][i] = (gmul(v, 14) << 24) | (gmul(v, 9) << 16) | (gmul(v, 13) << 8) | gmul(v, 11);
+        for (j = 1; j < 4; j++) {
+            Te[j][i] = CC_ROR(Te[j - 1][i], 8);
+            Td[j][i] = CC_ROR(Td[j - 1][i], 8);
+        }
+    }
+}
+
+static uint32_t
+sub_word(uint32_t x)
+{
+    return ((uint32_t)sbox[x >> 24] << 24) | ((uint32_t)sbox[(x >> 16) & 0xFF] << 16) | ((uint32_t)sbox[(x >> 8) & 0xFF] << 8) | sbox[x & 0xFF];
+}
+
+static int
+aes_expand_key(struct ccaes_ctx *ctx, size_t key_len, const unsigned char *key)
+{
+    uint32_t w[60];
+    uint32_t t, rcon = 1;
+    unsigned nk, total, i;
+
+    if (key_len != CCAES_KEY_SIZE_128 && key_len != CCAES_KEY_SIZE_192 && key_len != CCAES_KEY_SIZE_256) {
+        return -1;
+    }
+    nk = key_len / 4;
+    ctx->rounds = nk + 6;
+    total = 4 * (ctx->rounds + 1);
+
+    for (i = 0; i < nk; i++) {
+        w[i] = CC_LOAD32_BE(key + 4 * i);
+    }
+    for (; i < total; i++) {
+        t = w[i - 1];
+        if (i % nk == 0) {
+            t = sub_word(CC_ROL(t, 8)) ^ (rcon << 24);
+            rcon = xtime(rcon);
+        } else if (nk > 6 && i % nk == 4) {
+            t = sub_word(t);
+        }
+        w[i] = w[i - nk] ^ t;
+    }
+    for (i = 0; i < total; i++) {
+        CC_STORE32_BE(w[i], ctx->rk[i / 4] + 4 * (i % 4));
+    }
+    cc_clear(sizeof(w), w);
+    return 0;
+}
+
+static void
+aes_invert_key(struct ccaes_ctx *ctx)
+{
+    unsigned char tmp[15][16];
+    unsigned r, i, n = ctx->rounds;
+
+    memcpy(tmp, ctx->rk, sizeof(tmp));
+    for (r = 0; r <= n; r++) {
+        memcpy(ctx->rk[r], tmp[n - r], 16);
+    }
+    for (r = 1; r < n; r++) {
+        for (i = 0; i < 16; i += 4) {
+            unsigned char *p = ctx->rk[r] + i;
+            uint32_t w = CC_LOAD32_BE(p);
+            w = Td[0][sbox[w >> 24]] ^ Td[1][sbox[(w >> 16) & 0xFF]] ^ Td[2][sbox[(w >> 8) & 0xFF]] ^ Td[3][sbox[w & 0xFF]];
+            CC_STORE32_BE(w, p);
+        }
+    }
+    cc_clear(sizeof(tmp), tmp);
+}
+
+static void
+aes_encrypt_ltc(const struct ccaes_ctx *ctx, const unsigned char in[16], unsigned char out[16])
+{
+    const unsigned char *rk = ctx->rk[0];
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    unsigned r;
+
+    s0 = CC_LOAD32_BE(in) ^ CC_LOAD32_BE(rk);
+    s1 = CC_LOAD32_BE(in + 4) ^ CC_LOAD32_BE(rk + 4);
+    s2 = CC_LOAD32_BE(in + 8) ^ CC_LOAD32_BE(rk + 8);
+    s3 = CC_LOAD32_BE(in + 12) ^ CC_LOAD32_BE(rk + 12);
+    for (r = 1; r < ctx->rounds; r++) {
+        rk += 16;
+        t0 = Te[0][s0 >> 24] ^ Te[1][(s1 >> 16) & 0xFF] ^ Te[2][(s2 >> 8) & 0xFF] ^ Te[3][s3 & 0xFF] ^ CC_LOAD32_BE(rk);
+        t1 = Te[0][s1 >> 24] ^ Te[1][(s2 >> 16) & 0xFF] ^ Te[2][(s3 >> 8) & 0xFF] ^ Te[3][s0 & 0xFF] ^ CC_LOAD32_BE(rk + 4);
+        t2 = Te[0][s2 >> 24] ^ Te[1][(s3 >> 16) & 0xFF] ^ Te[2][(s0 >> 8) & 0xFF] ^ Te[3][s1 & 0xFF] ^ CC_LOAD32_BE(rk + 8);
+        t3 = Te[0][s3 >> 24] ^ Te[1][(s0 >> 16) & 0xFF] ^ Te[2][(s1 >> 8) & 0xFF] ^ Te[3][s2 & 0xFF] ^ CC_LOAD32_BE(rk + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    rk += 16;
+#define LAST(a, b, c, d) \
+    (((uint32_t)sbox[(a) >> 24] << 24) | ((uint32_t)sbox[((b) >> 16) & 0xFF] << 16) | ((uint32_t)sbox[((c) >> 8) & 0xFF] << 8) | sbox[(d) & 0xFF])
+    t0 = LAST(s0, s1, s2, s3) ^ CC_LOAD32_BE(rk);
+    t1 = LAST(s1, s2, s3, s0) ^ CC_LOAD32_BE(rk + 4);
+    t2 = LAST(s2, s3, s0, s1) ^ CC_LOAD32_BE(rk + 8);
+    t3 = LAST(s3, s0, s1, s2) ^ CC_LOAD32_BE(rk + 12);
+#undef LAST
+    CC_STORE32_BE(t0, out);
+    CC_STORE32_BE(t1, out + 4);
+    CC_STORE32_BE(t2, out + 8);
+    CC_STORE32_BE(t3, out + 12);
+}
+
+static void
+aes_decrypt_ltc(const struct ccaes_ctx *ctx, const unsigned char in[16], unsigned char out[16])
+{
+    const unsigned char *rk = ctx->rk[0];
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    unsigned r;
+
+    s0 = CC_LOAD32_BE(in) ^ CC_LOAD32_BE(rk);
+    s1 = CC_LOAD32_BE(in + 4) ^ CC_LOAD32_BE(rk + 4);
+    s2 = CC_LOAD32_BE(in + 8) ^ CC_LOAD32_BE(rk + 8);
+    s3 = CC_LOAD32_BE(in + 12) ^ CC_LOAD32_BE(rk + 12);
+    for (r = 1; r < ctx->rounds; r++) {
+        rk += 16;
+        t0 = Td[0][s0 >> 24] ^ Td[1][(s3 >> 16) & 0xFF] ^ Td[2][(s2 >> 8) & 0xFF] ^ Td[3][s1 & 0xFF] ^ CC_LOAD32_BE(rk);
+        t1 = Td[0][s1 >> 24] ^ Td[1][(s0 >> 16) & 0xFF] ^ Td[2][(s3 >> 8) & 0xFF] ^ Td[3][s2 & 0xFF] ^ CC_LOAD32_BE(rk + 4);
+        t2 = Td[0][s2 >> 24] ^ Td[1][(s1 >> 16) & 0xFF] ^ Td[2][(s0 >> 8) & 0xFF] ^ Td[3][s3 & 0xFF] ^ CC_LOAD32_BE(rk + 8);
+        t3 = Td[0][s3 >> 24] ^ Td[1][(s2 >> 16) & 0xFF] ^ Td[2][(s1 >> 8) & 0xFF] ^ Td[3][s0 & 0xFF] ^ CC_LOAD32_BE(rk + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    rk += 16;
+#define LAST(a, b, c, d) \
+    (((uint32_t)inv_sbox[(a) >> 24] << 24) | ((uint32_t)inv_sbox[((b) >> 16) & 0xFF] << 16) | ((uint32_t)inv_sbox[((c) >> 8) & 0xFF] << 8) | inv_sbox[(d) & 0xFF])
+    t0 = LAST(s0, s3, s2, s1) ^ CC_LOAD32_BE(rk);
+    t1 = LAST(s1, s0, s3, s2) ^ CC_LOAD32_BE(rk + 4);
+    t2 = LAST(s2, s1, s0, s3) ^ CC_LOAD32_BE(rk + 8);
+    t3 = LAST(s3, s2, s1, s0) ^ CC_LOAD32_BE(rk + 12);
+#undef LAST
+    CC_STORE32_BE(t0, out);
+    CC_STORE32_BE(t1, out + 4);
+    CC_STORE32_BE(t2, out + 8);
+    CC_STORE32_BE(t3, out + 12);
+}
+
+static void
+aes_cbc_encrypt_ltc(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+    unsigned char x[16];
+    unsigned i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; i++) {
+            x[i] = in[i] ^ iv[i];
+        }
+        aes_encrypt_ltc(ctx, x, iv);
+        memcpy(out, iv, 16);
+        in += 16;
+        out += 16;
+    }
+}
+
+static void
+aes_cbc_decrypt_ltc(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+    unsigned char c[16], x[16];
+    unsigned i;
+
+    while (nblocks--) {
+        memcpy(c, in, 16);
+        aes_decrypt_ltc(ctx, c, x);
+        for (i = 0; i < 16; i++) {
+            out[i] = x[i] ^ iv[i];
+        }
+        memcpy(iv, c, 16);
+        in += 16;
+        out += 16;
+    }
+}
+
+#ifdef CC_X86_DISPATCH
+__attribute__((target("aes,sse2"))) static void
+aes_cbc_encrypt_ni(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+    __m128i rk[15], x;
+    unsigned r, n = ctx->rounds;
+
+    for (r = 0; r <= n; r++) {
+        rk[r] = _mm_loadu_si128((const __m128i *)ctx->rk[r]);
+    }
+    x = _mm_loadu_si128((const __m128i *)iv);
+    while (nblocks--) {
+        x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)in));
+        x = _mm_xor_si128(x, rk[0]);
+        for (r = 1; r < n; r++) {
+            x = _mm_aesenc_si128(x, rk[r]);
+        }
+        x = _mm_aesenclast_si128(x, rk[n]);
+        _mm_storeu_si128((__m128i *)out, x);
+        in += 16;
+        out += 16;
+    }
+    _mm_storeu_si128((__m128i *)iv, x);
+}
+
+/* CBC decryption has no chain to wait for, keep eight blocks in flight */
+#define NI_EIGHT(op, k) do { \
+        x0 = op(x0, k); x1 = op(x1, k); x2 = op(x2, k); x3 = op(x3, k); \
+        x4 = op(x4, k); x5 = op(x5, k); x6 = op(x6, k); x7 = op(x7, k); \
+    } while (0)
+
+__attribute__((target("aes,sse2"))) static void
+aes_cbc_decrypt_ni(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+    const __m128i *src = (const __m128i *)in;
+    __m128i *dst = (__m128i *)out;
+    __m128i k, prev, last, x0, x1, x2, x3, x4, x5, x6, x7;
+    unsigned r, n = ctx->rounds;
+
+    prev = _mm_loadu_si128((const __m128i *)iv);
+    for (; nblocks >= 8; nblocks -= 8) {
+        k = _mm_loadu_si128((const __m128i *)ctx->rk[0]);
+        x0 = _mm_loadu_si128(src);
+        x1 = _mm_loadu_si128(src + 1);
+        x2 = _mm_loadu_si128(src + 2);
+        x3 = _mm_loadu_si128(src + 3);
+        x4 = _mm_loadu_si128(src + 4);
+        x5 = _mm_loadu_si128(src + 5);
+        x6 = _mm_loadu_si128(src + 6);
+        x7 = _mm_loadu_si128(src + 7);
+        NI_EIGHT(_mm_xor_si128, k);
+        for (r = 1; r < n; r++) {
+            k = _mm_loadu_si128((const __m128i *)ctx->rk[r]);
+            NI_EIGHT(_mm_aesdec_si128, k);
+        }
+        k = _mm_loadu_si128((const __m128i *)ctx->rk[n]);
+        NI_EIGHT(_mm_aesdeclast_si128, k);
+        /* reload the ciphertext, out may be in */
+        last = _mm_loadu_si128(src + 7);
+        x0 = _mm_xor_si128(x0, prev);
+        x1 = _mm_xor_si128(x1, _mm_loadu_si128(src));
+        x2 = _mm_xor_si128(x2, _mm_loadu_si128(src + 1));
+        x3 = _mm_xor_si128(x3, _mm_loadu_si128(src + 2));
+        x4 = _mm_xor_si128(x4, _mm_loadu_si128(src + 3));
+        x5 = _mm_xor_si128(x5, _mm_loadu_si128(src + 4));
+        x6 = _mm_xor_si128(x6, _mm_loadu_si128(src + 5));
+        x7 = _mm_xor_si128(x7, _mm_loadu_si128(src + 6));
+        _mm_storeu_si128(dst, x0);
+        _mm_storeu_si128(dst + 1, x1);
+        _mm_storeu_si128(dst + 2, x2);
+        _mm_storeu_si128(dst + 3, x3);
+        _mm_storeu_si128(dst + 4, x4);
+        _mm_storeu_si128(dst + 5, x5);
+        _mm_storeu_si128(dst + 6, x6);
+        _mm_storeu_si128(dst + 7, x7);
+        prev = last;
+        src += 8;
+        dst += 8;
+    }
+    for (; nblocks; nblocks--) {
+        last = _mm_loadu_si128(src);
+        x0 = _mm_xor_si128(last, _mm_loadu_si128((const __m128i *)ctx->rk[0]));
+        for (r = 1; r < n; r++) {
+            x0 = _mm_aesdec_si128(x0, _mm_loadu_si128((const __m128i *)ctx->rk[r]));
+        }
+        x0 = _mm_aesdeclast_si128(x0, _mm_loadu_si128((const __m128i *)ctx->rk[n]));
+        _mm_storeu_si128(dst, _mm_xor_si128(x0, prev));
+        prev = last;
+        src++;
+        dst++;
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
+#endif
+
+#ifdef CC_ARM_AES
+static void
+aes_cbc_encrypt_arm(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+    uint8x16_t rk[15], x;
+    unsigned r, n = ctx->rounds;
+
+    for (r = 0; r <= n; r++) {
+        rk[r] = vld1q_u8(ctx->rk[r]);
+    }
+    x = vld1q_u8(iv);
+    while (nblocks--) {
+        x = veorq_u8(x, vld1q_u8(in));
+        for (r = 0; r < n - 1; r++) {
+            x = vaesmcq_u8(vaeseq_u8(x, rk[r]));
+        }
+        x = veorq_u8(vaeseq_u8(x, rk[n - 1]), rk[n]);
+        vst1q_u8(out, x);
+        in += 16;
+        out += 16;
+    }
+    vst1q_u8(iv, x);
+}
+
+static void
+aes_cbc_decrypt_arm(const struct ccaes_ctx *ctx, unsigned char iv[16], size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+    uint8x16_t rk[15], prev, c, x;
+    unsigned r, n = ctx->rounds;
+
+    for (r = 0; r <= n; r++) {
+        rk[r] = vld1q_u8(ctx->rk[r]);
+    }
+    prev = vld1q_u8(iv);
+    while (nblocks--) {
+        c = vld1q_u8(in);
+        x = c;
+        for (r = 0; r < n - 1; r++) {
+            x = vaesimcq_u8(vaesdq_u8(x, rk[r]));
+        }
+        x = veorq_u8(vaesdq_u8(x, rk[n - 1]), rk[n]);
+        vst1q_u8(out, veorq_u8(x, prev));
+        prev = c;
+        in += 16;
+        out += 16;
+    }
+    vst1q_u8(iv, prev);
+}
+#endif
+
+static void
+aes_setup(void)
+{
+    aes_tables();
+    cbc_encrypt = aes_cbc_encrypt_ltc;
+    cbc_decrypt = aes_cbc_decrypt_ltc;
+#ifdef CC_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes")) {
+        cbc_encrypt = aes_cbc_encrypt_ni;
+        cbc_decrypt = aes_cbc_decrypt_ni;
+    }
+#endif
+#ifdef CC_ARM_AES
+    cbc_encrypt = aes_cbc_encrypt_arm;
+    cbc_decrypt = aes_cbc_decrypt_arm;
+#endif
+}
+
+static int
+aes_cbc_init_encrypt(const struct ccmode_cbc *cbc, cccbc_ctx *ctx, size_t key_len, const void *key)
+{
+    struct ccaes_ctx *aes = (struct ccaes_ctx *)ctx;
+    pthread_once(&aes_once, aes_setup);
+    if (aes_expand_key(aes, key_len, key)) {
+        return -1;
+    }
+    aes->cbc = cbc_encrypt;
+    return 0;
+}
+
+static int
+aes_cbc_init_decrypt(const struct ccmode_cbc *cbc, cccbc_ctx *ctx, size_t key_len, const void *key)
+{
+    struct ccaes_ctx *aes = (struct ccaes_ctx *)ctx;
+    pthread_once(&aes_once, aes_setup);
+    if (aes_expand_key(aes, key_len, key)) {
+        return -1;
+    }
+    aes_invert_key(aes);
+    aes->cbc = cbc_decrypt;
+    return 0;
+}
+
+static int
+aes_cbc(const cccbc_ctx *ctx, cccbc_iv *iv, size_t nblocks, const void *in, void *out)
+{
+    const struct ccaes_ctx *aes = (const struct ccaes_ctx *)ctx;
+    aes->cbc(aes, iv->b, nblocks, in, out);
+    return 0;
+}
+
+static const struct ccmode_cbc aes_cbc_encrypt_mode = {
+    sizeof(struct ccaes_ctx), CCAES_BLOCK_SIZE, aes_cbc_init_encrypt, aes_cbc
+};
+
+static const struct ccmode_cbc aes_cbc_decrypt_mode = {
+    sizeof(struct ccaes_ctx), CCAES_BLOCK_SIZE, aes_cbc_init_decrypt, aes_cbc
+};
+
+const struct ccmode_cbc *
+ccaes_cbc_encrypt_mode(void)
+{
+    return &aes_cbc_encrypt_mode;
+}
+
+const struct ccmode_cbc *
+ccaes_cbc_decrypt_mode(void)
+{
+    return &aes_cbc_decrypt_mode;
+}
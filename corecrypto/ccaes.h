@@ -1 +1,15 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCAES_H_
+#define _CORECRYPTO_CCAES_H_
+
+#include <corecrypto/ccmode.h>
+
+#define CCAES_BLOCK_SIZE 16
+#define CCAES_KEY_SIZE_128 16
+#define CCAES_KEY_SIZE_192 24
+#define CCAES_KEY_SIZE_256 32
+
+/* AES-NI or ARMv8 AES when there is one, T-tables otherwise */
+const struct ccmode_cbc *ccaes_cbc_encrypt_mode(void);
+const struct ccmode_cbc *ccaes_cbc_decrypt_mode(void);
+
+#endif
@@ -1 +1,14 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCASN1_H_
+#define _CORECRYPTO_CCASN1_H_
+
+#include <corecrypto/cc.h>
+
+/* DER encoded OBJECT IDENTIFIER, tag and length included */
+typedef const unsigned char *ccoid_t;
+
+#define ccoid_sha1 ((ccoid_t)"\x06\x05\x2b\x0e\x03\x02\x1a")
+#define ccoid_sha384 ((ccoid_t)"\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x02")
+
+#define ccoid_size(_oid_) (2 + (size_t)(_oid_)[1])
+
+#endif
@@ -1 +1,7 @@
-https://developer.apple.com/security/
+#include <corecrypto/ccdigest.h>
+
+void
+ccdigest(const struct ccdigest_info *di, size_t len, const void *data, void *digest)
+{
+    di->digest(len, data, digest);
+}
@@ -1 +1,17 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCDIGEST_H_
+#define _CORECRYPTO_CCDIGEST_H_
+
+#include <corecrypto/cc.h>
+#include <corecrypto/ccasn1.h>
+
+/* one-shot only, img4 always has the whole message at hand */
+struct ccdigest_info {
+    size_t output_size;
+    size_t block_size;
+    ccoid_t oid;
+    void (*digest)(size_t len, const void *data, void *digest);
+};
+
+void ccdigest(const struct ccdigest_info *di, size_t len, const void *data, void *digest);
+
+#endif
@@ -0,0 +1,18 @@
+#include <corecrypto/ccmode.h>
+
+int
+cccbc_one_shot(const struct ccmode_cbc *mode, size_t key_len, const void *key, const void *iv, size_t nblocks, const void *in, void *out)
+{
+    int rv;
+    cccbc_ctx_decl(cccbc_context_size(mode), ctx);
+    cccbc_iv_decl(cccbc_block_size(mode), iv_ctx);
+
+    rv = cccbc_init(mode, ctx, key_len, key);
+    if (rv == 0) {
+        cccbc_set_iv(mode, iv_ctx, iv);
+        rv = cccbc_update(mode, ctx, iv_ctx, nblocks, in, out);
+    }
+    cccbc_ctx_clear(cccbc_context_size(mode), ctx);
+    cccbc_iv_clear(cccbc_block_size(mode), iv_ctx);
+    return rv;
+}
@@ -1 +1,65 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCMODE_H_
+#define _CORECRYPTO_CCMODE_H_
+
+#include <corecrypto/cc.h>
+
+typedef struct {
+    unsigned char b[16];
+} __attribute__((aligned(16))) cccbc_ctx;
+
+typedef struct {
+    unsigned char b[16];
+} cccbc_iv;
+
+struct ccmode_cbc {
+    size_t size;                /* of the key schedule, for cccbc_ctx_decl() */
+    size_t block_size;
+    int (*init)(const struct ccmode_cbc *cbc, cccbc_ctx *ctx, size_t key_len, const void *key);
+    int (*cbc)(const cccbc_ctx *ctx, cccbc_iv *iv, size_t nblocks, const void *in, void *out);
+};
+
+#define cccbc_ctx_decl(_size_, _name_) cc_ctx_decl(cccbc_ctx, _size_, _name_)
+#define cccbc_ctx_clear(_size_, _name_) cc_clear(_size_, _name_)
+#define cccbc_iv_decl(_size_, _name_) cc_ctx_decl(cccbc_iv, _size_, _name_)
+#define cccbc_iv_clear(_size_, _name_) cc_clear(_size_, _name_)
+
+static inline size_t
+cccbc_context_size(const struct ccmode_cbc *mode)
+{
+    return mode->size;
+}
+
+static inline size_t
+cccbc_block_size(const struct ccmode_cbc *mode)
+{
+    return mode->block_size;
+}
+
+/* key_len is in bytes */
+static inline int
+cccbc_init(const struct ccmode_cbc *mode, cccbc_ctx *ctx, size_t key_len, const void *key)
+{
+    return mode->init(mode, ctx, key_len, key);
+}
+
+static inline int
+cccbc_set_iv(const struct ccmode_cbc *mode, cccbc_iv *iv_ctx, const void *iv)
+{
+    if (iv) {
+        memcpy(iv_ctx, iv, mode->block_size);
+    } else {
+        cc_zero(mode->block_size, iv_ctx);
+    }
+    return 0;
+}
+
+/* the chaining value in iv is updated, so a stream can be fed in pieces */
+static inline int
+cccbc_update(const struct ccmode_cbc *mode, const cccbc_ctx *ctx, cccbc_iv *iv, size_t nblocks, const void *in, void *out)
+{
+    return mode->cbc(ctx, iv, nblocks, in, out);
+}
+
+int cccbc_one_shot(const struct ccmode_cbc *mode, size_t key_len, const void *key, const void *iv, size_t nblocks, const void *in, void *out);
+
+#endif
@@ -0,0 +1,90 @@
+#include <corecrypto/ccn.h>
+
+int
+ccn_read_uint(cc_size n, cc_unit *r, size_t data_size, const uint8_t *data)
+{
+    size_t i;
+
+    while (data_size && *data == 0) {
+        data++;
+        data_size--;
+    }
+    if (data_size > ccn_sizeof_n(n)) {
+        return -1;
+    }
+    ccn_zero(n, r);
+    for (i = 0; i < data_size; i++) {
+        r[i / CCN_UNIT_SIZE] |= (cc_unit)data[data_size - 1 - i] << (8 * (i % CCN_UNIT_SIZE));
+    }
+    return 0;
+}
+
+int
+ccn_write_uint_padded(cc_size n, const cc_unit *s, size_t out_size, uint8_t *out)
+{
+    size_t i, len = ccn_write_uint_size(n, s);
+
+    if (len > out_size) {
+        return -1;
+    }
+    memset(out, 0, out_size - len);
+    out += out_size;
+    for (i = 0; i < len; i++) {
+        *--out = (uint8_t)(s[i / CCN_UNIT_SIZE] >> (8 * (i % CCN_UNIT_SIZE)));
+    }
+    return 0;
+}
+
+size_t
+ccn_bitlen(cc_size n, const cc_unit *s)
+{
+    while (n && s[n - 1] == 0) {
+        n--;
+    }
+    if (!n) {
+        return 0;
+    }
+    return n * CCN_UNIT_BITS - __builtin_clzll(s[n - 1]);
+}
+
+int
+ccn_cmp(cc_size n, const cc_unit *s, const cc_unit *t)
+{
+    while (n--) {
+        if (s[n] != t[n]) {
+            return s[n] > t[n] ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+/* r = s - t, returns the borrow */
+cc_unit
+ccn_sub(cc_size n, cc_unit *r, const cc_unit *s, const cc_unit *t)
+{
+    cc_unit borrow = 0;
+    cc_size i;
+
+    for (i = 0; i < n; i++) {
+        cc_unit a = s[i], b = t[i];
+        cc_unit d = a - b - borrow;
+        borrow = (a < b) | ((a == b) & borrow);
+        r[i] = d;
+    }
+    return borrow;
+}
+
+/* r = s << 1, returns the bit shifted out */
+cc_unit
+ccn_shift_left_1(cc_size n, cc_unit *r, const cc_unit *s)
+{
+    cc_unit carry = 0;
+    cc_size i;
+
+    for (i = 0; i < n; i++) {
+        cc_unit v = s[i];
+        r[i] = (v << 1) | carry;
+        carry = v >> (CCN_UNIT_BITS - 1);
+    }
+    return carry;
+}
@@ -1 +1,34 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCN_H_
+#define _CORECRYPTO_CCN_H_
+
+#include <corecrypto/cc.h>
+
+/* little-endian arrays of 64-bit units */
+typedef uint64_t cc_unit;
+typedef size_t cc_size;
+
+#define CCN_UNIT_SIZE 8
+#define CCN_UNIT_BITS 64
+
+#define ccn_nof(_bits_) (((_bits_) + CCN_UNIT_BITS - 1) / CCN_UNIT_BITS)
+#define ccn_nof_size(_size_) (((_size_) + CCN_UNIT_SIZE - 1) / CCN_UNIT_SIZE)
+#define ccn_sizeof_n(_n_) ((_n_) * CCN_UNIT_SIZE)
+#define ccn_sizeof_size(_size_) ccn_sizeof_n(ccn_nof_size(_size_))
+
+/* big-endian bytes in; -1 if they do not fit in n units */
+int ccn_read_uint(cc_size n, cc_unit *r, size_t data_size, const uint8_t *data);
+/* big-endian bytes out, zero padded on the left to out_size; -1 if too small */
+int ccn_write_uint_padded(cc_size n, const cc_unit *s, size_t out_size, uint8_t *out);
+
+size_t ccn_bitlen(cc_size n, const cc_unit *s);
+#define ccn_write_uint_size(_n_, _s_) ((ccn_bitlen(_n_, _s_) + 7) / 8)
+
+int ccn_cmp(cc_size n, const cc_unit *s, const cc_unit *t);
+cc_unit ccn_sub(cc_size n, cc_unit *r, const cc_unit *s, const cc_unit *t);
+cc_unit ccn_shift_left_1(cc_size n, cc_unit *r, const cc_unit *s);
+
+#define ccn_zero(_n_, _r_) cc_zero(ccn_sizeof_n(_n_), _r_)
+#define ccn_set(_n_, _r_, _s_) memmove(_r_, _s_, ccn_sizeof_n(_n_))
+#define ccn_bit(_s_, _k_) (((_s_)[(_k_) / CCN_UNIT_BITS] >> ((_k_) % CCN_UNIT_BITS)) & 1)
+
+#endif
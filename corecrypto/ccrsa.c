@@ -0,0 +1,48 @@
+#include <corecrypto/ccrsa.h>
+
+int
+ccrsa_verify_pkcs1v15(ccrsa_pub_ctx_t key, ccoid_t oid, size_t digest_len, const uint8_t *digest,
+                      size_t sig_len, const uint8_t *sig, bool *valid)
+{
+    cc_size n = ccrsa_ctx_n(key);
+    size_t k = ccn_write_uint_size(n, ccrsa_ctx_m(key));
+    size_t oid_len = ccoid_size(oid);
+    size_t t_len = 2 + 2 + oid_len + 2 + 2 + digest_len;
+    cc_unit s[n];
+    uint8_t em[ccn_sizeof_n(n)];
+    uint8_t expected[ccn_sizeof_n(n)];
+    uint8_t *p = expected;
+
+    *valid = false;
+    if (sig_len != k || digest_len > 64 || t_len + 11 > k) {
+        return -1;
+    }
+    if (ccn_read_uint(n, s, sig_len, sig)) {
+        return -1;
+    }
+    if (cczp_power_fast(ccrsa_ctx_zm(key), s, s, ccrsa_ctx_e(key), ccn_bitlen(n, ccrsa_ctx_e(key)))) {
+        return -1;
+    }
+    ccn_write_uint_padded(n, s, k, em);
+
+    /* 00 01 FF .. FF 00 SEQUENCE { SEQUENCE { oid, NULL }, OCTET STRING digest } */
+    *p++ = 0x00;
+    *p++ = 0x01;
+    memset(p, 0xFF, k - 3 - t_len);
+    p += k - 3 - t_len;
+    *p++ = 0x00;
+    *p++ = 0x30;
+    *p++ = (uint8_t)(t_len - 2);
+    *p++ = 0x30;
+    *p++ = (uint8_t)(oid_len + 2);
+    memcpy(p, oid, oid_len);
+    p += oid_len;
+    *p++ = 0x05;
+    *p++ = 0x00;
+    *p++ = 0x04;
+    *p++ = (uint8_t)digest_len;
+    memcpy(p, digest, digest_len);
+
+    *valid = cc_cmp_safe(k, em, expected) == 0;
+    return 0;
+}
@@ -1 +1,30 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCRSA_H_
+#define _CORECRYPTO_CCRSA_H_
+
+#include <stdbool.h>
+#include <corecrypto/ccasn1.h>
+#include <corecrypto/cczp.h>
+
+/* a public key is a cczp for the modulus followed by the exponent */
+typedef struct cczp *ccrsa_pub_ctx_t;
+
+#define ccrsa_pub_ctx_size(_size_) (cczp_size(_size_) + (_size_))
+
+/* _size_ is ccn_sizeof_size() of the largest modulus to accept */
+#define ccrsa_pub_ctx_decl(_size_, _name_) \
+    cc_ctx_decl(struct cczp, ccrsa_pub_ctx_size(_size_), _name_##_storage); \
+    ccrsa_pub_ctx_t _name_ = _name_##_storage
+
+#define ccrsa_ctx_zm(_ctx_) (_ctx_)
+#define ccrsa_ctx_n(_ctx_) cczp_n(_ctx_)
+#define ccrsa_ctx_m(_ctx_) cczp_prime(_ctx_)
+#define ccrsa_ctx_e(_ctx_) (cczp_prime(_ctx_) + 2 * cczp_n(_ctx_))
+
+/*
+ * EMSA-PKCS1-v1_5 with a DigestInfo for oid.  returns 0 and sets *valid when
+ * the check could be made, non-zero for malformed input
+ */
+int ccrsa_verify_pkcs1v15(ccrsa_pub_ctx_t key, ccoid_t oid, size_t digest_len, const uint8_t *digest,
+                          size_t sig_len, const uint8_t *sig, bool *valid);
+
+#endif
@@ -0,0 +1,262 @@
+#include <pthread.h>
+#include <corecrypto/ccsha1.h>
+#include <corecrypto/cc_priv.h>
+#ifdef CC_X86_DISPATCH
+#include <immintrin.h>
+#endif
+#ifdef CC_ARM_SHA1
+#include <arm_neon.h>
+#endif
+
+typedef void (*sha1_compress_t)(uint32_t state[5], const unsigned char *data, size_t nblocks);
+
+static const uint32_t sha1_initial_state[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static void
+sha1_oneshot(sha1_compress_t compress, size_t len, const void *data, void *digest)
+{
+    uint32_t state[5];
+    unsigned char pad[2 * CCSHA1_BLOCK_SIZE];
+    unsigned char *out = digest;
+    size_t full = len / CCSHA1_BLOCK_SIZE;
+    size_t tail = len % CCSHA1_BLOCK_SIZE;
+    size_t padlen = tail < CCSHA1_BLOCK_SIZE - 8 ? CCSHA1_BLOCK_SIZE : 2 * CCSHA1_BLOCK_SIZE;
+    uint64_t bits = (uint64_t)len << 3;
+    unsigned i;
+
+    memcpy(state, sha1_initial_state, sizeof(state));
+    if (full) {
+        compress(state, data, full);
+    }
+    if (tail) {
+        memcpy(pad, (const unsigned char *)data + full * CCSHA1_BLOCK_SIZE, tail);
+    }
+    pad[tail] = 0x80;
+    memset(pad + tail + 1, 0, padlen - tail - 1 - 8);
+    CC_STORE64_BE(bits, pad + padlen - 8);
+    compress(state, pad, padlen / CCSHA1_BLOCK_SIZE);
+
+    for (i = 0; i < 5; i++) {
+        CC_STORE32_BE(state[i], out + 4 * i);
+    }
+}
+
+/* five rounds bring the working variables back where they started */
+#define SHA1_ROUND(a, b, c, d, e, f, k, i) do { \
+        if ((i) >= 16) { \
+            t = w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15]; \
+            w[(i) & 15] = CC_ROL(t, 1); \
+        } \
+        e += CC_ROL(a, 5) + f(b, c, d) + (k) + w[(i) & 15]; \
+        b = CC_ROL(b, 30); \
+    } while (0)
+
+#define SHA1_FIVE(f, k, i) do { \
+        SHA1_ROUND(a, b, c, d, e, f, k, (i) + 0); \
+        SHA1_ROUND(e, a, b, c, d, f, k, (i) + 1); \
+        SHA1_ROUND(d, e, a, b, c, f, k, (i) + 2); \
+        SHA1_ROUND(c, d, e, a, b, f, k, (i) + 3); \
+        SHA1_ROUND(b, c, d, e, a, f, k, (i) + 4); \
+    } while (0)
+
+#define F0(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F1(b, c, d) ((b) ^ (c) ^ (d))
+#define F2(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+static void
+sha1_compress_ltc(uint32_t state[5], const unsigned char *p, size_t nblocks)
+{
+    uint32_t w[16];
+    uint32_t a, b, c, d, e, t;
+    unsigned i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; i++) {
+            w[i] = CC_LOAD32_BE(p + 4 * i);
+        }
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        for (i = 0; i < 20; i += 5) {
+            SHA1_FIVE(F0, 0x5A827999, i);
+        }
+        for (; i < 40; i += 5) {
+            SHA1_FIVE(F1, 0x6ED9EBA1, i);
+        }
+        for (; i < 60; i += 5) {
+            SHA1_FIVE(F2, 0x8F1BBCDC, i);
+        }
+        for (; i < 80; i += 5) {
+            SHA1_FIVE(F1, 0xCA62C1D6, i);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        p += CCSHA1_BLOCK_SIZE;
+    }
+}
+
+static void
+ccsha1_ltc_digest(size_t len, const void *data, void *digest)
+{
+    sha1_oneshot(sha1_compress_ltc, len, data, digest);
+}
+
+const struct ccdigest_info ccsha1_ltc_di = {
+    CCSHA1_OUTPUT_SIZE, CCSHA1_BLOCK_SIZE, ccoid_sha1, ccsha1_ltc_digest
+};
+
+#ifdef CC_X86_DISPATCH
+/*
+ * four rounds per sha1rnds4, whose round function selector must be an
+ * immediate; g is a constant in every expansion, so the dead branches and the
+ * array indexing fold away
+ */
+#define SHA1_NI_GROUP(g) do { \
+        if ((g) < 4) { \
+            m[(g) & 3] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * ((g) & 3))), mask); \
+        } \
+        if ((g) == 0) { \
+            e[0] = _mm_add_epi32(e[0], m[0]); \
+        } else { \
+            e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], m[(g) & 3]); \
+        } \
+        e[((g) + 1) & 1] = abcd; \
+        if ((g) >= 3 && (g) <= 18) { \
+            m[((g) + 1) & 3] = _mm_sha1msg2_epu32(m[((g) + 1) & 3], m[(g) & 3]); \
+        } \
+        abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (g) / 5); \
+        if ((g) >= 1 && (g) <= 16) { \
+            m[((g) + 3) & 3] = _mm_sha1msg1_epu32(m[((g) + 3) & 3], m[(g) & 3]); \
+        } \
+        if ((g) >= 2 && (g) <= 17) { \
+            m[((g) + 2) & 3] = _mm_xor_si128(m[((g) + 2) & 3], m[(g) & 3]); \
+        } \
+    } while (0)
+
+__attribute__((target("sha,ssse3,sse4.1"))) static void
+sha1_compress_ni(uint32_t state[5], const unsigned char *p, size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e_save;
+    __m128i e[2], m[4];
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (nblocks--) {
+        abcd_save = abcd;
+        e_save = e[0];
+        SHA1_NI_GROUP(0);  SHA1_NI_GROUP(1);  SHA1_NI_GROUP(2);  SHA1_NI_GROUP(3);
+        SHA1_NI_GROUP(4);  SHA1_NI_GROUP(5);  SHA1_NI_GROUP(6);  SHA1_NI_GROUP(7);
+        SHA1_NI_GROUP(8);  SHA1_NI_GROUP(9);  SHA1_NI_GROUP(10); SHA1_NI_GROUP(11);
+        SHA1_NI_GROUP(12); SHA1_NI_GROUP(13); SHA1_NI_GROUP(14); SHA1_NI_GROUP(15);
+        SHA1_NI_GROUP(16); SHA1_NI_GROUP(17); SHA1_NI_GROUP(18); SHA1_NI_GROUP(19);
+        e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        p += CCSHA1_BLOCK_SIZE;
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+static void
+ccsha1_ni_digest(size_t len, const void *data, void *digest)
+{
+    sha1_oneshot(sha1_compress_ni, len, data, digest);
+}
+
+static const struct ccdigest_info ccsha1_ni_di = {
+    CCSHA1_OUTPUT_SIZE, CCSHA1_BLOCK_SIZE, ccoid_sha1, ccsha1_ni_digest
+};
+#endif
+
+#ifdef CC_ARM_SHA1
+static void
+sha1_compress_arm(uint32_t state[5], const unsigned char *p, size_t nblocks)
+{
+    static const uint32_t k[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t abcd, abcd_save, wk;
+    uint32x4_t w[4];
+    uint32_t e, e_save, e_next;
+    unsigned g;
+
+    abcd = vld1q_u32(state);
+    e = state[4];
+
+    while (nblocks--) {
+        abcd_save = abcd;
+        e_save = e;
+        for (g = 0; g < 4; g++) {
+            w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * g)));
+        }
+        for (g = 0; g < 20; g++) {
+            wk = vaddq_u32(w[g & 3], vdupq_n_u32(k[g / 5]));
+            if (g < 16) {
+                /* the quad four groups ahead */
+                w[g & 3] = vsha1su1q_u32(vsha1su0q_u32(w[g & 3], w[(g + 1) & 3], w[(g + 2) & 3]), w[(g + 3) & 3]);
+            }
+            e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            switch (g / 5) {
+                case 0:
+                    abcd = vsha1cq_u32(abcd, e, wk);
+                    break;
+                case 2:
+                    abcd = vsha1mq_u32(abcd, e, wk);
+                    break;
+                default:
+                    abcd = vsha1pq_u32(abcd, e, wk);
+                    break;
+            }
+            e = e_next;
+        }
+        abcd = vaddq_u32(abcd, abcd_save);
+        e += e_save;
+        p += CCSHA1_BLOCK_SIZE;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+static void
+ccsha1_arm_digest(size_t len, const void *data, void *digest)
+{
+    sha1_oneshot(sha1_compress_arm, len, data, digest);
+}
+
+static const struct ccdigest_info ccsha1_arm_di = {
+    CCSHA1_OUTPUT_SIZE, CCSHA1_BLOCK_SIZE, ccoid_sha1, ccsha1_arm_digest
+};
+#endif
+
+static const struct ccdigest_info *sha1_best = &ccsha1_ltc_di;
+static pthread_once_t sha1_once = PTHREAD_ONCE_INIT;
+
+static void
+pick_sha1(void)
+{
+#ifdef CC_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        sha1_best = &ccsha1_ni_di;
+    }
+#endif
+#ifdef CC_ARM_SHA1
+    sha1_best = &ccsha1_arm_di;
+#endif
+}
+
+const struct ccdigest_info *
+ccsha1_di(void)
+{
+    pthread_once(&sha1_once, pick_sha1);
+    return sha1_best;
+}
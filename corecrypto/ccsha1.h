@@ -1 +1,15 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCSHA1_H_
+#define _CORECRYPTO_CCSHA1_H_
+
+#include <corecrypto/ccdigest.h>
+
+#define CCSHA1_BLOCK_SIZE 64
+#define CCSHA1_OUTPUT_SIZE 20
+
+/* portable C */
+extern const struct ccdigest_info ccsha1_ltc_di;
+
+/* the fastest one for this CPU (SHA-NI, ARMv8 SHA1 or portable) */
+const struct ccdigest_info *ccsha1_di(void);
+
+#endif
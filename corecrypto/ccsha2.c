@@ -0,0 +1,135 @@
+#include <corecrypto/ccsha2.h>
+#include <corecrypto/cc_priv.h>
+
+static const uint64_t sha384_initial_state[8] = {
+    0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+    0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+static const uint64_t sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+#define S0(x) (CC_ROR64(x, 28) ^ CC_ROR64(x, 34) ^ CC_ROR64(x, 39))
+#define S1(x) (CC_ROR64(x, 14) ^ CC_ROR64(x, 18) ^ CC_ROR64(x, 41))
+#define s0(x) (CC_ROR64(x, 1) ^ CC_ROR64(x, 8) ^ ((x) >> 7))
+#define s1(x) (CC_ROR64(x, 19) ^ CC_ROR64(x, 61) ^ ((x) >> 6))
+
+/* the eight working variables rotate through the arguments instead of being moved */
+#define SHA512_ROUND(a, b, c, d, e, f, g, h, k) do { \
+        t1 = h + S1(e) + (g ^ (e & (f ^ g))) + sha512_k[k] + w[(k) & 15]; \
+        d += t1; \
+        h = t1 + S0(a) + ((a & b) | (c & (a | b))); \
+    } while (0)
+
+#define SHA512_EIGHT(k) do { \
+        SHA512_ROUND(a, b, c, d, e, f, g, h, (k) + 0); \
+        SHA512_ROUND(h, a, b, c, d, e, f, g, (k) + 1); \
+        SHA512_ROUND(g, h, a, b, c, d, e, f, (k) + 2); \
+        SHA512_ROUND(f, g, h, a, b, c, d, e, (k) + 3); \
+        SHA512_ROUND(e, f, g, h, a, b, c, d, (k) + 4); \
+        SHA512_ROUND(d, e, f, g, h, a, b, c, (k) + 5); \
+        SHA512_ROUND(c, d, e, f, g, h, a, b, (k) + 6); \
+        SHA512_ROUND(b, c, d, e, f, g, h, a, (k) + 7); \
+    } while (0)
+
+static void
+sha512_compress_ltc(uint64_t state[8], const unsigned char *p, size_t nblocks)
+{
+    uint64_t w[16];
+    uint64_t a, b, c, d, e, f, g, h, t1;
+    unsigned i, j;
+
+    while (nblocks--) {
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+        for (i = 0; i < 16; i++) {
+            w[i] = CC_LOAD64_BE(p + 8 * i);
+        }
+        SHA512_EIGHT(0);
+        SHA512_EIGHT(8);
+        for (i = 16; i < 80; i += 16) {
+            for (j = 0; j < 16; j++) {
+                w[j] += s1(w[(j + 14) & 15]) + w[(j + 9) & 15] + s0(w[(j + 1) & 15]);
+            }
+            SHA512_EIGHT(i);
+            SHA512_EIGHT(i + 8);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        p += CCSHA384_BLOCK_SIZE;
+    }
+}
+
+static void
+ccsha384_ltc_digest(size_t len, const void *data, void *digest)
+{
+    uint64_t state[8];
+    unsigned char pad[2 * CCSHA384_BLOCK_SIZE];
+    unsigned char *out = digest;
+    size_t full = len / CCSHA384_BLOCK_SIZE;
+    size_t tail = len % CCSHA384_BLOCK_SIZE;
+    size_t padlen = tail < CCSHA384_BLOCK_SIZE - 16 ? CCSHA384_BLOCK_SIZE : 2 * CCSHA384_BLOCK_SIZE;
+    uint64_t bits = (uint64_t)len << 3;
+    uint64_t bits_hi = (uint64_t)len >> 61;
+    unsigned i;
+
+    memcpy(state, sha384_initial_state, sizeof(state));
+    if (full) {
+        sha512_compress_ltc(state, data, full);
+    }
+    if (tail) {
+        memcpy(pad, (const unsigned char *)data + full * CCSHA384_BLOCK_SIZE, tail);
+    }
+    pad[tail] = 0x80;
+    memset(pad + tail + 1, 0, padlen - tail - 1 - 16);
+    CC_STORE64_BE(bits_hi, pad + padlen - 16);
+    CC_STORE64_BE(bits, pad + padlen - 8);
+    sha512_compress_ltc(state, pad, padlen / CCSHA384_BLOCK_SIZE);
+
+    for (i = 0; i < CCSHA384_OUTPUT_SIZE / 8; i++) {
+        CC_STORE64_BE(state[i], out + 8 * i);
+    }
+}
+
+const struct ccdigest_info ccsha384_ltc_di = {
+    CCSHA384_OUTPUT_SIZE, CCSHA384_BLOCK_SIZE, ccoid_sha384, ccsha384_ltc_digest
+};
+
+/* no SHA-512 instructions are used yet, neither x86 nor arm64 */
+const struct ccdigest_info *
+ccsha384_di(void)
+{
+    return &ccsha384_ltc_di;
+}
@@ -1 +1,14 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCSHA2_H_
+#define _CORECRYPTO_CCSHA2_H_
+
+#include <corecrypto/ccdigest.h>
+
+#define CCSHA384_BLOCK_SIZE 128
+#define CCSHA384_OUTPUT_SIZE 48
+
+/* portable C */
+extern const struct ccdigest_info ccsha384_ltc_di;
+
+const struct ccdigest_info *ccsha384_di(void);
+
+#endif
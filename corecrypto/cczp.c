@@ -0,0 +1,181 @@
+#include <corecrypto/cczp.h>
+
+__extension__ typedef unsigned __int128 cc_dunit;
+
+/* x = 2x mod m, x < m */
+static void
+cczp_double(cc_size n, cc_unit *x, const cc_unit *m)
+{
+    cc_unit carry = ccn_shift_left_1(n, x, x);
+    if (carry || ccn_cmp(n, x, m) >= 0) {
+        ccn_sub(n, x, x, m);
+    }
+}
+
+/* CIOS, with a final subtraction so results stay below m */
+void
+cczp_mul_mont(cczp_t zp, cc_unit *r, const cc_unit *a, const cc_unit *b)
+{
+    cc_size n = cczp_n(zp);
+    const cc_unit *m = cczp_prime(zp);
+    cc_unit t[n + 2];
+    cc_unit c, u;
+    cc_dunit uv;
+    cc_size i, j;
+
+    memset(t, 0, sizeof(t));
+    for (i = 0; i < n; i++) {
+        c = 0;
+        for (j = 0; j < n; j++) {
+            uv = (cc_dunit)a[j] * b[i] + t[j] + c;
+            t[j] = (cc_unit)uv;
+            c = (cc_unit)(uv >> 64);
+        }
+        uv = (cc_dunit)t[n] + c;
+        t[n] = (cc_unit)uv;
+        t[n + 1] = (cc_unit)(uv >> 64);
+
+        u = t[0] * zp->m0inv;
+        uv = (cc_dunit)u * m[0] + t[0];
+        c = (cc_unit)(uv >> 64);
+        for (j = 1; j < n; j++) {
+            uv = (cc_dunit)u * m[j] + t[j] + c;
+            t[j - 1] = (cc_unit)uv;
+            c = (cc_unit)(uv >> 64);
+        }
+        uv = (cc_dunit)t[n] + c;
+        t[n - 1] = (cc_unit)uv;
+        t[n] = t[n + 1] + (cc_unit)(uv >> 64);
+    }
+    if (t[n] || ccn_cmp(n, t, m) >= 0) {
+        ccn_sub(n, r, t, m);
+    } else {
+        ccn_set(n, r, t);
+    }
+}
+
+/* r = t / R mod m for t < mR of 2n units; t is clobbered */
+static void
+cczp_redc(cczp_t zp, cc_unit *r, cc_unit *t)
+{
+    cc_size n = cczp_n(zp);
+    const cc_unit *m = cczp_prime(zp);
+    cc_unit c, u, top = 0;
+    cc_dunit uv;
+    cc_size i, j;
+
+    for (i = 0; i < n; i++) {
+        u = t[i] * zp->m0inv;
+        c = 0;
+        for (j = 0; j < n; j++) {
+            uv = (cc_dunit)u * m[j] + t[i + j] + c;
+            t[i + j] = (cc_unit)uv;
+            c = (cc_unit)(uv >> 64);
+        }
+        /* the carry out of t[i + n] is added one unit up next time round */
+        uv = (cc_dunit)t[i + n] + c + top;
+        t[i + n] = (cc_unit)uv;
+        top = (cc_unit)(uv >> 64);
+    }
+    if (top || ccn_cmp(n, t + n, m) >= 0) {
+        ccn_sub(n, r, t + n, m);
+    } else {
+        ccn_set(n, r, t + n);
+    }
+}
+
+/* r = a^2 / R mod m, the cross products are only computed once */
+static void
+cczp_sqr_mont(cczp_t zp, cc_unit *r, const cc_unit *a)
+{
+    cc_size n = cczp_n(zp);
+    cc_unit t[2 * n];
+    cc_unit c;
+    cc_dunit uv;
+    cc_size i, j;
+
+    ccn_zero(2 * n, t);
+    for (i = 0; i < n; i++) {
+        c = 0;
+        for (j = i + 1; j < n; j++) {
+            uv = (cc_dunit)a[i] * a[j] + t[i + j] + c;
+            t[i + j] = (cc_unit)uv;
+            c = (cc_unit)(uv >> 64);
+        }
+        t[i + n] = c;
+    }
+    ccn_shift_left_1(2 * n, t, t);
+    c = 0;
+    for (i = 0; i < n; i++) {
+        uv = (cc_dunit)a[i] * a[i] + t[2 * i] + c;
+        t[2 * i] = (cc_unit)uv;
+        uv = (cc_dunit)t[2 * i + 1] + (cc_unit)(uv >> 64);
+        t[2 * i + 1] = (cc_unit)uv;
+        c = (cc_unit)(uv >> 64);
+    }
+    cczp_redc(zp, r, t);
+}
+
+int
+cczp_init(cczp_t zp)
+{
+    cc_size n = cczp_n(zp);
+    const cc_unit *m = cczp_prime(zp);
+    cc_unit *rr = cczp_rr(zp);
+    size_t bits, rbits, squarings, t, i;
+    cc_unit x;
+
+    bits = ccn_bitlen(n, m);
+    if (bits < 2 || !(m[0] & 1)) {
+        return -1;
+    }
+
+    /* Newton's iteration, m0 is its own inverse mod 8 and each step doubles that */
+    x = m[0];
+    for (i = 0; i < 5; i++) {
+        x *= 2 - m[0] * x;
+    }
+    zp->m0inv = -x;
+
+    /*
+     * rather than doubling 1 all the way up to R^2: start at the top bit of m,
+     * double up to 2^(log2 R + t), which is 2^t in Montgomery form, then square
+     * that up to R.  a doubling is far cheaper than a squaring, but not 64n/16
+     * times cheaper, so stop at four squarings
+     */
+    rbits = CCN_UNIT_BITS * n;
+    squarings = 4;
+    t = rbits >> squarings;
+    ccn_zero(n, rr);
+    rr[(bits - 1) / CCN_UNIT_BITS] = (cc_unit)1 << ((bits - 1) % CCN_UNIT_BITS);
+    for (i = bits - 1; i < rbits + t; i++) {
+        cczp_double(n, rr, m);
+    }
+    for (i = 0; i < squarings; i++) {
+        cczp_sqr_mont(zp, rr, rr);
+    }
+    return 0;
+}
+
+int
+cczp_power_fast(cczp_t zp, cc_unit *r, const cc_unit *s, const cc_unit *e, size_t ebitlen)
+{
+    cc_size n = cczp_n(zp);
+    cc_unit a[n], x[2 * n];
+    size_t k;
+
+    if (!ebitlen || ccn_cmp(n, s, cczp_prime(zp)) >= 0) {
+        return -1;
+    }
+    cczp_mul_mont(zp, a, s, cczp_rr(zp));
+    ccn_set(n, x, a);
+    for (k = ebitlen - 1; k-- > 0; ) {
+        cczp_sqr_mont(zp, x, x);
+        if (ccn_bit(e, k)) {
+            cczp_mul_mont(zp, x, x, a);
+        }
+    }
+    ccn_zero(n, x + n);
+    cczp_redc(zp, r, x);
+    return 0;
+}
@@ -1 +1,31 @@
-https://developer.apple.com/security/
+#ifndef _CORECRYPTO_CCZP_H_
+#define _CORECRYPTO_CCZP_H_
+
+#include <corecrypto/ccn.h>
+
+/*
+ * an odd modulus prepared for Montgomery arithmetic.  the header is followed
+ * in memory by the modulus, then R^2 mod m (n units each)
+ */
+struct cczp {
+    cc_size n;
+    cc_unit m0inv;              /* -m^-1 mod 2^64 */
+};
+typedef struct cczp *cczp_t;
+
+#define cczp_n(_zp_) ((_zp_)->n)
+#define cczp_prime(_zp_) ((cc_unit *)((_zp_) + 1))
+#define cczp_rr(_zp_) (cczp_prime(_zp_) + (_zp_)->n)
+
+/* bytes for a modulus of _size_ bytes (from ccn_sizeof_size) */
+#define cczp_size(_size_) (sizeof(struct cczp) + 2 * (_size_))
+
+/* fill in m0inv and rr once n and the prime are set; -1 for an even modulus */
+int cczp_init(cczp_t zp);
+
+/* r = a * b / R mod m */
+void cczp_mul_mont(cczp_t zp, cc_unit *r, const cc_unit *a, const cc_unit *b);
+/* r = s^e mod m, s < m, e of ebitlen bits.  not constant time: public keys only */
+int cczp_power_fast(cczp_t zp, cc_unit *r, const cc_unit *s, const cc_unit *e, size_t ebitlen);
+
+#endif
@@ -1 +0,0 @@
-https://developer.apple.com/security/
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <stdbool.h>
 #include "libvfs/vfs.h"
+#include "patch.h"
+#include "search.h"
 
 #define FOURCC(tag) (unsigned char)((tag) >> 24), (unsigned char)((tag) >> 16), (unsigned char)((tag) >> 8), (unsigned char)(tag)
 
@@ -94,170 +96,63 @@ write_file(const char *name, void *buf, size_t size)
     return out->close(out);
 }
 
-typedef struct {
-    size_t off;
-    int skip;
-    uint8_t ov, nv;
-} PATCH;
-
 static int
 apply_patch(FHANDLE fd, const char *patchfile, int force, int undo)
 {
-    FILE *f;
-    char buf[BUFSIZ];
-    PATCH *patches = NULL;
-    unsigned i, max = 0, len = 0;
-    size_t length;
-    int rv = 0;
-
-    length = fd->length(fd);
-    if ((ssize_t)length < 0) {
-        return -1;
-    }
-
-    f = fopen(patchfile, "rt");
-    if (!f) {
-        fprintf(stderr, "[e] cannot read '%s'\n", patchfile);
-        return -1;
-    }
-
-    while (fgets(buf, sizeof(buf), f)) {
-        PATCH patch;
-        char *p, *q = buf;
-        p = strchr(buf, '\n');
-        if (p == NULL) {
-            fprintf(stderr, "[e] patch: malformed line\n");
-            rv = -1;
-            break;
-        }
-        if (p > buf && p[-1] == '\r') {
-            p--;
-        }
-        *p = '\0';
-        buf[strcspn(buf, "#;")] = '\0';
-        if (buf[0] == '\0') {
-            continue;
-        }
-        p = q;
-        errno = 0;
-        patch.off = strtoull(p, &q, 0);
-        if (errno || p == q) {
-            fprintf(stderr, "[e] patch: malformed line\n");
-            rv = -1;
-            break;
-        }
-        p = q;
-        errno = 0;
-        patch.ov = strtoul(p, &q, 0);
-        if (errno || p == q) {
-            fprintf(stderr, "[e] patch: malformed line\n");
-            rv = -1;
-            break;
-        }
-        p = q;
-        errno = 0;
-        patch.nv = strtoul(q, &q, 0);
-        if (errno || p == q) {
-            fprintf(stderr, "[e] patch: malformed line\n");
-            rv = -1;
-            break;
-        }
-        if (patch.off > length) {
-            fprintf(stderr, "[e] patch: offset 0x%zx too big\n", patch.off);
-            rv = -1;
-            break;
-        }
-        if (len >= max) {
-            PATCH *tmp;
-            if (max == 0) {
-                max = 8;
-            }
-            max *= 2;
-            tmp = realloc(patches, max * sizeof(PATCH));
-            if (!tmp) {
-                fprintf(stderr, "[e] patch: out of memory\n");
-                rv = -1;
-                break;
-            }
-            patches = tmp;
-        }
-        patch.skip = 0;
-        if (undo) {
-            uint8_t tv = patch.ov;
-            patch.ov = patch.nv;
-            patch.nv = tv;
-        }
-        patches[len++] = patch;
-    }
-
-    fclose(f);
+    int rv;
+    size_t i, sz;
+    unsigned char *buf;
+    void *data;
+    struct patch_set set;
 
+    rv = read_file(patchfile, &buf, &sz);
     if (rv) {
-        free(patches);
         return rv;
     }
-
-    for (i = 0; i < len; i++) {
-        size_t n, off;
-        unsigned char cv, nv, ov;
-        PATCH *p = &patches[i];
-        off = fd->lseek(fd, p->off, SEEK_SET);
-        if (off != p->off) {
-            fprintf(stderr, "[e] patch: cannot seek to 0x%zx\n", p->off);
-            rv = -1;
-            break;
-        }
-        n = fd->read(fd, &cv, 1);
-        if (n != 1) {
-            fprintf(stderr, "[e] patch: cannot read from 0x%zx\n", off);
-            rv = -1;
-            break;
-        }
-        nv = p->nv;
-        ov = p->ov;
-        if (cv != ov) {
-            if (cv == nv) {
-                fprintf(stderr, "[w] patch: offset 0x%zx is already patched: %02x\n", off, cv);
-            } else {
-                fprintf(stderr, "[w] patch: offset 0x%zx has %02x, expected %02x\n", off, cv, ov);
-                if (!force) {
-                    rv = -1;
-                }
-                break;
-            }
-        }
-        p->skip = (cv == nv);
-    }
-
+    rv = patch_load(&set, buf, sz, undo);
+    free(buf);
     if (rv) {
-        free(patches);
         return rv;
     }
 
-    for (i = 0; i < len; i++) {
-        size_t n, off;
-        PATCH *p = &patches[i];
-        if (p->skip) {
-            continue;
-        }
-        off = fd->lseek(fd, p->off, SEEK_SET);
-        if (off != p->off) {
-            fprintf(stderr, "[e] patch: cannot seek to 0x%zx\n", p->off);
-            rv = -1;
-            break;
-        }
-        n = fd->write(fd, &p->nv, 1);
-        if (n != 1) {
-            fprintf(stderr, "[e] patch: cannot patch 0x%zx\n", off);
-            rv = -1;
-            break;
-        }
+    /* check and write everything in place, then let the layers know */
+    rv = fd->ioctl(fd, IOCTL_MEM_GET_DATAPTR, &data, &sz);
+    if (rv) {
+        fprintf(stderr, "[e] patch: cannot access data\n");
+    } else {
+        rv = patch_apply(&set, data, sz, force, 0);
+    }
+    for (i = 0; rv == 0 && i < set.count; i++) {
+        rv = fd->ioctl(fd, IOCTL_MEM_SET_DIRTY_RANGE, (size_t)set.runs[i].offset, set.runs[i].length);
     }
 
-    free(patches);
+    patch_free(&set);
     return rv;
 }
 
+static int
+copy_payload(FHANDLE fd, FHANDLE src, size_t total)
+{
+    unsigned char *buf;
+    size_t size;
+    if (fd->ioctl(fd, IOCTL_MEM_RESERVE, total) || fd->ftruncate(fd, total)) {
+        return -1;
+    }
+    if (fd->ioctl(fd, IOCTL_MEM_GET_DATAPTR, &buf, &size) || size != total) {
+        return -1;
+    }
+    src->lseek(src, 0, SEEK_SET);
+    while (total) {
+        ssize_t n = src->read(src, buf, total);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        total -= n;
+    }
+    return 0;
+}
+
 static FHANDLE
 make_img4(const char *iname, FHANDLE *orig)
 {
@@ -266,8 +161,8 @@ make_img4(const char *iname, FHANDLE *orig)
         0x6e, 0x65, 0x16, 0x07,  'U',  'n',  'k',  'n',  'o',  'w',  'n', 0x04,
         0x01, 0x00
     };
-    size_t total;
-    unsigned char *tmp, xfer[4096];
+    ssize_t total;
+    unsigned char *tmp;
     FHANDLE fd, src = file_open(iname, O_RDONLY);
     if (!src) {
         return NULL;
@@ -286,24 +181,9 @@ make_img4(const char *iname, FHANDLE *orig)
         return NULL;
     }
     fd = img4_reopen(*orig, NULL, 0);
-    if (fd) {
-        fd->lseek(fd, 0, SEEK_SET);
-        for (;;) {
-            ssize_t n, written;
-            n = src->read(src, xfer, sizeof(xfer));
-            if (n <= 0) {
-                break;
-            }
-            written = fd->write(fd, xfer, n);
-            if (written != n) {
-                break;
-            }
-            total -= written;
-        }
-        if (total) {
-            fd->close(fd);
-            fd = NULL;
-        }
+    if (fd && (total < 0 || copy_payload(fd, src, total))) {
+        fd->close(fd);
+        fd = NULL;
     }
     src->close(src);
     return fd;
@@ -312,8 +192,7 @@ make_img4(const char *iname, FHANDLE *orig)
 static FHANDLE
 replace_img4(const char *iname, const char *replacer, FHANDLE *orig)
 {
-    size_t total;
-    unsigned char xfer[4096];
+    ssize_t total;
     FHANDLE fd, src = file_open(replacer, O_RDONLY);
     if (!src) {
         return NULL;
@@ -325,39 +204,509 @@ replace_img4(const char *iname, const char *replacer, FHANDLE *orig)
         return NULL;
     }
     fd = img4_reopen(*orig, NULL, FLAG_IMG4_SKIP_DECOMPRESSION);
-    if (fd) {
-        fd->ftruncate(fd, total);
-        fd->lseek(fd, 0, SEEK_SET);
-        for (;;) {
-            ssize_t n, written;
-            n = src->read(src, xfer, sizeof(xfer));
-            if (n <= 0) {
-                break;
+    if (fd && (total < 0 || copy_payload(fd, src, total))) {
+        fd->close(fd);
+        fd = NULL;
+    }
+    src->close(src);
+    return fd;
+}
+
+struct query_ctx {
+    bool json;
+    unsigned object;
+};
+
+static int
+print_property(void *arg, unsigned object, unsigned prop, int kind, const void *value, size_t length)
+{
+    struct query_ctx *q = arg;
+    const unsigned char *p = value;
+    size_t i;
+
+    if (q->json) {
+        if (object != q->object) {
+            printf("%s\"%c%c%c%c\": {", q->object ? "}, " : "{", FOURCC(object));
+        } else {
+            printf(", ");
+        }
+        printf("\"%c%c%c%c\": ", FOURCC(prop));
+    } else {
+        printf("%c%c%c%c.%c%c%c%c -> ", FOURCC(object), FOURCC(prop));
+    }
+    q->object = object;
+
+    switch (kind) {
+        case IMG4_PROP_BOOL:
+            printf("%s", *(const bool *)value ? "true" : "false");
+            break;
+        case IMG4_PROP_INT:
+            printf(q->json ? "\"0x%llx\"" : "0x%llx", (unsigned long long)*(const uint64_t *)value);
+            break;
+        default:
+            if (q->json) putchar('"');
+            for (i = 0; i < length; i++) printf("%02x", p[i]);
+            if (q->json) putchar('"');
+    }
+    if (!q->json) {
+        printf("\n");
+    }
+    return 0;
+}
+
+/* devices are lines of sigcheck info, tickets are files; prints one JSON object per ticket/device pair */
+static int
+validate_fleet(const char *devname, int count, char **names)
+{
+    int i, rv = -1;
+    char *line, *end;
+    unsigned char *buf = NULL;
+    size_t sz, d, ndevices = 0;
+    struct img4_device *devices = NULL;
+    void **tickets;
+    size_t *sizes;
+    int *trust;
+    unsigned char *matrix = NULL;
+
+    tickets = calloc(count, sizeof(void *));
+    sizes = calloc(count, sizeof(size_t));
+    trust = calloc(count, sizeof(int));
+    if (!tickets || !sizes || !trust) {
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        if (read_file(names[i], (unsigned char **)&tickets[i], &sizes[i])) {
+            goto done;
+        }
+    }
+
+    if (read_file(devname, &buf, &sz)) {
+        goto done;
+    }
+    line = realloc(buf, sz + 1);
+    if (!line) {
+        goto done;
+    }
+    buf = (unsigned char *)line;
+    line[sz] = '\0';
+    devices = malloc((sz / 2 + 1) * sizeof(struct img4_device));
+    if (!devices) {
+        goto done;
+    }
+    for (; *line; line = end) {
+        end = line + strcspn(line, "\n");
+        if (*end) {
+            *end++ = '\0';
+        }
+        line += strspn(line, " \t\r");
+        if (*line && *line != '#') {
+            img4_parse_device(&devices[ndevices++], line);
+        }
+    }
+
+    matrix = malloc(count * ndevices + 1);
+    if (!matrix) {
+        goto done;
+    }
+    rv = img4_validate_fleet((const void *const *)tickets, sizes, count, devices, ndevices, trust, matrix, 0);
+    for (i = 0; i < count; i++) {
+        if (trust[i]) {
+            printf("{\"ticket\": \"%s\", \"trusted\": false}\n", names[i]);
+            continue;
+        }
+        for (d = 0; d < ndevices; d++) {
+            printf("{\"ticket\": \"%s\", \"device\": %zu, \"ECID\": \"0x%llx\", \"match\": %s}\n", names[i], d, devices[d].ECID, matrix[i * ndevices + d] ? "true" : "false");
+        }
+    }
+
+  done:
+    if (tickets) {
+        for (i = 0; i < count; i++) {
+            free(tickets[i]);
+        }
+    }
+    free(tickets);
+    free(sizes);
+    free(trust);
+    free(devices);
+    free(matrix);
+    free(buf);
+    return rv;
+}
+
+#define NONCE_BATCH (1 << 20)
+
+/* candidates are hex nonces, one per line, or <first>+<count> for a range; prints one JSON object per ticket */
+static int
+match_nonces(const char *candname, int count, char **names)
+{
+    int i, rv = -1;
+    char *line, *end;
+    unsigned char *buf = NULL;
+    size_t sz, n = 0, pending = 1, lineno;
+    void **tickets;
+    size_t *sizes;
+    unsigned long long *nonces = NULL, nonce;
+    struct img4_bnch_table *table = NULL;
+
+    tickets = calloc(count, sizeof(void *));
+    sizes = calloc(count, sizeof(size_t));
+    if (!tickets || !sizes) {
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        if (read_file(names[i], (unsigned char **)&tickets[i], &sizes[i])) {
+            goto done;
+        }
+    }
+    if (read_file(candname, &buf, &sz)) {
+        goto done;
+    }
+    line = realloc(buf, sz + 1);
+    nonces = malloc(NONCE_BATCH * sizeof(unsigned long long));
+    if (!line || !nonces) {
+        goto done;
+    }
+    buf = (unsigned char *)line;
+    line[sz] = '\0';
+
+    table = img4_bnch_table((const void *const *)tickets, sizes, count);
+    if (!table) {
+        fprintf(stderr, "[e] cannot read tickets\n");
+        goto done;
+    }
+    for (lineno = 1; *line && pending; line = end, lineno++) {
+        unsigned long long first, total = 1;
+        char *p;
+        end = line + strcspn(line, "\n");
+        if (*end) {
+            *end++ = '\0';
+        }
+        line += strspn(line, " \t\r");
+        if (!*line || *line == '#') {
+            continue;
+        }
+        errno = 0;
+        first = strtoull(line, &p, 16);
+        if (errno || p == line || *line == '-') {
+            fprintf(stderr, "[e] malformed candidate line %zu\n", lineno);
+            goto done;
+        }
+        if (*p == '+') {
+            line = p + 1;
+            errno = 0;
+            total = strtoull(line, &p, 0);
+            if (errno || p == line || *line == '-' || !total) {
+                fprintf(stderr, "[e] malformed candidate line %zu\n", lineno);
+                goto done;
             }
-            written = fd->write(fd, xfer, n);
-            if (written != n) {
+        }
+        if (p[strspn(p, " \t\r")]) {
+            fprintf(stderr, "[e] malformed candidate line %zu\n", lineno);
+            goto done;
+        }
+        for (nonce = first; total && pending; total--) {
+            nonces[n++] = nonce++;
+            if (n == NONCE_BATCH) {
+                pending = img4_bnch_match(table, nonces, n, 0);
+                n = 0;
+            }
+        }
+    }
+    if (n && pending) {
+        img4_bnch_match(table, nonces, n, 0);
+    }
+
+    rv = 0;
+    for (i = 0; i < count; i++) {
+        switch (img4_bnch_found(table, i, &nonce)) {
+            case 1:
+                printf("{\"ticket\": \"%s\", \"nonce\": \"0x%016llx\"}\n", names[i], nonce);
+                break;
+            case 0:
+                printf("{\"ticket\": \"%s\", \"nonce\": null}\n", names[i]);
                 break;
+            default:
+                printf("{\"ticket\": \"%s\", \"BNCH\": false}\n", names[i]);
+        }
+    }
+
+  done:
+    if (tickets) {
+        for (i = 0; i < count; i++) {
+            free(tickets[i]);
+        }
+    }
+    img4_bnch_free(table);
+    free(tickets);
+    free(sizes);
+    free(nonces);
+    free(buf);
+    return rv;
+}
+
+/* print where the signatures are, or the patch their replacements make */
+static int
+search_image(FHANDLE fd, const char *sigfile, int as_patch, bool json)
+{
+    int rv;
+    size_t i, j, sz, count;
+    unsigned char *buf, *data;
+    struct search_set set;
+    struct search_match *matches;
+
+    rv = read_file(sigfile, &buf, &sz);
+    if (rv) {
+        return rv;
+    }
+    rv = search_load(&set, buf, sz);
+    free(buf);
+    if (rv) {
+        return rv;
+    }
+    rv = fd->ioctl(fd, IOCTL_MEM_GET_DATAPTR, &data, &sz);
+    if (rv) {
+        fprintf(stderr, "[e] search: cannot access data\n");
+        goto done;
+    }
+    rv = search_run(&set, data, sz, 0, &matches, &count);
+    if (rv) {
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        const struct search_sig *sig = &set.sigs[matches[i].sig];
+        const unsigned char *cur = data + matches[i].offset;
+        if (as_patch) {
+            unsigned char tmp[256], *repl;
+            if (!sig->repl) {
+                continue;
+            }
+            repl = sig->length > sizeof(tmp) ? malloc(sig->length) : tmp;
+            if (!repl) {
+                continue;
             }
-            total -= written;
+            search_replace(sig, cur, repl);
+            for (j = 0; j < sig->length; j++) {
+                if (repl[j] != cur[j]) {
+                    printf("0x%llx 0x%02x 0x%02x\n", (unsigned long long)(matches[i].offset + j), cur[j], repl[j]);
+                }
+            }
+            if (repl != tmp) {
+                free(repl);
+            }
+        } else if (json) {
+            printf("{\"signature\": \"%s\", \"offset\": \"0x%llx\"}\n", sig->name, (unsigned long long)matches[i].offset);
+        } else {
+            printf("%s 0x%llx\n", sig->name, (unsigned long long)matches[i].offset);
         }
-        if (total) {
-            fd->close(fd);
-            fd = NULL;
+    }
+    free(matches);
+
+  done:
+    search_free(&set);
+    return rv;
+}
+
+/* what the allocator holds for the whole process */
+static void
+print_memory(bool json)
+{
+    struct vfs_memory_usage usage;
+    vfs_memory_usage(&usage);
+    if (json) {
+        printf("{\"process\": {\"live_bytes\": %zu, \"peak_bytes\": %zu, \"pooled_bytes\": %zu, \"spilled_bytes\": %zu, \"budget\": %zu, \"refused\": %zu}}\n",
+               usage.live, usage.peak, usage.pooled, usage.spilled, usage.budget, usage.refused);
+    } else {
+        printf("process: live %zu, peak %zu, pooled %zu, spilled %zu, budget %zu, refused %zu\n",
+               usage.live, usage.peak, usage.pooled, usage.spilled, usage.budget, usage.refused);
+    }
+}
+
+/* after a failure, tell whether the memory budget was the cause */
+static void
+check_budget(void)
+{
+    struct vfs_memory_usage usage;
+    vfs_memory_usage(&usage);
+    if (usage.refused) {
+        fprintf(stderr, "[e] memory budget of %zu bytes exceeded\n", usage.budget);
+    }
+}
+
+/* bytes, with an optional k, m or g suffix */
+static int
+parse_size(const char *str, size_t *size)
+{
+    char *end;
+    unsigned long long n = strtoull(str, &end, 0);
+    switch (*end) {
+        case 'g': case 'G': n <<= 10; /* fallthrough */
+        case 'm': case 'M': n <<= 10; /* fallthrough */
+        case 'k': case 'K': n <<= 10;
+            end++;
+    }
+    if (end == str || *end) {
+        return -1;
+    }
+    *size = n;
+    return 0;
+}
+
+/* per-layer counters, top of the stack first, as the layers left them at close so that saving is in there */
+static void
+print_stats(struct vfs_stats_list *list, bool json)
+{
+    size_t i;
+
+    if (!list->count) {
+        fprintf(stderr, "[e] no stats\n");
+        return;
+    }
+    if (list->count > list->max) {
+        list->count = list->max;
+    }
+    if (!json) {
+        printf("%-8s %8s %8s %6s %12s %12s %10s %10s %10s %10s %6s %12s %12s\n", "layer", "reads", "writes", "fsyncs",
+               "bytes_in", "bytes_out", "read_us", "write_us", "fsync_us", "reopen_us", "allocs", "live_bytes", "peak_bytes");
+    }
+    for (i = 0; i < list->count; i++) {
+        const struct vfs_stats *s = &list->layers[i];
+        if (json) {
+            printf("{\"layer\": \"%s\", \"reads\": %llu, \"writes\": %llu, \"fsyncs\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, "
+                   "\"read_ns\": %llu, \"write_ns\": %llu, \"fsync_ns\": %llu, \"reopen_ns\": %llu, \"allocs\": %llu, \"live_bytes\": %llu, \"peak_bytes\": %llu}\n",
+                   s->layer, s->reads, s->writes, s->fsyncs, s->bytes_in, s->bytes_out,
+                   s->read_ns, s->write_ns, s->fsync_ns, s->reopen_ns, s->allocs, s->live_bytes, s->peak_bytes);
+        } else {
+            printf("%-8s %8llu %8llu %6llu %12llu %12llu %10llu %10llu %10llu %10llu %6llu %12llu %12llu\n",
+                   s->layer, s->reads, s->writes, s->fsyncs, s->bytes_in, s->bytes_out,
+                   s->read_ns / 1000, s->write_ns / 1000, s->fsync_ns / 1000, s->reopen_ns / 1000, s->allocs, s->live_bytes, s->peak_bytes);
         }
     }
-    src->close(src);
+    print_memory(json);
+}
+
+static FHANDLE
+open_decoded(const char *name, const unsigned char *ivkey, unsigned char **data, size_t *size)
+{
+    void *kbag;
+    size_t kbagsize;
+    FHANDLE fd = img4_reopen(file_open(name, O_RDONLY), ivkey, 0);
+    if (!fd) {
+        fprintf(stderr, "[e] cannot open '%s'\n", name);
+        return NULL;
+    }
+    if (!ivkey && fd->ioctl(fd, IOCTL_IMG4_GET_KEYBAG, &kbag, &kbagsize) == 0 && kbagsize) {
+        /* the ciphertext would be diffed instead */
+        fprintf(stderr, "[e] '%s' is encrypted, give its ivkey with -k\n", name);
+        fd->close(fd);
+        return NULL;
+    }
+    if (fd->ioctl(fd, IOCTL_MEM_GET_DATAPTR, data, size)) {
+        fprintf(stderr, "[e] cannot read '%s'\n", name);
+        fd->close(fd);
+        return NULL;
+    }
     return fd;
 }
 
+/* write the patch taking the decoded payload of one image to the other's */
+static int
+diff_images(int argc, char **argv)
+{
+    const char *names[2] = { NULL, NULL };
+    const char *oname = NULL;
+    unsigned char keys[2][16 + 32];
+    const unsigned char *ivkeys[2] = { NULL, NULL };
+    int binary = 0;
+    int i, n = 0, nkeys = 0, rv = -1;
+    unsigned char *a, *b;
+    size_t asize, bsize;
+    FHANDLE fa, fb = NULL, out;
+
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            binary = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            oname = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            if (nkeys == 2 || str2hex(sizeof(keys[0]), keys[nkeys], argv[++i]) != sizeof(keys[0])) {
+                fprintf(stderr, "[e] invalid ivkey\n");
+                return -1;
+            }
+            ivkeys[nkeys] = keys[nkeys];
+            nkeys++;
+        } else if (argv[i][0] != '-' && n < 2) {
+            names[n++] = argv[i];
+        } else {
+            fprintf(stderr, "[e] illegal option '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+    if (n != 2) {
+        fprintf(stderr, "[e] need two images to diff\n");
+        return -1;
+    }
+    if (!oname) {
+        fprintf(stderr, "[e] no output file name\n");
+        return -1;
+    }
+    if (nkeys == 1) {
+        ivkeys[1] = ivkeys[0];
+    }
+
+    fa = open_decoded(names[0], ivkeys[0], &a, &asize);
+    if (!fa) {
+        return -1;
+    }
+    fb = open_decoded(names[1], ivkeys[1], &b, &bsize);
+    if (!fb) {
+        goto done;
+    }
+    if (asize != bsize) {
+        fprintf(stderr, "[w] diff: sizes differ, comparing the first %zu bytes\n", asize < bsize ? asize : bsize);
+        if (asize > bsize) {
+            asize = bsize;
+        }
+    }
+
+    out = file_open(oname, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (!out) {
+        fprintf(stderr, "[e] cannot write '%s'\n", oname);
+        goto done;
+    }
+    rv = patch_diff(a, b, asize, binary, out, NULL);
+    if (out->close(out) && !rv) {
+        fprintf(stderr, "[e] cannot write '%s'\n", oname);
+        rv = -1;
+    }
+
+  done:
+    if (fb) {
+        fb->close(fb);
+    }
+    fa->close(fa);
+    return rv;
+}
+
 static void __attribute__((noreturn))
 usage(const char *argv0)
 {
     printf("usage: %s -i <input> [-o <output>] [-k <ivkey>] [GETTERS] [MODIFIERS]\n", argv0);
+    printf("       %s --fleet <devices> <ticket> [<ticket>...]\n", argv0);
+    printf("       %s --nonces <candidates> <ticket> [<ticket>...]\n", argv0);
+    printf("       %s --diff <image> <image> -o <patch> [-k <ivkey> [-k <ivkey>]] [--binary]\n", argv0);
     printf("    -i <file>       read from <file>\n");
     printf("    -o <file>       write image to <file>\n");
     printf("    -k <ivkey>      use <ivkey> to decrypt\n");
     printf("    -z              operate on compressed data\n");
     printf("    --json          output information in JSON format\n");
+    printf("    --stats         print per-layer I/O and time counters at the end\n");
+    printf("    --trace <file>  write timing spans to <file> as chrome trace-event JSON\n");
+    printf("    --max-memory <n>  fail rather than hold more than <n> bytes of buffers (k, m, g)\n");
+    printf("    --spill <dir>   past --max-memory, keep big buffers in unlinked files in <dir>\n");
+    printf("    --cache         keep parsed metadata in <input>.img4meta and reuse it\n");
+    printf("    --cache-dir <dir>  same, but keep it in <dir>\n");
     printf("getters:\n");
     printf("    -l              list all info\n");
     printf("    -w <file>       write watchtower to <file>\n");
@@ -365,7 +714,10 @@ usage(const char *argv0)
     printf("    -m <file>       write ticket to <file>\n");
     printf("    -e <file>       write epinfo to <file>\n");
     printf("    -c <info>       check signature with <info>\n");
+    printf("    -S[p] <file>    search for signatures from <file> (p=print as patch)\n");
     printf("    -q <prop>       query property\n");
+    printf("    -q <p1,p2|*>    query several (or all) properties at once\n");
+    printf("    --objects       with -q, query every object in the manifest\n");
     printf("    -f              check hash against manifest\n");
     printf("    -n              print nonce\n");
     printf("    -b              print kbags\n");
@@ -389,6 +741,10 @@ usage(const char *argv0)
     printf("note: if no modifier is present and -o is specified, extract the bare image\n");
     printf("note: if modifiers are present and -o is not specified, modify the input file\n");
     printf("note: sigcheck info is: \"CHIP=0x8960,ECID=0x1122334455667788[,...]\"\n");
+    printf("note: --fleet reads one sigcheck info per line, and prints a JSON line per ticket and device\n");
+    printf("note: --nonces reads one nonce (or <first>+<count>) per line, and prints a JSON line per ticket\n");
+    printf("note: --diff writes the patch that -P applies to turn the first payload into the second\n");
+    printf("note: --diff takes one -k for both images, or one per image in order; encrypted images need one\n");
     exit(0);
 }
 
@@ -404,6 +760,8 @@ main(int argc, char **argv)
     const char *mname = NULL;
     const char *ename = NULL;
     const char *query = NULL;
+    const char *search = NULL;
+    int sp = 0;
     char *cinfo = NULL;
     int list_only = 0;
     int get_nonce = 0;
@@ -429,6 +787,13 @@ main(int argc, char **argv)
     int img4flags = 0;
 
     bool json_output = false;
+    bool show_stats = false;
+    struct vfs_stats layers[16];
+    struct vfs_stats_list stats;
+    const char *trace = NULL;
+    size_t max_memory = 0;
+    const char *spill = NULL;
+    int all_objects = 0;
 
     int rv, rc = 0;
     unsigned char *buf;
@@ -438,12 +803,67 @@ main(int argc, char **argv)
     FHANDLE fd, orig = NULL;
     unsigned char *k, ivkey[16 + 32], kb1[16 + 32], kb2[16 + 32];
 
+    if (argc >= 3 && strcmp(argv[1], "--fleet") == 0) {
+        return validate_fleet(argv[2], argc - 3, argv + 3);
+    }
+    if (argc >= 3 && strcmp(argv[1], "--nonces") == 0) {
+        return match_nonces(argv[2], argc - 3, argv + 3);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--diff") == 0) {
+        return diff_images(argc - 2, argv + 2);
+    }
+
     while (--argc > 0) {
         const char *arg = *++argv;
         if (strcmp(arg, "--json") == 0) {
             json_output = true;
             continue;
         }
+        if (strcmp(arg, "--objects") == 0) {
+            all_objects = 1;
+            continue;
+        }
+        if (strcmp(arg, "--stats") == 0) {
+            show_stats = true;
+            vfs_stats_enable(1);
+            continue;
+        }
+        if (strcmp(arg, "--max-memory") == 0 && argc >= 2) {
+            argc--;
+            if (parse_size(*++argv, &max_memory) || !max_memory) {
+                fprintf(stderr, "[e] invalid size '%s'\n", *argv);
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(arg, "--spill") == 0 && argc >= 2) {
+            spill = *++argv;
+            argc--;
+            continue;
+        }
+        if (strcmp(arg, "--cache") == 0) {
+            img4flags |= FLAG_IMG4_META_CACHE;
+            continue;
+        }
+        if (strcmp(arg, "--cache-dir") == 0 && argc >= 2) {
+            img4flags |= FLAG_IMG4_META_CACHE;
+            img4_meta_dir(*++argv);
+            argc--;
+            continue;
+        }
+        if (strcmp(arg, "--trace") == 0) {
+#ifndef VFS_TRACE
+            fprintf(stderr, "[e] tracing is not built in, rebuild with TRACE=1\n");
+            return -1;
+#endif
+            if (argc < 2) {
+                fprintf(stderr, "[e] argument to '%s' is missing\n", arg);
+                return -1;
+            }
+            trace = *++argv;
+            argc--;
+            continue;
+        }
         if (*arg == '-') switch (arg[1]) {
             case 'h':
                 usage(argv0);
@@ -500,6 +920,8 @@ main(int argc, char **argv)
                 if (argc >= 2) { ename = *++argv; argc--; continue; }
             case 'q':
                 if (argc >= 2) { query = *++argv; argc--; continue; }
+            case 'S':
+                if (argc >= 2) { search = *++argv; argc--; sp = (!!strchr(arg, 'p')); continue; }
             case 'T':
                 if (argc >= 2) { set_type = *++argv; argc--; continue; }
             case 'P':
@@ -537,6 +959,11 @@ main(int argc, char **argv)
         fprintf(stderr, "[e] no input file name\n");
         return -1;
     }
+    if (spill && !max_memory) {
+        fprintf(stderr, "[e] --spill needs --max-memory\n");
+        return -1;
+    }
+    vfs_memory_budget(max_memory, spill);
 
     modify = set_type || set_patch || set_wtower || set_manifest || set_nonce || set_decrypt || set_convert || set_version || set_wrap || set_kb1 || set_keybag || set_replacer || set_epinfo || (img4flags & FLAG_IMG4_UPDATE_HASH);
 
@@ -554,7 +981,7 @@ main(int argc, char **argv)
     }
 
     // open
-    if (!modify || list_only || get_nonce || get_kbags || get_version || query) {
+    if (!modify || list_only || get_nonce || get_kbags || get_version || query || search) {
         fd = img4_reopen(file_open(iname, O_RDONLY), k, img4flags);
     } else if (set_wrap) {
         if (!oname) oname = iname;
@@ -570,6 +997,7 @@ main(int argc, char **argv)
 
     if (!fd) {
         fprintf(stderr, "[e] cannot open '%s'\n", iname);
+        check_budget();
         return -1;
     }
 
@@ -650,7 +1078,7 @@ main(int argc, char **argv)
     }
     
     // Niet-list-only getters
-    if (!get_nonce && !get_kbags && !get_version && !query) {
+    if (!get_nonce && !get_kbags && !get_version && !query && !search) {
         if (!json_output) {
              printf("%c%c%c%c\n", FOURCC(type));
         }
@@ -660,11 +1088,31 @@ main(int argc, char **argv)
     if (gname) {  }
     if (mname) {  }
     if (ename) {  }
-    if (cinfo) {  }
+    if (cinfo) {
+        rv = fd->ioctl(fd, IOCTL_IMG4_EVAL_TRUST, cinfo);
+        if (json_output) {
+            printf("{\"signature\": %s}\n", rv ? "false" : "true");
+        } else {
+            printf("signature %s\n", rv ? "FAILED" : "OK");
+        }
+        rc |= rv;
+    }
 
-    if (query) {
+    if (query && (all_objects || !strcmp(query, "*") || strchr(query, ','))) {
+        struct query_ctx q;
+        q.json = json_output;
+        q.object = 0;
+        rv = fd->ioctl(fd, IOCTL_IMG4_QUERY_PROPS, query, all_objects, print_property, &q);
+        if (json_output && q.object) {
+            printf("}}\n");
+        }
+        if (rv) {
+            fprintf(stderr, "[e] query failed\n");
+        }
+        rc |= rv;
+    } else if (query) {
         unsigned char result[256];
-        unsigned int i, len = sizeof(result);
+        size_t i, len = sizeof(result);
         rv = fd->ioctl(fd, IOCTL_IMG4_QUERY_PROP, query, result, &len);
         if (rv) {
             fprintf(stderr, "[e] query failed\n");
@@ -681,6 +1129,11 @@ main(int argc, char **argv)
         rc |= rv;
     }
 
+    if (search) {
+        rv = search_image(fd, search, sp, json_output);
+        rc |= rv;
+    }
+
     if (get_nonce) {
         uint64_t gnonce = 0;
         rv = fd->ioctl(fd, IOCTL_IMG4_GET_NONCE, &gnonce);
@@ -862,5 +1315,23 @@ main(int argc, char **argv)
         rc |= rv;
     }
 
-    return rc | fd->close(fd);
+    if (show_stats) {
+        stats.layers = layers;
+        stats.max = sizeof(layers) / sizeof(layers[0]);
+        stats.count = 0;
+        vfs_stats_collect(&stats);
+    }
+    rc |= fd->close(fd);
+    if (show_stats) {
+        vfs_stats_collect(NULL);
+        print_stats(&stats, json_output);
+    }
+    if (rc) {
+        check_budget();
+    }
+    if (trace && vfs_trace_write(trace)) {
+        fprintf(stderr, "[e] cannot write trace to %s\n", trace);
+        rc = -1;
+    }
+    return rc;
 }
\ No newline at end of file
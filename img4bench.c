@@ -0,0 +1,1151 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef USE_COMMONCRYPTO
+#include <CommonCrypto/CommonCrypto.h>
+#define SHA1(data, len, md) CC_SHA1(data, len, md)
+#define SHA384(data, len, md) CC_SHA384(data, len, md)
+#else
+#include <openssl/sha.h>
+#endif
+#ifdef USE_CORECRYPTO
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <corecrypto/ccaes.h>
+#include <corecrypto/ccrsa.h>
+#include <corecrypto/ccsha1.h>
+#include <corecrypto/ccsha2.h>
+#endif
+#ifdef USE_LIBCOMPRESSION
+typedef enum {
+    COMPRESSION_LZFSE_SMALL = 0x891,
+} compression_algorithm;
+size_t compression_encode_buffer(uint8_t *restrict dst_buffer, size_t dst_size, const uint8_t *restrict src_buffer, size_t src_size, void *restrict scratch_buffer, compression_algorithm algorithm);
+size_t compression_decode_buffer(uint8_t *restrict dst_buffer, size_t dst_size, const uint8_t *restrict src_buffer, size_t src_size, void *restrict scratch_buffer, compression_algorithm algorithm);
+#define lzfse_decode_buffer(dst_buffer, dst_size, src_buffer, src_size, scratch_buffer) compression_decode_buffer(dst_buffer, dst_size, src_buffer, src_size, scratch_buffer, COMPRESSION_LZFSE_SMALL)
+#define lzfse_encode_buffer(dst_buffer, dst_size, src_buffer, src_size, scratch_buffer) compression_encode_buffer(dst_buffer, dst_size, src_buffer, src_size, scratch_buffer, COMPRESSION_LZFSE_SMALL)
+#else
+#include "lzfse.h"
+#endif
+#include "libvfs/vfs.h"
+#include "lzss.h"
+#include "sha_mb.h"
+
+#define MAX_RESULTS     1024
+
+/* what -j writes out */
+static struct result {
+    char name[64];
+    size_t bytes;
+    size_t ops;
+    double elapsed;
+} results[MAX_RESULTS];
+static size_t nresults;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* bytes may be 0 for things that are not about throughput */
+static void
+report(const char *what, size_t bytes, size_t ops, double elapsed)
+{
+    struct result *r;
+    if (bytes) {
+        printf("%-36s %10.2f MB/s %12.1f us/op\n", what, bytes / elapsed / 1e6, elapsed * 1e6 / ops);
+    } else {
+        printf("%-36s %10.0f op/s %12.1f us/op\n", what, ops / elapsed, elapsed * 1e6 / ops);
+    }
+    if (nresults < MAX_RESULTS) {
+        r = &results[nresults++];
+        snprintf(r->name, sizeof(r->name), "%s", what);
+        r->bytes = bytes;
+        r->ops = ops;
+        r->elapsed = elapsed;
+    }
+}
+
+#ifdef USE_CORECRYPTO
+static int
+mismatch(const char *what)
+{
+    fprintf(stderr, "[e] %s: in-tree and OpenSSL results differ\n", what);
+    return -1;
+}
+
+static size_t
+unhex(unsigned char *out, const char *hex)
+{
+    size_t n = 0;
+    unsigned v;
+    while (hex[0] && hex[1] && sscanf(hex, "%2x", &v) == 1) {
+        out[n++] = v;
+        hex += 2;
+    }
+    return n;
+}
+
+/* known answers from FIPS 180-2 and SP 800-38A F.2, for whichever code ccsha1_di() and ccaes pick on this CPU */
+static int
+check_vectors(void)
+{
+    static const struct {
+        const char *msg;
+        const char *sha1;
+        const char *sha384;
+    } digests[] = {
+        { "",
+          "da39a3ee5e6b4b0d3255bfef95601890afd80709",
+          "38b060a751ac96384cd9327eb1b1e36a21fdb71114be07434c0cc7bf63f6e1da274edebfe76f65fbd51ad2f14898b95b" },
+        { "abc",
+          "a9993e364706816aba3e25717850c26c9cd0d89d",
+          "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+          NULL },
+        { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+          "a49b2446a02c645bf419f995b67091253a04a259",
+          "09330c33f71147e83d192fc782cd1b4753111b173b3b05d22fa08086e3b0f712fcc7c71a557e2db966c3e9fa91746039" },
+        { NULL,                 /* a million 'a' */
+          "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+          "9d0e1809716474cb086e834e310a4a1ced149e9c00f248527972cec5704c2a5b07b8b3dc38ecc4ebae97ddd87f3d8985" },
+    };
+    static const struct {
+        const char *key;
+        const char *ct;
+    } cbc[] = {
+        { "2b7e151628aed2a6abf7158809cf4f3c",
+          "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b273bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+        { "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+          "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd" },
+        { "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+          "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" },
+    };
+    static const char cbc_iv[] = "000102030405060708090a0b0c0d0e0f";
+    static const char cbc_pt[] = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+    unsigned char want[64], got[64], key[32], iv[16], pt[64], *million;
+    size_t i, len, keylen;
+
+    million = malloc(1000000);
+    if (!million) {
+        fprintf(stderr, "[e] out of memory\n");
+        return -1;
+    }
+    memset(million, 'a', 1000000);
+    for (i = 0; i < sizeof(digests) / sizeof(digests[0]); i++) {
+        const unsigned char *msg = digests[i].msg ? (const unsigned char *)digests[i].msg : million;
+        len = digests[i].msg ? strlen(digests[i].msg) : 1000000;
+        unhex(want, digests[i].sha1);
+        ccdigest(ccsha1_di(), len, msg, got);
+        if (memcmp(want, got, 20)) {
+            fprintf(stderr, "[e] SHA1: wrong answer for vector %zu\n", i);
+            free(million);
+            return -1;
+        }
+        if (digests[i].sha384) {
+            unhex(want, digests[i].sha384);
+            ccdigest(ccsha384_di(), len, msg, got);
+            if (memcmp(want, got, 48)) {
+                fprintf(stderr, "[e] SHA384: wrong answer for vector %zu\n", i);
+                free(million);
+                return -1;
+            }
+        }
+    }
+    free(million);
+
+    unhex(iv, cbc_iv);
+    len = unhex(pt, cbc_pt);
+    for (i = 0; i < sizeof(cbc) / sizeof(cbc[0]); i++) {
+        keylen = unhex(key, cbc[i].key);
+        unhex(want, cbc[i].ct);
+        cccbc_one_shot(ccaes_cbc_encrypt_mode(), keylen, key, iv, len / 16, pt, got);
+        if (memcmp(want, got, len)) {
+            fprintf(stderr, "[e] AES%zu-CBC encrypt: wrong answer\n", keylen * 8);
+            return -1;
+        }
+        cccbc_one_shot(ccaes_cbc_decrypt_mode(), keylen, key, iv, len / 16, want, got);
+        if (memcmp(pt, got, len)) {
+            fprintf(stderr, "[e] AES%zu-CBC decrypt: wrong answer\n", keylen * 8);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+bench_digests(struct sha_mb_job *jobs, size_t count, size_t total, unsigned rounds)
+{
+    unsigned char ref[48];
+    unsigned r;
+    size_t i;
+    double t;
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            ccdigest(ccsha1_di(), jobs[i].length, jobs[i].data, jobs[i].digest);
+        }
+    }
+    report("SHA1 in-tree", total, count * rounds, now() - t);
+    SHA1(jobs[0].data, jobs[0].length, ref);
+    if (memcmp(ref, jobs[0].digest, 20)) {
+        return mismatch("SHA1");
+    }
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            ccdigest(ccsha384_di(), jobs[i].length, jobs[i].data, jobs[i].digest);
+        }
+    }
+    report("SHA384 in-tree", total, count * rounds, now() - t);
+    SHA384(jobs[0].data, jobs[0].length, ref);
+    if (memcmp(ref, jobs[0].digest, 48)) {
+        return mismatch("SHA384");
+    }
+    return 0;
+}
+
+static void
+evp_cbc(int enc, const unsigned char *key, const unsigned char *iv, const unsigned char *in, unsigned char *out, size_t length)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int outl;
+    EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, enc);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    while (length) {
+        int chunk = length > 0x40000000 ? 0x40000000 : (int)length;
+        EVP_CipherUpdate(ctx, out, &outl, in, chunk);
+        in += chunk;
+        out += chunk;
+        length -= chunk;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+static int
+bench_aes(const unsigned char *buf, size_t length, unsigned rounds)
+{
+    static const unsigned char key[32] = "0123456789abcdef0123456789abcdef";
+    static const unsigned char iv[16] = "fedcba9876543210";
+    unsigned char *ours, *theirs, *plain;
+    size_t total;
+    unsigned r;
+    double t;
+    int rv = -1;
+
+    length &= ~(size_t)15;
+    total = length * rounds;
+    ours = malloc(length);
+    theirs = malloc(length);
+    plain = malloc(length);
+    if (!ours || !theirs || !plain) {
+        fprintf(stderr, "[e] out of memory\n");
+        goto done;
+    }
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        evp_cbc(1, key, iv, buf, theirs, length);
+    }
+    report("AES256-CBC enc OpenSSL", total, rounds, now() - t);
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        cccbc_one_shot(ccaes_cbc_encrypt_mode(), 32, key, iv, length / 16, buf, ours);
+    }
+    report("AES256-CBC enc in-tree", total, rounds, now() - t);
+    if (memcmp(ours, theirs, length)) {
+        mismatch("AES256-CBC encrypt");
+        goto done;
+    }
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        evp_cbc(0, key, iv, ours, theirs, length);
+    }
+    report("AES256-CBC dec OpenSSL", total, rounds, now() - t);
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        cccbc_one_shot(ccaes_cbc_decrypt_mode(), 32, key, iv, length / 16, ours, plain);
+    }
+    report("AES256-CBC dec in-tree", total, rounds, now() - t);
+    if (memcmp(plain, buf, length) || memcmp(theirs, buf, length)) {
+        mismatch("AES256-CBC decrypt");
+        goto done;
+    }
+    rv = 0;
+
+  done:
+    free(plain);
+    free(theirs);
+    free(ours);
+    return rv;
+}
+
+/* content of the next DER element with the given tag */
+static const unsigned char *
+der_next(const unsigned char **p, const unsigned char *end, unsigned tag, size_t *length)
+{
+    const unsigned char *q = *p;
+    size_t n, k;
+
+    if (end - q < 2 || q[0] != tag) {
+        return NULL;
+    }
+    n = q[1];
+    q += 2;
+    if (n & 0x80) {
+        k = n & 0x7F;
+        if (k > sizeof(size_t) || (size_t)(end - q) < k) {
+            return NULL;
+        }
+        for (n = 0; k--; ) {
+            n = (n << 8) | *q++;
+        }
+    }
+    if ((size_t)(end - q) < n) {
+        return NULL;
+    }
+    *p = q + n;
+    *length = n;
+    return q;
+}
+
+static int
+bench_rsa(unsigned iterations)
+{
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *pkey = NULL;
+    unsigned char digest[20], sig[512];
+    unsigned char *der = NULL;
+    const unsigned char *p, *end, *seq, *m, *e;
+    size_t siglen = sizeof(sig), mlen, elen, len;
+    unsigned i, good;
+    int derlen;
+    double t;
+
+    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) != 1 || EVP_PKEY_keygen(ctx, &pkey) != 1) {
+        fprintf(stderr, "[e] cannot make an RSA key\n");
+        EVP_PKEY_CTX_free(ctx);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(ctx);
+
+    SHA1((const unsigned char *)"img4bench", 9, digest);
+    ctx = EVP_PKEY_CTX_new(pkey, NULL);
+    if (!ctx || EVP_PKEY_sign_init(ctx) != 1
+        || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) != 1
+        || EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha1()) != 1
+        || EVP_PKEY_sign(ctx, sig, &siglen, digest, sizeof(digest)) != 1) {
+        fprintf(stderr, "[e] cannot sign\n");
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(pkey);
+        return -1;
+    }
+    EVP_PKEY_CTX_free(ctx);
+
+    /* RSAPublicKey ::= SEQUENCE { modulus INTEGER, publicExponent INTEGER } */
+    derlen = i2d_PublicKey(pkey, &der);
+    p = der;
+    end = der + (derlen > 0 ? derlen : 0);
+    seq = der_next(&p, end, 0x30, &len);
+    if (seq) {
+        p = seq;
+        end = seq + len;
+    }
+    if (!seq || !(m = der_next(&p, end, 0x02, &mlen)) || !(e = der_next(&p, end, 0x02, &elen))) {
+        fprintf(stderr, "[e] cannot parse the public key\n");
+        OPENSSL_free(der);
+        EVP_PKEY_free(pkey);
+        return -1;
+    }
+    while (mlen && *m == 0) {
+        m++;
+        mlen--;
+    }
+
+    t = now();
+    for (good = i = 0; i < iterations; i++) {
+        ctx = EVP_PKEY_CTX_new(pkey, NULL);
+        good += ctx && EVP_PKEY_verify_init(ctx) == 1
+            && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1
+            && EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha1()) == 1
+            && EVP_PKEY_verify(ctx, sig, siglen, digest, sizeof(digest)) == 1;
+        EVP_PKEY_CTX_free(ctx);
+    }
+    report("RSA2048 verify OpenSSL", 0, iterations, now() - t);
+    if (good != iterations) {
+        fprintf(stderr, "[e] OpenSSL rejected its own signature\n");
+    }
+
+    /* same steps as verify_signature_rsa(), key set up every time */
+    t = now();
+    for (good = i = 0; i < iterations; i++) {
+        bool valid = false;
+        ccrsa_pub_ctx_decl(ccn_sizeof_size(512), key);
+        ccrsa_ctx_n(key) = ccn_nof_size(mlen);
+        if (ccn_read_uint(ccrsa_ctx_n(key), ccrsa_ctx_m(key), mlen, m)
+            || cczp_init(ccrsa_ctx_zm(key))
+            || ccn_read_uint(ccrsa_ctx_n(key), ccrsa_ctx_e(key), elen, e)
+            || ccrsa_verify_pkcs1v15(key, ccoid_sha1, sizeof(digest), digest, siglen, sig, &valid)) {
+            break;
+        }
+        good += valid;
+    }
+    report("RSA2048 verify in-tree", 0, iterations, now() - t);
+
+    OPENSSL_free(der);
+    EVP_PKEY_free(pkey);
+    if (good != iterations) {
+        return mismatch("RSA verify");
+    }
+    return 0;
+}
+#endif
+
+/*
+ * synthetic corpus: every sample exists as a plain, an lzss, an lzfse and
+ * an encrypted lzss IM4P, for each kind of content and each size.  content
+ * is a function of (kind, size) only, so runs compare across releases
+ */
+
+static const char *const kinds[] = { "zero", "text", "random" };
+static const unsigned char bench_iv[16] = "fedcba9876543210";
+static const unsigned char bench_key[32] = "0123456789abcdef0123456789abcdef";
+
+struct sample {
+    char name[32];		/* kind-size */
+    unsigned char *raw;
+    size_t size;
+    unsigned char *lzss;	/* complzss header included */
+    size_t lzsslen;
+    unsigned char *lzfse;
+    size_t lzfselen;
+};
+
+/* 0: mostly zeros, like padding; 1: short repeated runs, like code; 2: noise */
+static void
+fill(unsigned char *p, size_t n, unsigned kind, uint64_t seed)
+{
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    size_t i = 0;
+
+    while (i < n) {
+        unsigned w, len, j;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        switch (kind) {
+            case 0:
+                p[i++] = (x & 0xFF) < 4 ? (unsigned char)(x >> 8) : 0;
+                break;
+            case 1:
+                w = x % 64;
+                len = 4 + w % 13;
+                for (j = 0; j < len && i < n; j++) {
+                    p[i++] = (unsigned char)(w * 7 + j * (w | 1));
+                }
+                if ((x >> 32) % 8 == 0 && i < n) {
+                    p[i++] = (unsigned char)(x >> 40);
+                }
+                break;
+            default:
+                for (j = 0; j < 8 && i < n; j++) {
+                    p[i++] = (unsigned char)(x >> (8 * j));
+                }
+        }
+    }
+}
+
+static void
+put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* DER header for n bytes of content; returns its length */
+static size_t
+der_header(unsigned char *p, unsigned tag, size_t n)
+{
+    size_t k = 0, m;
+    p[0] = tag;
+    if (n < 0x80) {
+        p[1] = n;
+        return 2;
+    }
+    for (m = n; m; m >>= 8) {
+        k++;
+    }
+    p[1] = 0x80 | k;
+    for (m = 0; m < k; m++) {
+        p[2 + m] = n >> (8 * (k - 1 - m));
+    }
+    return 2 + k;
+}
+
+static size_t
+der_put(unsigned char *p, unsigned tag, const void *data, size_t n)
+{
+    size_t h = der_header(p, tag, n);
+    memcpy(p + h, data, n);
+    return h + n;
+}
+
+static size_t
+der_uint(unsigned char *p, uint64_t v)
+{
+    unsigned char tmp[9];
+    size_t n = 0;
+    do {
+        tmp[8 - n++] = v;
+        v >>= 8;
+    } while (v);
+    if (tmp[9 - n] & 0x80) {
+        tmp[8 - n++] = 0;
+    }
+    return der_put(p, 0x02, tmp + 9 - n, n);
+}
+
+/* IM4P around payload, with a keybag if encrypted and compression info if usize */
+static unsigned char *
+make_im4p(const unsigned char *payload, size_t length, int encrypted, size_t usize, size_t *outlen)
+{
+    unsigned char *buf, *p, kb[128], seq[64], tmp[64];
+    size_t n, k, h;
+
+    buf = malloc(length + 256);
+    if (!buf) {
+        return NULL;
+    }
+    p = buf + 16;		/* room for the outer header */
+    p += der_put(p, 0x16, "IM4P", 4);
+    p += der_put(p, 0x16, "krnl", 4);
+    p += der_put(p, 0x16, "img4bench", 9);
+    p += der_put(p, 0x04, payload, length);
+    if (encrypted) {
+        /* SEQUENCE of SEQUENCE { INTEGER, OCTET iv, OCTET key }; only its presence matters */
+        n = der_uint(tmp, 1);
+        n += der_put(tmp + n, 0x04, bench_iv, 16);
+        n += der_put(tmp + n, 0x04, bench_key, 32);
+        k = der_put(seq, 0x30, tmp, n);
+        k = der_put(kb, 0x30, seq, k);
+        p += der_put(p, 0x04, kb, k);
+    }
+    if (usize) {
+        n = der_uint(tmp, 1);
+        n += der_uint(tmp + n, usize);
+        p += der_put(p, 0x30, tmp, n);
+    }
+    n = p - (buf + 16);
+    h = der_header(tmp, 0x30, n);
+    memcpy(buf + 16 - h, tmp, h);
+    memmove(buf, buf + 16 - h, h + n);
+    *outlen = h + n;
+    return buf;
+}
+
+/* private-class manifest property: [PRIVATE fourcc] SEQUENCE { IA5String fourcc, value } */
+static size_t
+der_prop(unsigned char *p, const char *fourcc, const void *value, size_t n)
+{
+    unsigned char seq[512], tmp[512];
+    uint32_t tag = (uint32_t)fourcc[0] << 24 | fourcc[1] << 16 | fourcc[2] << 8 | fourcc[3];
+    size_t k, h;
+    int i;
+
+    k = der_put(tmp, 0x16, fourcc, 4);
+    memcpy(tmp + k, value, n);
+    k = der_put(seq, 0x30, tmp, k + n);
+    /* the tag number does not fit the first byte: five base 128 digits follow it */
+    p[0] = 0xFF;
+    for (i = 0; i < 5; i++) {
+        p[1 + i] = ((tag >> (7 * (4 - i))) & 0x7F) | (i < 4 ? 0x80 : 0);
+    }
+    h = der_header(tmp, 0, k);
+    memcpy(p + 6, tmp + 1, h - 1);
+    memcpy(p + 5 + h, seq, k);
+    return 5 + h + k;
+}
+
+/* IMG4 around an IM4P, with a manifest carrying a few properties to query */
+static unsigned char *
+make_img4(const unsigned char *im4p, size_t length, size_t *outlen)
+{
+    static const unsigned char digest[20];
+    static const unsigned char sig[64];
+    unsigned char *buf, *p, man[512], set[512], tmp[512];
+    size_t n, k, h;
+
+    buf = malloc(length + 1024);
+    if (!buf) {
+        return NULL;
+    }
+    n = der_uint(tmp, 0x8960);
+    k = der_prop(set, "CHIP", tmp, n);
+    n = der_uint(tmp, 0x1122334455667788ULL);
+    k += der_prop(set + k, "ECID", tmp, n);
+    n = der_put(tmp, 0x31, set, k);
+    h = der_prop(man, "MANP", tmp, n);
+    n = der_put(tmp, 0x04, digest, sizeof(digest));
+    k = der_prop(set, "DGST", tmp, n);
+    n = der_put(tmp, 0x31, set, k);
+    h += der_prop(man + h, "krnl", tmp, n);
+    n = der_put(tmp, 0x31, man, h);
+    k = der_prop(set, "MANB", tmp, n);
+
+    /* IM4M: the signature and the chain are not looked at unless trust is evaluated */
+    n = der_put(man, 0x16, "IM4M", 4);
+    n += der_uint(man + n, 0);
+    n += der_put(man + n, 0x31, set, k);
+    n += der_put(man + n, 0x04, sig, sizeof(sig));
+    n += der_header(man + n, 0x30, 0);
+    k = der_put(tmp, 0x30, man, n);
+
+    p = buf + 16;		/* room for the outer header */
+    p += der_put(p, 0x16, "IMG4", 4);
+    memcpy(p, im4p, length);
+    p += length;
+    p += der_put(p, 0xA0, tmp, k);
+    n = p - (buf + 16);
+    h = der_header(tmp, 0x30, n);
+    memcpy(buf + 16 - h, tmp, h);
+    memmove(buf, buf + 16 - h, h + n);
+    *outlen = h + n;
+    return buf;
+}
+
+static int
+write_corpus(const char *dir, const char *name, const char *variant, const void *data, size_t size)
+{
+    char path[4096];
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/%s.%s.im4p", dir, name, variant);
+    f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "[e] cannot write '%s'\n", path);
+        return -1;
+    }
+    if (fwrite(data, 1, size, f) != size) {
+        fclose(f);
+        fprintf(stderr, "[e] cannot write '%s'\n", path);
+        return -1;
+    }
+    return fclose(f);
+}
+
+static unsigned char *
+copy_of(const void *data, size_t size)
+{
+    unsigned char *p = malloc(size ? size : 1);
+    if (p) {
+        memcpy(p, data, size);
+    }
+    return p;
+}
+
+static int
+bench_codecs(struct sample *s, unsigned rounds)
+{
+    size_t n = s->size, max = n + n / 8 + 1024, out = 0;
+    unsigned char *dec, *end;
+    char what[64];
+    uint32_t adler = 0;
+    unsigned r;
+    double t;
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        adler = lzadler32(s->raw, n);
+    }
+    snprintf(what, sizeof(what), "lzadler32 %s", s->name);
+    report(what, n * rounds, rounds, now() - t);
+
+    s->lzss = malloc(0x180 + max);
+    s->lzfse = malloc(max);
+    dec = malloc(n + 1);
+    if (!s->lzss || !s->lzfse || !dec) {
+        fprintf(stderr, "[e] out of memory\n");
+        free(dec);
+        return -1;
+    }
+
+    /* slow enough that one round says it all */
+    t = now();
+    end = compress_lzss(s->lzss + 0x180, max, s->raw, n);
+    snprintf(what, sizeof(what), "compress_lzss %s", s->name);
+    report(what, n, 1, now() - t);
+    if (!end) {
+        fprintf(stderr, "[e] compress_lzss %s failed\n", s->name);
+        free(dec);
+        return -1;
+    }
+    s->lzsslen = end - s->lzss;
+    memset(s->lzss, 0, 0x180);
+    put_be32(s->lzss, 'comp');
+    put_be32(s->lzss + 4, 'lzss');
+    put_be32(s->lzss + 8, adler);
+    put_be32(s->lzss + 12, n);
+    put_be32(s->lzss + 16, s->lzsslen - 0x180);
+    put_be32(s->lzss + 20, 1);
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        out = decompress_lzss(dec, s->lzss + 0x180, s->lzsslen - 0x180);
+    }
+    snprintf(what, sizeof(what), "decompress_lzss %s", s->name);
+    report(what, n * rounds, rounds, now() - t);
+    if (out != n || memcmp(dec, s->raw, n)) {
+        fprintf(stderr, "[e] lzss %s does not round-trip\n", s->name);
+        free(dec);
+        return -1;
+    }
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        s->lzfselen = lzfse_encode_buffer(s->lzfse, max, s->raw, n, NULL);
+    }
+    snprintf(what, sizeof(what), "lzfse_encode_buffer %s", s->name);
+    report(what, n * rounds, rounds, now() - t);
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        out = lzfse_decode_buffer(dec, n + 1, s->lzfse, s->lzfselen, NULL);
+    }
+    snprintf(what, sizeof(what), "lzfse_decode_buffer %s", s->name);
+    report(what, n * rounds, rounds, now() - t);
+    if (!s->lzfselen || out != n || memcmp(dec, s->raw, n)) {
+        fprintf(stderr, "[e] lzfse %s does not round-trip\n", s->name);
+        free(dec);
+        return -1;
+    }
+    free(dec);
+    return 0;
+}
+
+/* time rounds of reopen + close of a layer over a memory copy of data; throughput is of data */
+static int
+bench_reopen(const char *what, struct sample *s, const unsigned char *data, size_t size, int layer, const unsigned char *ivkey, unsigned rounds)
+{
+    char name[64];
+    unsigned r;
+    double t, total = 0;
+
+    for (r = 0; r < rounds; r++) {
+        FHANDLE fd, mem;
+        unsigned char *copy = copy_of(data, size);
+        if (!copy) {
+            return -1;
+        }
+        t = now();
+        mem = memory_open(O_RDONLY, copy, size);
+        switch (layer) {
+            case 'e': fd = enc_reopen(mem, bench_iv, bench_key); break;
+            case 's': fd = lzss_reopen(mem); break;
+            case 'f': fd = lzfse_reopen(mem, s->size); break;
+            default: fd = img4_reopen(mem, ivkey, 0);
+        }
+        if (!fd) {
+            fprintf(stderr, "[e] %s %s failed\n", what, s->name);
+            return -1;
+        }
+        fd->close(fd);
+        total += now() - t;
+    }
+    snprintf(name, sizeof(name), "%s %s", what, s->name);
+    report(name, size * rounds, rounds, total);
+    return 0;
+}
+
+/* time rounds of fsync after marking everything, or only the last page, dirty; throughput is of what fd holds */
+static int
+bench_fsync(const char *what, FHANDLE fd, struct sample *s, int tail, unsigned rounds)
+{
+    char name[64];
+    unsigned r;
+    double t, total = 0;
+    size_t size = fd->length(fd);
+
+    for (r = 0; r < rounds; r++) {
+        if (tail) {
+            size_t len = size < 4096 ? size : 4096;
+            fd->ioctl(fd, IOCTL_MEM_SET_DIRTY_RANGE, size - len, len);
+        } else {
+            fd->ioctl(fd, IOCTL_MEM_SET_DIRTY);
+        }
+        t = now();
+        if (fd->fsync(fd)) {
+            fprintf(stderr, "[e] %s %s failed\n", what, s->name);
+            return -1;
+        }
+        total += now() - t;
+    }
+    snprintf(name, sizeof(name), "%s %s", what, s->name);
+    report(name, size * rounds, rounds, total);
+    return 0;
+}
+
+static int
+bench_layers(struct sample *s, const char *dir, unsigned rounds)
+{
+    unsigned char ivkey[16 + 32];
+    unsigned char *im4p, *img4, *enc = NULL, *plain, *data;
+    size_t len, img4len, enclen, size;
+    FHANDLE fd, mem;
+    unsigned v;
+    int rv = -1;
+    struct {
+        const char *tag;
+        const unsigned char *payload;
+        size_t length;
+        int encrypted;
+        size_t usize;
+    } variants[4];
+
+    memcpy(ivkey, bench_iv, 16);
+    memcpy(ivkey + 16, bench_key, 32);
+
+    /* the encrypted variant: the lzss payload, zero-padded, through enc_fsync */
+    enclen = (s->lzsslen + 15) & ~(size_t)15;
+    plain = calloc(1, enclen);
+    if (!plain) {
+        return -1;
+    }
+    memcpy(plain, s->lzss, s->lzsslen);
+    mem = memory_open(O_RDWR, copy_of(plain, enclen), enclen);
+    fd = enc_reopen(mem, bench_iv, bench_key);
+    if (!fd || fd->pwrite(fd, plain, enclen, 0) != (ssize_t)enclen || bench_fsync("enc_fsync", fd, s, 0, rounds)) {
+        free(plain);
+        goto done;
+    }
+    free(plain);
+    mem->ioctl(mem, IOCTL_MEM_GET_DATAPTR, &data, &size);
+    enc = copy_of(data, size);
+    fd->close(fd);
+    fd = NULL;
+    if (!enc || bench_reopen("enc_reopen", s, enc, enclen, 'e', NULL, rounds)) {
+        goto done;
+    }
+
+    if (bench_reopen("lzss_reopen", s, s->lzss, s->lzsslen, 's', NULL, rounds)
+        || bench_reopen("lzfse_reopen", s, s->lzfse, s->lzfselen, 'f', NULL, rounds)) {
+        goto done;
+    }
+    /* lzss_fsync leaves no room for a stream larger than its input */
+    if (s->lzsslen - 0x180 + 256 <= s->size) {
+        fd = lzss_reopen(memory_open(O_RDWR, copy_of(s->lzss, s->lzsslen), s->lzsslen));
+        if (!fd || bench_fsync("lzss_fsync", fd, s, 0, 1) || bench_fsync("lzss_fsync tail", fd, s, 1, rounds)) {
+            goto done;
+        }
+        fd->close(fd);
+    }
+    fd = lzfse_reopen(memory_open(O_RDWR, copy_of(s->lzfse, s->lzfselen), s->lzfselen), s->size);
+    if (!fd || bench_fsync("lzfse_fsync", fd, s, 0, rounds) || bench_fsync("lzfse_fsync tail", fd, s, 1, rounds)) {
+        goto done;
+    }
+    fd->close(fd);
+    fd = NULL;
+
+    variants[0].tag = "lzss";
+    variants[0].payload = s->lzss;
+    variants[0].length = s->lzsslen;
+    variants[0].encrypted = 0;
+    variants[0].usize = 0;
+    variants[1].tag = "lzfse";
+    variants[1].payload = s->lzfse;
+    variants[1].length = s->lzfselen;
+    variants[1].encrypted = 0;
+    variants[1].usize = s->size;
+    variants[2].tag = "enc";
+    variants[2].payload = enc;
+    variants[2].length = enclen;
+    variants[2].encrypted = 1;
+    variants[2].usize = 0;
+    variants[3].tag = "raw";
+    variants[3].payload = s->raw;
+    variants[3].length = s->size;
+    variants[3].encrypted = 0;
+    variants[3].usize = 0;
+
+    /* DER: parse on open, encode on save.  raw goes last, it is kept for the latter */
+    for (v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        char what[32];
+        snprintf(what, sizeof(what), "img4_reopen %s", variants[v].tag);
+        im4p = make_im4p(variants[v].payload, variants[v].length, variants[v].encrypted, variants[v].usize, &len);
+        if (!im4p || write_corpus(dir, s->name, variants[v].tag, im4p, len)
+            || bench_reopen(what, s, im4p, len, 'i', variants[v].encrypted ? ivkey : NULL, rounds)) {
+            free(im4p);
+            goto done;
+        }
+        if (v + 1 < sizeof(variants) / sizeof(variants[0])) {
+            free(im4p);
+        }
+    }
+    /* and the raw one once more, signed for, for the manifest queries */
+    img4 = make_img4(im4p, len, &img4len);
+    if (!img4 || write_corpus(dir, s->name, "img4", img4, img4len)) {
+        free(img4);
+        free(im4p);
+        goto done;
+    }
+    free(img4);
+    fd = img4_reopen(memory_open(O_RDWR, im4p, len), NULL, 0);
+    if (!fd || fd->ioctl(fd, IOCTL_IMG4_SET_VERSION, "img4bench-2", (size_t)11) || bench_fsync("img4_fsync raw", fd, s, 0, rounds)) {
+        goto done;
+    }
+    rv = 0;
+
+  done:
+    if (rv) {
+        fprintf(stderr, "[e] layer benchmarks failed for %s\n", s->name);
+    }
+    if (fd) {
+        fd->close(fd);
+    }
+    free(enc);
+    return rv;
+}
+
+/* whole img4 runs over the corpus files; argv0 is the binary to run */
+static int
+bench_cli(struct sample *s, const char *dir, const char *img4, unsigned rounds)
+{
+    static const char *const variants[] = { "raw", "lzss", "lzfse", "enc", "img4" };
+    static const char *const ops[][3] = {
+        { "list", "-l", "" },
+        { "extract", "-o %s/out.raw", "" },
+        { "repack", "-V img4bench-3 -o %s/out.im4p", "" },
+        /* these go through every layer's ioctl, counted or not */
+        { "query", "--stats -q CHIP", "img4" },
+        { "query all", "--stats -q '*' --json", "img4" },
+    };
+    char cmd[16384], args[4096 + 64], name[64], path[4096], hex[2 * 48 + 1];
+    unsigned v, o, r;
+    double t;
+
+    for (v = 0; v < 48; v++) {
+        sprintf(hex + 2 * v, "%02x", v < 16 ? bench_iv[v] : bench_key[v - 16]);
+    }
+
+    for (v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s.%s.im4p", dir, s->name, variants[v]);
+        if (stat(path, &st)) {
+            continue;
+        }
+        for (o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+            if (strcmp(ops[o][2], variants[v]) && *ops[o][2]) {
+                continue;
+            }
+            snprintf(args, sizeof(args), ops[o][1], dir);
+            snprintf(cmd, sizeof(cmd), "%s -i %s %s%s %s >/dev/null", img4, path, v == 3 ? "-k " : "", v == 3 ? hex : "", args);
+            t = now();
+            for (r = 0; r < rounds; r++) {
+                int status = system(cmd);
+                if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+                    fprintf(stderr, "[e] '%s' failed\n", cmd);
+                    return -1;
+                }
+            }
+            snprintf(name, sizeof(name), "cli %s %s.%s", ops[o][0], s->name, variants[v]);
+            report(name, st.st_size * rounds, rounds, now() - t);
+        }
+    }
+    return 0;
+}
+
+static int
+bench_corpus(size_t size, unsigned rounds, const char *dir, const char *img4)
+{
+    const size_t sizes[] = { size / 16, size, size * 8 };
+    unsigned k, i;
+    int rv = 0;
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "[e] cannot create '%s'\n", dir);
+        return -1;
+    }
+    for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]) && !rv; k++) {
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && !rv; i++) {
+            struct sample s;
+            memset(&s, 0, sizeof(s));
+            s.size = sizes[i] ? sizes[i] : 1;
+            snprintf(s.name, sizeof(s.name), "%s-%zuk", kinds[k], (s.size + 1023) / 1024);
+            s.raw = malloc(s.size);
+            if (!s.raw) {
+                fprintf(stderr, "[e] out of memory\n");
+                return -1;
+            }
+            fill(s.raw, s.size, k, s.size);
+            printf("%s:\n", s.name);
+            rv = bench_codecs(&s, rounds);
+            if (!rv) {
+                rv = bench_layers(&s, dir, rounds);
+            }
+            if (!rv && img4) {
+                rv = bench_cli(&s, dir, img4, rounds);
+            }
+            free(s.lzfse);
+            free(s.lzss);
+            free(s.raw);
+        }
+    }
+    return rv;
+}
+
+static int
+write_json(const char *path, size_t size, size_t count, unsigned rounds)
+{
+    FILE *f;
+    size_t i;
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "[e] cannot write '%s'\n", path);
+        return -1;
+    }
+    fprintf(f, "{\"size\": %zu, \"count\": %zu, \"rounds\": %u, \"results\": [", size, count, rounds);
+    for (i = 0; i < nresults; i++) {
+        const struct result *r = &results[i];
+        fprintf(f, "%s\n  {\"name\": \"%s\", \"bytes\": %zu, \"ops\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.3f, \"us_per_op\": %.3f}",
+                i ? "," : "", r->name, r->bytes, r->ops, r->elapsed, r->bytes / r->elapsed / 1e6, r->elapsed * 1e6 / r->ops);
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f);
+}
+
+static void __attribute__((noreturn))
+usage(const char *argv0)
+{
+    printf("usage: %s [-s <size>] [-n <count>] [-r <rounds>] [-d <dir>] [-x <img4>] [-j <file>]\n", argv0);
+    printf("    -s <size>       bytes per message (default 1048576); corpus samples are size/16, size and size*8\n");
+    printf("    -n <count>      messages per round (default 64)\n");
+    printf("    -r <rounds>     rounds (default 4)\n");
+    printf("    -d <dir>        write the corpus to <dir> (default bench.corpus)\n");
+    printf("    -x <img4>       also time <img4> runs over the corpus\n");
+    printf("    -j <file>       write the results to <file> as JSON\n");
+    printf("note: single-threaded, so the figures are per core\n");
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *argv0 = argv[0];
+    size_t size = 1 << 20;
+    size_t count = 64;
+    unsigned rounds = 4;
+    const char *dir = "bench.corpus";
+    const char *img4 = NULL;
+    const char *json = NULL;
+    struct sha_mb_job *jobs;
+    unsigned char *buf, *digests;
+    size_t i, total;
+    unsigned r;
+    double t;
+
+    while (--argc > 0) {
+        const char *arg = *++argv;
+        if (!strcmp(arg, "-s") && argc >= 2) {
+            size = strtoul(*++argv, NULL, 0);
+            argc--;
+        } else if (!strcmp(arg, "-n") && argc >= 2) {
+            count = strtoul(*++argv, NULL, 0);
+            argc--;
+        } else if (!strcmp(arg, "-r") && argc >= 2) {
+            rounds = strtoul(*++argv, NULL, 0);
+            argc--;
+        } else if (!strcmp(arg, "-d") && argc >= 2) {
+            dir = *++argv;
+            argc--;
+        } else if (!strcmp(arg, "-x") && argc >= 2) {
+            img4 = *++argv;
+            argc--;
+        } else if (!strcmp(arg, "-j") && argc >= 2) {
+            json = *++argv;
+            argc--;
+        } else {
+            usage(argv0);
+        }
+    }
+    if (!size || !count || !rounds) {
+        usage(argv0);
+    }
+
+    buf = malloc(size * count);
+    digests = malloc(48 * count);
+    jobs = malloc(sizeof(*jobs) * count);
+    if (!buf || !digests || !jobs) {
+        fprintf(stderr, "[e] out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < size * count; i++) {
+        buf[i] = (unsigned char)(i * 2654435761U >> 24);
+    }
+    for (i = 0; i < count; i++) {
+        jobs[i].data = buf + i * size;
+        jobs[i].length = size;
+        jobs[i].digest = digests + 48 * i;
+    }
+    total = size * count * rounds;
+
+    printf("%zu x %zu bytes, %u rounds\n", count, size, rounds);
+    printf("sha1 lanes %u, sha384 lanes %u (0 = not worth it here)\n", sha1_mb_lanes(), sha384_mb_lanes());
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            SHA1(jobs[i].data, jobs[i].length, jobs[i].digest);
+        }
+    }
+    report("SHA1 one-shot", total, count * rounds, now() - t);
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        sha1_mb(jobs, count);
+    }
+    report("SHA1 multi-buffer", total, count * rounds, now() - t);
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            SHA384(jobs[i].data, jobs[i].length, jobs[i].digest);
+        }
+    }
+    report("SHA384 one-shot", total, count * rounds, now() - t);
+
+    t = now();
+    for (r = 0; r < rounds; r++) {
+        sha384_mb(jobs, count);
+    }
+    report("SHA384 multi-buffer", total, count * rounds, now() - t);
+
+#ifdef USE_CORECRYPTO
+    if (check_vectors() || bench_digests(jobs, count, total, rounds) || bench_aes(buf, size * count, rounds) || bench_rsa(1000 * rounds)) {
+        return -1;
+    }
+#endif
+
+    if (bench_corpus(size, rounds, dir, img4) || (json && write_json(json, size, count, rounds))) {
+        return -1;
+    }
+
+    free(jobs);
+    free(digests);
+    free(buf);
+    return 0;
+}
@@ -43,7 +43,7 @@ extern "C" {
  */
 #define DER_MAX_ENCODED_SIZE(len)					\
 	( 1 +			/* tag */						\
-	  5 +			/* max length */				\
+	  9 +			/* max length */				\
 	  1 +			/* possible prepended zero */	\
 	  len)
 
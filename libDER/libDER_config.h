@@ -38,11 +38,12 @@ extern "C" {
 #endif
 
 /*
- * Basic data types: unsigned 8-bit integer, unsigned 32-bit integer
+ * Basic data types: unsigned 8-bit integer, unsigned 64-bit integer
+ * (lengths may exceed 4GB, long form length is up to 8 bytes)
  */
 typedef uint8_t DERByte;
 typedef uint16_t DERShort;
-typedef uint32_t DERSize;
+typedef uint64_t DERSize;
 
 /* 
  * Use these #defines of you have memset, memmove, and memcmp; else
@@ -3,9 +3,13 @@
 
 typedef struct file_ops *FHANDLE;
 
+struct vfs_stats_layer;
+
 struct file_ops {
     ssize_t (*read)(FHANDLE fd, void *buf, size_t count);
     ssize_t (*write)(FHANDLE fd, const void *buf, size_t count);
+    ssize_t (*pread)(FHANDLE fd, void *buf, size_t count, off_t offset);
+    ssize_t (*pwrite)(FHANDLE fd, const void *buf, size_t count, off_t offset);
     off_t (*lseek)(FHANDLE fd, off_t offset, int whence);
     int (*ioctl)(FHANDLE fd, unsigned long request, ...);
     int (*ftruncate)(FHANDLE fd, off_t length);
@@ -13,11 +17,18 @@ struct file_ops {
     int (*close)(FHANDLE fd);
     ssize_t (*length)(FHANDLE fd);	/* convenience */
     int flags;
+    const struct vfs_allocator *alloc;	/* used by layers opened on top of this one */
+    struct vfs_stats_layer *stats;	/* NULL unless opened with stats enabled */
 };
 
 #define IOCTL_MEM_GET_DATAPTR   10	/* (void **, size_t *) // working data of current file */
 #define IOCTL_MEM_GET_BACKING   11	/* (void **, size_t *) // underlying backing store */
 #define IOCTL_MEM_SET_FUNCS     12	/* (realloc_t, free_t) */
+#define IOCTL_MEM_SNAPSHOT      13	/* (FHANDLE *, int flags) // copy-on-write clone of this layer and those below */
+#define IOCTL_MEM_RESERVE       14	/* (size_t) // preallocate room for that many bytes */
+#define IOCTL_MEM_SET_DIRTY     15	/* (void) // after writing through IOCTL_MEM_GET_DATAPTR */
+#define IOCTL_MEM_SET_DIRTY_RANGE 16	/* (size_t offset, size_t length) // same, when only that range was written */
+#define IOCTL_FILE_GET_INFO     20	/* (struct stat *, const char **) // file status and the name it was opened by */
 #define IOCTL_ENC_SET_NOENC     30	/* (void) */
 #define IOCTL_LZSS_GET_WTOWER   40	/* (void **, size_t *) */
 #define IOCTL_LZSS_SET_WTOWER   41	/* (void *, size_t) */
@@ -39,16 +50,138 @@ struct file_ops {
 #define IOCTL_IMG4_SET_VERSION  71	/* (void *, size_t) */
 #define IOCTL_IMG4_GET_EP_INFO  72	/* (void **, size_t *) */
 #define IOCTL_IMG4_SET_EP_INFO  73	/* (void *, size_t) */
-#define IOCTL_IMG4_QUERY_PROP   80	/* (const char *, unsigned char *, unsigned int *) */
+#define IOCTL_IMG4_QUERY_PROP   80	/* (const char *, unsigned char *, size_t *) */
+#define IOCTL_IMG4_QUERY_PROPS  81	/* (const char *, int, img4_prop_cb, void *) // see below */
 #define IOCTL_IMG4_EVAL_TRUST   90	/* (void *) */
+#define IOCTL_IMG4_SNAPSHOT     91	/* (FHANDLE, FHANDLE *) // see img4_clone */
+#define IOCTL_VFS_GET_STATS     100	/* (struct vfs_stats_list *) // see below */
 
 #define FLAG_IMG4_SKIP_DECOMPRESSION    (1 << 0)
 #define FLAG_IMG4_VERIFY_HASH           (1 << 1)
 #define FLAG_IMG4_UPDATE_HASH           (1 << 2)
+#define FLAG_IMG4_META_CACHE            (1 << 3)	/* see img4_meta_dir */
 
 typedef void (*free_t)(void *ptr);
 typedef void *(*realloc_t)(void *ptr, size_t size);
 
+/*
+ * IOCTL_IMG4_QUERY_PROPS takes a comma separated list of fourccs ("*" or
+ * NULL for all of them) and reports each property found in MANP and in our
+ * object, or in every object of the manifest if the int is set.  it fails
+ * if nothing was found; a nonzero return from the callback stops the walk
+ */
+#define IMG4_PROP_BOOL  1	/* value is a bool */
+#define IMG4_PROP_INT   2	/* value is a uint64_t */
+#define IMG4_PROP_DATA  3	/* value is 'length' bytes */
+typedef int (*img4_prop_cb)(void *arg, unsigned object, unsigned prop, int kind, const void *value, size_t length);
+
+/*
+ * every payload-sized buffer is obtained from other->alloc when a layer is
+ * reopened on top of 'other'; set it right after file_open/memory_open to
+ * change the allocator for the whole stack.  the default allocator hands
+ * out 64-byte aligned buffers, huge-page backed above a threshold, and
+ * recycles the big ones between jobs; vfs_allocator_trim() releases them
+ */
+struct vfs_allocator {
+    realloc_t realloc;		/* realloc(NULL, size) allocates */
+    free_t free;
+};
+
+extern const struct vfs_allocator vfs_default_allocator;
+extern const struct vfs_allocator vfs_libc_allocator;
+void vfs_allocator_trim(void);
+
+/*
+ * the default allocator counts the bytes it has handed out.  with a budget
+ * (0 = none), a request that would take live + pooled bytes over it fails,
+ * so that the layer asking fails to open or to save instead of the process
+ * getting killed; if spilldir is set, buffers of 2MB and up go to unlinked
+ * files there instead, which the kernel can write back.  spilldir is kept,
+ * not copied.  buffers from other allocators are not counted
+ */
+struct vfs_memory_usage {
+    size_t live;		/* handed out and not freed, spilled ones excluded */
+    size_t peak;		/* highest live */
+    size_t pooled;		/* freed, kept for reuse */
+    size_t spilled;		/* handed out from spill files */
+    size_t budget;
+    size_t refused;		/* requests failed for the budget */
+};
+
+void vfs_memory_budget(size_t bytes, const char *spilldir);
+void vfs_memory_usage(struct vfs_memory_usage *usage);
+
+/*
+ * bump allocator for small per-open data.  nothing is freed individually;
+ * reset keeps the chunks for the next user, destroy gives them back
+ */
+struct vfs_arena;
+struct vfs_arena_mark {
+    void *chunk;
+    size_t used;
+};
+
+struct vfs_arena *vfs_arena_create(size_t chunk);	/* pass chunk=0 for the default */
+void *vfs_arena_alloc(struct vfs_arena *arena, size_t size);	/* 16-byte aligned */
+void vfs_arena_mark(struct vfs_arena *arena, struct vfs_arena_mark *mark);
+void vfs_arena_release(struct vfs_arena *arena, const struct vfs_arena_mark *mark);
+void vfs_arena_reset(struct vfs_arena *arena);
+void vfs_arena_destroy(struct vfs_arena *arena);
+
+/*
+ * per-layer counters.  only handles opened while vfs_stats_enable(1) is in
+ * effect count anything: their calls go through counting wrappers, the
+ * others run exactly as before.  times are wall clock and include the layers
+ * below.  IOCTL_VFS_GET_STATS walks the stack from the handle down, filling
+ * up to max entries; count gets the number of counting layers found
+ */
+struct vfs_stats {
+    const char *layer;		/* "file", "memory", "sub", "enc", "lzss", "lzfse" or "img4" */
+    unsigned long long reads;	/* read and pread calls */
+    unsigned long long writes;	/* write and pwrite calls */
+    unsigned long long fsyncs;
+    unsigned long long bytes_in;	/* written into the layer */
+    unsigned long long bytes_out;	/* read from it */
+    unsigned long long read_ns;
+    unsigned long long write_ns;
+    unsigned long long fsync_ns;
+    unsigned long long reopen_ns;
+    unsigned long long allocs;	/* buffers (re)allocated, the one made at open included */
+    unsigned long long live_bytes;	/* buffer held now */
+    unsigned long long peak_bytes;	/* largest buffer held, or used while saving */
+};
+
+struct vfs_stats_list {
+    struct vfs_stats *layers;
+    size_t max;
+    size_t count;
+};
+
+void vfs_stats_enable(int on);
+
+/*
+ * while list is set, counting layers leave their final counters in it as they
+ * close, in the same order.  a save on close is counted this way, which it
+ * cannot be by asking before closing.  pass NULL to stop
+ */
+void vfs_stats_collect(struct vfs_stats_list *list);
+
+/*
+ * spans recorded so far (open, parse, decrypt, decompress, reassemble, digests
+ * and signatures), written as chrome trace-event json.  recording is compiled
+ * in with -DVFS_TRACE only; without it this fails and returns -1
+ */
+int vfs_trace_write(const char *path);
+
+/* call fn(arg, i) for every i < count on up to nthreads threads, 0 means one per cpu */
+void vfs_parallel_for(size_t count, unsigned nthreads, void (*fn)(void *arg, size_t i), void *arg);
+
+/*
+ * pread/pwrite never touch the file position, so any number of threads may
+ * pread the same handle at once.  pwrite is not safe against concurrent I/O
+ * on memory-backed handles, because writing past the end may move the buffer
+ */
+
 FHANDLE file_open(const char *pathname, int flags, ...);
 
 /*
@@ -68,4 +201,82 @@ FHANDLE lzfse_reopen(FHANDLE other, size_t usize);		/* pass usize=0 to decompres
 FHANDLE sub_reopen(FHANDLE other, size_t offset, off_t length);	/* pass length<0 to slice to the end of file */
 FHANDLE img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags);
 
+/*
+ * same as img4_reopen, but metadata lives in the caller's arena, which must
+ * outlive the handle; reset it after closing to reuse it for the next image.
+ * img4_reopen uses a private arena, released on close
+ */
+FHANDLE img4_reopen_ex(FHANDLE other, const unsigned char *ivkey, int flags, struct vfs_arena *arena);
+
+/*
+ * with FLAG_IMG4_META_CACHE, img4_reopen over a file_open handle keeps what
+ * parsing found (type, version, keybag, compression, where the payload and
+ * manifest are, the nonce, and the digests once computed) in a sidecar, and
+ * reads that back next time instead of parsing; a hash check that passed is
+ * not redone either.  the sidecar is <name>.img4meta, or <dev>-<ino>.img4meta
+ * in dir if one is set (dir is kept, not copied).  entries carry a format
+ * version and the dev, inode, size and mtime of the file they describe, so
+ * stale or foreign ones are ignored, then replaced
+ */
+void img4_meta_dir(const char *dir);
+
+/*
+ * clone an opened image without decoding it again.  the decoded buffers are
+ * shared copy-on-write, page by page, so a clone costs only what it modifies.
+ * the clone saves into 'other', which is closed in case of failure.
+ * writes made through IOCTL_MEM_GET_DATAPTR pointers are not seen by later
+ * clones of the same handle
+ */
+FHANDLE img4_clone(FHANDLE fd, FHANDLE other);
+
+/*
+ * IOCTL_IMG4_EVAL_TRUST on each handle, spread over nthreads threads.
+ * results[i] gets the outcome for fds[i]; returns 0 if all of them passed.
+ * payloads are hashed a group at a time first, where the CPU has the vector
+ * units for it (see sha_mb.h).  a handle must not be used elsewhere while the
+ * batch runs
+ */
+int img4_verify_batch(FHANDLE *fds, size_t count, const char *args, int *results, unsigned nthreads);
+
+/*
+ * a device as IMG4_EVAL_TRUST sees it.  img4_parse_device fills one from the
+ * same "CHIP=0x8960,ECID=0x1122334455667788[,...]" string, defaults included;
+ * BNCN=<nonce> is checked against BNCH unless the image has its own nonce
+ */
+struct img4_device {
+    unsigned long long CHIP;
+    unsigned long long BORD;
+    unsigned long long ECID;
+    unsigned long long SDOM;
+    unsigned long long SEPO;
+    unsigned long long nonce;	/* 0 if unknown */
+    unsigned char CPRO;
+    unsigned char CSEC;
+};
+
+void img4_parse_device(struct img4_device *dev, const char *args);
+
+/*
+ * match every ticket (IMG4 or bare IM4M) against every device.  the signature,
+ * chain and certificate constraints are checked once per ticket, trust[t] gets
+ * the outcome.  matrix[t * ndevices + d] is set if ticket t is trusted and its
+ * MANP fits device d.  returns 0 if all tickets are trusted
+ */
+int img4_validate_fleet(const void *const *tickets, const size_t *sizes, size_t ntickets, const struct img4_device *devices, size_t ndevices, int *trust, unsigned char *matrix, unsigned nthreads);
+
+/*
+ * find the nonce behind each ticket's BNCH.  img4_bnch_table pulls BNCH out of
+ * every ticket (IMG4 or bare IM4M); img4_bnch_match then hashes candidates the
+ * way IMG4_EVAL_TRUST hashes BNCN (the 8 bytes of the value as they are in
+ * memory) with SHA-1 for 20-byte BNCH and SHA-384 otherwise, on nthreads
+ * threads, and returns how many tickets are still unmatched.  call it as many
+ * times as needed; img4_bnch_found gives 1 and the nonce once found, 0 while
+ * not found, -1 if the ticket has no BNCH
+ */
+struct img4_bnch_table;
+struct img4_bnch_table *img4_bnch_table(const void *const *tickets, const size_t *sizes, size_t ntickets);
+size_t img4_bnch_match(struct img4_bnch_table *table, const unsigned long long *nonces, size_t count, unsigned nthreads);
+int img4_bnch_found(const struct img4_bnch_table *table, size_t ticket, unsigned long long *nonce);
+void img4_bnch_free(struct img4_bnch_table *table);
+
 #endif
@@ -0,0 +1,312 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vfs.h"
+
+/*
+ * every block starts with a 64-byte header, so the data is 64-byte aligned.
+ * blocks of ALLOC_HUGE bytes and above are anonymous mappings whose data is
+ * aligned to 2MB (huge-page backed where the kernel allows it), rounded up
+ * to a size class of a quarter power of two, and kept in a pool when freed,
+ * up to POOL_MAX.  vfs_allocator_trim() gives the pool back to the system.
+ *
+ * the capacity of every block handed out is added to 'live'.  a budget caps
+ * live + pooled: the pool is trimmed first, then huge blocks go to a spill
+ * file if there is a spill directory, and anything else fails
+ */
+
+#define ALLOC_ALIGN     64
+#define ALLOC_HUGE      ((size_t)2 << 20)
+#define POOL_MAX        ((size_t)512 << 20)
+
+struct alloc_hdr {
+    size_t capacity;
+    size_t maplen;              /* 0 if heap */
+    void *map;
+    struct alloc_hdr *next;
+    size_t spilled;             /* mapped from a spill file, never pooled */
+    unsigned char pad[ALLOC_ALIGN - 3 * sizeof(size_t) - 2 * sizeof(void *)];
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct alloc_hdr *pool;
+static size_t pooled;
+
+static size_t budget;           /* 0 = none */
+static const char *spilldir;
+static size_t live, peak, spilled, refused;
+
+#define HDR(ptr) ((struct alloc_hdr *)(ptr) - 1)
+
+static size_t
+size_class(size_t size)
+{
+    size_t step = ALLOC_HUGE;
+    while (step < size / 4) {
+        step *= 2;
+    }
+    return (size + step - 1) & ~(step - 1);
+}
+
+static struct alloc_hdr *
+map_block(size_t capacity)
+{
+    struct alloc_hdr *hdr;
+    unsigned char *map, *data, *base;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t maplen = capacity + 2 * ALLOC_HUGE;
+
+    map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    /* one page for the header, right below the aligned data */
+    data = (unsigned char *)(((uintptr_t)map + page + ALLOC_HUGE - 1) & ~(ALLOC_HUGE - 1));
+    base = data - page;
+    if (base > map) {
+        munmap(map, base - map);
+    }
+    munmap(data + capacity, map + maplen - (data + capacity));
+#ifdef MADV_HUGEPAGE
+    madvise(data, capacity, MADV_HUGEPAGE);
+#endif
+    hdr = (struct alloc_hdr *)data - 1;
+    hdr->capacity = capacity;
+    hdr->maplen = capacity + page;
+    hdr->map = base;
+    hdr->next = NULL;
+    hdr->spilled = 0;
+    return hdr;
+}
+
+/* page-aligned block backed by an unlinked file, which the kernel can write back under pressure */
+static struct alloc_hdr *
+spill_block(size_t capacity)
+{
+    struct alloc_hdr *hdr;
+    unsigned char *map;
+    char path[4096];
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t maplen = capacity + page;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/img4spill.XXXXXX", spilldir) >= (int)sizeof(path)) {
+        return NULL;
+    }
+    fd = mkstemp(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    unlink(path);
+    if (ftruncate(fd, maplen)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    hdr = (struct alloc_hdr *)(map + page) - 1;
+    hdr->capacity = capacity;
+    hdr->maplen = maplen;
+    hdr->map = map;
+    hdr->next = NULL;
+    hdr->spilled = 1;
+    return hdr;
+}
+
+/* count capacity as live, unless that would break the budget */
+static int
+admit(size_t capacity)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (budget && live + pooled + capacity > budget) {
+        pthread_mutex_unlock(&pool_lock);
+        vfs_allocator_trim();
+        pthread_mutex_lock(&pool_lock);
+    }
+    if (budget && live + pooled + capacity > budget) {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    live += capacity;
+    if (live > peak) {
+        peak = live;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+static void
+unadmit(size_t capacity)
+{
+    pthread_mutex_lock(&pool_lock);
+    live -= capacity;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static struct alloc_hdr *
+pool_get(size_t capacity)
+{
+    struct alloc_hdr **pp, **best = NULL;
+    struct alloc_hdr *hdr = NULL;
+    pthread_mutex_lock(&pool_lock);
+    for (pp = &pool; *pp; pp = &(*pp)->next) {
+        size_t cap = (*pp)->capacity;
+        if (cap >= capacity && cap - capacity <= capacity / 4 && (!best || cap < (*best)->capacity)) {
+            best = pp;
+        }
+    }
+    if (best) {
+        hdr = *best;
+        *best = hdr->next;
+        pooled -= hdr->capacity;
+        hdr->next = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return hdr;
+}
+
+static void
+vfs_free(void *ptr)
+{
+    struct alloc_hdr *hdr;
+    if (!ptr) {
+        return;
+    }
+    hdr = HDR(ptr);
+    if (hdr->spilled) {
+        __atomic_fetch_sub(&spilled, hdr->capacity, __ATOMIC_RELAXED);
+        munmap(hdr->map, hdr->maplen);
+        return;
+    }
+    if (!hdr->maplen) {
+        unadmit(hdr->capacity);
+        free(hdr);
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    live -= hdr->capacity;
+    if (pooled + hdr->capacity <= POOL_MAX && (!budget || live + pooled + hdr->capacity <= budget)) {
+        hdr->next = pool;
+        pool = hdr;
+        pooled += hdr->capacity;
+        hdr = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (hdr) {
+        munmap(hdr->map, hdr->maplen);
+    }
+}
+
+static void *
+vfs_alloc(size_t size)
+{
+    struct alloc_hdr *hdr;
+    void *ptr;
+    if (size >= ALLOC_HUGE) {
+        size_t capacity = size_class(size);
+        if (admit(capacity)) {
+            hdr = spilldir ? spill_block(capacity) : NULL;
+            if (!hdr) {
+                __atomic_fetch_add(&refused, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            __atomic_fetch_add(&spilled, capacity, __ATOMIC_RELAXED);
+            return hdr + 1;
+        }
+        hdr = pool_get(capacity);
+        if (!hdr) {
+            hdr = map_block(capacity);
+        }
+        if (!hdr) {
+            unadmit(capacity);
+            return NULL;
+        }
+        return hdr + 1;
+    }
+    if (admit(size)) {
+        __atomic_fetch_add(&refused, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (posix_memalign(&ptr, ALLOC_ALIGN, sizeof(struct alloc_hdr) + size)) {
+        unadmit(size);
+        return NULL;
+    }
+    hdr = ptr;
+    hdr->capacity = size;
+    hdr->maplen = 0;
+    hdr->map = NULL;
+    hdr->next = NULL;
+    hdr->spilled = 0;
+    return hdr + 1;
+}
+
+static void *
+vfs_realloc(void *ptr, size_t size)
+{
+    void *tmp;
+    size_t capacity;
+    if (!ptr) {
+        return vfs_alloc(size);
+    }
+    capacity = HDR(ptr)->capacity;
+    if (size <= capacity && size >= capacity / 2) {
+        return ptr;
+    }
+    tmp = vfs_alloc(size);
+    if (tmp) {
+        memcpy(tmp, ptr, size < capacity ? size : capacity);
+        vfs_free(ptr);
+    }
+    return tmp;
+}
+
+void
+vfs_allocator_trim(void)
+{
+    struct alloc_hdr *hdr;
+    pthread_mutex_lock(&pool_lock);
+    hdr = pool;
+    pool = NULL;
+    pooled = 0;
+    pthread_mutex_unlock(&pool_lock);
+    while (hdr) {
+        struct alloc_hdr *next = hdr->next;
+        munmap(hdr->map, hdr->maplen);
+        hdr = next;
+    }
+}
+
+void
+vfs_memory_budget(size_t bytes, const char *dir)
+{
+    pthread_mutex_lock(&pool_lock);
+    budget = bytes;
+    spilldir = dir;
+    pthread_mutex_unlock(&pool_lock);
+    if (bytes) {
+        vfs_allocator_trim();
+    }
+}
+
+void
+vfs_memory_usage(struct vfs_memory_usage *usage)
+{
+    pthread_mutex_lock(&pool_lock);
+    usage->live = live;
+    usage->pooled = pooled;
+    usage->peak = peak;
+    usage->budget = budget;
+    pthread_mutex_unlock(&pool_lock);
+    usage->spilled = __atomic_load_n(&spilled, __ATOMIC_RELAXED);
+    usage->refused = __atomic_load_n(&refused, __ATOMIC_RELAXED);
+}
+
+const struct vfs_allocator vfs_default_allocator = { vfs_realloc, vfs_free };
+const struct vfs_allocator vfs_libc_allocator = { realloc, free };
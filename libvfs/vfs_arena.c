@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vfs.h"
+
+#define ARENA_ALIGN     16
+#define ARENA_CHUNK     (16 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t capacity;
+    size_t used;
+};
+
+#define CHUNK_HDR ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((unsigned char *)(c) + CHUNK_HDR)
+
+struct vfs_arena {
+    struct arena_chunk *head;
+    struct arena_chunk *cur;
+    size_t chunk;
+};
+
+struct vfs_arena *
+vfs_arena_create(size_t chunk)
+{
+    struct vfs_arena *arena = malloc(sizeof(struct vfs_arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->head = NULL;
+    arena->cur = NULL;
+    arena->chunk = chunk ? chunk : ARENA_CHUNK;
+    return arena;
+}
+
+void *
+vfs_arena_alloc(struct vfs_arena *arena, size_t size)
+{
+    struct arena_chunk *c = arena->cur;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (c && c->capacity - c->used >= size) {
+        goto okay;
+    }
+    /* chunks past the current one were released, reuse them if big enough */
+    if (c && c->next && c->next->capacity >= size) {
+        c = c->next;
+        c->used = 0;
+        goto okay;
+    }
+    if (!c && arena->head && arena->head->capacity >= size) {
+        c = arena->head;
+        c->used = 0;
+        goto okay;
+    }
+    {
+        size_t capacity = size > arena->chunk ? size : arena->chunk;
+        struct arena_chunk *n = malloc(CHUNK_HDR + capacity);
+        if (!n) {
+            return NULL;
+        }
+        n->capacity = capacity;
+        n->used = 0;
+        if (c) {
+            n->next = c->next;
+            c->next = n;
+        } else {
+            n->next = arena->head;
+            arena->head = n;
+        }
+        c = n;
+    }
+  okay:
+    arena->cur = c;
+    c->used += size;
+    return CHUNK_DATA(c) + c->used - size;
+}
+
+void
+vfs_arena_mark(struct vfs_arena *arena, struct vfs_arena_mark *mark)
+{
+    mark->chunk = arena->cur;
+    mark->used = arena->cur ? arena->cur->used : 0;
+}
+
+void
+vfs_arena_release(struct vfs_arena *arena, const struct vfs_arena_mark *mark)
+{
+    arena->cur = mark->chunk;
+    if (arena->cur) {
+        arena->cur->used = mark->used;
+    }
+}
+
+void
+vfs_arena_reset(struct vfs_arena *arena)
+{
+    arena->cur = NULL;
+}
+
+void
+vfs_arena_destroy(struct vfs_arena *arena)
+{
+    struct arena_chunk *c;
+    if (!arena) {
+        return;
+    }
+    for (c = arena->head; c; ) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    free(arena);
+}
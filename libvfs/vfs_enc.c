@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -67,7 +68,7 @@ enc_fsync(FHANDLE fd)
     cccbc_ctx_decl(cccbc_context_size(ccaes_cbc_encrypt_mode()), aesctx);
     cccbc_iv_decl(cccbc_block_size(ccaes_cbc_encrypt_mode()), iv_ctx);
     cccbc_set_iv(ccaes_cbc_encrypt_mode(), iv_ctx, ctx->iv);
-    cccbc_init(ccaes_cbc_encrypt_mode(), aesctx, 256, ctx->key);
+    cccbc_init(ccaes_cbc_encrypt_mode(), aesctx, 32, ctx->key);
 #elif defined(USE_COMMONCRYPTO)
     CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES, 0, ctx->key, kCCKeySizeAES256, ctx->iv, &cryptor);
 #else
@@ -115,7 +116,7 @@ enc_fsync(FHANDLE fd)
     }
 
   next:
-    MEMFD(fd)->dirty = 0;
+    memory_clean(fd);
     return other->fsync(other);
 }
 
@@ -181,12 +182,47 @@ enc_ioctl(FHANDLE fd, unsigned long req, ...)
             rv = 0;
             break;
         }
+        case IOCTL_MEM_RESERVE: {
+            size_t capacity = va_arg(ap, size_t);
+            rv = memory_reserve(fd, capacity);
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY: {
+            memory_set_dirty(fd, 0, SIZE_MAX);
+            rv = 0;
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY_RANGE: {
+            size_t offset = va_arg(ap, size_t);
+            size_t length = va_arg(ap, size_t);
+            memory_set_dirty(fd, offset, length);
+            rv = 0;
+            break;
+        }
         case IOCTL_ENC_SET_NOENC: {
             MEMFD(fd)->dirty = 1;
             ctx->noencrypt = 1;
             rv = 0;
             break;
         }
+        case IOCTL_MEM_SNAPSHOT: {
+            FHANDLE *out = va_arg(ap, FHANDLE *);
+            int flags = va_arg(ap, int);
+            FHANDLE other = ctx->other;
+            FHANDLE copy;
+            rv = other->ioctl(other, IOCTL_MEM_SNAPSHOT, &copy, flags);
+            if (rv) {
+                break;
+            }
+            *out = memory_clone(fd, sizeof(struct file_ops_enc), flags);
+            if (!*out) {
+                copy->close(copy);
+                rv = -1;
+                break;
+            }
+            ((struct file_ops_enc *)*out)->other = copy;
+            break;
+        }
         default: {
             void *a = va_arg(ap, void *);
             void *b = va_arg(ap, void *);
@@ -206,9 +242,11 @@ enc_reopen(FHANDLE other, const unsigned char iv[16], const unsigned char key[32
     struct file_ops_enc *ctx;
     unsigned char *buf;
     unsigned char theiv[16];
+    const struct vfs_allocator *alloc;
 #if !defined(USE_CORECRYPTO) && !defined(USE_COMMONCRYPTO)
     AES_KEY decryptKey;
 #endif
+    STATS_SINCE(since);
 
     if (!other) {
         return NULL;
@@ -225,12 +263,14 @@ enc_reopen(FHANDLE other, const unsigned char iv[16], const unsigned char key[32
     if ((ssize_t)total < 0) {
         goto closeit;
     }
-    buf = calloc(1, (total + 15) & ~15);
+    alloc = ALLOCATOR(other);
+    buf = alloc->realloc(NULL, (total + 15) & ~15);
     if (!buf) {
         goto closeit;
     }
+    memset(buf + total, 0, ((total + 15) & ~15) - total);
 
-    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, total);
+    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, total, alloc);
     if (!fd) {
         goto freebuf;
     }
@@ -247,6 +287,7 @@ enc_reopen(FHANDLE other, const unsigned char iv[16], const unsigned char key[32
     } else {
         memset(theiv, 0, 16);
     }
+    TRACE_BEGIN(t);
 #ifdef USE_CORECRYPTO
     cccbc_one_shot(ccaes_cbc_decrypt_mode(), 32, key, theiv, (n + 15) / 16, buf, buf);
 #elif defined(USE_COMMONCRYPTO)
@@ -255,6 +296,7 @@ enc_reopen(FHANDLE other, const unsigned char iv[16], const unsigned char key[32
     AES_set_decrypt_key(key, 256, &decryptKey);
     AES_cbc_encrypt(buf, buf, (n + 15) & ~15, &decryptKey, theiv, AES_DECRYPT);
 #endif
+    TRACE_END(t, "enc_decrypt");
     memcpy(ctx->key, key, 32);
     if (iv) {
         memcpy(ctx->iv, iv, 16);
@@ -265,12 +307,14 @@ enc_reopen(FHANDLE other, const unsigned char iv[16], const unsigned char key[32
     fd->ioctl = enc_ioctl;
     fd->fsync = enc_fsync;
     fd->close = enc_close;
+    STATS_ATTACH(fd, "enc", since, MEMFD(fd)->capacity);
     return fd;
 
   error:
-    fd->close(fd);
+    memory_close(fd);
+    goto closeit;
   freebuf:
-    free(buf);
+    alloc->free(buf);
   closeit:
     other->close(other);
     return NULL;
@@ -1,6 +1,8 @@
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "vfs.h"
@@ -9,6 +11,7 @@
 struct file_ops_file {
     struct file_ops ops;
     int fd;
+    char *path;
 };
 
 static int
@@ -29,6 +32,7 @@ file_close(FHANDLE fd_)
         return -1;
     }
     close(fd->fd);
+    free(fd->path);
     free(fd);
     return 0;
 }
@@ -53,6 +57,26 @@ file_write(FHANDLE fd_, const void *buf, size_t count)
     return write(fd->fd, buf, count);
 }
 
+static ssize_t
+file_pread(FHANDLE fd_, void *buf, size_t count, off_t offset)
+{
+    struct file_ops_file *fd = (struct file_ops_file *)fd_;
+    if (!fd) {
+        return -1;
+    }
+    return pread(fd->fd, buf, count, offset);
+}
+
+static ssize_t
+file_pwrite(FHANDLE fd_, const void *buf, size_t count, off_t offset)
+{
+    struct file_ops_file *fd = (struct file_ops_file *)fd_;
+    if (!fd) {
+        return -1;
+    }
+    return pwrite(fd->fd, buf, count, offset);
+}
+
 static off_t
 file_lseek(FHANDLE fd_, off_t offset, int whence)
 {
@@ -67,10 +91,20 @@ static int
 file_ioctl(FHANDLE fd_, unsigned long req, ...)
 {
     struct file_ops_file *fd = (struct file_ops_file *)fd_;
+    va_list ap;
+    int rv = -1;
     if (!fd) {
         return -1;
     }
-    return -1;
+    va_start(ap, req);
+    if (req == IOCTL_FILE_GET_INFO) {
+        struct stat *st = va_arg(ap, struct stat *);
+        const char **path = va_arg(ap, const char **);
+        rv = fstat(fd->fd, st);
+        *path = fd->path;
+    }
+    va_end(ap);
+    return rv;
 }
 
 static int
@@ -104,6 +138,7 @@ file_open(const char *pathname, int flags, ...)
 {
     mode_t mode = 0;
     struct file_ops_file *ops;
+    STATS_SINCE(since);
     ops = malloc(sizeof(*ops));
     if (!ops) {
         return NULL;
@@ -114,19 +149,30 @@ file_open(const char *pathname, int flags, ...)
         mode = va_arg(ap, int);
         va_end(ap);
     }
+    ops->path = strdup(pathname);
+    if (!ops->path) {
+        free(ops);
+        return NULL;
+    }
     ops->fd = open(pathname, flags, mode);
     if (ops->fd < 0) {
+        free(ops->path);
         free(ops);
         return NULL;
     }
     ops->ops.flags = flags & O_ACCMODE;
+    ops->ops.alloc = &vfs_default_allocator;
     ops->ops.read = file_read;
     ops->ops.write = file_write;
+    ops->ops.pread = file_pread;
+    ops->ops.pwrite = file_pwrite;
     ops->ops.lseek = file_lseek;
     ops->ops.ioctl = file_ioctl;
     ops->ops.ftruncate = file_ftruncate;
     ops->ops.fsync = file_fsync;
     ops->ops.close = file_close;
     ops->ops.length = file_length;
+    ops->ops.stats = NULL;
+    STATS_ATTACH(&ops->ops, "file", since, 0);
     return (FHANDLE)ops;
 }
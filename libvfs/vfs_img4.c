@@ -5,6 +5,7 @@
 
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,8 @@
 #include <libDER/asn1Types.h>
 #include <libDER/oids.h>
 #include "validate_ca.h"
+#include "libvfs/vfs.h"
+#include "libvfs/vfs_internal.h"
 
 #define E000000000000000 (ASN1_CONSTRUCTED | ASN1_PRIVATE)
 
@@ -61,6 +64,7 @@ typedef struct {
     DERItem ep_info;
 #endif
     DERByte full_digest[RESERVE_DIGEST_SPACE];
+    DERByte full_digest384[48];
 } TheImg4Payload;
 
 typedef struct {
@@ -79,14 +83,37 @@ typedef struct {
     DERItem nonce;
 } TheImg4RestoreInfo;
 
+typedef struct {
+    DERTag tag;
+    DERItem item;
+} Img4IndexEntry;
+
+typedef struct {
+    Img4IndexEntry *entries;    // in manifest order
+    unsigned *slots;            // open addressing, entry + 1 (0 = empty)
+    unsigned count;
+    unsigned mask;
+} Img4Index;
+
+typedef struct {
+    DERItem manb;
+    Img4Index objects;          // MANP and every object, item is the property SET
+    Img4Index *props;           // properties of each of the above
+} Img4ManifestIndex;
+
 typedef struct {
     bool payloadHashed;
+    bool payloadHashed384;
     bool manifestHashed;
+    bool thesetHashed;
     DERItem payloadRaw;
     DERItem manifestRaw;
     DERItem manb;
     DERItem manp;
     DERItem objp;
+    const Img4ManifestIndex *index;
+    const Img4Index *manpProps;
+    const Img4Index *objpProps;
     TheImg4Payload payload;
     TheImg4Manifest manifest;
     TheImg4RestoreInfo restoreInfo;
@@ -235,20 +262,129 @@ const DERItemSpec kbagSpecs[] = {
 
 #define doHash sha1_digest
 
+#ifdef USE_COMMONCRYPTO
+/* CC_LONG is 32-bit, feed large buffers in pieces */
+#define CC_CHUNK 0x40000000
+#endif
+
 void
 sha1_digest(const void *data, DERSize length, DERByte digest[20])
 {
+    TRACE_BEGIN(t);
 #ifdef USE_CORECRYPTO
-    ccdigest(&ccsha1_ltc_di, length, data, digest);
+    ccdigest(ccsha1_di(), length, data, digest);
 #elif defined(USE_COMMONCRYPTO)
-    CC_SHA1(data, length, digest);
+    CC_SHA1_CTX ctx;
+    CC_SHA1_Init(&ctx);
+    while (length > CC_CHUNK) {
+        CC_SHA1_Update(&ctx, data, CC_CHUNK);
+        data = (const char *)data + CC_CHUNK;
+        length -= CC_CHUNK;
+    }
+    CC_SHA1_Update(&ctx, data, (CC_LONG)length);
+    CC_SHA1_Final(digest, &ctx);
 #else
     SHA1(data, length, digest);
 #endif
+    TRACE_END(t, "sha1");
 }
 
-int
-verify_signature_rsa(const DERItem *pkey, const DERItem *digest, const DERItem *sig)
+static void
+sha384_digest(const void *data, DERSize length, DERByte digest[48])
+{
+    TRACE_BEGIN(t);
+#ifdef USE_CORECRYPTO
+    ccdigest(ccsha384_di(), length, data, digest);
+#elif defined(USE_COMMONCRYPTO)
+    CC_SHA512_CTX ctx;
+    CC_SHA384_Init(&ctx);
+    while (length > CC_CHUNK) {
+        CC_SHA384_Update(&ctx, data, CC_CHUNK);
+        data = (const char *)data + CC_CHUNK;
+        length -= CC_CHUNK;
+    }
+    CC_SHA384_Update(&ctx, data, (CC_LONG)length);
+    CC_SHA384_Final(digest, &ctx);
+#else
+    SHA384(data, length, digest);
+#endif
+    TRACE_END(t, "sha384");
+}
+
+#if !defined(USE_CORECRYPTO) && !defined(USE_COMMONCRYPTO)
+/*
+ * the same few issuer keys sign everything: keep them decoded.  an RSA key
+ * sets up its Montgomery context on first use and keeps it, so reusing the
+ * EVP_PKEY also saves that.  callers get a reference of their own
+ */
+
+#define KEY_CACHE_SIZE 16
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_PKEY_up_ref(key) CRYPTO_add(&(key)->references, 1, CRYPTO_LOCK_EVP_PKEY)
+#endif
+
+struct key_cache_entry {
+    DERByte *der;
+    DERSize length;
+    EVP_PKEY *key;
+};
+
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct key_cache_entry key_cache[KEY_CACHE_SIZE];
+static unsigned key_cache_next;
+
+static EVP_PKEY *
+get_rsa_key(const DERItem *pkey)
+{
+    unsigned i;
+    DERByte *der;
+    EVP_PKEY *key = NULL;
+    struct key_cache_entry *e;
+    const unsigned char *p = pkey->data;
+
+    pthread_mutex_lock(&key_cache_lock);
+    for (i = 0; i < KEY_CACHE_SIZE; i++) {
+        e = &key_cache[i];
+        if (e->key && e->length == pkey->length && !memcmp(e->der, pkey->data, e->length)) {
+            key = e->key;
+            EVP_PKEY_up_ref(key);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&key_cache_lock);
+    if (key) {
+        return key;
+    }
+
+    key = d2i_PublicKey(EVP_PKEY_RSA, NULL, &p, pkey->length);
+    if (!key) {
+        ERR_clear_error();
+        return NULL;
+    }
+    der = malloc(pkey->length);
+    if (!der) {
+        return key;
+    }
+    memcpy(der, pkey->data, pkey->length);
+
+    pthread_mutex_lock(&key_cache_lock);
+    e = &key_cache[key_cache_next++ % KEY_CACHE_SIZE];
+    if (e->key) {
+        EVP_PKEY_free(e->key);
+        free(e->der);
+    }
+    e->der = der;
+    e->length = pkey->length;
+    e->key = key;
+    EVP_PKEY_up_ref(key);
+    pthread_mutex_unlock(&key_cache_lock);
+    return key;
+}
+#endif
+
+static int
+verify_rsa(const DERItem *pkey, const DERItem *digest, const DERItem *sig)
 {
     int rv;
 #ifdef USE_CORECRYPTO
@@ -259,9 +395,9 @@ verify_signature_rsa(const DERItem *pkey, const DERItem *digest, const DERItem *
     bool valid;
     DERItem pkeyComponents[2];
     DERItem var_390;
-    ccrsa_pub_ctx_decl(256, key);
+    ccrsa_pub_ctx_decl(ccn_sizeof_size(512), key);
 
-    ccrsa_ctx_n(key) = 256;
+    ccrsa_ctx_n(key) = ccn_nof_size(512);
 
     valid = false;
 
@@ -285,13 +421,14 @@ verify_signature_rsa(const DERItem *pkey, const DERItem *digest, const DERItem *
     }
     ccrsa_ctx_n(key) = n;
     ccn_read_uint(n, ccrsa_ctx_m(key), len, ptr);
-    cczp_init(ccrsa_ctx_zm(key));
+    if (cczp_init(ccrsa_ctx_zm(key))) {
+        return -1;
+    }
     rv = ccn_read_uint(n, ccrsa_ctx_e(key), pkeyComponents[1].length, pkeyComponents[1].data);
     if (rv) {
         return -1;
     }
     rv = ccrsa_verify_pkcs1v15(key, ccoid_sha1, digest->length, digest->data, sig->length, sig->data, &valid);
-    printf("+rv = %d, valid = %d\n", rv, valid);
     return (valid != true) | (rv != 0);
 #elif defined(USE_COMMONCRYPTO)
     int bits = 256 * 8;
@@ -337,44 +474,113 @@ verify_signature_rsa(const DERItem *pkey, const DERItem *digest, const DERItem *
     CFRelease(data);
     CFRelease(k);
 
-    printf("+rv = %d\n", rv);
     return (rv == 1) ? 0 : -1;
 #else
-    RSA *rsa;
-    DERItem pkeyComponents[2];
+    EVP_PKEY *key;
+    EVP_PKEY_CTX *ctx;
 
-    if (DERParseSequence(pkey, 2, DERRSAPubKeyPKCS1ItemSpecs, pkeyComponents, 2 * sizeof(DERItem))) {
+    key = get_rsa_key(pkey);
+    if (!key) {
         return -1;
     }
+    ctx = EVP_PKEY_CTX_new(key, NULL);
+    rv = ctx && EVP_PKEY_verify_init(ctx) == 1
+        && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1
+        && EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha1()) == 1
+        && EVP_PKEY_verify(ctx, sig->data, sig->length, digest->data, digest->length) == 1;
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(key);
+    if (!rv) {
+        ERR_clear_error();
+        return -1;
+    }
+    return 0;
+#endif
+}
 
-    rsa = RSA_new();
-    assert(rsa);
+int
+verify_signature_rsa(const DERItem *pkey, const DERItem *digest, const DERItem *sig)
+{
+    int rv;
+    TRACE_BEGIN(t);
+    rv = verify_rsa(pkey, digest, sig);
+    TRACE_END(t, "verify_signature");
+    return rv;
+}
 
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-    rv = RSA_set0_key(rsa, BN_bin2bn(pkeyComponents[0].data, pkeyComponents[0].length, NULL), BN_bin2bn(pkeyComponents[1].data, pkeyComponents[1].length, NULL), NULL);
-    assert(rv == 1);
-#else
-    rsa->n = BN_bin2bn(pkeyComponents[0].data, pkeyComponents[0].length, NULL);
-    assert(rsa->n);
+static int
+parse_certificate(const DERItem *cert, DERItem var_2F0[3], DERItem var_4D0[10], DERItem *pkey, DERItem *spec)
+{
+    DERItem var_208[2];
+    unsigned char var_1E1;
+    DERItem var_1E0[2];
+    DERItem var_1C0[3];
+    DERDecodedInfo var_190;
+    DERTag var_178;
+    DERSequence var_170;
+    DERDecodedInfo var_160;
 
-    rsa->e = BN_bin2bn(pkeyComponents[1].data, pkeyComponents[1].length, NULL);
-    assert(rsa->e);
-#endif
+    if (DERParseSequence(cert, 3, DERSignedCertCrlItemSpecs, var_2F0, 3 * sizeof(DERItem))
+        || DERParseSequence(var_2F0, 10, DERTBSCertItemSpecs, var_4D0, 10 * sizeof(DERItem))
+        || DERParseSequenceContent(&var_4D0[6], 2, DERSubjPubKeyInfoItemSpecs, var_1E0, 2 * sizeof(DERItem))
+        || DERParseSequenceContent(var_1E0, 2, DERAlgorithmIdItemSpecs, var_208, 2 * sizeof(DERItem))
+        || !DEROidCompare(var_208, &oidRsa)) {
+        return -1;
+    }
+    if (var_208[1].length) {
+        if (var_208[1].length != 2 || var_208[1].data[0] != 5 || var_208[1].data[1]) {
+            return -1;
+        }
+    }
 
-    rv = RSA_verify(NID_sha1, digest->data, digest->length, sig->data, sig->length, rsa);
-    printf("+rv = %d\n", rv);
+    if (DERParseBitString(&var_1E0[1], pkey, &var_1E1) || var_1E1) {
+        return -1;
+    }
 
-    RSA_free(rsa);
-    return (rv == 1) ? 0 : -1;
-#endif
+    spec->data = NULL;
+    spec->length = 0;
+    if (var_4D0[9].length == 0) {
+        return 0;
+    }
+    if (DERDecodeSeqInit(&var_4D0[9], &var_178, &var_170)) {
+        return -1;
+    }
+    if (var_178 != ASN1_CONSTR_SEQUENCE) {
+        return -1;
+    }
+    while (!DERDecodeSeqNext(&var_170, &var_190)) {
+        if (var_190.tag != ASN1_CONSTR_SEQUENCE || DERParseSequenceContent(&var_190.content, 3, DERExtensionItemSpecs, var_1C0, 3 * sizeof(DERItem))) {
+            return -1;
+        }
+        if (DEROidCompare(&oidAppleImg4ManifestCertSpec, var_1C0)) {
+            if (DERDecodeItem(&var_1C0[2], &var_160) || var_160.tag != ASN1_CONSTR_SET) {
+                return -1;
+            }
+            *spec = var_1C0[2];
+        }
+    }
+    return 0;
 }
 
-int
-img4_verify_signature_with_chain(
-    void *chain_blob_data, unsigned int chain_blob_length,
-    void *sig_blob_data, unsigned int sig_blob_length,
-    void *digest_data, unsigned int digest_length,
-    DERByte **img4_data, DERSize *img4_length)
+/* the root never changes, parse it once */
+
+static pthread_once_t root_once = PTHREAD_ONCE_INIT;
+static int root_rv = -1;
+static DERItem root_2F0[3];
+static DERItem root_4D0[10];
+static DERItem root_pkey;
+
+static void
+parse_root(void)
+{
+    DERItem cert, spec;
+    cert.data = (void *)ROOT_CA_CERTIFICATE;
+    cert.length = ROOT_CA_CERTIFICATE_SIZE;
+    root_rv = parse_certificate(&cert, root_2F0, root_4D0, &root_pkey, &spec);
+}
+
+static int
+verify_chain(const DERItem *chain_blob, DERItem *leaf_pkey, DERItem *leaf_spec)
 {
     DERItem var_540;
     DERItem var_530[3];
@@ -384,14 +590,6 @@ img4_verify_signature_with_chain(
     DERItem certChain[3];       // var_260
     DERDecodedInfo var_230;
     DERItem var_218;
-    DERItem var_208[2];
-    unsigned char var_1E1;
-    DERItem var_1E0[2];
-    DERItem var_1C0[3];
-    DERDecodedInfo var_190;
-    DERTag var_178;
-    DERSequence var_170;
-    DERDecodedInfo var_160;
     DERItem var_148;
     DERItem var_138;
     unsigned char var_121;
@@ -401,19 +599,21 @@ img4_verify_signature_with_chain(
     DERItem var_D8[2];
     DERDecodedInfo var_B8;
     DERSequence var_A0;
-    DERItem var_90;
-    DERItem var_80;
     unsigned char var_6C[20];
 
     DERSize v1;
     unsigned i;
     int rv;
 
-    certChain[0].data = (void *)ROOT_CA_CERTIFICATE;
-    certChain[0].length = ROOT_CA_CERTIFICATE_SIZE;
+    pthread_once(&root_once, parse_root);
+    if (root_rv) {
+        return -1;
+    }
+    memcpy(var_2F0[0], root_2F0, sizeof(root_2F0));
+    memcpy(var_4D0[0], root_4D0, sizeof(root_4D0));
+    var_500[0] = root_pkey;
 
-    var_218.data = chain_blob_data;
-    var_218.length = chain_blob_length;
+    var_218 = *chain_blob;
 
     i = 1;
     do {
@@ -434,46 +634,10 @@ img4_verify_signature_with_chain(
         return -1;
     }
 
-    for (i = 0; i < 3; i++) {
-        if (DERParseSequence(&certChain[i], 3, DERSignedCertCrlItemSpecs, var_2F0[i], 3 * sizeof(DERItem))
-            || DERParseSequence(var_2F0[i], 10, DERTBSCertItemSpecs, var_4D0[i], 10 * sizeof(DERItem))
-            || DERParseSequenceContent(&var_4D0[i][6], 2, DERSubjPubKeyInfoItemSpecs, var_1E0, 2 * sizeof(DERItem))
-            || DERParseSequenceContent(var_1E0, 2, DERAlgorithmIdItemSpecs, var_208, 2 * sizeof(DERItem))
-            || !DEROidCompare(var_208, &oidRsa)) {
-            return -1;
-        }
-        if (var_208[1].length) {
-            if (var_208[1].length != 2 || var_208[1].data[0] != 5 || var_208[1].data[1]) {
-                return -1;
-            }
-        }
-
-        if (DERParseBitString(&var_1E0[1], &var_500[i], &var_1E1) || var_1E1) {
-            return -1;
-        }
-
-        var_530[i].data = NULL;
-        var_530[i].length = 0;
-        if (var_4D0[i][9].length == 0) {
-            continue;
-        }
-        if (DERDecodeSeqInit(&var_4D0[i][9], &var_178, &var_170)) {
-            return -1;
-        }
-        if (var_178 != ASN1_CONSTR_SEQUENCE) {
+    for (i = 1; i < 3; i++) {
+        if (parse_certificate(&certChain[i], var_2F0[i], var_4D0[i], &var_500[i], &var_530[i])) {
             return -1;
         }
-        while (!DERDecodeSeqNext(&var_170, &var_190)) {
-            if (var_190.tag != ASN1_CONSTR_SEQUENCE || DERParseSequenceContent(&var_190.content, 3, DERExtensionItemSpecs, var_1C0, 3 * sizeof(DERItem))) {
-                return -1;
-            }
-            if (DEROidCompare(&oidAppleImg4ManifestCertSpec, var_1C0)) {
-                if (DERDecodeItem(&var_1C0[2], &var_160) || var_160.tag != ASN1_CONSTR_SET) {
-                    return -1;
-                }
-                var_530[i] = var_1C0[2];
-            }
-        }
     }
 
     for (i = 1; i < 3; i++) {
@@ -538,6 +702,104 @@ img4_verify_signature_with_chain(
     if (!DEROidCompare(&AppleSecureBootCA, &var_540)) {
         return -1;
     }
+
+    *leaf_pkey = var_500[2];
+    *leaf_spec = var_530[2];
+    return 0;
+}
+
+/*
+ * tickets share a handful of chains: remember the ones that checked out,
+ * keyed by digest.  entries keep a copy of the chain and offsets into it,
+ * so results are rebased onto the caller's blob and never dangle
+ */
+
+#define CHAIN_CACHE_SIZE 16
+
+struct chain_cache_entry {
+    DERByte digest[20];
+    DERByte *chain;
+    DERSize length;
+    DERSize pkey_offset;
+    DERSize pkey_length;
+    DERSize spec_offset;
+    DERSize spec_length;
+};
+
+static pthread_mutex_t chain_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct chain_cache_entry chain_cache[CHAIN_CACHE_SIZE];
+static unsigned chain_cache_next;
+
+static int
+chain_cache_lookup(const DERItem *chain_blob, const DERByte digest[20], DERItem *pkey, DERItem *spec)
+{
+    unsigned i;
+    int rv = -1;
+
+    pthread_mutex_lock(&chain_cache_lock);
+    for (i = 0; i < CHAIN_CACHE_SIZE; i++) {
+        const struct chain_cache_entry *e = &chain_cache[i];
+        if (e->chain && e->length == chain_blob->length && !memcmp(e->digest, digest, 20) && !memcmp(e->chain, chain_blob->data, e->length)) {
+            pkey->data = chain_blob->data + e->pkey_offset;
+            pkey->length = e->pkey_length;
+            spec->data = e->spec_length ? chain_blob->data + e->spec_offset : NULL;
+            spec->length = e->spec_length;
+            rv = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&chain_cache_lock);
+    return rv;
+}
+
+static void
+chain_cache_insert(const DERItem *chain_blob, const DERByte digest[20], const DERItem *pkey, const DERItem *spec)
+{
+    struct chain_cache_entry *e;
+    DERByte *copy = malloc(chain_blob->length);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, chain_blob->data, chain_blob->length);
+
+    pthread_mutex_lock(&chain_cache_lock);
+    e = &chain_cache[chain_cache_next++ % CHAIN_CACHE_SIZE];
+    free(e->chain);
+    memcpy(e->digest, digest, 20);
+    e->chain = copy;
+    e->length = chain_blob->length;
+    e->pkey_offset = pkey->data - chain_blob->data;
+    e->pkey_length = pkey->length;
+    e->spec_offset = spec->data ? spec->data - chain_blob->data : 0;
+    e->spec_length = spec->data ? spec->length : 0;
+    pthread_mutex_unlock(&chain_cache_lock);
+}
+
+int
+img4_verify_signature_with_chain(
+    void *chain_blob_data, DERSize chain_blob_length,
+    void *sig_blob_data, DERSize sig_blob_length,
+    void *digest_data, DERSize digest_length,
+    DERByte **img4_data, DERSize *img4_length)
+{
+    DERItem chain;
+    DERItem pkey;
+    DERItem spec;
+    DERItem var_90;
+    DERItem var_80;
+    DERByte digest[20];
+
+    chain.data = chain_blob_data;
+    chain.length = chain_blob_length;
+    sha1_digest(chain.data, chain.length, digest);
+
+    if (chain_cache_lookup(&chain, digest, &pkey, &spec)) {
+        if (verify_chain(&chain, &pkey, &spec)) {
+            return -1;
+        }
+        chain_cache_insert(&chain, digest, &pkey, &spec);
+    }
+
     var_80.data = sig_blob_data;
     var_80.length = sig_blob_length;
     var_90.data = digest_data;
@@ -545,12 +807,12 @@ img4_verify_signature_with_chain(
     if (digest_length != 20) {
         return -1;
     }
-    if (verify_signature_rsa(&var_500[2], &var_90, &var_80)) {
+    if (verify_signature_rsa(&pkey, &var_90, &var_80)) {
         return -1;
     }
-    if (var_530[2].data && var_530[2].length && img4_data && img4_length) {
-        *img4_data = var_530[2].data;
-        *img4_length = var_530[2].length;
+    if (spec.data && spec.length && img4_data && img4_length) {
+        *img4_data = spec.data;
+        *img4_length = spec.length;
     }
     return 0;
 }
@@ -832,6 +1094,40 @@ DERImg4DecodeFindProperty(const DERItem *a1, DERTag etag, DERTag atag, DERMonste
     return 0;
 }
 
+#define Img4IndexHash(tag) ((uint32_t)(tag) * 2654435761U)
+
+int
+Img4IndexFind(const Img4Index *index, DERTag tag, unsigned *pos)
+{
+    unsigned i;
+
+    for (i = Img4IndexHash(tag) & index->mask; index->slots[i]; i = (i + 1) & index->mask) {
+        if (index->entries[index->slots[i] - 1].tag == tag) {
+            *pos = index->slots[i] - 1;
+            return 0;
+        }
+    }
+    return DR_EndOfSequence;
+}
+
+int
+Img4IndexFindDictionary(const Img4ManifestIndex *index, DERTag etag, DERItem *dict, const Img4Index **props)
+{
+    int rv;
+    unsigned pos;
+
+    if (index == NULL) {
+        return DR_ParamErr;
+    }
+    rv = Img4IndexFind(&index->objects, etag, &pos);
+    if (rv) {
+        return rv;
+    }
+    *dict = index->objects.entries[pos].item;
+    *props = &index->props[pos];
+    return 0;
+}
+
 int
 Img4DecodeGetPayload(TheImg4 *img4, DERItem *a2)
 {
@@ -870,26 +1166,36 @@ Img4DecodeGetPayloadKeybag(TheImg4 *img4, DERItem *a2)
     return 0;
 }
 
+static const DERByte *
+Img4PayloadDigest(TheImg4 *img4, DERSize length)
+{
+    if (length == 20) {
+        if (!img4->payloadHashed) {
+            sha1_digest(img4->payloadRaw.data, img4->payloadRaw.length, img4->payload.full_digest);
+            img4->payloadHashed = 1;
+        }
+        return img4->payload.full_digest;
+    }
+    if (length == 48) {
+        if (!img4->payloadHashed384) {
+            sha384_digest(img4->payloadRaw.data, img4->payloadRaw.length, img4->payload.full_digest384);
+            img4->payloadHashed384 = 1;
+        }
+        return img4->payload.full_digest384;
+    }
+    return NULL;
+}
+
 int
 Img4DecodeCopyPayloadHash(TheImg4 *img4, void *hash, DERSize length)
 {
-    unsigned char var_3C[20];
-
     if (img4 == NULL || hash == NULL || length != 20) {
         return DR_ParamErr;
     }
     if (img4->payload.imageData.data == NULL || img4->payload.imageData.length == 0) {
         return DR_EndOfSequence;
     }
-    if (!img4->payloadHashed) {
-        sha1_digest(img4->payloadRaw.data, img4->payloadRaw.length, var_3C);
-        memmove(hash, &var_3C, length);
-        return 0;
-    }
-    if (length != 20) {
-        return DR_BufOverflow;
-    }
-    memcpy(hash, img4->payload.full_digest, 20);
+    memcpy(hash, Img4PayloadDigest(img4, 20), 20);
     return 0;
 }
 
@@ -906,8 +1212,6 @@ Img4DecodeManifestExists(TheImg4 *img4, bool *exists)
 int
 Img4DecodeCopyManifestHash(TheImg4 *img4, void *hash, DERSize length)
 {
-    unsigned char var_3C[20];
-
     if (img4 == NULL || hash == NULL || length != 20) {
         return DR_ParamErr;
     }
@@ -915,12 +1219,8 @@ Img4DecodeCopyManifestHash(TheImg4 *img4, void *hash, DERSize length)
         return DR_EndOfSequence;
     }
     if (!img4->manifestHashed) {
-        sha1_digest(img4->manifestRaw.data, img4->manifestRaw.length, var_3C);
-        memmove(hash, var_3C, length);
-        return 0;
-    }
-    if (length != 20) {
-        return DR_BufOverflow;
+        sha1_digest(img4->manifestRaw.data, img4->manifestRaw.length, img4->manifest.full_digest);
+        img4->manifestHashed = 1;
     }
     memcpy(hash, img4->manifest.full_digest, 20);
     return 0;
@@ -1028,9 +1328,10 @@ int
 Img4DecodeEvaluateCertificateProperties(TheImg4 *img4)
 {
     int rv;
-    DERItem var_130;
+    const Img4Index *var_130;
     DERItem var_118;
     DERMonster var_108[2];
+    unsigned pos;
     DERMonster var_D8[2];
     DERDecodedInfo var_A8;
     DERDecodedInfo var_90;
@@ -1038,7 +1339,7 @@ Img4DecodeEvaluateCertificateProperties(TheImg4 *img4)
     DERSequence var_70;
     DERSequence var_60;
 
-    if (img4 == NULL) {
+    if (img4 == NULL || img4->manpProps == NULL || img4->objpProps == NULL) {
         return DR_ParamErr;
     }
     rv = DERDecodeSeqInit(&img4->manifest.img4_blob, &tag, &var_60);
@@ -1055,9 +1356,9 @@ Img4DecodeEvaluateCertificateProperties(TheImg4 *img4)
             if (var_90.tag != (E000000000000000 | 'MANP')) {
                 return DR_UnexpectedTag;
             }
-            var_130 = img4->manp;
+            var_130 = img4->manpProps;
         } else {
-            var_130 = img4->objp;
+            var_130 = img4->objpProps;
         }
 
         rv = DERImg4DecodeProperty(&var_90.content, var_90.tag, var_D8);
@@ -1080,7 +1381,10 @@ Img4DecodeEvaluateCertificateProperties(TheImg4 *img4)
                 return rv;
             }
 
-            rv = DERImg4DecodeContentFindItemWithTag(&var_130, var_A8.tag, &var_118);
+            rv = Img4IndexFind(var_130, var_A8.tag, &pos);
+            if (rv == 0) {
+                var_118 = var_130->entries[pos].item;
+            }
             if ((var_108[1].tag & (ASN1_CLASS_MASK | ASN1_METHOD_MASK)) > ASN1_CONTEXT_SPECIFIC) {
                 if (var_108[1].tag != (ASN1_CONSTRUCTED|ASN1_CONTEXT_SPECIFIC)) {
                     if (var_108[1].tag != (ASN1_CONSTRUCTED|ASN1_CONTEXT_SPECIFIC | 1)) {
@@ -1196,21 +1500,20 @@ Img4DecodeInit(DERByte *data, DERSize length, TheImg4 *img4)
     return 0;
 }
 
+/* the part of Img4DecodeEvaluateTrust that does not depend on the object type */
 int
-Img4DecodeEvaluateTrust(int type, TheImg4 *img4, int (*property_cb)(DERTag, DERItem *, DictType, void *), void *ctx)
+Img4DecodeVerifyManifest(TheImg4 *img4)
 {
     int rv;
-    DERDecodedInfo var_88;
-    DERMonster var_70[2];
 
-    if (img4 == NULL || property_cb == NULL) {
-        return DR_ParamErr;
-    }
-    if (img4->manifestRaw.data == NULL) {
+    if (img4 == NULL || img4->manifestRaw.data == NULL) {
         return DR_ParamErr;
     }
 
-    sha1_digest(img4->manifest.theset.data, img4->manifest.theset.length, img4->manifest.theset_digest);
+    if (!img4->thesetHashed) {
+        sha1_digest(img4->manifest.theset.data, img4->manifest.theset.length, img4->manifest.theset_digest);
+        img4->thesetHashed = 1;
+    }
 
     rv = img4_verify_signature_with_chain(
         img4->manifest.chain_blob.data, img4->manifest.chain_blob.length,
@@ -1224,57 +1527,46 @@ Img4DecodeEvaluateTrust(int type, TheImg4 *img4, int (*property_cb)(DERTag, DERI
         return DR_DecodeError;
     }
 
-    rv = DERDecodeItem(&img4->manifest.theset, &var_88);
-    if (rv) {
-        return rv;
+    if (img4->index == NULL) {
+        return DR_DecodeError;
     }
 
-    if (var_88.tag != ASN1_CONSTR_SET) {
-        return -1;
-    }
+    img4->manb = img4->index->manb;
 
-    rv = DERImg4DecodeFindProperty(&var_88.content, E000000000000000 | 'MANB', ASN1_CONSTR_SET, var_70);
-    if (rv) {
-        return rv;
-    }
+    return Img4IndexFindDictionary(img4->index, E000000000000000 | 'MANP', &img4->manp, &img4->manpProps);
+}
+
+int
+Img4DecodeEvaluateTrust(int type, TheImg4 *img4, int (*property_cb)(DERTag, DERItem *, DictType, void *), void *ctx)
+{
+    int rv;
 
-    img4->manb = var_70[1].item;
+    if (img4 == NULL || property_cb == NULL) {
+        return DR_ParamErr;
+    }
 
-    rv = DERImg4DecodeFindProperty(&img4->manb, E000000000000000 | 'MANP', ASN1_CONSTR_SET, var_70);
+    rv = Img4DecodeVerifyManifest(img4);
     if (rv) {
         return rv;
     }
 
-    img4->manp = var_70[1].item;
-
-    rv = DERImg4DecodeFindProperty(&img4->manb, E000000000000000 | (unsigned int)type, ASN1_CONSTR_SET, var_70);
+    rv = Img4IndexFindDictionary(img4->index, E000000000000000 | (unsigned int)type, &img4->objp, &img4->objpProps);
     if (rv) {
         return rv;
     }
-    img4->objp = var_70[1].item;
 
     rv = Img4DecodeEvaluateCertificateProperties(img4);
     if (rv) {
         return rv;
     }
 
-    sha1_digest(img4->payloadRaw.data, img4->payloadRaw.length, img4->payload.full_digest);
-    img4->payloadHashed = 1;
-
+    /* payload and manifest digests are taken on demand (DGST, Img4DecodeCopyManifestHash) */
     rv = Img4DecodeEvaluateDictionaryProperties(&img4->manp, DictMANP, property_cb, ctx);
     if (rv) {
         return rv;
     }
 
-    rv = Img4DecodeEvaluateDictionaryProperties(&img4->objp, DictOBJP, property_cb, ctx);
-    if (rv) {
-        return rv;
-    }
-
-    sha1_digest(img4->manifestRaw.data, img4->manifestRaw.length, img4->manifest.full_digest);
-    img4->manifestHashed = 1;
-
-    return 0;
+    return Img4DecodeEvaluateDictionaryProperties(&img4->objp, DictOBJP, property_cb, ctx);
 }
 
 int
@@ -1507,14 +1799,18 @@ query_property_callback(DERTag tag, DERItem *b, DictType what, void *ctx)
     return 0;
 }
 
+typedef struct {
+    TheImg4 *img4;
+    bool update;        // write the digest instead of checking it
+} HashContext;
+
 static int
 hash_property_callback(DERTag tag, DERItem *b, DictType what, void *ctx)
 {
     int rv;
     if (what == DictOBJP && (unsigned int)tag == 'DGST') {
-        const DERMonster *tmp = (DERMonster *)ctx;
-        const DERItem *payloadRaw = &tmp->item;
-        unsigned char digest[64];
+        const HashContext *tmp = (HashContext *)ctx;
+        const DERByte *digest;
 
         DERSize var_1C;
         DERByte *var_18;
@@ -1523,18 +1819,11 @@ hash_property_callback(DERTag tag, DERItem *b, DictType what, void *ctx)
             return rv;
         }
 
-        if (var_1C == 20) {
-            sha1_digest(payloadRaw->data, payloadRaw->length, digest);
-        } else {
-#ifdef USE_CORECRYPTO
-            ccdigest(&ccsha384_ltc_di, payloadRaw->length, payloadRaw->data, digest);
-#elif defined(USE_COMMONCRYPTO)
-            CC_SHA384(payloadRaw->data, payloadRaw->length, digest);
-#else
-            SHA384(payloadRaw->data, payloadRaw->length, digest);
-#endif
+        digest = Img4PayloadDigest(tmp->img4, var_1C);
+        if (!digest) {
+            return -1;
         }
-        if (tmp->tag) {
+        if (tmp->update) {
             memmove(var_18, digest, var_1C);
             return 0;
         }
@@ -1544,38 +1833,21 @@ hash_property_callback(DERTag tag, DERItem *b, DictType what, void *ctx)
 }
 
 static int
-walkman(const TheImg4Manifest *m, unsigned int type, int (*cb)(DERTag tag, DERItem *b, DictType what, void *ctx), DERMonster *ctx)
+walkman(const Img4ManifestIndex *index, unsigned int type, int (*cb)(DERTag tag, DERItem *b, DictType what, void *ctx), void *ctx)
 {
     int rv;
-    DERDecodedInfo var_88;
-    DERMonster var_70[2];
-    DERItem manb, manp, objp;
-
-    rv = DERDecodeItem(&m->theset, &var_88);
-    if (rv) {
-        return rv;
-    }
-    if (var_88.tag != ASN1_CONSTR_SET) {
-        return -1;
-    }
-
-    rv = DERImg4DecodeFindProperty(&var_88.content, E000000000000000 | 'MANB', ASN1_CONSTR_SET, var_70);
-    if (rv) {
-        return rv;
-    }
-    manb = var_70[1].item;
+    DERItem manp, objp;
+    const Img4Index *props;
 
-    rv = DERImg4DecodeFindProperty(&manb, E000000000000000 | 'MANP', ASN1_CONSTR_SET, var_70);
+    rv = Img4IndexFindDictionary(index, E000000000000000 | 'MANP', &manp, &props);
     if (rv) {
         return rv;
     }
-    manp = var_70[1].item;
 
-    rv = DERImg4DecodeFindProperty(&manb, E000000000000000 | type, ASN1_CONSTR_SET, var_70);
+    rv = Img4IndexFindDictionary(index, E000000000000000 | type, &objp, &props);
     if (rv) {
         return rv;
     }
-    objp = var_70[1].item;
 
     rv = Img4DecodeEvaluateDictionaryProperties(&manp, DictMANP, cb, ctx);
     if (rv) {
@@ -1586,13 +1858,67 @@ walkman(const TheImg4Manifest *m, unsigned int type, int (*cb)(DERTag tag, DERIt
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #ifdef USE_CORECRYPTO
 #include <corecrypto/ccaes.h>
 #elif !defined(USE_COMMONCRYPTO)
 #include <openssl/aes.h>
 #endif
-#include "libvfs/vfs.h"
-#include "libvfs/vfs_internal.h"
+#include "sha_mb.h"
+
+/* digests of what reassemble() gives back, valid until the handle is modified */
+struct img4_digests {
+    DERSize payloadLength;
+    DERSize manifestLength;
+    bool payloadHashed;
+    bool payloadHashed384;
+    bool manifestHashed;
+    bool thesetHashed;
+    DERByte payload[20];
+    DERByte payload384[48];
+    DERByte manifest[20];
+    DERByte theset[20];
+};
+
+/*
+ * a sidecar record: where things are in the image, and what parsing it
+ * found.  bump IMG4_META_VERSION whenever the meaning of a field changes;
+ * the size check catches layout changes (and other builds) for free
+ */
+#define IMG4_META_MAGIC         0x494d3443	/* 'I4MC' */
+#define IMG4_META_VERSION       1
+
+#define META_IMG4       (1 << 0)	/* payload came wrapped in an IMG4 */
+#define META_NONCE      (1 << 1)
+#define META_VERIFIED   (1 << 2)	/* the hash check passed, or there was nothing to check */
+#define META_COMPINFO   (1 << 3)	/* deco and usize came from the payload */
+
+struct img4_meta {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t flags;
+    /* identity of the file described */
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t fsize;
+    int64_t mtime;
+    int64_t mtime_ns;
+    /* layout, as offsets into the first 'total' bytes of it */
+    uint64_t total;
+    uint64_t payload, payload_len;
+    uint64_t keybag, keybag_len;
+    uint64_t version_off, version_len;
+    uint64_t manifest, manifest_len;
+    uint64_t usize;
+    uint64_t nonce;
+    uint32_t type;
+    uint32_t deco;
+    struct img4_digests digests;
+    uint32_t check;             /* of everything above */
+};
 
 struct file_ops_img4 {
     struct file_ops ops;
@@ -1610,6 +1936,12 @@ struct file_ops_img4 {
     int uphash;
     int lzfse;
     int dirty;
+    struct vfs_arena *arena;
+    int ownarena;
+    const Img4ManifestIndex *index;
+    struct img4_digests digests;
+    struct img4_meta *meta;     /* sidecar record, refreshed at close if more got hashed */
+    const char *metapath;
 };
 
 const DERItemSpec nonceItemSpecs[2] = {
@@ -1617,18 +1949,63 @@ const DERItemSpec nonceItemSpecs[2] = {
     { 1 * sizeof(DERItem), ASN1_OCTET_STRING,                           0 }                     // nonce
 };
 
+static const Img4ManifestIndex *index_manifest(struct vfs_arena *arena, const DERItem *manifest);
+static void meta_refresh(struct file_ops_img4 *fd);
+
+static void
+forget_digests(struct file_ops_img4 *fd)
+{
+    memset(&fd->digests, 0, sizeof(fd->digests));
+}
+
+static void
+remember_digests(struct file_ops_img4 *fd, const TheImg4 *img4)
+{
+    struct img4_digests *d = &fd->digests;
+    d->payloadLength = img4->payloadRaw.length;
+    d->manifestLength = img4->manifestRaw.length;
+    d->payloadHashed = img4->payloadHashed;
+    d->payloadHashed384 = img4->payloadHashed384;
+    d->manifestHashed = img4->manifestHashed;
+    d->thesetHashed = img4->thesetHashed;
+    memcpy(d->payload, img4->payload.full_digest, sizeof(d->payload));
+    memcpy(d->payload384, img4->payload.full_digest384, sizeof(d->payload384));
+    memcpy(d->manifest, img4->manifest.full_digest, sizeof(d->manifest));
+    memcpy(d->theset, img4->manifest.theset_digest, sizeof(d->theset));
+}
+
+static void
+recall_digests(const struct file_ops_img4 *fd, TheImg4 *img4)
+{
+    const struct img4_digests *d = &fd->digests;
+    /* reassembling drops what we do not keep (ep_info), which shows in the length */
+    if (d->payloadLength == img4->payloadRaw.length) {
+        img4->payloadHashed = d->payloadHashed;
+        img4->payloadHashed384 = d->payloadHashed384;
+        memcpy(img4->payload.full_digest, d->payload, sizeof(d->payload));
+        memcpy(img4->payload.full_digest384, d->payload384, sizeof(d->payload384));
+    }
+    if (d->manifestLength == img4->manifestRaw.length) {
+        img4->manifestHashed = d->manifestHashed;
+        img4->thesetHashed = d->thesetHashed;
+        memcpy(img4->manifest.full_digest, d->manifest, sizeof(d->manifest));
+        memcpy(img4->manifest.theset_digest, d->theset, sizeof(d->theset));
+    }
+}
+
 static TheImg4 *
-parse(unsigned char *data, unsigned length)
+parse(struct vfs_arena *arena, unsigned char *data, size_t length)
 {
     int rv;
     TheImg4 *img4;
 
-    img4 = malloc(sizeof(TheImg4));
+    img4 = vfs_arena_alloc(arena, sizeof(TheImg4));
     if (!img4) {
         return NULL;
     }
     memset(img4, 0, sizeof(TheImg4));
 
+    TRACE_BEGIN(t);
     rv = Img4DecodeInit(data, length, img4);
     if (rv) {
         DERItem item;
@@ -1636,21 +2013,20 @@ parse(unsigned char *data, unsigned length)
         item.length = length;
         rv = DERImg4DecodePayload(&item, &img4->payload);
     }
-    if (rv) {
-        free(img4);
-        return NULL;
+    if (rv == 0) {
+        img4->index = index_manifest(arena, &img4->manifestRaw);
     }
-
-    return img4;
+    TRACE_END(t, "parse");
+    return rv ? NULL : img4;
 }
 
 static int
-derdup(DERItem *dst, DERItem *src)
+derdup(struct vfs_arena *arena, DERItem *dst, DERItem *src)
 {
     void *ptr = NULL;
     DERSize length = src->length;
     if (length && src->data) {
-        ptr = malloc(length);
+        ptr = vfs_arena_alloc(arena, length);
         if (!ptr) {
             return -1;
         }
@@ -1661,22 +2037,234 @@ derdup(DERItem *dst, DERItem *src)
     return 0;
 }
 
+static int
+report_property(const Img4IndexEntry *obj, const Img4IndexEntry *e, img4_prop_cb cb, void *arg)
+{
+    int rv;
+    DERMonster var_40[2];
+    bool b;
+    uint64_t u;
+
+    rv = DERImg4DecodeProperty(&e->item, e->tag, var_40);
+    if (rv) {
+        return rv;
+    }
+    switch (var_40[1].tag) {
+        case ASN1_BOOLEAN:
+            rv = DERParseBoolean(&var_40[1].item, &b);
+            if (rv == 0) {
+                rv = cb(arg, (unsigned)obj->tag, (unsigned)e->tag, IMG4_PROP_BOOL, &b, sizeof(b));
+            }
+            break;
+        case ASN1_INTEGER:
+            rv = DERParseInteger64(&var_40[1].item, &u);
+            if (rv == 0) {
+                rv = cb(arg, (unsigned)obj->tag, (unsigned)e->tag, IMG4_PROP_INT, &u, sizeof(u));
+            }
+            break;
+        case ASN1_OCTET_STRING:
+            rv = cb(arg, (unsigned)obj->tag, (unsigned)e->tag, IMG4_PROP_DATA, var_40[1].item.data, var_40[1].item.length);
+            break;
+        default:
+            rv = DR_UnexpectedTag;
+    }
+    return rv;
+}
+
+static int
+query_properties(const Img4ManifestIndex *index, unsigned type, const char *props, int objects, img4_prop_cb cb, void *arg)
+{
+    int rv;
+    unsigned i, j, pos, found = 0;
+    bool all = (!props || !strcmp(props, "*"));
+
+    for (i = 0; i < index->objects.count; i++) {
+        const Img4IndexEntry *obj = &index->objects.entries[i];
+        const Img4Index *p = &index->props[i];
+        if (!objects && (unsigned)obj->tag != 'MANP' && (unsigned)obj->tag != type) {
+            continue;
+        }
+        if (Img4IndexFind(&index->objects, obj->tag, &pos) || pos != i) {
+            continue; /* shadowed */
+        }
+        if (all) {
+            for (j = 0; j < p->count; j++) {
+                if (Img4IndexFind(p, p->entries[j].tag, &pos) || pos != j) {
+                    continue;
+                }
+                rv = report_property(obj, &p->entries[j], cb, arg);
+                if (rv) {
+                    return rv;
+                }
+                found++;
+            }
+            continue;
+        }
+        for (j = 0; props[j]; ) {
+            unsigned fourcc = 0;
+            for (; props[j] && props[j] != ','; j++) {
+                fourcc = (fourcc << 8) | (unsigned char)props[j];
+            }
+            if (props[j]) {
+                j++;
+            }
+            if (!fourcc || Img4IndexFind(p, E000000000000000 | fourcc, &pos)) {
+                continue;
+            }
+            rv = report_property(obj, &p->entries[pos], cb, arg);
+            if (rv) {
+                return rv;
+            }
+            found++;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+static int
+index_items(struct vfs_arena *arena, const DERItem *set, Img4Index *index, bool objects)
+{
+    int rv;
+    unsigned i, n, size;
+    DERSequence seq;
+    DERDecodedInfo elt;
+    DERMonster prop[2];
+
+    rv = DERDecodeSeqContentInit(set, &seq);
+    if (rv) {
+        return rv;
+    }
+    for (n = 0; (rv = DERDecodeSeqNext(&seq, &elt)) == 0; n++) {
+        continue;
+    }
+    if (rv != DR_EndOfSequence) {
+        return rv;
+    }
+
+    for (size = 1; size < 2 * n; size *= 2) {
+        continue;
+    }
+    index->entries = vfs_arena_alloc(arena, n * sizeof(Img4IndexEntry));
+    index->slots = vfs_arena_alloc(arena, size * sizeof(unsigned));
+    if (!index->entries || !index->slots) {
+        return -1;
+    }
+    memset(index->slots, 0, size * sizeof(unsigned));
+    index->count = n;
+    index->mask = size - 1;
+
+    DERDecodeSeqContentInit(set, &seq);
+    for (n = 0; n < index->count; n++) {
+        Img4IndexEntry *e = &index->entries[n];
+        DERDecodeSeqNext(&seq, &elt);
+        e->tag = elt.tag;
+        e->item = elt.content;
+        if (objects) {
+            rv = DERImg4DecodeProperty(&elt.content, elt.tag, prop);
+            if (rv) {
+                return rv;
+            }
+            if (prop[1].tag != ASN1_CONSTR_SET) {
+                return DR_UnexpectedTag;
+            }
+            e->item = prop[1].item;
+        }
+        /* first one wins, like a linear search would */
+        for (i = Img4IndexHash(e->tag) & index->mask; index->slots[i]; i = (i + 1) & index->mask) {
+            if (index->entries[index->slots[i] - 1].tag == e->tag) {
+                break;
+            }
+        }
+        if (!index->slots[i]) {
+            index->slots[i] = n + 1;
+        }
+    }
+    return 0;
+}
+
+static const Img4ManifestIndex *
+index_manifest(struct vfs_arena *arena, const DERItem *manifest)
+{
+    int rv;
+    unsigned i;
+    TheImg4Manifest m;
+    DERDecodedInfo set;
+    DERMonster manb[2];
+    Img4ManifestIndex *index;
+
+    if (!manifest->data || !manifest->length) {
+        return NULL;
+    }
+    rv = DERImg4DecodeManifest(manifest, &m);
+    if (rv) {
+        return NULL;
+    }
+    rv = DERDecodeItem(&m.theset, &set);
+    if (rv || set.tag != ASN1_CONSTR_SET) {
+        return NULL;
+    }
+    rv = DERImg4DecodeFindProperty(&set.content, E000000000000000 | 'MANB', ASN1_CONSTR_SET, manb);
+    if (rv) {
+        return NULL;
+    }
+
+    index = vfs_arena_alloc(arena, sizeof(Img4ManifestIndex));
+    if (!index) {
+        return NULL;
+    }
+    index->manb = manb[1].item;
+    rv = index_items(arena, &index->manb, &index->objects, true);
+    if (rv) {
+        return NULL;
+    }
+    index->props = vfs_arena_alloc(arena, index->objects.count * sizeof(Img4Index));
+    if (!index->props) {
+        return NULL;
+    }
+    for (i = 0; i < index->objects.count; i++) {
+        rv = index_items(arena, &index->objects.entries[i].item, &index->props[i], false);
+        if (rv) {
+            return NULL;
+        }
+    }
+    return index;
+}
+
+/* DER buffers come from the arena if there is one, from the allocator otherwise */
+
+static void *
+dalloc(const struct vfs_allocator *a, struct vfs_arena *arena, size_t size)
+{
+    if (arena) {
+        return vfs_arena_alloc(arena, size);
+    }
+    return a->realloc(NULL, size);
+}
+
+static void
+dfree(const struct vfs_allocator *a, struct vfs_arena *arena, void *ptr)
+{
+    if (!arena) {
+        a->free(ptr);
+    }
+}
+
 static DERReturn
-aDEREncodeItem(DERItem *item, DERTag tag, DERSize length, DERByte *src, bool freeOld)
+aDEREncodeItem(const struct vfs_allocator *a, struct vfs_arena *arena, DERItem *item, DERTag tag, DERSize length, DERByte *src, bool freeOld)
 {
     DERReturn rv;
     DERByte *old = freeOld ? src : NULL;
     DERSize inOutLen = DER_MAX_ENCODED_SIZE(length);
-    DERByte *der = malloc(inOutLen);
+    DERByte *der = dalloc(a, arena, inOutLen);
     if (!der) {
-        free(old);
+        dfree(a, arena, old);
         return -1;
     }
 
     rv = DEREncodeItem(tag, length, src, der, &inOutLen);
-    free(old);
+    dfree(a, arena, old);
     if (rv) {
-        free(der);
+        dfree(a, arena, der);
         return rv;
     }
 
@@ -1686,7 +2274,7 @@ aDEREncodeItem(DERItem *item, DERTag tag, DERSize length, DERByte *src, bool fre
 }
 
 static DERReturn
-aDEREncodeSequence(DERItem *where, DERTag topTag, const void *src, DERShort numItems, const DERItemSpec *itemSpecs, int freeElt)
+aDEREncodeSequence(const struct vfs_allocator *a, struct vfs_arena *arena, DERItem *where, DERTag topTag, const void *src, DERShort numItems, const DERItemSpec *itemSpecs, int freeElt)
 {
     int i;
     DERReturn rv;
@@ -1702,16 +2290,16 @@ aDEREncodeSequence(DERItem *where, DERTag topTag, const void *src, DERShort numI
             old = item->data;
         }
     }
-    der = malloc(inOutLen);
+    der = dalloc(a, arena, inOutLen);
     if (!der) {
-        free(old);
+        dfree(a, arena, old);
         return -1;
     }
 
     rv = DEREncodeSequence(topTag, src, numItems, itemSpecs, der, &inOutLen);
-    free(old);
+    dfree(a, arena, old);
     if (rv) {
-        free(der);
+        dfree(a, arena, der);
         return rv;
     }
 
@@ -1721,7 +2309,7 @@ aDEREncodeSequence(DERItem *where, DERTag topTag, const void *src, DERShort numI
 }
 
 static int
-makeKeybag(DERItem *where, const DERByte *a, const DERByte *b)
+makeKeybag(struct vfs_arena *arena, DERItem *where, const DERByte *a, const DERByte *b)
 {
     const DERItemSpec wrap[2] = {
         { 0 * sizeof(DERItem), ASN1_CONSTR_SEQUENCE,                        DER_ENC_WRITE_DER },
@@ -1739,7 +2327,7 @@ makeKeybag(DERItem *where, const DERByte *a, const DERByte *b)
     elements[1].length = 16;
     elements[2].data = (DERByte *)a + 16;
     elements[2].length = 32;
-    rv = aDEREncodeSequence(&first, ASN1_CONSTR_SEQUENCE, elements, 3, kbagSpecs, -1);
+    rv = aDEREncodeSequence(NULL, arena, &first, ASN1_CONSTR_SEQUENCE, elements, 3, kbagSpecs, -1);
     if (rv) {
         return rv;
     }
@@ -1750,9 +2338,8 @@ makeKeybag(DERItem *where, const DERByte *a, const DERByte *b)
     elements[1].length = 16;
     elements[2].data = (DERByte *)b + 16;
     elements[2].length = 32;
-    rv = aDEREncodeSequence(&second, ASN1_CONSTR_SEQUENCE, elements, 3, kbagSpecs, -1);
+    rv = aDEREncodeSequence(NULL, arena, &second, ASN1_CONSTR_SEQUENCE, elements, 3, kbagSpecs, -1);
     if (rv) {
-        free(first.data);
         return rv;
     }
 
@@ -1760,15 +2347,11 @@ makeKeybag(DERItem *where, const DERByte *a, const DERByte *b)
     elements[0].length = first.length;
     elements[1].data = second.data;
     elements[1].length = second.length;
-    rv = aDEREncodeSequence(where, ASN1_CONSTR_SEQUENCE, elements, 2, wrap, -1);
-    free(first.data);
-    free(second.data);
-
-    return rv;
+    return aDEREncodeSequence(NULL, arena, where, ASN1_CONSTR_SEQUENCE, elements, 2, wrap, -1);
 }
 
 static int
-makePayload(DERItem *where, unsigned type, DERItem *version, DERItem *keybag, DERItem *compr, DERItem *ep_info, unsigned char *data, size_t size)
+makePayload(const struct vfs_allocator *alloc, DERItem *where, unsigned type, DERItem *version, DERItem *keybag, DERItem *compr, DERItem *ep_info, unsigned char *data, size_t size)
 {
     char IM4P[] = "IM4P";
     DERByte tmp[4];
@@ -1798,11 +2381,11 @@ makePayload(DERItem *where, unsigned type, DERItem *version, DERItem *keybag, DE
         elements[n++] = *ep_info;
     }
 #endif
-    return aDEREncodeSequence(where, ASN1_CONSTR_SEQUENCE, elements, n, DERImg4PayloadItemSpecs, -1);
+    return aDEREncodeSequence(alloc, NULL, where, ASN1_CONSTR_SEQUENCE, elements, n, DERImg4PayloadItemSpecs, -1);
 }
 
 static int
-makeRestoreInfo(DERItem *where, uint64_t nonce)
+makeRestoreInfo(struct vfs_arena *arena, DERItem *where, uint64_t nonce)
 {
     int rv;
     char IM4R[] = "IM4R";
@@ -1820,12 +2403,12 @@ makeRestoreInfo(DERItem *where, uint64_t nonce)
     elements[1].data = tmp;
     elements[1].length = 8;
 
-    rv = aDEREncodeSequence(&item, ASN1_CONSTR_SEQUENCE, elements, 2, nonceItemSpecs, -1);
+    rv = aDEREncodeSequence(NULL, arena, &item, ASN1_CONSTR_SEQUENCE, elements, 2, nonceItemSpecs, -1);
     if (rv) {
         return rv;
     }
 
-    rv = aDEREncodeItem(restoreInfo + 1, ASN1_CONSTRUCTED | ASN1_PRIVATE | 'BNCN', item.length, item.data, true);
+    rv = aDEREncodeItem(NULL, arena, restoreInfo + 1, ASN1_CONSTRUCTED | ASN1_PRIVATE | 'BNCN', item.length, item.data, true);
     if (rv) {
         return rv;
     }
@@ -1833,11 +2416,11 @@ makeRestoreInfo(DERItem *where, uint64_t nonce)
     restoreInfo[0].data = (DERByte *)IM4R;
     restoreInfo[0].length = sizeof(IM4R) - 1;
 
-    return aDEREncodeSequence(where, ASN1_CONSTR_SEQUENCE, restoreInfo, 2, DERImg4RestoreInfoItemSpecs, 1);
+    return aDEREncodeSequence(NULL, arena, where, ASN1_CONSTR_SEQUENCE, restoreInfo, 2, DERImg4RestoreInfoItemSpecs, 1);
 }
 
 static int
-makeCompression(DERItem *where, uint32_t deco, size_t size)
+makeCompression(struct vfs_arena *arena, DERItem *where, uint32_t deco, size_t size)
 {
     unsigned char *p;
     unsigned char dbytes[5];
@@ -1863,11 +2446,11 @@ makeCompression(DERItem *where, uint32_t deco, size_t size)
     elements[1].length = sbytes + sizeof(sbytes) - p;
 
     /* XXX ugly hack: reuse DERRSAPubKeyPKCS1ItemSpecs */
-    return aDEREncodeSequence(where, ASN1_CONSTR_SEQUENCE, elements, 2, DERRSAPubKeyPKCS1ItemSpecs, -1);
+    return aDEREncodeSequence(NULL, arena, where, ASN1_CONSTR_SEQUENCE, elements, 2, DERRSAPubKeyPKCS1ItemSpecs, -1);
 }
 
 static int
-reassemble(struct file_ops_img4 *fd, DERItem *out)
+doreassemble(struct file_ops_img4 *fd, DERItem *out)
 {
     int rv;
     void *data;
@@ -1876,6 +2459,7 @@ reassemble(struct file_ops_img4 *fd, DERItem *out)
     DERItem compr = { NULL, 0 };
     char IMG4[] = "IMG4";
     FHANDLE pfd = fd->pfd;
+    const struct vfs_allocator *alloc = fd->ops.alloc;
 
     rv = pfd->ioctl(pfd, IOCTL_MEM_GET_BACKING, &data, &size);
     if (rv) {
@@ -1884,13 +2468,12 @@ reassemble(struct file_ops_img4 *fd, DERItem *out)
     if (fd->lzfse) {
         uint64_t usize = fd->usize;
         pfd->ioctl(pfd, IOCTL_LZFSE_GET_LENGTH, &usize);
-        rv = makeCompression(&compr, fd->lzfse, usize);
+        rv = makeCompression(fd->arena, &compr, fd->lzfse, usize);
         if (rv) {
             return rv;
         }
     }
-    rv = makePayload(&items[1], fd->type, &fd->version, &fd->keybag, &compr, &fd->ep_info, data, size);
-    free(compr.data);
+    rv = makePayload(alloc, &items[1], fd->type, &fd->version, &fd->keybag, &compr, &fd->ep_info, data, size);
     if (rv) {
         return rv;
     }
@@ -1900,22 +2483,35 @@ reassemble(struct file_ops_img4 *fd, DERItem *out)
         int n = 3;
         items[2] = fd->manifest;
         if (fd->hasnonce) {
-            rv = makeRestoreInfo(&items[3], fd->nonce);
+            rv = makeRestoreInfo(fd->arena, &items[3], fd->nonce);
             if (rv) {
-                free(items[1].data);
+                alloc->free(items[1].data);
                 return rv;
             }
             n++;
         }
-        rv = aDEREncodeSequence(out, ASN1_CONSTR_SEQUENCE, items, n, DERImg4ItemSpecs, 3);
-        free(items[1].data);
+        rv = aDEREncodeSequence(alloc, NULL, out, ASN1_CONSTR_SEQUENCE, items, n, DERImg4ItemSpecs, -1);
+        alloc->free(items[1].data);
     } else if (fd->wasimg4) {
-        rv = aDEREncodeSequence(out, ASN1_CONSTR_SEQUENCE, items, 2, DERImg4ItemSpecs, 1);
+        rv = aDEREncodeSequence(alloc, NULL, out, ASN1_CONSTR_SEQUENCE, items, 2, DERImg4ItemSpecs, 1);
     } else {
         *out = items[1];
     }
     if (rv) {
-        free(out->data);
+        alloc->free(out->data);
+    }
+    return rv;
+}
+
+static int
+reassemble(struct file_ops_img4 *fd, DERItem *out)
+{
+    int rv;
+    TRACE_BEGIN(t);
+    rv = doreassemble(fd, out);
+    TRACE_END(t, "reassemble");
+    if (rv == 0 && fd->ops.stats) {
+        vfs_stats_scratch(&fd->ops, out->length);
     }
     return rv;
 }
@@ -1934,7 +2530,7 @@ getint(const char *s, size_t len, unsigned long long def)
 }
 
 static void
-parseargs(ContextH *ctxh, const char *s)
+parseargs(ContextH *ctxh, const char *s, int verbose)
 {
     do {
         size_t index = strcspn(s, " \t,\r\n");
@@ -1943,7 +2539,7 @@ parseargs(ContextH *ctxh, const char *s)
             if (p && p - s == 4) {
                 size_t vallen = s + index - ++p;
                 switch (GET_DWORD_BE(s, 0)) {
-#define CASE(fourcc, field) case fourcc: ctxh->field = getint(p, vallen, ctxh->field); printf(#field " = 0x%llx\n", (unsigned long long)ctxh->field); break
+#define CASE(fourcc, field) case fourcc: ctxh->field = getint(p, vallen, ctxh->field); if (verbose) printf("%.4s = 0x%llx\n", s, (unsigned long long)ctxh->field); break
                     CASE('BORD', BORD);
                     CASE('CHIP', CHIP);
                     CASE('ECID', ECID);
@@ -1951,6 +2547,7 @@ parseargs(ContextH *ctxh, const char *s)
                     CASE('CSEC', CSEC);
                     CASE('SDOM', SDOM);
                     CASE('SEPO', SEPO);
+                    CASE('BNCN', field_30);
 #undef CASE
                 }
             }
@@ -1960,80 +2557,94 @@ parseargs(ContextH *ctxh, const char *s)
     } while (*s);
 }
 
+static void
+hardware_defaults(ContextH *ctxh)
+{
+    memset(ctxh, 0, sizeof(ContextH));
+    ctxh->BORD = 0x12;
+    ctxh->CHIP = 0x8960;
+    ctxh->ECID = 0;
+    ctxh->CPRO = 1;
+    ctxh->CSEC = 1;
+    ctxh->SDOM = 1;
+    ctxh->SEPO = 1;
+}
+
+static void
+hardware_nonce(ContextH *ctxh, const TheImg4 *img4)
+{
+    ctxh->field_2A = 1; /* use Img4DecodeGetRestoreInfoData() */
+    ctxh->field_2C = 1;
+    if (img4->restoreInfo.nonce.data == NULL) {
+        ctxh->field_2A = 0; /* use field_30 */
+        if (!ctxh->field_30) {
+            ctxh->field_2C = 0; /* field_30 was not set, skip */
+        }
+    }
+}
+
 static int
-validate(TheImg4 *img4, unsigned type, const char *args)
+validate(struct vfs_arena *arena, TheImg4 *img4, unsigned type, const char *args)
 {
     int rv;
     CTX ctx;
 
     ctx.img4 = img4;
-    ctx.hardware = malloc(sizeof(ContextH));
+    ctx.hardware = vfs_arena_alloc(arena, sizeof(ContextH));
     assert(ctx.hardware);
-    memset(ctx.hardware, 0, sizeof(ContextH));
-
-    ctx.hardware->BORD = 0x12;
-    ctx.hardware->CHIP = 0x8960;
-    ctx.hardware->ECID = 0;
-    ctx.hardware->CPRO = 1;
-    ctx.hardware->CSEC = 1;
-    ctx.hardware->SDOM = 1;
-    ctx.hardware->SEPO = 1;
-    parseargs(ctx.hardware, args);
-
-    ctx.hardware->field_2A = 1; /* use Img4DecodeGetRestoreInfoData() */
-    ctx.hardware->field_2C = 1;
-    if (img4->restoreInfo.nonce.data == NULL) {
-        ctx.hardware->field_2A = 0; /* use field_30 */
-        if (!ctx.hardware->field_30) {
-            ctx.hardware->field_2C = 0; /* field_30 was not set, skip */
-        }
-    }
+    hardware_defaults(ctx.hardware);
+    parseargs(ctx.hardware, args, 1);
+    hardware_nonce(ctx.hardware, img4);
 
-    ctx.unknown = malloc(sizeof(ContextU));
+    ctx.unknown = vfs_arena_alloc(arena, sizeof(ContextU));
     assert(ctx.unknown);
     memset(ctx.unknown, 0, sizeof(ContextU));
     rv = Img4DecodeManifestExists(img4, &ctx.unknown->has_manifest);
     if (rv == 0) {
         rv = Img4DecodeEvaluateTrust(type, img4, image4_validate_property_callback, &ctx);
     }
-    free(ctx.unknown);
-    free(ctx.hardware);
     return rv;
 }
 
-static int
-dovalidate(struct file_ops_img4 *fd, const char *args)
+/* parse the image as it stands now, in fd->arena; out is freed by the caller */
+static TheImg4 *
+parse_current(struct file_ops_img4 *fd, DERItem *out)
 {
-    int rv;
-    DERItem out;
     TheImg4 *img4;
     FHANDLE pfd = fd->pfd;
 
-    rv = pfd->fsync(pfd);
-    if (rv) {
-        return -1;
+    if (pfd->fsync(pfd) || reassemble(fd, out)) {
+        return NULL;
     }
-
-    rv = reassemble(fd, &out);
-    if (rv) {
-        return rv;
+    img4 = parse(fd->arena, out->data, out->length);
+    if (!img4) {
+        fd->ops.alloc->free(out->data);
+        return NULL;
     }
+    recall_digests(fd, img4);
+    return img4;
+}
+
+static int
+dovalidate(struct file_ops_img4 *fd, const char *args)
+{
+    int rv;
+    DERItem out;
+    TheImg4 *img4;
+    struct vfs_arena_mark mark;
 
-    img4 = parse(out.data, out.length);
+    vfs_arena_mark(fd->arena, &mark);
+    img4 = parse_current(fd, &out);
     if (!img4) {
-        free(out.data);
+        vfs_arena_release(fd->arena, &mark);
         return -1;
     }
 
-    rv = validate(img4, fd->type, args);
-#if !defined(USE_CORECRYPTO) && !defined(USE_COMMONCRYPTO)
-    EVP_cleanup();
-    ERR_remove_state(0);
-    CRYPTO_cleanup_all_ex_data();
-#endif
+    rv = validate(fd->arena, img4, fd->type, args);
+    remember_digests(fd, img4);
 
-    free(img4);
-    free(out.data);
+    fd->ops.alloc->free(out.data);
+    vfs_arena_release(fd->arena, &mark);
     return rv;
 }
 
@@ -2046,6 +2657,7 @@ img4_fsync(FHANDLE fd_)
     size_t size;
     FHANDLE pfd;
     FHANDLE other;
+    struct vfs_arena_mark mark;
 
     if (!fd) {
         return -1;
@@ -2064,31 +2676,36 @@ img4_fsync(FHANDLE fd_)
         goto next;
     }
 
+    vfs_arena_mark(fd->arena, &mark);
     rv = reassemble(fd, &out);
     if (rv) {
+        vfs_arena_release(fd->arena, &mark);
         return rv;
     }
 
     if (fd->uphash && fd->manifest.data) {
-        DERMonster tmp;
-        TheImg4 *img4 = parse(out.data, out.length);
-        if (!img4) {
-            free(out.data);
-            return -1;
+        HashContext tmp;
+        TheImg4 *img4 = parse(fd->arena, out.data, out.length);
+        rv = -1;
+        if (img4) {
+            recall_digests(fd, img4);
+            tmp.img4 = img4;
+            tmp.update = true;
+            rv = walkman(img4->index, fd->type, hash_property_callback, &tmp);
+            /* the new DGST only goes to disk, fd->manifest is left as it was */
+            remember_digests(fd, img4);
         }
-        tmp.item = img4->payloadRaw;
-        tmp.tag = 1; // XXX abuse: tell hash_property_callback to write
-        rv = walkman(&img4->manifest, fd->type, hash_property_callback, &tmp);
-        free(img4);
         if (rv) {
-            free(out.data);
+            fd->ops.alloc->free(out.data);
+            vfs_arena_release(fd->arena, &mark);
             return -1;
         }
     }
+    vfs_arena_release(fd->arena, &mark);
 
     other->lseek(other, 0, SEEK_SET);
     size = other->write(other, out.data, out.length);
-    free(out.data);
+    fd->ops.alloc->free(out.data);
     if (size != out.length) {
         return -1;
     }
@@ -2112,10 +2729,12 @@ img4_close(FHANDLE fd)
     pfd = ctx->pfd;
     other = ctx->other;
     rv = fd->fsync(fd);
-    free(ctx->manifest.data);
-    free(ctx->keybag.data);
-    free(ctx->version.data);
-    free(fd);
+    if (ctx->meta) {
+        meta_refresh(ctx);
+    }
+    if (ctx->ownarena) {
+        vfs_arena_destroy(ctx->arena);	/* ctx lives in there */
+    }
     rc = pfd->close(pfd);
     rc = other->close(other); /* XXX ugh?... which code to keep? */
     return rv ? rv : rc;
@@ -2138,9 +2757,31 @@ img4_write(FHANDLE fd_, const void *buf, size_t count)
     if (!fd) {
         return -1;
     }
+    forget_digests(fd);
     return fd->pfd->write(fd->pfd, buf, count);
 }
 
+static ssize_t
+img4_pread(FHANDLE fd_, void *buf, size_t count, off_t offset)
+{
+    struct file_ops_img4 *fd = (struct file_ops_img4 *)fd_;
+    if (!fd) {
+        return -1;
+    }
+    return fd->pfd->pread(fd->pfd, buf, count, offset);
+}
+
+static ssize_t
+img4_pwrite(FHANDLE fd_, const void *buf, size_t count, off_t offset)
+{
+    struct file_ops_img4 *fd = (struct file_ops_img4 *)fd_;
+    if (!fd) {
+        return -1;
+    }
+    forget_digests(fd);
+    return fd->pfd->pwrite(fd->pfd, buf, count, offset);
+}
+
 static off_t
 img4_lseek(FHANDLE fd_, off_t offset, int whence)
 {
@@ -2169,6 +2810,19 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
             rv = dovalidate(ctx, param);
             break;
         }
+        case IOCTL_MEM_RESERVE: {
+            FHANDLE pfd = ctx->pfd;
+            size_t capacity = va_arg(ap, size_t);
+            rv = pfd->ioctl(pfd, req, capacity);
+            break;
+        }
+        case IOCTL_IMG4_SNAPSHOT: {
+            FHANDLE other = va_arg(ap, FHANDLE);
+            FHANDLE *out = va_arg(ap, FHANDLE *);
+            *out = img4_clone(fd, other);
+            rv = *out ? 0 : -1;
+            break;
+        }
         case IOCTL_IMG4_GET_KEYBAG: {
             void **dst = va_arg(ap, void **);
             size_t *sz = va_arg(ap, size_t *);
@@ -2217,10 +2871,10 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
             if (!b) {
                 b = a;
             }
-            rv = makeKeybag(&item, a, b);
+            rv = makeKeybag(ctx->arena, &item, a, b);
             if (rv == 0) {
-                free(ctx->keybag.data);
                 ctx->keybag = item;
+                forget_digests(ctx);
             }
             break;
         }
@@ -2252,10 +2906,10 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
             }
             if (i == 2) {
                 DERItem knew;
-                rv = derdup(&knew, &kbag);
+                rv = derdup(ctx->arena, &knew, &kbag);
                 if (rv == 0) {
-                    free(ctx->keybag.data);
                     ctx->keybag = knew;
+                    forget_digests(ctx);
                 }
             }
             break;
@@ -2270,6 +2924,7 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
             unsigned type = va_arg(ap, unsigned);
             ctx->type = type;
             ctx->dirty = 1;
+            forget_digests(ctx);
             rv = 0;
             break;
         }
@@ -2284,19 +2939,19 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
         case IOCTL_IMG4_SET_MANIFEST: if (fd->flags == O_RDONLY) break; else {
             DERItem item;
             TheImg4Manifest tmp;
-            void *old = ctx->manifest.data;
             item.data = va_arg(ap, void *);
             item.length = va_arg(ap, size_t);
             rv = DERImg4DecodeManifest(&item, &tmp);
             if (rv) {
                 break;
             }
-            rv = derdup(&ctx->manifest, &item);
+            rv = derdup(ctx->arena, &ctx->manifest, &item);
             if (rv) {
                 break;
             }
-            free(old);
+            ctx->index = index_manifest(ctx->arena, &ctx->manifest);
             ctx->dirty = 1;
+            forget_digests(ctx);
             break;
         }
         case IOCTL_IMG4_GET_NONCE: {
@@ -2312,6 +2967,7 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
             ctx->nonce = va_arg(ap, uint64_t);
             ctx->hasnonce = 1;
             ctx->dirty = 1;
+            forget_digests(ctx);
             rv = 0;
             break;
         }
@@ -2325,15 +2981,14 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
         }
         case IOCTL_IMG4_SET_VERSION: if (fd->flags == O_RDONLY) break; else {
             DERItem item;
-            void *old = ctx->version.data;
             item.data = va_arg(ap, void *);
             item.length = va_arg(ap, size_t);
-            rv = derdup(&ctx->version, &item);
+            rv = derdup(ctx->arena, &ctx->version, &item);
             if (rv) {
                 break;
             }
-            free(old);
             ctx->dirty = 1;
+            forget_digests(ctx);
             break;
         }
         case IOCTL_IMG4_GET_EP_INFO: {
@@ -2346,39 +3001,49 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
         }
         case IOCTL_IMG4_SET_EP_INFO: if (fd->flags == O_RDONLY) break; else {
             DERItem item;
-            void *old = ctx->ep_info.data;
             item.data = va_arg(ap, void *);
             item.length = va_arg(ap, size_t);
-            rv = derdup(&ctx->ep_info, &item);
+            rv = derdup(ctx->arena, &ctx->ep_info, &item);
             if (rv) {
                 break;
             }
-            free(old);
             ctx->dirty = 1;
+            forget_digests(ctx);
             break;
         }
         case IOCTL_IMG4_QUERY_PROP: {
             const char *prop = va_arg(ap, char *);
             unsigned char *out = va_arg(ap, unsigned char *);
-            unsigned int *len = va_arg(ap, unsigned int *);
+            size_t *len = va_arg(ap, size_t *);
             unsigned int fourcc;
-            TheImg4Manifest m;
+            unsigned pos;
+            DictType what;
+            DERItem dict;
+            const Img4Index *props;
             DERMonster tmp;
             for (fourcc = 0; *prop; prop++) {
                 fourcc = (fourcc << 8) | *prop;
             }
-            if (!fourcc) {
+            if (!fourcc || !ctx->index) {
                 rv = -1;
                 break;
             }
-            rv = DERImg4DecodeManifest(&ctx->manifest, &m);
-            if (rv) {
-                break;
-            }
             tmp.item.data = out;
             tmp.item.length = *len;
             tmp.tag = fourcc;
-            rv = walkman(&m, ctx->type, query_property_callback, &tmp);
+            /* MANP first, then our object */
+            for (what = DictMANP; what <= DictOBJP && tmp.tag; what++) {
+                rv = Img4IndexFindDictionary(ctx->index, E000000000000000 | (what == DictMANP ? 'MANP' : ctx->type), &dict, &props);
+                if (rv) {
+                    break;
+                }
+                if (Img4IndexFind(props, E000000000000000 | fourcc, &pos) == 0) {
+                    rv = query_property_callback(props->entries[pos].tag, &props->entries[pos].item, what, &tmp);
+                    if (rv) {
+                        break;
+                    }
+                }
+            }
             if (rv) {
                 break;
             }
@@ -2389,13 +3054,24 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
             *len = tmp.item.length;
             break;
         }
+        case IOCTL_IMG4_QUERY_PROPS: {
+            const char *props = va_arg(ap, char *);
+            int objects = va_arg(ap, int);
+            img4_prop_cb cb = va_arg(ap, img4_prop_cb);
+            void *arg = va_arg(ap, void *);
+            if (!ctx->index || !cb) {
+                break;
+            }
+            rv = query_properties(ctx->index, ctx->type, props, objects, cb, arg);
+            break;
+        }
         case IOCTL_ENC_SET_NOENC: if (fd->flags == O_RDONLY) break; else {
             FHANDLE pfd = ctx->pfd;
             pfd->ioctl(pfd, req); /* may fail if enc is just a pass-through */
-            free(ctx->keybag.data);
             ctx->keybag.data = NULL;
             ctx->keybag.length = 0;
             ctx->dirty = 1;
+            forget_digests(ctx);
             rv = 0;
             break;
         }
@@ -2407,14 +3083,24 @@ img4_ioctl(FHANDLE fd, unsigned long req, ...)
                 if (rv == 0) {
                     ctx->lzfse = 0;
                     ctx->dirty = 1;
+                    forget_digests(ctx);
                 }
             }
             break;
         }
+        case IOCTL_VFS_GET_STATS: {
+            void *list = va_arg(ap, void *);
+            FHANDLE pfd = ctx->pfd;
+            FHANDLE other = ctx->other;
+            pfd->ioctl(pfd, req, list);
+            rv = other->ioctl(other, req, list);
+            break;
+        }
         default: {
             void *a = va_arg(ap, void *);
             void *b = va_arg(ap, void *);
             FHANDLE pfd = ctx->pfd;
+            forget_digests(ctx); /* data pointers handed out can be written to */
             rv = pfd->ioctl(pfd, req, a, b); /* XXX varargs */
         }
     }
@@ -2429,6 +3115,7 @@ img4_ftruncate(FHANDLE fd_, off_t length)
     if (!fd) {
         return -1;
     }
+    forget_digests(fd);
     return fd->pfd->ftruncate(fd->pfd, length);
 }
 
@@ -2442,23 +3129,206 @@ img4_length(FHANDLE fd_)
     return fd->pfd->length(fd->pfd);
 }
 
-FHANDLE
-img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
+static const char *meta_dir;
+
+void
+img4_meta_dir(const char *dir)
 {
-    int rv;
-    struct file_ops_img4 *ops, *ctx;
+    meta_dir = dir;
+}
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+static uint32_t
+meta_check(const struct img4_meta *meta)
+{
+    const unsigned char *p = (const unsigned char *)meta;
+    size_t i, n = offsetof(struct img4_meta, check);
+    uint32_t h = 2166136261u;
+    for (i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* fill in the identity of the file under other and where its record goes; -1 if it has none */
+static int
+meta_locate(FHANDLE other, char *path, size_t size, struct img4_meta *meta)
+{
+    struct stat st;
+    const char *name = NULL;
+    int n;
+
+    if (other->ioctl(other, IOCTL_FILE_GET_INFO, &st, &name) || !name || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    if (meta_dir) {
+        n = snprintf(path, size, "%s/%llx-%llx.img4meta", meta_dir, (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+    } else {
+        n = snprintf(path, size, "%s.img4meta", name);
+    }
+    if (n < 0 || (size_t)n >= size) {
+        return -1;
+    }
+    memset(meta, 0, sizeof(*meta));
+    meta->magic = IMG4_META_MAGIC;
+    meta->version = IMG4_META_VERSION;
+    meta->size = sizeof(*meta);
+    meta->dev = st.st_dev;
+    meta->ino = st.st_ino;
+    meta->fsize = st.st_size;
+    meta->mtime = st.st_mtime;
+    meta->mtime_ns = MTIME_NSEC(st);
+    return 0;
+}
+
+static int
+meta_same_file(const struct img4_meta *a, const struct img4_meta *b)
+{
+    return a->magic == b->magic && a->version == b->version && a->size == b->size &&
+           a->dev == b->dev && a->ino == b->ino && a->fsize == b->fsize &&
+           a->mtime == b->mtime && a->mtime_ns == b->mtime_ns;
+}
+
+static int
+meta_within(uint64_t off, uint64_t len, uint64_t total)
+{
+    return off <= total && len <= total - off;
+}
+
+/* meta holds the identity on entry, and the whole record if it returns 0 */
+static int
+meta_load(const char *path, struct img4_meta *meta)
+{
+    struct img4_meta tmp;
+    FILE *f;
+    size_t n;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        return -1;
+    }
+    n = fread(&tmp, 1, sizeof(tmp), f);
+    fclose(f);
+    if (n != sizeof(tmp) || !meta_same_file(&tmp, meta) || tmp.check != meta_check(&tmp)) {
+        return -1;
+    }
+    if (tmp.total > tmp.fsize ||
+        !meta_within(tmp.payload, tmp.payload_len, tmp.total) ||
+        !meta_within(tmp.keybag, tmp.keybag_len, tmp.total) ||
+        !meta_within(tmp.version_off, tmp.version_len, tmp.total) ||
+        !meta_within(tmp.manifest, tmp.manifest_len, tmp.total)) {
+        return -1;
+    }
+    *meta = tmp;
+    return 0;
+}
+
+/* best effort: a record that cannot be written is simply not there next time */
+static void
+meta_save(const char *path, struct img4_meta *meta)
+{
+    char tmp[4096];
+    FILE *f;
+    int n;
+
+    n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp)) {
+        return;
+    }
+    meta->check = meta_check(meta);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        return;
+    }
+    n = fwrite(meta, sizeof(*meta), 1, f);
+    if (fclose(f) || n != 1 || rename(tmp, path)) {
+        unlink(tmp);
+    }
+}
+
+static DERItem
+meta_item(const unsigned char *buf, uint64_t off, uint64_t len)
+{
+    DERItem item;
+    item.data = len ? (DERByte *)buf + off : NULL;
+    item.length = len;
+    return item;
+}
+
+static int
+digests_grew(const struct img4_digests *now, const struct img4_digests *then)
+{
+    if (now->payloadLength != then->payloadLength || now->manifestLength != then->manifestLength) {
+        return 0;
+    }
+    return (now->payloadHashed && !then->payloadHashed) ||
+           (now->payloadHashed384 && !then->payloadHashed384) ||
+           (now->manifestHashed && !then->manifestHashed) ||
+           (now->thesetHashed && !then->thesetHashed);
+}
+
+/* keep digests computed since the record was read, if the file is still the same one */
+static void
+meta_refresh(struct file_ops_img4 *fd)
+{
+    struct img4_meta now;
+    char path[4096];
+
+    if (!digests_grew(&fd->digests, &fd->meta->digests)) {
+        return;
+    }
+    if (meta_locate(fd->other, path, sizeof(path), &now) || !meta_same_file(&now, fd->meta) || strcmp(path, fd->metapath)) {
+        return;
+    }
+    fd->meta->digests = fd->digests;
+    meta_save(fd->metapath, fd->meta);
+}
+
+/* offset and length of an item that points into buf, or -1 if it does not */
+static int
+meta_span(const unsigned char *buf, size_t total, const DERItem *item, uint64_t *off, uint64_t *len)
+{
+    *off = 0;
+    *len = 0;
+    if (!item->data || !item->length) {
+        return 0;
+    }
+    if (item->data < buf || item->data > buf + total || item->length > (size_t)(buf + total - item->data)) {
+        return -1;
+    }
+    *off = item->data - buf;
+    *len = item->length;
+    return 0;
+}
+
+static FHANDLE
+doreopen(FHANDLE other, const unsigned char *ivkey, int flags, struct vfs_arena *arena)
+{
+    int rv;
+    struct file_ops_img4 *ops, *ctx;
     size_t n, total;
     unsigned char *buf;
-    TheImg4 *img4;
-    DERItem item;
+    TheImg4 *img4 = NULL;
+    DERItem item, payload, keybag, version, manifest;
     bool exists = false;
     FHANDLE pfd;
     unsigned char *dup;
-    unsigned type;
+    const struct vfs_allocator *alloc;
     uint32_t deco = 0;
     uint64_t usize = 0;
     DERByte *der;
     DERSize derlen;
+    struct vfs_arena *own = NULL;
+    struct vfs_arena_mark mark;
+    struct img4_meta meta;
+    char metapath[4096];
+    int usemeta = 0, cached = 0;
+    STATS_SINCE(since);
 
     if (!other) {
         return NULL;
@@ -2470,13 +3340,34 @@ img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
         goto closeit;
     }
 
+    if (!arena) {
+        arena = own = vfs_arena_create(0);
+        if (!arena) {
+            goto closeit;
+        }
+    }
+    vfs_arena_mark(arena, &mark);
+
     total = other->length(other);
     if ((ssize_t)total < 0) {
-        goto closeit;
+        goto freearena;
+    }
+
+    /* a writable handle rewrites the file on close, so its record would not outlive it */
+    memset(&meta, 0, sizeof(meta));
+    if ((flags & FLAG_IMG4_META_CACHE) && other->flags == O_RDONLY &&
+        meta_locate(other, metapath, sizeof(metapath), &meta) == 0 && meta.fsize == total) {
+        usemeta = 1;
+        cached = (meta_load(metapath, &meta) == 0);
+        if (cached && (flags & FLAG_IMG4_VERIFY_HASH) && !(meta.flags & META_VERIFIED)) {
+            cached = 0;
+        }
     }
-    buf = malloc(total);
+
+    alloc = ALLOCATOR(other);
+    buf = alloc->realloc(NULL, total);
     if (!buf) {
-        goto closeit;
+        goto freearena;
     }
 
     n = other->read(other, buf, total);
@@ -2484,7 +3375,12 @@ img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
         goto freebuf;
     }
 
-    if (other->flags == O_RDONLY) {
+    if (cached) {
+        if (total > meta.total) {
+            fprintf(stderr, "[w] extra %zu bytes discarded\n", total - (size_t)meta.total);
+            total = meta.total;
+        }
+    } else if (other->flags == O_RDONLY) {
         DERDecodedInfo seq;
         item.data = buf;
         item.length = total;
@@ -2497,46 +3393,102 @@ img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
         }
     }
 
-    img4 = parse(buf, total);
-    if (!img4) {
-        goto freebuf;
-    }
+    if (cached) {
+        payload = meta_item(buf, meta.payload, meta.payload_len);
+        keybag = meta_item(buf, meta.keybag, meta.keybag_len);
+        version = meta_item(buf, meta.version_off, meta.version_len);
+        manifest = meta_item(buf, meta.manifest, meta.manifest_len);
+    } else {
+        unsigned type;
 
-    rv = Img4DecodeGetPayload(img4, &item);
-    if (rv) {
-        fprintf(stderr, "[e] cannot extract payload\n");
-        goto freeimg;
-    }
-    rv = Img4DecodeGetPayloadType(img4, &type);
-    if (rv) {
-        fprintf(stderr, "[e] cannot identify\n");
-        goto freeimg;
-    }
+        img4 = parse(arena, buf, total);
+        if (!img4) {
+            goto freebuf;
+        }
 
-    if ((flags & FLAG_IMG4_VERIFY_HASH) && img4->manifestRaw.data) {
-        DERMonster tmp;
-        tmp.item = img4->payloadRaw;
-        tmp.tag = 0; // XXX abuse: tell hash_property_callback to read
-        rv = walkman(&img4->manifest, type, hash_property_callback, &tmp);
+        rv = Img4DecodeGetPayload(img4, &payload);
+        if (rv) {
+            fprintf(stderr, "[e] cannot extract payload\n");
+            goto freebuf;
+        }
+        rv = Img4DecodeGetPayloadType(img4, &type);
         if (rv) {
-            printf("[e] image fast check failed: %d\n", rv);
-            goto freeimg;
+            fprintf(stderr, "[e] cannot identify\n");
+            goto freebuf;
+        }
+
+        meta.flags = 0;
+        if ((flags & FLAG_IMG4_VERIFY_HASH) && img4->manifestRaw.data) {
+            HashContext tmp;
+            tmp.img4 = img4;
+            tmp.update = false;
+            rv = walkman(img4->index, type, hash_property_callback, &tmp);
+            if (rv) {
+                printf("[e] image fast check failed: %d\n", rv);
+                goto freebuf;
+            }
+        }
+        if ((flags & FLAG_IMG4_VERIFY_HASH) || !img4->manifestRaw.data) {
+            meta.flags |= META_VERIFIED;
+        }
+#ifdef iOS10
+        if (img4->payload.compression.data && img4->payload.compression.length) {
+            DERItem tmp[2];
+            uint32_t d = 0;
+            uint64_t u = 0;
+            if (DERParseSequenceContent(&img4->payload.compression, 2, DERRSAPubKeyPKCS1ItemSpecs, tmp, 0) ||
+                DERParseInteger(&tmp[0], &d) || DERParseInteger64(&tmp[1], &u)) {
+                if (!(flags & FLAG_IMG4_SKIP_DECOMPRESSION)) {
+                    fprintf(stderr, "[W] cannot get decompression info\n");
+                }
+            }
+            meta.flags |= META_COMPINFO;
+            meta.deco = d;
+            meta.usize = u;
+        }
+#endif
+        if (img4->payloadRaw.data) {
+            meta.flags |= META_IMG4;
+        }
+        if (img4->restoreInfo.nonce.data && img4->restoreInfo.nonce.length) {
+            rv = Img4DecodeGetRestoreInfoData(img4, 'BNCN', &der, &derlen);
+            if (rv == 0) {
+                meta.flags |= META_NONCE;
+                meta.nonce = GET_QWORD_BE(der, 0);
+            }
+        }
+        rv = Img4DecodeManifestExists(img4, &exists);
+        keybag = img4->payload.keybag;
+        version = img4->payload.version;
+        manifest = img4->manifestRaw;
+        if (rv || !exists) {
+            manifest.data = NULL;
+            manifest.length = 0;
+        }
+        meta.type = type;
+        meta.total = total;
+        if (meta_span(buf, total, &payload, &meta.payload, &meta.payload_len) ||
+            meta_span(buf, total, &keybag, &meta.keybag, &meta.keybag_len) ||
+            meta_span(buf, total, &version, &meta.version_off, &meta.version_len) ||
+            meta_span(buf, total, &manifest, &meta.manifest, &meta.manifest_len)) {
+            usemeta = 0;
         }
     }
 
-    dup = calloc(1, item.length);
+    dup = alloc->realloc(NULL, payload.length);
     if (!dup) {
-        goto freeimg;
+        goto freebuf;
     }
-    memcpy(dup, item.data, item.length);
+    memcpy(dup, payload.data, payload.length);
 
-    pfd = memory_open(other->flags, dup, item.length);
+    pfd = memory_openex(malloc(sizeof(struct file_ops_memory)), other->flags, dup, payload.length, alloc);
     if (!pfd) {
-        free(dup);
+        alloc->free(dup);
+    } else {
+        STATS_ATTACH(pfd, "memory", vfs_stats_now(), payload.length);
     }
     if (ivkey) {
-        rv = Img4DecodeGetPayloadKeybag(img4, &item);
-        if (rv || item.length == 0) {
+        if (keybag.length == 0) {
             fprintf(stderr, "[w] image has no keybag\n");
         } else {
             pfd = enc_reopen(pfd, ivkey, ivkey + 16);
@@ -2546,12 +3498,9 @@ img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
         goto okay;
     }
 #ifdef iOS10
-    if (img4->payload.compression.data && img4->payload.compression.length) {
-        DERItem tmp[2];
-        if (DERParseSequenceContent(&img4->payload.compression, 2, DERRSAPubKeyPKCS1ItemSpecs, tmp, 0) ||
-            DERParseInteger(&tmp[0], &deco) || DERParseInteger64(&tmp[1], &usize)) {
-            fprintf(stderr, "[W] cannot get decompression info\n");
-        }
+    if (meta.flags & META_COMPINFO) {
+        deco = meta.deco;
+        usize = meta.usize;
         if (deco == 1) {
             pfd = lzfse_reopen(pfd, usize);
         }
@@ -2559,56 +3508,74 @@ img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
 #endif
     pfd = lzss_reopen(pfd);
     if (!pfd) {
-        goto freeimg;
+        goto freebuf;
     }
 
   okay:
-    ops = calloc(1, sizeof(struct file_ops_img4));
+    ops = vfs_arena_alloc(arena, sizeof(struct file_ops_img4));
     if (!ops) {
         goto closefd;
     }
+    memset(ops, 0, sizeof(struct file_ops_img4));
     ctx = ops;
+    ctx->arena = arena;
+    ctx->ownarena = (own != NULL);
     ctx->pfd = pfd;
-    ctx->type = type;
+    ctx->type = meta.type;
     ctx->lzfse = deco;
     ctx->usize = usize;
     ctx->other = other;
-    ctx->wasimg4 = (img4->payloadRaw.data != NULL);
+    ctx->wasimg4 = !!(meta.flags & META_IMG4);
     ctx->uphash = (flags & FLAG_IMG4_UPDATE_HASH);
+    if (img4) {
+        remember_digests(ctx, img4);
+    } else {
+        ctx->digests = meta.digests;
+    }
 
-    rv = Img4DecodeManifestExists(img4, &exists);
-    if (rv == 0 && exists) {
-        rv = derdup(&ctx->manifest, &img4->manifestRaw);
+    if (manifest.length) {
+        rv = derdup(arena, &ctx->manifest, &manifest);
         if (rv) {
-            goto freeops;
+            goto closefd;
         }
+        ctx->index = index_manifest(arena, &ctx->manifest);
     }
-    rv = derdup(&ctx->keybag, &img4->payload.keybag);
+    rv = derdup(arena, &ctx->keybag, &keybag);
     if (rv) {
-        goto err1;
+        goto closefd;
     }
-    rv = derdup(&ctx->version, &img4->payload.version);
+    rv = derdup(arena, &ctx->version, &version);
     if (rv) {
-        goto err2;
+        goto closefd;
     }
-    // rv = derdup(&ctx->ep_info, &img4->payload.ep_info);
-    if (rv) {
-        goto err3;
+    // rv = derdup(arena, &ctx->ep_info, &img4->payload.ep_info);
+
+    if (meta.flags & META_NONCE) {
+        ctx->hasnonce = 1;
+        ctx->nonce = meta.nonce;
     }
 
-    if (img4->restoreInfo.nonce.data && img4->restoreInfo.nonce.length) {
-        rv = Img4DecodeGetRestoreInfoData(img4, 'BNCN', &der, &derlen);
-        if (rv == 0) {
-            ctx->hasnonce = 1;
-            ctx->nonce = GET_QWORD_BE(der, 0);
+    if (usemeta) {
+        meta.digests = ctx->digests;
+        if (!cached) {
+            meta_save(metapath, &meta);
+        }
+        ctx->meta = vfs_arena_alloc(arena, sizeof(meta));
+        ctx->metapath = vfs_arena_alloc(arena, strlen(metapath) + 1);
+        if (ctx->meta && ctx->metapath) {
+            memcpy(ctx->meta, &meta, sizeof(meta));
+            strcpy((char *)ctx->metapath, metapath);
+        } else {
+            ctx->meta = NULL;
         }
     }
 
-    free(img4);
-    free(buf);
+    alloc->free(buf);
 
     ops->ops.read = img4_read;
     ops->ops.write = img4_write;
+    ops->ops.pread = img4_pread;
+    ops->ops.pwrite = img4_pwrite;
     ops->ops.lseek = img4_lseek;
     ops->ops.ioctl = img4_ioctl;
     ops->ops.ftruncate = img4_ftruncate;
@@ -2616,23 +3583,649 @@ img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
     ops->ops.close = img4_close;
     ops->ops.length = img4_length;
     ops->ops.flags = other->flags;
+    ops->ops.alloc = alloc;
+    STATS_ATTACH(&ops->ops, "img4", since, 0);
+    if (ops->ops.stats) {
+        /* buf is gone by now */
+        vfs_stats_scratch(&ops->ops, total);
+    }
     return (FHANDLE)ops;
 
-  err3:
-    free(ctx->version.data);
-  err2:
-    free(ctx->keybag.data);
-  err1:
-    free(ctx->manifest.data);
-  freeops:
-    free(ops);
   closefd:
     pfd->close(pfd);
-  freeimg:
-    free(img4);
   freebuf:
-    free(buf);
+    alloc->free(buf);
+  freearena:
+    if (own) {
+        vfs_arena_destroy(own);
+    } else {
+        vfs_arena_release(arena, &mark);
+    }
   closeit:
     other->close(other);
     return NULL;
 }
+
+FHANDLE
+img4_reopen_ex(FHANDLE other, const unsigned char *ivkey, int flags, struct vfs_arena *arena)
+{
+    FHANDLE fd;
+    TRACE_BEGIN(t);
+    fd = doreopen(other, ivkey, flags, arena);
+    TRACE_END(t, "img4_reopen");
+    return fd;
+}
+
+FHANDLE
+img4_reopen(FHANDLE other, const unsigned char *ivkey, int flags)
+{
+    return img4_reopen_ex(other, ivkey, flags, NULL);
+}
+
+FHANDLE
+img4_clone(FHANDLE fd, FHANDLE other)
+{
+    int rv;
+    struct file_ops_img4 *ctx = (struct file_ops_img4 *)fd;
+    struct file_ops_img4 *ops;
+    struct vfs_arena *arena;
+    FHANDLE pfd;
+
+    if (!other) {
+        return NULL;
+    }
+    if (!fd || vfs_stats_ops(fd)->close != img4_close) {
+        goto closeit;
+    }
+
+    rv = ctx->pfd->ioctl(ctx->pfd, IOCTL_MEM_SNAPSHOT, &pfd, other->flags);
+    if (rv) {
+        goto closeit;
+    }
+
+    arena = vfs_arena_create(0);
+    if (!arena) {
+        goto closefd;
+    }
+    ops = vfs_arena_alloc(arena, sizeof(struct file_ops_img4));
+    if (!ops) {
+        goto freearena;
+    }
+    memcpy(ops, ctx, sizeof(struct file_ops_img4));
+    vfs_stats_fork(&ops->ops);
+    ops->pfd = pfd;
+    ops->other = other;
+    ops->arena = arena;
+    ops->ownarena = 1;
+    ops->ops.flags = other->flags;
+    ops->ops.alloc = ALLOCATOR(other);
+    ops->meta = NULL;
+
+    if (derdup(arena, &ops->manifest, &ctx->manifest) ||
+        derdup(arena, &ops->keybag, &ctx->keybag) ||
+        derdup(arena, &ops->version, &ctx->version) ||
+        derdup(arena, &ops->ep_info, &ctx->ep_info)) {
+        goto freearena;
+    }
+    ops->index = index_manifest(arena, &ops->manifest);
+    return (FHANDLE)ops;
+
+  freearena:
+    vfs_arena_destroy(arena);
+  closefd:
+    pfd->close(pfd);
+  closeit:
+    other->close(other);
+    return NULL;
+}
+
+struct verify_batch {
+    FHANDLE *fds;
+    size_t count;
+    const char *args;
+    int *results;
+    unsigned lanes;
+};
+
+/* hash the payloads of one group of handles side by side, for EVAL_TRUST to find */
+static void
+prime_group(void *arg, size_t g)
+{
+    struct verify_batch *batch = arg;
+    struct file_ops_img4 *fds[SHA_MB_MAX_LANES];
+    TheImg4 *imgs[SHA_MB_MAX_LANES];
+    DERItem outs[SHA_MB_MAX_LANES];
+    struct vfs_arena_mark marks[SHA_MB_MAX_LANES];
+    struct sha_mb_job jobs[SHA_MB_MAX_LANES];
+    size_t i, end = (g + 1) * batch->lanes;
+    unsigned n = 0;
+
+    if (end > batch->count) {
+        end = batch->count;
+    }
+    for (i = g * batch->lanes; i < end; i++) {
+        struct file_ops_img4 *fd = (struct file_ops_img4 *)batch->fds[i];
+        TheImg4 *img4;
+        if (!fd || vfs_stats_ops(&fd->ops)->close != img4_close) {
+            continue;
+        }
+        vfs_arena_mark(fd->arena, &marks[n]);
+        img4 = parse_current(fd, &outs[n]);
+        if (img4 && !img4->payloadHashed && img4->payload.imageData.length) {
+            fds[n] = fd;
+            imgs[n] = img4;
+            jobs[n].data = img4->payloadRaw.data;
+            jobs[n].length = img4->payloadRaw.length;
+            jobs[n].digest = img4->payload.full_digest;
+            n++;
+            continue;
+        }
+        if (img4) {
+            fd->ops.alloc->free(outs[n].data);
+        }
+        vfs_arena_release(fd->arena, &marks[n]);
+    }
+
+    TRACE_BEGIN(t);
+    sha1_mb(jobs, n);
+    TRACE_END(t, "sha1_mb");
+
+    while (n--) {
+        imgs[n]->payloadHashed = 1;
+        remember_digests(fds[n], imgs[n]);
+        fds[n]->ops.alloc->free(outs[n].data);
+        vfs_arena_release(fds[n]->arena, &marks[n]);
+    }
+}
+
+static void
+verify_one(void *arg, size_t i)
+{
+    struct verify_batch *batch = arg;
+    FHANDLE fd = batch->fds[i];
+    batch->results[i] = fd ? fd->ioctl(fd, IOCTL_IMG4_EVAL_TRUST, batch->args) : -1;
+}
+
+int
+img4_verify_batch(FHANDLE *fds, size_t count, const char *args, int *results, unsigned nthreads)
+{
+    size_t i;
+    int rv = 0;
+    struct verify_batch batch;
+
+    batch.fds = fds;
+    batch.count = count;
+    batch.args = args;
+    batch.results = results;
+    batch.lanes = sha1_mb_lanes();
+    if (batch.lanes > 1 && count > 1) {
+        vfs_parallel_for((count + batch.lanes - 1) / batch.lanes, nthreads, prime_group, &batch);
+    }
+    vfs_parallel_for(count, nthreads, verify_one, &batch);
+
+    for (i = 0; i < count; i++) {
+        if (results[i]) {
+            rv = -1;
+        }
+    }
+    return rv;
+}
+
+void
+img4_parse_device(struct img4_device *dev, const char *args)
+{
+    ContextH ctxh;
+
+    hardware_defaults(&ctxh);
+    parseargs(&ctxh, args, 0);
+    dev->CHIP = ctxh.CHIP;
+    dev->BORD = ctxh.BORD;
+    dev->ECID = ctxh.ECID;
+    dev->SDOM = ctxh.SDOM;
+    dev->SEPO = ctxh.SEPO;
+    dev->nonce = ctxh.field_30;
+    dev->CPRO = ctxh.CPRO;
+    dev->CSEC = ctxh.CSEC;
+}
+
+#define FLEET_BLOCK 1024	/* devices per job */
+
+struct fleet_ticket {
+    TheImg4 img4;		/* index pointers are gone once the ticket is prepared */
+    Img4IndexEntry *props;	/* MANP properties that depend on the device, in manifest order */
+    unsigned count;
+};
+
+struct fleet {
+    const void *const *tickets;
+    const size_t *sizes;
+    const struct img4_device *devices;
+    size_t ndevices;
+    size_t blocks;
+    struct fleet_ticket *prep;
+    int *trust;
+    unsigned char *matrix;
+};
+
+/* full images and bare tickets alike */
+static int
+fleet_decode(struct vfs_arena *arena, TheImg4 *img4, const void *data, size_t size)
+{
+    int rv;
+    DERItem item;
+
+    item.data = (DERByte *)data;
+    item.length = size;
+    rv = Img4DecodeInit(item.data, item.length, img4);
+    if (rv) {
+        memset(img4, 0, sizeof(TheImg4));
+        rv = DERImg4DecodeManifest(&item, &img4->manifest);
+        img4->manifestRaw = item;
+    }
+    if (rv) {
+        return rv;
+    }
+    img4->index = index_manifest(arena, &img4->manifestRaw);
+    return img4->index ? 0 : DR_DecodeError;
+}
+
+/* check what does not depend on the device, and pick out what does */
+static int
+fleet_prepare(struct vfs_arena *arena, struct fleet_ticket *t, const void *data, size_t size)
+{
+    static unsigned noslot;
+    static const Img4Index noprops = { NULL, &noslot, 0, 0 };
+    int rv;
+    unsigned i;
+    TheImg4 *img4 = &t->img4;
+    const Img4ManifestIndex *index;
+    DERMonster prop[2];
+
+    rv = fleet_decode(arena, img4, data, size);
+    if (rv) {
+        return rv;
+    }
+    rv = Img4DecodeVerifyManifest(img4);
+    if (rv) {
+        return rv;
+    }
+
+    /* OBJP constraints are per image, the certificate has to allow one object at least */
+    index = img4->index;
+    img4->objpProps = &noprops;
+    rv = DR_EndOfSequence;
+    for (i = 0; i < index->objects.count && rv; i++) {
+        if (index->objects.entries[i].tag == (E000000000000000 | 'MANP')) {
+            continue;
+        }
+        img4->objp = index->objects.entries[i].item;
+        img4->objpProps = &index->props[i];
+        rv = Img4DecodeEvaluateCertificateProperties(img4);
+    }
+    if (img4->objpProps == &noprops) {
+        rv = Img4DecodeEvaluateCertificateProperties(img4);
+    }
+    if (rv) {
+        return rv;
+    }
+
+    /* same checks as Img4DecodeEvaluateDictionaryProperties, once */
+    t->props = malloc(img4->manpProps->count * sizeof(Img4IndexEntry));
+    if (!t->props) {
+        return -1;
+    }
+    for (i = 0; i < img4->manpProps->count; i++) {
+        const Img4IndexEntry *e = &img4->manpProps->entries[i];
+        rv = DERImg4DecodeProperty(&e->item, e->tag, prop);
+        if (rv) {
+            return rv;
+        }
+        if (prop[1].tag != ASN1_OCTET_STRING && prop[1].tag != ASN1_INTEGER && prop[1].tag != ASN1_BOOLEAN) {
+            return DR_UnexpectedTag;
+        }
+        if ((e->tag & E000000000000000) == 0) {
+            return DR_UnexpectedTag;
+        }
+        switch ((unsigned int)e->tag) {
+            case 'BNCH':
+            case 'BORD':
+            case 'CEPO':
+            case 'CHIP':
+            case 'CPRO':
+            case 'CSEC':
+            case 'ECID':
+            case 'SDOM':
+                t->props[t->count++] = *e;
+        }
+    }
+    return 0;
+}
+
+static void
+fleet_prepare_one(void *arg, size_t i)
+{
+    struct fleet *fleet = arg;
+    struct fleet_ticket *t = &fleet->prep[i];
+    struct vfs_arena *arena = vfs_arena_create(0);
+
+    fleet->trust[i] = arena ? fleet_prepare(arena, t, fleet->tickets[i], fleet->sizes[i]) : -1;
+    vfs_arena_destroy(arena);
+
+    t->img4.index = NULL;
+    t->img4.manpProps = NULL;
+    t->img4.objpProps = NULL;
+}
+
+static void
+fleet_match(void *arg, size_t job)
+{
+    struct fleet *fleet = arg;
+    size_t i = job / fleet->blocks;
+    size_t d = job % fleet->blocks * FLEET_BLOCK;
+    size_t end = d + FLEET_BLOCK;
+    struct fleet_ticket *t = &fleet->prep[i];
+    unsigned char *row = fleet->matrix + i * fleet->ndevices;
+    ContextH ctxh;
+    ContextU ctxu;
+    CTX ctx;
+
+    if (end > fleet->ndevices) {
+        end = fleet->ndevices;
+    }
+    if (fleet->trust[i]) {
+        memset(row + d, 0, end - d);
+        return;
+    }
+
+    ctx.img4 = &t->img4;
+    ctx.hardware = &ctxh;
+    ctx.unknown = &ctxu;
+    for (; d < end; d++) {
+        const struct img4_device *dev = &fleet->devices[d];
+        int rv = 0;
+        unsigned k;
+        memset(&ctxh, 0, sizeof(ctxh));
+        ctxh.CHIP = dev->CHIP;
+        ctxh.BORD = dev->BORD;
+        ctxh.ECID = dev->ECID;
+        ctxh.SDOM = dev->SDOM;
+        ctxh.SEPO = dev->SEPO;
+        ctxh.CPRO = dev->CPRO;
+        ctxh.CSEC = dev->CSEC;
+        ctxh.field_30 = dev->nonce;
+        hardware_nonce(&ctxh, &t->img4);
+        memset(&ctxu, 0, sizeof(ctxu));
+        ctxu.has_manifest = true;
+        for (k = 0; k < t->count && !rv; k++) {
+            DERItem item = t->props[k].item;
+            rv = image4_validate_property_callback(t->props[k].tag, &item, DictMANP, &ctx);
+        }
+        row[d] = !rv;
+    }
+}
+
+int
+img4_validate_fleet(const void *const *tickets, const size_t *sizes, size_t ntickets, const struct img4_device *devices, size_t ndevices, int *trust, unsigned char *matrix, unsigned nthreads)
+{
+    size_t i;
+    int rv = 0;
+    struct fleet fleet;
+
+    fleet.tickets = tickets;
+    fleet.sizes = sizes;
+    fleet.devices = devices;
+    fleet.ndevices = ndevices;
+    fleet.blocks = (ndevices + FLEET_BLOCK - 1) / FLEET_BLOCK;
+    fleet.trust = trust;
+    fleet.matrix = matrix;
+    fleet.prep = calloc(ntickets, sizeof(struct fleet_ticket));
+    if (!fleet.prep && ntickets) {
+        return -1;
+    }
+
+    vfs_parallel_for(ntickets, nthreads, fleet_prepare_one, &fleet);
+    vfs_parallel_for(ntickets * fleet.blocks, nthreads, fleet_match, &fleet);
+
+    for (i = 0; i < ntickets; i++) {
+        if (trust[i]) {
+            rv = -1;
+        }
+        free(fleet.prep[i].props);
+    }
+    free(fleet.prep);
+    return rv;
+}
+
+#define BNCH_CHUNK 65536	/* candidates per job */
+#define BNCH_BATCH 256		/* candidates hashed at once */
+
+struct bnch_entry {
+    DERByte hash[48];
+    DERSize length;
+    size_t ticket;
+};
+
+/* open addressing on the first word of the digest, which is as good as random */
+struct bnch_hash {
+    struct bnch_entry *entries;
+    unsigned count;
+    uint32_t *keys;
+    unsigned *slots;		/* entry + 1 (0 = empty) */
+    unsigned mask;
+};
+
+struct img4_bnch_table {
+    struct bnch_hash sha1;
+    struct bnch_hash sha384;
+    size_t ntickets;
+    size_t pending;
+    signed char *state;		/* -1 no BNCH, 0 not found yet, 1 found */
+    unsigned long long *nonces;
+    pthread_mutex_t lock;
+};
+
+static int
+bnch_get(const void *data, size_t size, DERByte *hash, DERSize *length)
+{
+    int rv;
+    unsigned pos;
+    TheImg4 img4;
+    DERItem manp;
+    const Img4Index *props;
+    DERByte *bnch;
+    struct vfs_arena *arena = vfs_arena_create(0);
+
+    if (!arena) {
+        return -1;
+    }
+    rv = fleet_decode(arena, &img4, data, size);
+    if (rv == 0) {
+        rv = Img4IndexFindDictionary(img4.index, E000000000000000 | 'MANP', &manp, &props);
+    }
+    if (rv == 0) {
+        rv = Img4IndexFind(props, E000000000000000 | 'BNCH', &pos);
+    }
+    if (rv == 0) {
+        rv = Img4DecodeGetPropertyData(&props->entries[pos].item, 'BNCH', &bnch, length);
+    }
+    if (rv == 0 && (*length < 8 || *length > 48)) {
+        rv = DR_DecodeError;
+    }
+    if (rv == 0) {
+        memcpy(hash, bnch, *length);
+    }
+    vfs_arena_destroy(arena);
+    return rv;
+}
+
+static int
+bnch_index(struct bnch_hash *h)
+{
+    unsigned i, j, size;
+
+    /* nearly every candidate misses, so keep it sparse enough that they land on empty slots */
+    for (size = 4096; size < 8 * h->count; size *= 2) {
+        continue;
+    }
+    h->keys = malloc(size * sizeof(uint32_t));
+    h->slots = calloc(size, sizeof(unsigned));
+    if (!h->keys || !h->slots) {
+        return -1;
+    }
+    h->mask = size - 1;
+    for (i = 0; i < h->count; i++) {
+        uint32_t key;
+        memcpy(&key, h->entries[i].hash, 4);
+        for (j = key & h->mask; h->slots[j]; j = (j + 1) & h->mask) {
+            continue;
+        }
+        h->keys[j] = key;
+        h->slots[j] = i + 1;
+    }
+    return 0;
+}
+
+struct img4_bnch_table *
+img4_bnch_table(const void *const *tickets, const size_t *sizes, size_t ntickets)
+{
+    size_t i;
+    struct img4_bnch_table *table;
+
+    table = calloc(1, sizeof(struct img4_bnch_table));
+    if (!table) {
+        return NULL;
+    }
+    pthread_mutex_init(&table->lock, NULL);
+    table->ntickets = ntickets;
+    table->state = calloc(ntickets + 1, 1);
+    table->nonces = calloc(ntickets + 1, sizeof(unsigned long long));
+    table->sha1.entries = malloc((ntickets + 1) * sizeof(struct bnch_entry));
+    table->sha384.entries = malloc((ntickets + 1) * sizeof(struct bnch_entry));
+    if (!table->state || !table->nonces || !table->sha1.entries || !table->sha384.entries) {
+        img4_bnch_free(table);
+        return NULL;
+    }
+
+    /* SHA-1 is 20 bytes, anything else is (a prefix of) SHA-384 */
+    for (i = 0; i < ntickets; i++) {
+        struct bnch_entry e;
+        if (bnch_get(tickets[i], sizes[i], e.hash, &e.length)) {
+            table->state[i] = -1;
+            continue;
+        }
+        e.ticket = i;
+        if (e.length == 20) {
+            table->sha1.entries[table->sha1.count++] = e;
+        } else {
+            table->sha384.entries[table->sha384.count++] = e;
+        }
+        table->pending++;
+    }
+    if (bnch_index(&table->sha1) || bnch_index(&table->sha384)) {
+        img4_bnch_free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void
+img4_bnch_free(struct img4_bnch_table *table)
+{
+    if (!table) {
+        return;
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table->sha1.entries);
+    free(table->sha1.keys);
+    free(table->sha1.slots);
+    free(table->sha384.entries);
+    free(table->sha384.keys);
+    free(table->sha384.slots);
+    free(table->state);
+    free(table->nonces);
+    free(table);
+}
+
+static void
+bnch_probe(struct img4_bnch_table *table, const struct bnch_hash *h, size_t size, const unsigned long long *nonces, size_t n, const DERByte *digests)
+{
+    size_t i;
+    unsigned j;
+
+    for (i = 0; i < n; i++, digests += size) {
+        uint32_t key;
+        memcpy(&key, digests, 4);
+        for (j = key & h->mask; h->slots[j]; j = (j + 1) & h->mask) {
+            const struct bnch_entry *e = &h->entries[h->slots[j] - 1];
+            if (h->keys[j] != key || memcmp(e->hash, digests, e->length)) {
+                continue;
+            }
+            pthread_mutex_lock(&table->lock);
+            if (!table->state[e->ticket]) {
+                table->state[e->ticket] = 1;
+                table->nonces[e->ticket] = nonces[i];
+                table->pending--;
+            }
+            pthread_mutex_unlock(&table->lock);
+        }
+    }
+}
+
+struct bnch_search {
+    struct img4_bnch_table *table;
+    const unsigned long long *nonces;
+    size_t count;
+};
+
+static void
+bnch_search(void *arg, size_t job)
+{
+    struct bnch_search *s = arg;
+    struct img4_bnch_table *table = s->table;
+    size_t i, n, end = (job + 1) * BNCH_CHUNK;
+    DERByte digests[BNCH_BATCH * 48];
+
+    if (end > s->count) {
+        end = s->count;
+    }
+    for (i = job * BNCH_CHUNK; i < end; i += n) {
+        n = end - i;
+        if (n > BNCH_BATCH) {
+            n = BNCH_BATCH;
+        }
+        if (table->sha1.count) {
+            sha1_mb_qwords(s->nonces + i, n, digests);
+            bnch_probe(table, &table->sha1, 20, s->nonces + i, n, digests);
+        }
+        if (table->sha384.count) {
+            sha384_mb_qwords(s->nonces + i, n, digests);
+            bnch_probe(table, &table->sha384, 48, s->nonces + i, n, digests);
+        }
+    }
+}
+
+size_t
+img4_bnch_match(struct img4_bnch_table *table, const unsigned long long *nonces, size_t count, unsigned nthreads)
+{
+    struct bnch_search s;
+
+    if (table->pending) {
+        s.table = table;
+        s.nonces = nonces;
+        s.count = count;
+        vfs_parallel_for((count + BNCH_CHUNK - 1) / BNCH_CHUNK, nthreads, bnch_search, &s);
+    }
+    return table->pending;
+}
+
+int
+img4_bnch_found(const struct img4_bnch_table *table, size_t ticket, unsigned long long *nonce)
+{
+    if (ticket >= table->ntickets) {
+        return -1;
+    }
+    if (table->state[ticket] == 1) {
+        *nonce = table->nonces[ticket];
+    }
+    return table->state[ticket];
+}
@@ -4,19 +4,65 @@
 /* when we know we *are* a memory-backed file, skip the bullshit */
 #define MEMFD(fd) ((struct file_ops_memory *)fd)
 
+/* handles built outside libvfs may not have an allocator */
+#define ALLOCATOR(fd) ((fd)->alloc ? (fd)->alloc : &vfs_default_allocator)
+
+/* dirty ranges kept per memory layer; past that, the closest ones are merged */
+#define MEMORY_DIRTY_RANGES 16
+
+struct memory_range {
+    size_t start;
+    size_t end;
+};
+
 struct file_ops_memory {
     struct file_ops ops;
     realloc_t realloc;
     free_t free;
     unsigned char *buf;
     size_t size;
+    size_t capacity;
     size_t position;
     int dirty;
+    int mapfd;          /* buf is a private (copy-on-write) mapping of mapfd */
+    size_t mapsize;
+    int mapdirty;       /* buf was written since it was mapped */
+    unsigned ndirty;    /* what changed since the last fsync, sorted and disjoint */
+    struct memory_range dirtyr[MEMORY_DIRTY_RANGES];
 };
 
-FHANDLE memory_openex(struct file_ops_memory *ops, int flags, void *buf, size_t size);
+/* 'alloc' owns buf and is inherited by layers above; NULL means libc */
+FHANDLE memory_openex(struct file_ops_memory *ops, int flags, void *buf, size_t size, const struct vfs_allocator *alloc);
+FHANDLE memory_clone(FHANDLE fd, size_t size, int flags);
+int memory_reserve(FHANDLE fd, size_t capacity);
 int memory_ftruncate(FHANDLE fd, off_t length);
 int memory_close(FHANDLE fd);
+/* length may be SIZE_MAX for "up to the end, whatever it is" */
+void memory_set_dirty(FHANDLE fd, size_t offset, size_t length);
+void memory_clean(FHANDLE fd);
+
+/* counters; see vfs_stats.c */
+extern int vfs_stats_enabled;
+uint64_t vfs_stats_now(void);
+void vfs_stats_attach(FHANDLE fd, const char *layer, uint64_t since, size_t held);
+int vfs_stats_fork(FHANDLE copy);
+void vfs_stats_buffer(FHANDLE fd, size_t capacity);	/* fd holds capacity bytes from now on */
+void vfs_stats_scratch(FHANDLE fd, size_t size);	/* fd used size bytes for a while */
+const struct file_ops *vfs_stats_ops(FHANDLE fd);
+
+/* when a layer is opened with stats enabled; the branch is all it costs otherwise */
+#define STATS_SINCE(t) uint64_t t = vfs_stats_enabled ? vfs_stats_now() : 0
+#define STATS_ATTACH(fd, layer, t, held) do { if (vfs_stats_enabled) vfs_stats_attach(fd, layer, t, held); } while (0)
+
+/* trace spans; see vfs_trace.c.  without VFS_TRACE these are no code at all */
+#ifdef VFS_TRACE
+void vfs_trace_span(const char *name, uint64_t start);
+#define TRACE_BEGIN(t) uint64_t t = vfs_stats_now()
+#define TRACE_END(t, name) vfs_trace_span(name, t)
+#else
+#define TRACE_BEGIN(t) (void)0
+#define TRACE_END(t, name) (void)0
+#endif
 
 #if defined(__LITTLE_ENDIAN__) || defined(__x86_64__) || defined(__i386__) /*XXX __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__*/
 #define GET_DWORD_BE(data, offset) __builtin_bswap32(*(uint32_t *)((char *)(data) + (offset)))
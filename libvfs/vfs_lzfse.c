@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -20,12 +21,281 @@ size_t compression_decode_buffer(uint8_t *restrict dst_buffer, size_t dst_size,
 #include "vfs_internal.h"
 #include "lzss.h"
 
+#define BLOCK_END           0x24787662  /* bvx$ */
+#define BLOCK_RAW           0x2d787662  /* bvx- */
+#define BLOCK_LZFSE_V2      0x32787662  /* bvx2 */
+#define BLOCK_LZVN          0x6e787662  /* bvxn */
+
+#define REENCODE_TRIES      3
+
+/* where a block of the stream lives, compressed and decoded */
+struct lzfse_block {
+    size_t raw;
+    size_t rawlen;
+    size_t comp;
+    size_t complen;
+};
+
 struct file_ops_lzfse {
     struct file_ops_memory ops;
     FHANDLE other;
     int convert;
+    struct lzfse_block *blocks;     /* NULL if the stream could not be indexed */
+    size_t nblocks;
+    size_t csize;                   /* up to and including bvx$ */
 };
 
+static uint32_t
+get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get_le64(const uint8_t *p)
+{
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static size_t
+decode(uint8_t *dst, size_t dstlen, const uint8_t *src, size_t srclen)
+{
+    size_t n;
+    TRACE_BEGIN(t);
+    n = lzfse_decode_buffer(dst, dstlen, src, srclen, NULL);
+    TRACE_END(t, "lzfse_decode");
+    return n;
+}
+
+/*
+ * walk the block headers.  v1 blocks are never produced by the encoder and
+ * are not handled; such streams are always re-encoded in full
+ */
+static int
+index_blocks(const uint8_t *src, size_t size, struct lzfse_block **blocks, size_t *count, size_t *csize)
+{
+    struct lzfse_block *b = NULL;
+    size_t n = 0, max = 0, pos = 0, raw = 0;
+
+    *blocks = NULL;
+    *count = 0;
+    while (pos + 4 <= size) {
+        uint32_t magic = get_le32(src + pos);
+        size_t hdr, payload;
+        if (magic == BLOCK_END) {
+            *blocks = b;
+            *count = n;
+            *csize = pos + 4;
+            return 0;
+        }
+        if (pos + 12 > size) {
+            break;
+        }
+        switch (magic) {
+            case BLOCK_RAW:
+                hdr = 8;
+                payload = get_le32(src + pos + 4);
+                break;
+            case BLOCK_LZVN:
+                hdr = 12;
+                payload = get_le32(src + pos + 8);
+                break;
+            case BLOCK_LZFSE_V2: {
+                uint64_t f0, f1;
+                if (pos + 32 > size) {
+                    goto error;
+                }
+                f0 = get_le64(src + pos + 8);
+                f1 = get_le64(src + pos + 16);
+                hdr = get_le32(src + pos + 24);
+                payload = ((f0 >> 20) & 0xfffff) + ((f1 >> 40) & 0xfffff);
+                break;
+            }
+            default:
+                goto error;
+        }
+        if (hdr + payload > size - pos) {
+            break;
+        }
+        if (n >= max) {
+            size_t m = max ? max * 2 : 64;
+            struct lzfse_block *tmp = realloc(b, m * sizeof(*b));
+            if (!tmp) {
+                break;
+            }
+            b = tmp;
+            max = m;
+        }
+        b[n].raw = raw;
+        b[n].rawlen = get_le32(src + pos + 4);
+        b[n].comp = pos;
+        b[n].complen = hdr + payload;
+        raw += b[n++].rawlen;
+        pos += hdr + payload;
+    }
+  error:
+    free(b);
+    return -1;
+}
+
+static size_t
+encode_full(FHANDLE fd, uint8_t **out)
+{
+    size_t csize, total = MEMFD(fd)->size;
+    uint8_t *buf = ALLOCATOR(fd)->realloc(NULL, total + 256);
+    if (!buf) {
+        return 0;
+    }
+    if (fd->stats) {
+        vfs_stats_scratch(fd, total + 256);
+    }
+    csize = lzfse_encode_buffer(buf, total + 256, MEMFD(fd)->buf, total, NULL);
+    if (!csize) {
+        ALLOCATOR(fd)->free(buf);
+        return 0;
+    }
+    *out = buf;
+    return csize;
+}
+
+/*
+ * splice: runs of blocks marked in redo are encoded as streams of their
+ * own and their bvx$ dropped; the other blocks are copied from old.  blocks
+ * past a change may still have matches reaching into it, so the result is
+ * decoded and any block that comes out wrong is redone.  returns 0 if that
+ * did not settle, the caller then encodes everything
+ */
+static size_t
+encode_spliced(FHANDLE fd, const uint8_t *old, uint8_t *redo, uint8_t **out)
+{
+    struct file_ops_lzfse *ctx = (struct file_ops_lzfse *)fd;
+    const struct vfs_allocator *alloc = ALLOCATOR(fd);
+    const struct lzfse_block *b = ctx->blocks;
+    const uint8_t *data = MEMFD(fd)->buf;
+    size_t total = MEMFD(fd)->size;
+    size_t max = ctx->csize + 256;
+    uint8_t *buf, *dec;
+    int tries;
+
+    dec = alloc->realloc(NULL, total + 1);
+    if (!dec) {
+        return 0;
+    }
+    for (tries = 0; tries < REENCODE_TRIES; tries++) {
+        size_t i, j, pos = 0, outlen;
+        int bad = 0;
+
+        buf = alloc->realloc(NULL, max);
+        if (!buf) {
+            break;
+        }
+        for (i = 0; i < ctx->nblocks; i = j) {
+            size_t need, raw, len;
+            for (j = i + 1; j < ctx->nblocks && redo[j] == redo[i]; j++) {
+                continue;
+            }
+            raw = b[i].raw;
+            len = b[j - 1].raw + b[j - 1].rawlen - raw;
+            need = redo[i] ? len + 256 : b[j - 1].comp + b[j - 1].complen - b[i].comp;
+            if (pos + need + 4 > max) {
+                uint8_t *tmp;
+                max = (pos + need + 4) * 2;
+                tmp = alloc->realloc(buf, max);
+                if (!tmp) {
+                    goto fail;
+                }
+                buf = tmp;
+            }
+            if (redo[i]) {
+                size_t n = lzfse_encode_buffer(buf + pos, need, data + raw, len, NULL);
+                if (n < 4 || get_le32(buf + pos + n - 4) != BLOCK_END) {
+                    goto fail;
+                }
+                pos += n - 4;
+            } else {
+                memcpy(buf + pos, old + b[i].comp, need);
+                pos += need;
+            }
+        }
+        memcpy(buf + pos, old + ctx->csize - 4, 4);
+        pos += 4;
+
+        outlen = decode(dec, total + 1, buf, pos);
+        if (outlen != total) {
+            goto fail;
+        }
+        for (i = 0; i < ctx->nblocks; i++) {
+            if (!redo[i] && memcmp(dec + b[i].raw, data + b[i].raw, b[i].rawlen)) {
+                redo[i] = 1;
+                bad = 1;
+            }
+        }
+        if (!bad) {
+            alloc->free(dec);
+            *out = buf;
+            return pos;
+        }
+        alloc->free(buf);
+    }
+    alloc->free(dec);
+    return 0;
+
+  fail:
+    alloc->free(buf);
+    alloc->free(dec);
+    return 0;
+}
+
+/* re-encode what the dirty ranges touch, or 0 if it is not worth it */
+static size_t
+encode_dirty(FHANDLE fd, uint8_t **out)
+{
+    struct file_ops_lzfse *ctx = (struct file_ops_lzfse *)fd;
+    const struct memory_range *r = MEMFD(fd)->dirtyr;
+    unsigned k, nr = MEMFD(fd)->ndirty;
+    size_t i, csize = 0, dirty = 0;
+    uint8_t *redo, *old;
+    FHANDLE other = ctx->other;
+
+    if (!ctx->blocks || !nr || !ctx->nblocks) {
+        return 0;
+    }
+    if (ctx->blocks[ctx->nblocks - 1].raw + ctx->blocks[ctx->nblocks - 1].rawlen != MEMFD(fd)->size) {
+        return 0;
+    }
+
+    redo = calloc(ctx->nblocks, 1);
+    if (!redo) {
+        return 0;
+    }
+    for (i = 0, k = 0; i < ctx->nblocks; i++) {
+        const struct lzfse_block *b = &ctx->blocks[i];
+        while (k < nr && r[k].end <= b->raw) {
+            k++;
+        }
+        if (k < nr && r[k].start < b->raw + b->rawlen) {
+            redo[i] = 1;
+            dirty += b->rawlen;
+        }
+    }
+    if (dirty > MEMFD(fd)->size / 2) {
+        goto done;
+    }
+
+    old = ALLOCATOR(fd)->realloc(NULL, ctx->csize);
+    if (!old) {
+        goto done;
+    }
+    if (other->pread(other, old, ctx->csize, 0) == (ssize_t)ctx->csize && get_le32(old + ctx->csize - 4) == BLOCK_END) {
+        csize = encode_spliced(fd, old, redo, out);
+    }
+    ALLOCATOR(fd)->free(old);
+
+  done:
+    free(redo);
+    return csize;
+}
+
 static int
 lzfse_fsync(FHANDLE fd)
 {
@@ -34,6 +304,7 @@ lzfse_fsync(FHANDLE fd)
     size_t csize;
     size_t total, written;
     uint8_t *buf;
+    const struct vfs_allocator *alloc;
 
     if (!fd) {
         return -1;
@@ -49,6 +320,7 @@ lzfse_fsync(FHANDLE fd)
     }
 
     total = MEMFD(fd)->size;
+    alloc = ALLOCATOR(fd);
 
     if (ctx->convert == 1) {
         uint32_t adler;
@@ -59,13 +331,24 @@ lzfse_fsync(FHANDLE fd)
             ptr += GET_DWORD_BE(ptr, 16);
         }
 
+        if (total > UINT32_MAX - 256) {
+            /* comp header has 32-bit sizes */
+            return -1;
+        }
         adler = lzadler32(ptr, total);
 
-        buf = malloc(0x180 + (total + 256));
+        buf = alloc->realloc(NULL, 0x180 + (total + 256));
         if (!buf) {
             return -1;
         }
         end = compress_lzss(buf + 0x180, total + 256, ptr, total);
+        if (!end) {
+            if (total) {
+                alloc->free(buf);
+                return -1;
+            }
+            end = buf + 0x180;
+        }
         csize = end - buf;
 
         PUT_DWORD_BE(buf,  0, 'comp');
@@ -79,7 +362,7 @@ lzfse_fsync(FHANDLE fd)
     }
     if (ctx->convert == -1) {
         csize = total;
-        buf = malloc(total);
+        buf = alloc->realloc(NULL, total);
         if (!buf) {
             return -1;
         }
@@ -87,32 +370,32 @@ lzfse_fsync(FHANDLE fd)
         goto okay;
     }
 
-    buf = malloc(total + 256);
-    if (!buf) {
-        return -1;
-    }
-
 #ifndef USE_LIBCOMPRESSION
     // XXX we're using the public library, which doesn't support COMPRESSION_LZFSE_SMALL
     fprintf(stderr, "[w] lzfse encoding\n");
 #endif
-    csize = lzfse_encode_buffer(buf, total + 256, MEMFD(fd)->buf, total, NULL);
+    csize = encode_dirty(fd, &buf);
+    if (!csize) {
+        csize = encode_full(fd, &buf);
+    }
     if (!csize) {
-        free(buf);
         return -1;
     }
+    /* the new stream is what later saves start from */
+    free(ctx->blocks);
+    index_blocks(buf, csize, &ctx->blocks, &ctx->nblocks, &ctx->csize);
 
   okay:
     other->lseek(other, 0, SEEK_SET);
     written = other->write(other, buf, csize);
-    free(buf);
+    alloc->free(buf);
     if (written != csize) {
         return -1;
     }
 
     other->ftruncate(other, written);
   next:
-    MEMFD(fd)->dirty = 0;
+    memory_clean(fd);
     return other->fsync(other);
 }
 
@@ -131,6 +414,7 @@ lzfse_close(FHANDLE fd)
 
     rv = fd->fsync(fd);
 
+    free(ctx->blocks);
     memory_close(fd);
     rc = other->close(other);
     return rv ? rv : rc;
@@ -157,6 +441,23 @@ lzfse_ioctl(FHANDLE fd, unsigned long req, ...)
             rv = 0;
             break;
         }
+        case IOCTL_MEM_RESERVE: {
+            size_t capacity = va_arg(ap, size_t);
+            rv = memory_reserve(fd, capacity);
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY: {
+            memory_set_dirty(fd, 0, SIZE_MAX);
+            rv = 0;
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY_RANGE: {
+            size_t offset = va_arg(ap, size_t);
+            size_t length = va_arg(ap, size_t);
+            memory_set_dirty(fd, offset, length);
+            rv = 0;
+            break;
+        }
         case IOCTL_LZFSE_SET_LZSS: {
             MEMFD(fd)->dirty = 1;
             ctx->convert = 1;
@@ -175,6 +476,35 @@ lzfse_ioctl(FHANDLE fd, unsigned long req, ...)
             rv = 0;
             break;
         }
+        case IOCTL_MEM_SNAPSHOT: {
+            FHANDLE *out = va_arg(ap, FHANDLE *);
+            int flags = va_arg(ap, int);
+            FHANDLE other = ctx->other;
+            FHANDLE copy;
+            rv = other->ioctl(other, IOCTL_MEM_SNAPSHOT, &copy, flags);
+            if (rv) {
+                break;
+            }
+            *out = memory_clone(fd, sizeof(struct file_ops_lzfse), flags);
+            if (!*out) {
+                copy->close(copy);
+                rv = -1;
+                break;
+            }
+            ((struct file_ops_lzfse *)*out)->other = copy;
+            ((struct file_ops_lzfse *)*out)->blocks = NULL;
+            if (ctx->blocks) {
+                struct lzfse_block *blocks = malloc(ctx->nblocks * sizeof(*blocks));
+                if (!blocks) {
+                    (*out)->close(*out);
+                    rv = -1;
+                    break;
+                }
+                memcpy(blocks, ctx->blocks, ctx->nblocks * sizeof(*blocks));
+                ((struct file_ops_lzfse *)*out)->blocks = blocks;
+            }
+            break;
+        }
         default: {
             void *a = va_arg(ap, void *);
             void *b = va_arg(ap, void *);
@@ -195,7 +525,11 @@ lzfse_reopen(FHANDLE other, size_t usize)
     unsigned char hdr[4];
     unsigned char *buf, *dec;
     struct file_ops_lzfse *ctx;
+    struct lzfse_block *blocks = NULL;
+    size_t nblocks = 0, end = 0;
     off_t where;
+    const struct vfs_allocator *alloc;
+    STATS_SINCE(since);
 
     if (!other) {
         return NULL;
@@ -216,7 +550,8 @@ lzfse_reopen(FHANDLE other, size_t usize)
         goto closeit;
     }
 
-    buf = malloc(csize);
+    alloc = ALLOCATOR(other);
+    buf = alloc->realloc(NULL, csize);
     if (!buf) {
         goto closeit;
     }
@@ -225,15 +560,19 @@ lzfse_reopen(FHANDLE other, size_t usize)
     if (outlen != csize) {
         goto freebuf;
     }
+    if (other->flags != O_RDONLY) {
+        /* so that saving can keep the blocks nobody touched */
+        index_blocks(buf, csize, &blocks, &nblocks, &end);
+    }
 
     if (usize) {
         /* we know exactly how much we want to decompress */
-        dec = malloc(usize + 1);
+        dec = alloc->realloc(NULL, usize + 1);
         if (!dec) {
             goto freebuf;
         }
-        outlen = lzfse_decode_buffer(dec, usize + 1, buf, csize, NULL);
-        free(buf);
+        outlen = decode(dec, usize + 1, buf, csize);
+        alloc->free(buf);
         buf = dec;
         if (outlen != usize) {
             goto freebuf;
@@ -242,46 +581,51 @@ lzfse_reopen(FHANDLE other, size_t usize)
     }
 
     usize = csize * 4;
-    dec = malloc(usize);
+    dec = alloc->realloc(NULL, usize);
     if (!dec) {
         goto freebuf;
     }
 
-    while ((outlen = lzfse_decode_buffer(dec, usize, buf, csize, NULL)) >= usize) {
-        void *tmp = realloc(dec, usize *= 2);
+    while ((outlen = decode(dec, usize, buf, csize)) >= usize) {
+        void *tmp = alloc->realloc(dec, usize *= 2);
         if (!tmp) {
-            free(dec);
+            alloc->free(dec);
             goto freebuf;
         }
         dec = tmp;
     }
-    free(buf);
+    alloc->free(buf);
     buf = dec;
     if (!outlen) {
         goto freebuf;
     }
-    dec = realloc(buf, outlen);
+    dec = alloc->realloc(buf, outlen);
     if (!dec) {
         goto freebuf;
     }
     buf = dec;
 
   okay:
-    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, outlen);
+    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, outlen, alloc);
     if (!fd) {
         goto freebuf;
     }
     ctx = (struct file_ops_lzfse *)fd;
     ctx->other = other;
     ctx->convert = 0;
+    ctx->blocks = blocks;
+    ctx->nblocks = nblocks;
+    ctx->csize = end;
 
     fd->ioctl = lzfse_ioctl;
     fd->fsync = lzfse_fsync;
     fd->close = lzfse_close;
+    STATS_ATTACH(fd, "lzfse", since, MEMFD(fd)->capacity);
     return fd;
 
   freebuf:
-    free(buf);
+    free(blocks);
+    alloc->free(buf);
   closeit:
     other->close(other);
     return NULL;
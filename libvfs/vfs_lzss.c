@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -13,6 +14,8 @@ struct file_ops_lzss {
     FHANDLE other;
     void *watchtower;
     size_t watchsize;
+    struct lzss_checkpoint *cps;    /* into the stream below, NULL if read-only */
+    size_t ncps;
 };
 
 static int
@@ -22,7 +25,7 @@ lzss_fsync(FHANDLE fd)
     struct file_ops_lzss *ctx = (struct file_ops_lzss *)fd;
     uint32_t csize;
     uint32_t adler;
-    size_t total, written;
+    size_t total, written, start = 0, dstoff = 0, keep = 0, max;
     uint8_t *end, *buf;
 
     if (!fd) {
@@ -39,13 +42,46 @@ lzss_fsync(FHANDLE fd)
     }
 
     total = MEMFD(fd)->size;
+    if (total > UINT32_MAX - 256) {
+        /* comp header has 32-bit sizes */
+        return -1;
+    }
     adler = lzadler32(MEMFD(fd)->buf, total);
 
-    buf = malloc(0x180 + (total + 256));
+    /* everything up to the last checkpoint before the first change still decodes the same */
+    if (MEMFD(fd)->ndirty) {
+        size_t first = MEMFD(fd)->dirtyr[0].start;
+        while (keep < ctx->ncps && ctx->cps[keep].raw <= first && ctx->cps[keep].raw <= total) {
+            keep++;
+        }
+        if (keep) {
+            keep--;
+            start = ctx->cps[keep].raw;
+            dstoff = ctx->cps[keep].comp;
+        }
+    }
+
+    max = dstoff + (total - start) + 256;
+    buf = ALLOCATOR(fd)->realloc(NULL, 0x180 + max);
     if (!buf) {
         return -1;
     }
-    end = compress_lzss(buf + 0x180, total + 256, MEMFD(fd)->buf, total);
+    if (fd->stats) {
+        vfs_stats_scratch(fd, 0x180 + max);
+    }
+    if (dstoff && other->pread(other, buf + 0x180, dstoff, 0x180) != (ssize_t)dstoff) {
+        start = dstoff = keep = 0;
+    }
+    ctx->ncps = keep;
+    end = compress_lzss_tail(buf + 0x180, max, MEMFD(fd)->buf, total, start, dstoff, &ctx->cps, &ctx->ncps);
+    if (!end) {
+        ctx->ncps = keep;
+        if (total) {
+            ALLOCATOR(fd)->free(buf);
+            return -1;
+        }
+        end = buf + 0x180;
+    }
     csize = end - (buf + 0x180);
 
     PUT_DWORD_BE(buf,  0, 'comp');
@@ -58,7 +94,7 @@ lzss_fsync(FHANDLE fd)
 
     other->lseek(other, 0, SEEK_SET);
     written = other->write(other, buf, end - buf);
-    free(buf);
+    ALLOCATOR(fd)->free(buf);
     if (buf + written != end) {
         return -1;
     }
@@ -68,7 +104,7 @@ lzss_fsync(FHANDLE fd)
     }
     other->ftruncate(other, end - buf + written);
   next:
-    MEMFD(fd)->dirty = 0;
+    memory_clean(fd);
     return other->fsync(other);
 }
 
@@ -88,6 +124,7 @@ lzss_close(FHANDLE fd)
     rv = fd->fsync(fd);
 
     free(ctx->watchtower);
+    free(ctx->cps);
     memory_close(fd);
     rc = other->close(other);
     return rv ? rv : rc;
@@ -114,6 +151,23 @@ lzss_ioctl(FHANDLE fd, unsigned long req, ...)
             rv = 0;
             break;
         }
+        case IOCTL_MEM_RESERVE: {
+            size_t capacity = va_arg(ap, size_t);
+            rv = memory_reserve(fd, capacity);
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY: {
+            memory_set_dirty(fd, 0, SIZE_MAX);
+            rv = 0;
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY_RANGE: {
+            size_t offset = va_arg(ap, size_t);
+            size_t length = va_arg(ap, size_t);
+            memory_set_dirty(fd, offset, length);
+            rv = 0;
+            break;
+        }
         case IOCTL_LZSS_GET_WTOWER: {
             void **dst = va_arg(ap, void **);
             size_t *sz = va_arg(ap, size_t *);
@@ -132,6 +186,45 @@ lzss_ioctl(FHANDLE fd, unsigned long req, ...)
             rv = 0;
             break;
         }
+        case IOCTL_MEM_SNAPSHOT: {
+            FHANDLE *out = va_arg(ap, FHANDLE *);
+            int flags = va_arg(ap, int);
+            FHANDLE other = ctx->other;
+            FHANDLE copy;
+            rv = other->ioctl(other, IOCTL_MEM_SNAPSHOT, &copy, flags);
+            if (rv) {
+                break;
+            }
+            *out = memory_clone(fd, sizeof(struct file_ops_lzss), flags);
+            if (!*out) {
+                copy->close(copy);
+                rv = -1;
+                break;
+            }
+            ((struct file_ops_lzss *)*out)->other = copy;
+            ((struct file_ops_lzss *)*out)->cps = NULL;
+            ((struct file_ops_lzss *)*out)->ncps = 0;
+            if (ctx->ncps) {
+                struct lzss_checkpoint *cps = malloc(ctx->ncps * sizeof(*cps));
+                if (cps) {
+                    memcpy(cps, ctx->cps, ctx->ncps * sizeof(*cps));
+                    ((struct file_ops_lzss *)*out)->cps = cps;
+                    ((struct file_ops_lzss *)*out)->ncps = ctx->ncps;
+                }
+            }
+            if (ctx->watchtower) {
+                void *tower = malloc(ctx->watchsize);
+                if (!tower) {
+                    ((struct file_ops_lzss *)*out)->watchtower = NULL;
+                    (*out)->close(*out);
+                    rv = -1;
+                    break;
+                }
+                memcpy(tower, ctx->watchtower, ctx->watchsize);
+                ((struct file_ops_lzss *)*out)->watchtower = tower;
+            }
+            break;
+        }
         default: {
             void *a = va_arg(ap, void *);
             void *b = va_arg(ap, void *);
@@ -156,6 +249,10 @@ lzss_reopen(FHANDLE other)
     struct file_ops_lzss *ctx;
     off_t where;
     size_t tail;
+    struct lzss_checkpoint *cps = NULL;
+    size_t ncps = 0;
+    const struct vfs_allocator *alloc;
+    STATS_SINCE(since);
 
     if (!other) {
         return NULL;
@@ -174,7 +271,8 @@ lzss_reopen(FHANDLE other)
     csize = GET_DWORD_BE(hdr, 16);
     usize = GET_DWORD_BE(hdr, 12);
 
-    buf = malloc(csize);
+    alloc = ALLOCATOR(other);
+    buf = alloc->realloc(NULL, csize);
     if (!buf) {
         goto closeit;
     }
@@ -187,13 +285,20 @@ lzss_reopen(FHANDLE other)
         goto freebuf;
     }
 
-    dec = malloc(usize);
+    dec = alloc->realloc(NULL, usize);
     if (!dec) {
         goto freebuf;
     }
 
-    outlen = decompress_lzss(dec, buf, csize);
-    free(buf);
+    TRACE_BEGIN(t);
+    if (other->flags == O_RDONLY) {
+        outlen = decompress_lzss(dec, buf, csize);
+    } else {
+        /* so that saving can resume after what did not change */
+        outlen = decompress_lzss_ex(dec, buf, csize, &cps, &ncps);
+    }
+    TRACE_END(t, "decompress_lzss");
+    alloc->free(buf);
     buf = dec;
     if (outlen != usize) {
         goto freebuf;
@@ -203,12 +308,15 @@ lzss_reopen(FHANDLE other)
         fprintf(stderr, "adler mismatch: stored=%08x calculated=%08x\n", GET_DWORD_BE(hdr, 8), adler);
     }
 
-    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, usize);
+    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, usize, alloc);
     if (!fd) {
         goto freebuf;
     }
     ctx = (struct file_ops_lzss *)fd;
     ctx->other = other;
+    ctx->cps = cps;
+    ctx->ncps = ncps;
+    cps = NULL;
 
     tail = other->length(other);
     if ((ssize_t)tail < 0 || tail < csize + 0x180) {
@@ -229,13 +337,17 @@ lzss_reopen(FHANDLE other)
     fd->ioctl = lzss_ioctl;
     fd->fsync = lzss_fsync;
     fd->close = lzss_close;
+    STATS_ATTACH(fd, "lzss", since, MEMFD(fd)->capacity);
     return fd;
 
   error:
-    fd->close(fd);
+    free(ctx->cps);
+    memory_close(fd);
+    goto closeit;
   freebuf:
-    free(buf);
+    alloc->free(buf);
   closeit:
+    free(cps);
     other->close(other);
     return NULL;
 }
@@ -192,7 +192,7 @@ lzvn_reopen(FHANDLE other)
         fprintf(stderr, "adler mismatch: stored=%08x calculated=%08x\n", GET_DWORD_BE(hdr, 8), adler);
     }
 
-    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, usize);
+    fd = memory_openex(malloc(sizeof(*ctx)), other->flags, buf, usize, NULL);
     if (!fd) {
         goto freebuf;
     }
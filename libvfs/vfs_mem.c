@@ -1,8 +1,11 @@
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include "vfs.h"
 #include "vfs_internal.h"
 
@@ -16,6 +19,133 @@ memory_fsync(FHANDLE fd_)
     return 0;
 }
 
+void
+memory_set_dirty(FHANDLE fd_, size_t offset, size_t length)
+{
+    struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
+    struct memory_range r[MEMORY_DIRTY_RANGES + 1];
+    size_t end = length > SIZE_MAX - offset ? SIZE_MAX : offset + length;
+    size_t gap = SIZE_MAX;
+    unsigned i, n = 0, at = 0;
+
+    fd->dirty = 1;
+    fd->mapdirty = 1;
+    if (offset >= end) {
+        return;
+    }
+
+    /* copy in order, swallowing every range the new one touches */
+    for (i = 0; i < fd->ndirty && fd->dirtyr[i].end < offset; i++) {
+        r[n++] = fd->dirtyr[i];
+    }
+    for (; i < fd->ndirty && fd->dirtyr[i].start <= end; i++) {
+        if (fd->dirtyr[i].start < offset) {
+            offset = fd->dirtyr[i].start;
+        }
+        if (fd->dirtyr[i].end > end) {
+            end = fd->dirtyr[i].end;
+        }
+    }
+    r[n].start = offset;
+    r[n++].end = end;
+    for (; i < fd->ndirty; i++) {
+        r[n++] = fd->dirtyr[i];
+    }
+
+    if (n > MEMORY_DIRTY_RANGES) {
+        /* one too many: close the smallest gap */
+        for (i = 1; i < n; i++) {
+            if (r[i].start - r[i - 1].end < gap) {
+                gap = r[i].start - r[i - 1].end;
+                at = i;
+            }
+        }
+        r[at - 1].end = r[at].end;
+        memmove(&r[at], &r[at + 1], (n - at - 1) * sizeof(*r));
+        n--;
+    }
+    memcpy(fd->dirtyr, r, n * sizeof(*r));
+    fd->ndirty = n;
+}
+
+void
+memory_clean(FHANDLE fd_)
+{
+    struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
+    fd->dirty = 0;
+    fd->ndirty = 0;
+}
+
+static void
+memory_release(struct file_ops_memory *fd)
+{
+    if (fd->mapfd >= 0) {
+        munmap(fd->buf, fd->mapsize);
+        close(fd->mapfd);
+        fd->mapfd = -1;
+    } else {
+        fd->free(fd->buf);
+    }
+    fd->buf = NULL;
+    fd->capacity = 0;
+}
+
+/* reallocate to exactly 'capacity' bytes; a private mapping is materialised when it must grow */
+static int
+memory_resize(struct file_ops_memory *fd, size_t capacity)
+{
+    unsigned char *tmp;
+    if (fd->mapfd >= 0) {
+        if (capacity <= fd->mapsize) {
+            return 0;
+        }
+        tmp = fd->realloc(NULL, capacity);
+        if (!tmp) {
+            return -1;
+        }
+        memcpy(tmp, fd->buf, fd->size);
+        memory_release(fd);
+    } else {
+        tmp = fd->realloc(fd->buf, capacity);
+        if (!tmp) {
+            return -1;
+        }
+    }
+    fd->buf = tmp;
+    fd->capacity = capacity;
+    if (fd->ops.stats) {
+        vfs_stats_buffer(&fd->ops, capacity);
+    }
+    return 0;
+}
+
+/* make room for 'size' bytes, growing geometrically so that appends are amortised */
+static int
+memory_grow(struct file_ops_memory *fd, size_t size)
+{
+    size_t capacity = fd->capacity + fd->capacity / 2;
+    if (size <= fd->capacity) {
+        return 0;
+    }
+    if (capacity > size && memory_resize(fd, capacity) == 0) {
+        return 0;
+    }
+    return memory_resize(fd, size);
+}
+
+int
+memory_reserve(FHANDLE fd_, size_t capacity)
+{
+    struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
+    if (!fd || fd_->flags == O_RDONLY) {
+        return -1;
+    }
+    if (capacity <= fd->capacity) {
+        return 0;
+    }
+    return memory_resize(fd, capacity);
+}
+
 int
 memory_close(FHANDLE fd_)
 {
@@ -23,53 +153,85 @@ memory_close(FHANDLE fd_)
     if (!fd) {
         return -1;
     }
-    fd->free(fd->buf);
+    memory_release(fd);
     free(fd);
     return 0;
 }
 
 static ssize_t
-memory_read(FHANDLE fd_, void *buf, size_t count)
+memory_pread(FHANDLE fd_, void *buf, size_t count, off_t offset)
 {
     struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
-    if (!fd) {
+    if (!fd || offset < 0) {
         return -1;
     }
-    if (fd->position > fd->size) {
+    if ((size_t)offset > fd->size) {
         return 0;
     }
-    if (count > fd->size - fd->position) {
-        count = fd->size - fd->position;
+    if (count > fd->size - offset) {
+        count = fd->size - offset;
     }
-    memmove(buf, fd->buf + fd->position, count);
-    fd->position += count;
+    memmove(buf, fd->buf + offset, count);
     return count;
 }
 
 static ssize_t
-memory_write(FHANDLE fd_, const void *buf, size_t count)
+memory_pwrite(FHANDLE fd_, const void *buf, size_t count, off_t offset)
 {
     struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
     size_t end;
-    if (!fd || fd_->flags == O_RDONLY) {
+    if (!fd || fd_->flags == O_RDONLY || offset < 0) {
         return -1;
     }
-    end = fd->position + count;
+    end = offset + count;
     if (end > fd->size) {
-        unsigned char *tmp = fd->realloc(fd->buf, end);
-        if (!tmp) {
-            count = fd->size - fd->position;
+        if (memory_grow(fd, end)) {
+            if ((size_t)offset > fd->size) {
+                return -1;
+            }
+            count = fd->size - offset;
         } else {
-            fd->buf = tmp;
+            if ((size_t)offset > fd->size) {
+                memset(fd->buf + fd->size, 0, offset - fd->size);
+            }
             fd->size = end;
         }
     }
-    fd->dirty = 1;
-    memmove(fd->buf + fd->position, buf, count);
-    fd->position += count;
+    memory_set_dirty(fd_, offset, count);
+    memmove(fd->buf + offset, buf, count);
     return count;
 }
 
+static ssize_t
+memory_read(FHANDLE fd_, void *buf, size_t count)
+{
+    struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
+    ssize_t n;
+    if (!fd) {
+        return -1;
+    }
+    n = memory_pread(fd_, buf, count, fd->position);
+    if (n > 0) {
+        fd->position += n;
+    }
+    return n;
+}
+
+static ssize_t
+memory_write(FHANDLE fd_, const void *buf, size_t count)
+{
+    struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
+    ssize_t n;
+    if (!fd) {
+        return -1;
+    }
+    n = memory_pwrite(fd_, buf, count, fd->position);
+    if (n > 0) {
+        fd->position += n;
+    }
+    return n;
+}
+
 static off_t
 memory_lseek(FHANDLE fd_, off_t offset, int whence)
 {
@@ -95,19 +257,14 @@ memory_lseek(FHANDLE fd_, off_t offset, int whence)
         return -1;
     }
     if ((size_t)position > fd->size) {
-        size_t gap;
-        unsigned char *tmp;
         if (fd_->flags == O_RDONLY) {
             return -1;
         }
-        gap = position - fd->size;
-        tmp = fd->realloc(fd->buf, position);
-        if (!tmp) {
+        if (memory_grow(fd, position)) {
             return -1;
         }
-        fd->dirty = 1;
-        memset(tmp + fd->size, 0, gap);
-        fd->buf = tmp;
+        memory_set_dirty(fd_, fd->size, position - fd->size);
+        memset(fd->buf + fd->size, 0, position - fd->size);
         fd->size = position;
     }
     fd->position = position;
@@ -142,6 +299,30 @@ memory_ioctl(FHANDLE fd_, unsigned long req, ...)
             rv = 0;
             break;
         }
+        case IOCTL_MEM_SNAPSHOT: {
+            FHANDLE *out = va_arg(ap, FHANDLE *);
+            int flags = va_arg(ap, int);
+            *out = memory_clone(fd_, sizeof(struct file_ops_memory), flags);
+            rv = *out ? 0 : -1;
+            break;
+        }
+        case IOCTL_MEM_RESERVE: {
+            size_t capacity = va_arg(ap, size_t);
+            rv = memory_reserve(fd_, capacity);
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY: {
+            memory_set_dirty(fd_, 0, SIZE_MAX);
+            rv = 0;
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY_RANGE: {
+            size_t offset = va_arg(ap, size_t);
+            size_t length = va_arg(ap, size_t);
+            memory_set_dirty(fd_, offset, length);
+            rv = 0;
+            break;
+        }
     }
     va_end(ap);
     return rv;
@@ -151,21 +332,23 @@ int
 memory_ftruncate(FHANDLE fd_, off_t length)
 {
     struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
-    void *tmp;
-    if (!fd || fd_->flags == O_RDONLY) {
+    if (!fd || fd_->flags == O_RDONLY || length < 0) {
         return -1;
     }
-    fd->size = length;
-    fd->dirty = 1;
     if (length == 0) {
-        free(fd->buf);
-        fd->buf = NULL;
-        return 0;
+        memory_release(fd);
+    } else if ((size_t)length > fd->capacity) {
+        if (memory_resize(fd, length)) {
+            return -1;
+        }
+    } else if ((size_t)length < fd->capacity / 2) {
+        memory_resize(fd, length);	/* give memory back, if we can */
     }
-    tmp = fd->realloc(fd->buf, length);
-    if (tmp) {
-        fd->buf = tmp;
+    if ((size_t)length > fd->size) {
+        memset(fd->buf + fd->size, 0, length - fd->size);
     }
+    memory_set_dirty(fd_, (size_t)length < fd->size ? (size_t)length : fd->size, SIZE_MAX);
+    fd->size = length;
     return 0;
 }
 
@@ -180,27 +363,40 @@ memory_length(FHANDLE fd_)
 }
 
 FHANDLE
-memory_openex(struct file_ops_memory *ops, int flags, void *buf, size_t size)
+memory_openex(struct file_ops_memory *ops, int flags, void *buf, size_t size, const struct vfs_allocator *alloc)
 {
     if (!ops) {
         return NULL;
     }
+    if (!alloc) {
+        alloc = &vfs_libc_allocator;
+    }
     ops->buf = buf;
     if (!buf && size) {
-        ops->buf = calloc(1, size);
+        ops->buf = alloc->realloc(NULL, size);
         if (!ops->buf) {
             free(ops);
             return NULL;
         }
+        memset(ops->buf, 0, size);
     }
     ops->size = size;
+    ops->capacity = size;
     ops->position = 0;
     ops->dirty = 0;
-    ops->realloc = realloc;
-    ops->free = free;
+    ops->ndirty = 0;
+    ops->mapfd = -1;
+    ops->mapsize = 0;
+    ops->mapdirty = 0;
+    ops->realloc = alloc->realloc;
+    ops->free = alloc->free;
+    ops->ops.alloc = alloc;
+    ops->ops.stats = NULL;
     ops->ops.flags = flags & O_ACCMODE;
     ops->ops.read = memory_read;
     ops->ops.write = memory_write;
+    ops->ops.pread = memory_pread;
+    ops->ops.pwrite = memory_pwrite;
     ops->ops.lseek = memory_lseek;
     ops->ops.ioctl = memory_ioctl;
     ops->ops.ftruncate = memory_ftruncate;
@@ -210,10 +406,116 @@ memory_openex(struct file_ops_memory *ops, int flags, void *buf, size_t size)
     return (FHANDLE)ops;
 }
 
+static int
+memory_tmpfile(void)
+{
+    int fd;
+    char path[4096];
+    const char *tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !*tmpdir) {
+        tmpdir = "/tmp";
+    }
+    if ((size_t)snprintf(path, sizeof(path), "%s/vfs.XXXXXX", tmpdir) >= sizeof(path)) {
+        return -1;
+    }
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+/* move the current contents into a fresh unlinked file and map it privately */
+static int
+memory_map(struct file_ops_memory *fd)
+{
+    int mapfd;
+    unsigned char *buf;
+    size_t n = 0;
+    mapfd = memory_tmpfile();
+    if (mapfd < 0) {
+        return -1;
+    }
+    while (n < fd->size) {
+        ssize_t written = write(mapfd, fd->buf + n, fd->size - n);
+        if (written <= 0) {
+            goto closeit;
+        }
+        n += written;
+    }
+    buf = mmap(NULL, fd->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, mapfd, 0);
+    if (buf == MAP_FAILED) {
+        goto closeit;
+    }
+    memory_release(fd);
+    fd->buf = buf;
+    fd->capacity = fd->size;
+    fd->mapfd = mapfd;
+    fd->mapsize = fd->size;
+    fd->mapdirty = 0;
+    return 0;
+  closeit:
+    close(mapfd);
+    return -1;
+}
+
+/*
+ * clone a memory-backed layer: size is the size of the whole layer struct,
+ * which is copied verbatim; pointers the layer owns must be fixed up by the caller.
+ * both handles end up as private mappings of the same file, so pages are shared
+ * until either side writes to them
+ */
+FHANDLE
+memory_clone(FHANDLE fd_, size_t size, int flags)
+{
+    struct file_ops_memory *fd = (struct file_ops_memory *)fd_;
+    struct file_ops_memory *ops;
+    if (!fd || size < sizeof(struct file_ops_memory)) {
+        return NULL;
+    }
+    if (fd->size && (fd->mapfd < 0 || fd->mapdirty) && memory_map(fd)) {
+        return NULL;
+    }
+    ops = malloc(size);
+    if (!ops) {
+        return NULL;
+    }
+    memcpy(ops, fd, size);
+    ops->position = 0;
+    ops->ops.flags = flags & O_ACCMODE;
+    ops->buf = NULL;
+    ops->capacity = 0;
+    ops->mapfd = -1;
+    ops->mapsize = 0;
+    if (fd->size) {
+        ops->mapfd = dup(fd->mapfd);
+        if (ops->mapfd < 0) {
+            free(ops);
+            return NULL;
+        }
+        ops->buf = mmap(NULL, fd->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, ops->mapfd, 0);
+        if (ops->buf == MAP_FAILED) {
+            close(ops->mapfd);
+            free(ops);
+            return NULL;
+        }
+        ops->mapsize = fd->size;
+        ops->capacity = fd->size;
+    }
+    vfs_stats_fork(&ops->ops);
+    return (FHANDLE)ops;
+}
+
 FHANDLE
 memory_open(int flags, void *buf, size_t size)
 {
-    return memory_openex(malloc(sizeof(struct file_ops_memory)), flags, buf, size);
+    STATS_SINCE(since);
+    FHANDLE fd = memory_openex(malloc(sizeof(struct file_ops_memory)), flags, buf, size, NULL);
+    if (fd) {
+        fd->alloc = &vfs_default_allocator;
+        STATS_ATTACH(fd, "memory", since, size);
+    }
+    return fd;
 }
 
 FHANDLE
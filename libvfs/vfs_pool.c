@@ -0,0 +1,70 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "vfs.h"
+
+struct parallel_job {
+    void (*fn)(void *arg, size_t i);
+    void *arg;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+static void *
+worker(void *ptr)
+{
+    struct parallel_job *job = ptr;
+    for (;;) {
+        size_t i;
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count) {
+            break;
+        }
+        job->fn(job->arg, i);
+    }
+    return NULL;
+}
+
+void
+vfs_parallel_for(size_t count, unsigned nthreads, void (*fn)(void *arg, size_t i), void *arg)
+{
+    unsigned n, started = 0;
+    pthread_t *threads = NULL;
+    struct parallel_job job;
+
+    if (!nthreads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? cpus : 1;
+    }
+    if (nthreads > count) {
+        nthreads = count;
+    }
+
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.next = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* the caller is one of the workers */
+    if (nthreads > 1) {
+        threads = malloc((nthreads - 1) * sizeof(pthread_t));
+    }
+    if (threads) {
+        for (n = 0; n < nthreads - 1; n++) {
+            if (pthread_create(&threads[started], NULL, worker, &job)) {
+                break;
+            }
+            started++;
+        }
+    }
+    worker(&job);
+    for (n = 0; n < started; n++) {
+        pthread_join(threads[n], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+}
@@ -0,0 +1,287 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vfs.h"
+#include "vfs_internal.h"
+
+/*
+ * a counting layer keeps the functions it was opened with in 'real' and
+ * gets wrappers in their place.  counters are bumped with relaxed atomics,
+ * since pread may be called from several threads at once
+ */
+
+struct vfs_stats_layer {
+    struct vfs_stats stats;
+    struct file_ops real;
+};
+
+int vfs_stats_enabled;
+static struct vfs_stats_list *closing;
+
+#define ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+#define STATS(fd) (&(fd)->stats->stats)
+#define REAL(fd) (&(fd)->stats->real)
+
+void
+vfs_stats_enable(int on)
+{
+    vfs_stats_enabled = on;
+}
+
+uint64_t
+vfs_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static ssize_t
+stats_read(FHANDLE fd, void *buf, size_t count)
+{
+    uint64_t t = vfs_stats_now();
+    ssize_t n = REAL(fd)->read(fd, buf, count);
+    ADD(STATS(fd)->read_ns, vfs_stats_now() - t);
+    ADD(STATS(fd)->reads, 1);
+    if (n > 0) {
+        ADD(STATS(fd)->bytes_out, n);
+    }
+    return n;
+}
+
+static ssize_t
+stats_pread(FHANDLE fd, void *buf, size_t count, off_t offset)
+{
+    uint64_t t = vfs_stats_now();
+    ssize_t n = REAL(fd)->pread(fd, buf, count, offset);
+    ADD(STATS(fd)->read_ns, vfs_stats_now() - t);
+    ADD(STATS(fd)->reads, 1);
+    if (n > 0) {
+        ADD(STATS(fd)->bytes_out, n);
+    }
+    return n;
+}
+
+static ssize_t
+stats_write(FHANDLE fd, const void *buf, size_t count)
+{
+    uint64_t t = vfs_stats_now();
+    ssize_t n = REAL(fd)->write(fd, buf, count);
+    ADD(STATS(fd)->write_ns, vfs_stats_now() - t);
+    ADD(STATS(fd)->writes, 1);
+    if (n > 0) {
+        ADD(STATS(fd)->bytes_in, n);
+    }
+    return n;
+}
+
+static ssize_t
+stats_pwrite(FHANDLE fd, const void *buf, size_t count, off_t offset)
+{
+    uint64_t t = vfs_stats_now();
+    ssize_t n = REAL(fd)->pwrite(fd, buf, count, offset);
+    ADD(STATS(fd)->write_ns, vfs_stats_now() - t);
+    ADD(STATS(fd)->writes, 1);
+    if (n > 0) {
+        ADD(STATS(fd)->bytes_in, n);
+    }
+    return n;
+}
+
+static int
+stats_fsync(FHANDLE fd)
+{
+    uint64_t t = vfs_stats_now();
+    int rv = REAL(fd)->fsync(fd);
+    ADD(STATS(fd)->fsync_ns, vfs_stats_now() - t);
+    ADD(STATS(fd)->fsyncs, 1);
+    return rv;
+}
+
+void
+vfs_stats_collect(struct vfs_stats_list *list)
+{
+    closing = list;
+}
+
+static int
+stats_close(FHANDLE fd)
+{
+    struct vfs_stats_layer *stats = fd->stats;
+    struct vfs_stats_list *list = closing;
+    size_t slot = 0;
+    int rv;
+    if (list) {
+        /* taken before the layers below close, so the order is that of IOCTL_VFS_GET_STATS */
+        slot = list->count++;
+    }
+    rv = stats->real.close(fd);
+    if (list && slot < list->max) {
+        list->layers[slot] = stats->stats;
+    }
+    free(stats);
+    return rv;
+}
+
+static int
+stats_ioctl(FHANDLE fd, unsigned long req, ...)
+{
+    int rv;
+    va_list ap;
+
+    /* the layer below sees exactly what we were given, typed as it reads it */
+    va_start(ap, req);
+    switch (req) {
+        case IOCTL_VFS_GET_STATS: {
+            struct vfs_stats_list *list = va_arg(ap, struct vfs_stats_list *);
+            if (list->count < list->max) {
+                list->layers[list->count] = *STATS(fd);
+            }
+            list->count++;
+            REAL(fd)->ioctl(fd, req, list); /* the layers below, if any */
+            rv = 0;
+            break;
+        }
+        case IOCTL_MEM_SNAPSHOT: {
+            FHANDLE *out = va_arg(ap, FHANDLE *);
+            int flags = va_arg(ap, int);
+            rv = REAL(fd)->ioctl(fd, req, out, flags);
+            break;
+        }
+        case IOCTL_MEM_RESERVE: {
+            size_t capacity = va_arg(ap, size_t);
+            rv = REAL(fd)->ioctl(fd, req, capacity);
+            break;
+        }
+        case IOCTL_MEM_SET_DIRTY_RANGE: {
+            size_t offset = va_arg(ap, size_t);
+            size_t length = va_arg(ap, size_t);
+            rv = REAL(fd)->ioctl(fd, req, offset, length);
+            break;
+        }
+        case IOCTL_IMG4_SET_TYPE: {
+            unsigned type = va_arg(ap, unsigned);
+            rv = REAL(fd)->ioctl(fd, req, type);
+            break;
+        }
+        case IOCTL_IMG4_SET_NONCE: {
+            uint64_t nonce = va_arg(ap, uint64_t);
+            rv = REAL(fd)->ioctl(fd, req, nonce);
+            break;
+        }
+        case IOCTL_IMG4_QUERY_PROP: {
+            const char *prop = va_arg(ap, char *);
+            unsigned char *out = va_arg(ap, unsigned char *);
+            size_t *len = va_arg(ap, size_t *);
+            rv = REAL(fd)->ioctl(fd, req, prop, out, len);
+            break;
+        }
+        case IOCTL_IMG4_QUERY_PROPS: {
+            const char *props = va_arg(ap, char *);
+            int objects = va_arg(ap, int);
+            img4_prop_cb cb = va_arg(ap, img4_prop_cb);
+            void *arg = va_arg(ap, void *);
+            rv = REAL(fd)->ioctl(fd, req, props, objects, cb, arg);
+            break;
+        }
+        case IOCTL_IMG4_SNAPSHOT: {
+            FHANDLE other = va_arg(ap, FHANDLE);
+            FHANDLE *out = va_arg(ap, FHANDLE *);
+            rv = REAL(fd)->ioctl(fd, req, other, out);
+            break;
+        }
+        default: {
+            /* everything else takes at most two pointers, or pointer and size */
+            void *a = va_arg(ap, void *);
+            void *b = va_arg(ap, void *);
+            rv = REAL(fd)->ioctl(fd, req, a, b);
+        }
+    }
+    va_end(ap);
+    return rv;
+}
+
+void
+vfs_stats_attach(FHANDLE fd, const char *layer, uint64_t since, size_t held)
+{
+    struct vfs_stats_layer *stats;
+
+    if (!fd || fd->stats) {
+        return;
+    }
+    stats = calloc(1, sizeof(*stats));
+    if (!stats) {
+        return;
+    }
+    stats->stats.layer = layer;
+    stats->stats.reopen_ns = vfs_stats_now() - since;
+    stats->stats.allocs = held != 0;
+    stats->stats.live_bytes = held;
+    stats->stats.peak_bytes = held;
+    stats->real = *fd;
+
+    fd->read = stats_read;
+    fd->write = stats_write;
+    fd->pread = stats_pread;
+    fd->pwrite = stats_pwrite;
+    fd->fsync = stats_fsync;
+    fd->close = stats_close;
+    fd->ioctl = stats_ioctl;
+    fd->stats = stats;
+}
+
+/* copy is a verbatim copy of a counting layer: give it counters of its own */
+int
+vfs_stats_fork(FHANDLE copy)
+{
+    struct vfs_stats_layer *stats = copy->stats;
+    if (!stats) {
+        return 0;
+    }
+    copy->stats = malloc(sizeof(*stats));
+    if (!copy->stats) {
+        /* not counting is better than sharing */
+        copy->read = stats->real.read;
+        copy->write = stats->real.write;
+        copy->pread = stats->real.pread;
+        copy->pwrite = stats->real.pwrite;
+        copy->fsync = stats->real.fsync;
+        copy->close = stats->real.close;
+        copy->ioctl = stats->real.ioctl;
+        return -1;
+    }
+    memset(copy->stats, 0, sizeof(*stats));
+    copy->stats->stats.layer = stats->stats.layer;
+    copy->stats->real = stats->real;
+    return 0;
+}
+
+void
+vfs_stats_buffer(FHANDLE fd, size_t capacity)
+{
+    struct vfs_stats *stats = STATS(fd);
+    ADD(stats->allocs, 1);
+    stats->live_bytes = capacity;
+    if (capacity > stats->peak_bytes) {
+        stats->peak_bytes = capacity;
+    }
+}
+
+void
+vfs_stats_scratch(FHANDLE fd, size_t size)
+{
+    struct vfs_stats *stats = STATS(fd);
+    ADD(stats->allocs, 1);
+    if (size > stats->peak_bytes) {
+        stats->peak_bytes = size;
+    }
+}
+
+const struct file_ops *
+vfs_stats_ops(FHANDLE fd)
+{
+    return fd->stats ? REAL(fd) : fd;
+}
@@ -1,7 +1,10 @@
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "vfs.h"
+#include "vfs_internal.h"
 
 struct file_ops_sub {
     struct file_ops ops;
@@ -88,6 +91,48 @@ sub_write(FHANDLE fd, const void *buf, size_t count)
     return n;
 }
 
+static ssize_t
+sub_pread(FHANDLE fd, void *buf, size_t count, off_t offset)
+{
+    FHANDLE other;
+    struct file_ops_sub *ctx = (struct file_ops_sub *)fd;
+
+    if (!fd || offset < 0) {
+        return -1;
+    }
+    other = ctx->other;
+
+    if ((size_t)offset > ctx->length) {
+        return 0;
+    }
+    if (count > ctx->length - offset) {
+        count = ctx->length - offset;
+    }
+
+    return other->pread(other, buf, count, ctx->start + offset);
+}
+
+static ssize_t
+sub_pwrite(FHANDLE fd, const void *buf, size_t count, off_t offset)
+{
+    FHANDLE other;
+    struct file_ops_sub *ctx = (struct file_ops_sub *)fd;
+
+    if (!fd || offset < 0) {
+        return -1;
+    }
+    other = ctx->other;
+
+    if ((size_t)offset > ctx->length) {
+        return -1;
+    }
+    if (count > ctx->length - offset) {
+        count = ctx->length - offset;
+    }
+
+    return other->pwrite(other, buf, count, ctx->start + offset);
+}
+
 static off_t
 sub_lseek(FHANDLE fd, off_t offset, int whence)
 {
@@ -177,9 +222,36 @@ sub_ioctl(FHANDLE fd, unsigned long req, ...)
     }
 
     va_start(ap, req);
+    other = ctx->other;
+    if (req == IOCTL_MEM_SNAPSHOT) {
+        FHANDLE *out = va_arg(ap, FHANDLE *);
+        int flags = va_arg(ap, int);
+        FHANDLE copy;
+        struct file_ops_sub *ops;
+        rv = other->ioctl(other, IOCTL_MEM_SNAPSHOT, &copy, flags);
+        if (rv == 0) {
+            ops = malloc(sizeof(*ops));
+            if (!ops) {
+                copy->close(copy);
+                rv = -1;
+            } else {
+                memcpy(ops, ctx, sizeof(*ops));
+                vfs_stats_fork(&ops->ops);
+                ops->other = copy;
+                ops->ops.flags = copy->flags;
+                *out = (FHANDLE)ops;
+            }
+        }
+        va_end(ap);
+        return rv;
+    }
+    if (req == IOCTL_MEM_RESERVE) {
+        size_t capacity = va_arg(ap, size_t);
+        va_end(ap);
+        return other->ioctl(other, req, ctx->start + capacity);
+    }
     a = va_arg(ap, void *);
     b = va_arg(ap, void *);
-    other = ctx->other;
     rv = other->ioctl(other, req, a, b); /* XXX varargs */
     va_end(ap);
     return rv;
@@ -190,6 +262,7 @@ sub_reopen(FHANDLE other, size_t offset, off_t length)
 {
     struct file_ops_sub *ops;
     FHANDLE fd;
+    STATS_SINCE(since);
 
     if (!other) {
         return NULL;
@@ -214,6 +287,8 @@ sub_reopen(FHANDLE other, size_t offset, off_t length)
 
     ops->ops.read = sub_read;
     ops->ops.write = sub_write;
+    ops->ops.pread = sub_pread;
+    ops->ops.pwrite = sub_pwrite;
     ops->ops.lseek = sub_lseek;
     ops->ops.ioctl = sub_ioctl;
     ops->ops.ftruncate = sub_ftruncate;
@@ -221,6 +296,9 @@ sub_reopen(FHANDLE other, size_t offset, off_t length)
     ops->ops.close = sub_close;
     ops->ops.length = sub_length;
     ops->ops.flags = other->flags;
+    ops->ops.alloc = other->alloc;
+    ops->ops.stats = NULL;
+    STATS_ATTACH(fd, "sub", since, 0);
     return fd;
 
   error:
@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "vfs.h"
+#include "vfs_internal.h"
+
+#ifdef VFS_TRACE
+
+/*
+ * every thread records into a ring of its own, so a span costs two clock
+ * reads and a few stores.  the lock is only taken the first time a thread
+ * records something, when it exits, and while writing the trace out.  the
+ * ring of a thread that exited goes to the next new one, so that the short
+ * lived workers of vfs_parallel_for do not grow the list without bound.
+ * once a ring wraps, its oldest spans are overwritten
+ */
+
+#define TRACE_RING      8192	/* spans per thread, a power of two */
+
+struct trace_span {
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    unsigned tid;
+};
+
+struct trace_ring {
+    struct trace_ring *next;
+    int busy;
+    size_t head;		/* spans ever recorded */
+    struct trace_span spans[TRACE_RING];
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static struct trace_ring *rings;
+static unsigned ntids;
+
+static __thread struct trace_ring *ring;
+static __thread unsigned tid;
+
+static void
+release_ring(void *arg)
+{
+    struct trace_ring *r = arg;
+    pthread_mutex_lock(&trace_lock);
+    r->busy = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void
+make_key(void)
+{
+    pthread_key_create(&trace_key, release_ring);
+}
+
+static struct trace_ring *
+claim_ring(void)
+{
+    struct trace_ring *r;
+
+    pthread_once(&trace_once, make_key);
+    pthread_mutex_lock(&trace_lock);
+    if (!tid) {
+        tid = ++ntids;
+    }
+    r = rings;
+    while (r && r->busy) {
+        r = r->next;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (r) {
+            r->next = rings;
+            rings = r;
+        }
+    }
+    if (r) {
+        r->busy = 1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (r) {
+        pthread_setspecific(trace_key, r);
+    }
+    return r;
+}
+
+void
+vfs_trace_span(const char *name, uint64_t start)
+{
+    uint64_t end = vfs_stats_now();
+    struct trace_span *span;
+    size_t head;
+
+    if (!ring) {
+        ring = claim_ring();
+        if (!ring) {
+            return;
+        }
+    }
+    head = ring->head;
+    span = &ring->spans[head & (TRACE_RING - 1)];
+    span->name = name;
+    span->start = start;
+    span->duration = end - start;
+    span->tid = tid;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+vfs_trace_write(const char *path)
+{
+    FILE *f;
+    struct trace_ring *r;
+    const char *sep = "";
+    int pid = getpid();
+
+    f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+    fprintf(f, "{\"traceEvents\":[");
+    pthread_mutex_lock(&trace_lock);
+    for (r = rings; r; r = r->next) {
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t i = head > TRACE_RING ? head - TRACE_RING : 0;
+        for (; i < head; i++) {
+            const struct trace_span *span = &r->spans[i & (TRACE_RING - 1)];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%d,\"tid\":%u}", sep, span->name,
+                    (unsigned long long)(span->start / 1000), (unsigned)(span->start % 1000),
+                    (unsigned long long)(span->duration / 1000), (unsigned)(span->duration % 1000),
+                    pid, span->tid);
+            sep = ",";
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    return fclose(f) ? -1 : 0;
+}
+
+#else
+
+int
+vfs_trace_write(const char *path)
+{
+    return -1;
+}
+
+#endif
@@ -13,7 +13,7 @@
 #define DO8(buf,i)  DO4(buf,i); DO4(buf,i+4);
 #define DO16(buf)   DO8(buf,0); DO8(buf,8);
 
-uint32_t lzadler32(uint8_t *buf, int32_t len)
+uint32_t lzadler32(uint8_t *buf, size_t len)
 {
     unsigned long s1 = 1; // adler & 0xffff;
     unsigned long s2 = 0; // (adler >> 16) & 0xffff;
@@ -74,12 +74,41 @@ struct encode_state {
 };
 
 
-int
-decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen)
+/* note where the flag byte at src starts, if it is far enough from the last one */
+static int
+add_checkpoint(struct lzss_checkpoint **cps, size_t *count, size_t raw, size_t comp)
+{
+    struct lzss_checkpoint *tmp = *cps;
+    if (*count && raw < tmp[*count - 1].raw + LZSS_CHECKPOINT_EVERY) {
+        return 0;
+    }
+    if ((*count & (*count - 1)) == 0) {
+        /* powers of two are where the array is full */
+        tmp = realloc(tmp, (*count ? *count * 2 : 16) * sizeof(*tmp));
+        if (!tmp) {
+            return -1;
+        }
+        *cps = tmp;
+    }
+    tmp[*count].raw = raw;
+    tmp[*count].comp = comp;
+    (*count)++;
+    return 0;
+}
+
+size_t
+decompress_lzss(uint8_t *dst, uint8_t *src, size_t srclen)
+{
+    return decompress_lzss_ex(dst, src, srclen, NULL, NULL);
+}
+
+size_t
+decompress_lzss_ex(uint8_t *dst, uint8_t *src, size_t srclen, struct lzss_checkpoint **cps, size_t *count)
 {
     /* ring buffer of size N, with extra F-1 bytes to aid string comparison */
     uint8_t text_buf[N + F - 1];
     uint8_t *dststart = dst;
+    uint8_t *srcstart = src;
     uint8_t *srcend = src + srclen;
     int  i, j, k, r, c;
     unsigned int flags;
@@ -92,6 +121,9 @@ decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen)
     flags = 0;
     for ( ; ; ) {
         if (((flags >>= 1) & 0x100) == 0) {
+            if (cps && add_checkpoint(cps, count, dst - dststart, src - srcstart)) {
+                cps = NULL;
+            }
             if (src < srcend) c = *src++; else break;
             flags = c | 0xFF00;  /* uses higher byte cleverly */
         }   /* to count eight */
@@ -232,18 +264,56 @@ static void delete_node(struct encode_state *sp, int p)
 }
 
 uint8_t *
-compress_lzss(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srcLen)
+compress_lzss(uint8_t *dst, size_t dstlen, uint8_t *src, size_t srcLen)
+{
+    return compress_lzss_tail(dst, dstlen, src, srcLen, 0, 0, NULL, NULL);
+}
+
+/*
+ * Put the encoder where it would be right before raw byte 'start': the
+ * window holds the N - F bytes before it (spaces where there are none yet),
+ * the lookahead the next F, and the trees every window position a run from
+ * 0 would still have in them.  The trees are shaped differently, so later
+ * matches may be too, but they only ever point at bytes the decoder has in
+ * its ring at that time.  Returns the lookahead length.
+ */
+static int resume_state(struct encode_state *sp, uint8_t *src, size_t srcLen, size_t start)
+{
+    int  i, len;
+    int  r = (N - F + start) & (N - 1);
+    size_t k = start > N - F ? start - (N - F) : 0;
+
+    for (; k < start; k++)
+        sp->text_buf[(N - F + k) & (N - 1)] = src[k];
+    for (len = 0; len < F && start + len < srcLen; len++)
+        sp->text_buf[(r + len) & (N - 1)] = src[start + len];
+    for (i = 0; i < F - 1; i++)
+        sp->text_buf[N + i] = sp->text_buf[i];
+
+    /* oldest first; the F space strings before byte 0 count as window */
+    for (i = start + F < N - F ? (int)start + F : N - F; i >= 1; i--)
+        insert_node(sp, (r - i) & (N - 1));
+    return len;
+}
+
+uint8_t *
+compress_lzss_tail(uint8_t *dst, size_t dstlen, uint8_t *src, size_t srcLen, size_t start, size_t dstoff,
+                   struct lzss_checkpoint **cps, size_t *count)
 {
     /* Encoding state, mostly tree but some current match stuff */
     struct encode_state *sp;
 
     int  i, c, len, r, s, last_match_length, code_buf_ptr;
     uint8_t code_buf[17], mask;
+    uint8_t *srcbase = src;
     uint8_t *srcend = src + srcLen;
+    uint8_t *dstbase = dst;
     uint8_t *dstend = dst + dstlen;
 
     /* initialize trees */
     sp = (struct encode_state *) malloc(sizeof(*sp));
+    if (!sp)
+        return (void *) 0;
     init_state(sp);
 
     /*
@@ -254,6 +324,18 @@ compress_lzss(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srcLen)
      */
     code_buf[0] = 0;
     code_buf_ptr = mask = 1;
+    dst += dstoff;
+
+    if (start) {
+        s = start & (N - 1);  r = (N - F + start) & (N - 1);
+        len = resume_state(sp, src, srcLen, start);
+        src += start + len;
+        if (!len) {
+            free(sp);
+            return dst;  /* nothing left after the prefix */
+        }
+        goto resumed;
+    }
 
     /* Clear the buffer with any character that will appear often. */
     s = 0;  r = N - F;
@@ -277,8 +359,12 @@ compress_lzss(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srcLen)
      * Finally, insert the whole string just read.
      * The global variables match_length and match_position are set.
      */
+  resumed:
     insert_node(sp, r);
     do {
+        /* a fresh flag byte is where decoding can pick up again */
+        if (mask == 1 && cps && add_checkpoint(cps, count, (src - srcbase) - len, dst - dstbase))
+            cps = NULL;
         /* match_length may be spuriously long near the end of text. */
         if (sp->match_length > len)
             sp->match_length = len;
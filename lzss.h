@@ -1,5 +1,25 @@
+#include <stddef.h>
 #include <stdint.h>
 
-uint32_t lzadler32(uint8_t *buf, int32_t len);
-int decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen);
-uint8_t *compress_lzss(uint8_t *dst, uint32_t dstlen, uint8_t *src, uint32_t srcLen);
+/* where a flag byte starts: raw bytes decoded before it, compressed bytes before it */
+struct lzss_checkpoint {
+    size_t raw;
+    size_t comp;
+};
+
+#define LZSS_CHECKPOINT_EVERY 65536
+
+uint32_t lzadler32(uint8_t *buf, size_t len);
+size_t decompress_lzss(uint8_t *dst, uint8_t *src, size_t srclen);
+uint8_t *compress_lzss(uint8_t *dst, size_t dstlen, uint8_t *src, size_t srcLen);
+
+/* same, appending a checkpoint to *cps about every LZSS_CHECKPOINT_EVERY raw bytes */
+size_t decompress_lzss_ex(uint8_t *dst, uint8_t *src, size_t srclen, struct lzss_checkpoint **cps, size_t *count);
+
+/*
+ * compress src[start..srcLen) after dst[0..dstoff), a stream that decodes to
+ * src[0..start) and ends where a flag byte would go (i.e. at a checkpoint).
+ * returns the end of the stream, like compress_lzss
+ */
+uint8_t *compress_lzss_tail(uint8_t *dst, size_t dstlen, uint8_t *src, size_t srcLen, size_t start, size_t dstoff,
+                            struct lzss_checkpoint **cps, size_t *count);
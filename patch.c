@@ -0,0 +1,578 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define PATCH_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "libvfs/vfs.h"
+#include "patch.h"
+
+#define PARALLEL_RUNS   65536   /* below this, one thread checks and applies */
+#define CHUNK_RUNS      16384
+
+/* runs as they come, before sorting; old bytes at 'at', new ones right after */
+struct raw_run {
+    uint64_t offset;
+    size_t length;
+    size_t at;
+};
+
+struct raw {
+    struct raw_run *runs;
+    size_t count;
+    size_t max;
+    uint8_t *bytes;
+    size_t used;
+    size_t capacity;
+};
+
+static int
+raw_add(struct raw *raw, uint64_t offset, size_t length, const uint8_t *ov, const uint8_t *nv)
+{
+    struct raw_run *run;
+
+    if (raw->count >= raw->max) {
+        size_t max = raw->max ? raw->max * 2 : 16;
+        struct raw_run *tmp = realloc(raw->runs, max * sizeof(struct raw_run));
+        if (!tmp) {
+            return -1;
+        }
+        raw->runs = tmp;
+        raw->max = max;
+    }
+    while (raw->used + 2 * length > raw->capacity) {
+        size_t capacity = raw->capacity ? raw->capacity * 2 : 64;
+        uint8_t *tmp = realloc(raw->bytes, capacity);
+        if (!tmp) {
+            return -1;
+        }
+        raw->bytes = tmp;
+        raw->capacity = capacity;
+    }
+    run = &raw->runs[raw->count++];
+    run->offset = offset;
+    run->length = length;
+    run->at = raw->used;
+    memcpy(raw->bytes + raw->used, ov, length);
+    memcpy(raw->bytes + raw->used + length, nv, length);
+    raw->used += 2 * length;
+    return 0;
+}
+
+static int
+load_text(struct raw *raw, const char *data, size_t size)
+{
+    char buf[BUFSIZ];
+
+    while (size) {
+        uint64_t off;
+        uint8_t ov, nv;
+        char *p, *q = buf;
+        const char *eol = memchr(data, '\n', size);
+        size_t len = eol ? (size_t)(eol - data) : size;
+        if (len >= sizeof(buf)) {
+            fprintf(stderr, "[e] patch: malformed line\n");
+            return -1;
+        }
+        memcpy(buf, data, len);
+        buf[len] = '\0';
+        data += len + !!eol;
+        size -= len + !!eol;
+
+        if (len && buf[len - 1] == '\r') {
+            buf[len - 1] = '\0';
+        }
+        buf[strcspn(buf, "#;")] = '\0';
+        if (buf[strspn(buf, " \t")] == '\0') {
+            continue;
+        }
+        p = q;
+        errno = 0;
+        off = strtoull(p, &q, 0);
+        if (errno || p == q) {
+            fprintf(stderr, "[e] patch: malformed line\n");
+            return -1;
+        }
+        p = q;
+        errno = 0;
+        ov = strtoul(p, &q, 0);
+        if (errno || p == q) {
+            fprintf(stderr, "[e] patch: malformed line\n");
+            return -1;
+        }
+        p = q;
+        errno = 0;
+        nv = strtoul(p, &q, 0);
+        if (errno || p == q) {
+            fprintf(stderr, "[e] patch: malformed line\n");
+            return -1;
+        }
+        if (raw_add(raw, off, 1, &ov, &nv)) {
+            fprintf(stderr, "[e] patch: out of memory\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+uleb128(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    unsigned shift;
+    *value = 0;
+    for (shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t c = *(*p)++;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int
+load_binary(struct raw *raw, const uint8_t *data, size_t size)
+{
+    const uint8_t *p = data + PATCH_MAGIC_SIZE;
+    const uint8_t *end = data + size;
+    uint64_t offset = 0;
+
+    while (p < end) {
+        uint64_t gap, length;
+        if (uleb128(&p, end, &gap) || uleb128(&p, end, &length) || !length || length > (size_t)(end - p) / 2 || offset + gap < offset) {
+            fprintf(stderr, "[e] patch: malformed run\n");
+            return -1;
+        }
+        offset += gap;
+        if (raw_add(raw, offset, length, p, p + length)) {
+            fprintf(stderr, "[e] patch: out of memory\n");
+            return -1;
+        }
+        p += 2 * length;
+        offset += length;
+    }
+    return 0;
+}
+
+static int
+by_offset(const void *a, const void *b)
+{
+    const struct raw_run *x = a;
+    const struct raw_run *y = b;
+    if (x->offset != y->offset) {
+        return (x->offset > y->offset) - (x->offset < y->offset);
+    }
+    /* storage is in file order */
+    return (x->at > y->at) - (x->at < y->at);
+}
+
+int
+patch_load(struct patch_set *set, const void *data, size_t size, int undo)
+{
+    struct raw raw;
+    struct patch_run *cur = NULL;
+    uint8_t *ov = NULL, *nv = NULL;
+    size_t i, j, total = 0;
+    int rv;
+
+    memset(set, 0, sizeof(*set));
+    memset(&raw, 0, sizeof(raw));
+    if (size >= PATCH_MAGIC_SIZE && !memcmp(data, PATCH_MAGIC, PATCH_MAGIC_SIZE)) {
+        rv = load_binary(&raw, data, size);
+    } else {
+        rv = load_text(&raw, data, size);
+    }
+    if (rv) {
+        goto done;
+    }
+
+    if (raw.count) {
+        qsort(raw.runs, raw.count, sizeof(struct raw_run), by_offset);
+    }
+
+    /* lay out old and new values of a merged run side by side */
+    rv = -1;
+    set->runs = malloc((raw.count + 1) * sizeof(struct patch_run));
+    set->bytes = malloc(raw.used + 1);
+    ov = malloc(raw.used / 2 + 1);
+    nv = malloc(raw.used / 2 + 1);
+    if (!set->runs || !set->bytes || !ov || !nv) {
+        fprintf(stderr, "[e] patch: out of memory\n");
+        goto merged;
+    }
+    for (i = 0; i <= raw.count; i++) {
+        const struct raw_run *r = i < raw.count ? &raw.runs[i] : NULL;
+        size_t start;
+        if (cur && r && r->offset <= cur->offset + cur->length) {
+            /* touches or overlaps the current run: overlapping bytes must agree */
+            start = cur->offset + cur->length - r->offset;
+            if (start > r->length) {
+                start = r->length;
+            }
+            for (j = 0; j < start; j++) {
+                size_t k = r->offset - cur->offset + j;
+                if (ov[k] != raw.bytes[r->at + j] || nv[k] != raw.bytes[r->at + r->length + j]) {
+                    fprintf(stderr, "[e] patch: conflicting entries at 0x%llx\n", (unsigned long long)(r->offset + j));
+                    goto merged;
+                }
+            }
+            memcpy(ov + cur->length, raw.bytes + r->at + start, r->length - start);
+            memcpy(nv + cur->length, raw.bytes + r->at + r->length + start, r->length - start);
+            cur->length += r->length - start;
+            continue;
+        }
+        if (cur) {
+            memcpy(set->bytes + total, undo ? nv : ov, cur->length);
+            cur->ov = set->bytes + total;
+            total += cur->length;
+            memcpy(set->bytes + total, undo ? ov : nv, cur->length);
+            cur->nv = set->bytes + total;
+            total += cur->length;
+        }
+        if (!r) {
+            break;
+        }
+        cur = &set->runs[set->count++];
+        cur->offset = r->offset;
+        cur->length = r->length;
+        memcpy(ov, raw.bytes + r->at, r->length);
+        memcpy(nv, raw.bytes + r->at + r->length, r->length);
+    }
+    rv = 0;
+
+  merged:
+    free(ov);
+    free(nv);
+    if (rv) {
+        patch_free(set);
+    }
+  done:
+    free(raw.runs);
+    free(raw.bytes);
+    return rv;
+}
+
+void
+patch_free(struct patch_set *set)
+{
+    free(set->runs);
+    free(set->bytes);
+    memset(set, 0, sizeof(*set));
+}
+
+enum {
+    RUN_APPLY,
+    RUN_PATCHED,                /* already has the new bytes */
+    RUN_MISMATCH
+};
+
+struct apply_job {
+    const struct patch_set *set;
+    uint8_t *buf;
+    uint8_t *state;
+};
+
+static void
+check_chunk(void *arg, size_t chunk)
+{
+    struct apply_job *job = arg;
+    size_t i, j, end = (chunk + 1) * CHUNK_RUNS;
+
+    if (end > job->set->count) {
+        end = job->set->count;
+    }
+    for (i = chunk * CHUNK_RUNS; i < end; i++) {
+        const struct patch_run *r = &job->set->runs[i];
+        const uint8_t *cv = job->buf + r->offset;
+        job->state[i] = RUN_APPLY;
+        if (!memcmp(cv, r->ov, r->length)) {
+            continue;
+        }
+        if (!memcmp(cv, r->nv, r->length)) {
+            job->state[i] = RUN_PATCHED;
+            continue;
+        }
+        for (j = 0; j < r->length; j++) {
+            if (cv[j] != r->ov[j] && cv[j] != r->nv[j]) {
+                job->state[i] = RUN_MISMATCH;
+                break;
+            }
+        }
+    }
+}
+
+static void
+apply_chunk(void *arg, size_t chunk)
+{
+    struct apply_job *job = arg;
+    size_t i, end = (chunk + 1) * CHUNK_RUNS;
+
+    if (end > job->set->count) {
+        end = job->set->count;
+    }
+    for (i = chunk * CHUNK_RUNS; i < end; i++) {
+        const struct patch_run *r = &job->set->runs[i];
+        if (job->state[i] != RUN_PATCHED) {
+            memcpy(job->buf + r->offset, r->nv, r->length);
+        }
+    }
+}
+
+int
+patch_apply(const struct patch_set *set, uint8_t *buf, size_t size, int force, unsigned nthreads)
+{
+    struct apply_job job;
+    size_t i, j, chunks = (set->count + CHUNK_RUNS - 1) / CHUNK_RUNS;
+
+    if (set->count < PARALLEL_RUNS) {
+        nthreads = 1;
+    }
+    for (i = 0; i < set->count; i++) {
+        const struct patch_run *r = &set->runs[i];
+        if (r->offset >= size || r->length > size - r->offset) {
+            fprintf(stderr, "[e] patch: offset 0x%llx too big\n", (unsigned long long)(r->offset + r->length - 1));
+            return -1;
+        }
+    }
+
+    job.set = set;
+    job.buf = buf;
+    job.state = malloc(set->count + 1);
+    if (!job.state) {
+        fprintf(stderr, "[e] patch: out of memory\n");
+        return -1;
+    }
+    vfs_parallel_for(chunks, nthreads, check_chunk, &job);
+
+    for (i = 0; i < set->count; i++) {
+        const struct patch_run *r = &set->runs[i];
+        if (job.state[i] == RUN_PATCHED && memcmp(r->ov, r->nv, r->length)) {
+            fprintf(stderr, "[w] patch: offset 0x%llx is already patched\n", (unsigned long long)r->offset);
+        }
+        if (job.state[i] == RUN_MISMATCH) {
+            const uint8_t *cv = buf + r->offset;
+            for (j = 0; cv[j] == r->ov[j] || cv[j] == r->nv[j]; j++) {
+                continue;
+            }
+            fprintf(stderr, "[w] patch: offset 0x%llx has %02x, expected %02x\n", (unsigned long long)(r->offset + j), cv[j], r->ov[j]);
+            if (!force) {
+                free(job.state);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    vfs_parallel_for(chunks, nthreads, apply_chunk, &job);
+    free(job.state);
+    return 0;
+}
+
+/* diff: the first byte at or after i where a and b differ (agree), or size */
+
+#define ONES    0x0101010101010101ULL
+#define HIGHS   0x8080808080808080ULL
+
+static size_t
+find_diff_generic(const uint8_t *a, const uint8_t *b, size_t i, size_t size)
+{
+    for (; i + 8 <= size; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) {
+            break;
+        }
+    }
+    for (; i < size && a[i] == b[i]; i++) {
+        continue;
+    }
+    return i;
+}
+
+static size_t
+find_same_generic(const uint8_t *a, const uint8_t *b, size_t i, size_t size)
+{
+    for (; i + 8 <= size; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        x ^= y;
+        if ((x - ONES) & ~x & HIGHS) {
+            break;
+        }
+    }
+    for (; i < size && a[i] != b[i]; i++) {
+        continue;
+    }
+    return i;
+}
+
+#ifdef PATCH_X86
+/* equal 64-byte lines are skipped with one test; most of a diff is those */
+static size_t __attribute__((target("avx2")))
+find_diff_avx2(const uint8_t *a, const uint8_t *b, size_t i, size_t size)
+{
+    for (; i + 64 <= size; i += 64) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(a + i + 32));
+        __m256i y0 = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i y1 = _mm256_loadu_si256((const __m256i *)(b + i + 32));
+        __m256i d = _mm256_or_si256(_mm256_xor_si256(x0, y0), _mm256_xor_si256(x1, y1));
+        if (!_mm256_testz_si256(d, d)) {
+            break;
+        }
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        unsigned m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return find_diff_generic(a, b, i, size);
+}
+
+static size_t __attribute__((target("avx2")))
+find_same_avx2(const uint8_t *a, const uint8_t *b, size_t i, size_t size)
+{
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return find_same_generic(a, b, i, size);
+}
+#elif defined(__aarch64__)
+static size_t
+find_diff_neon(const uint8_t *a, const uint8_t *b, size_t i, size_t size)
+{
+    for (; i + 64 <= size; i += 64) {
+        uint8x16_t d0 = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        uint8x16_t d1 = veorq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+        uint8x16_t d2 = veorq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+        uint8x16_t d3 = veorq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+        if (vmaxvq_u8(vorrq_u8(vorrq_u8(d0, d1), vorrq_u8(d2, d3)))) {
+            break;
+        }
+    }
+    return find_diff_generic(a, b, i, size);
+}
+#endif
+
+struct diff_out {
+    FHANDLE fd;
+    uint8_t buf[65536];
+    size_t used;
+    int error;
+};
+
+static void
+diff_flush(struct diff_out *out)
+{
+    if (out->used && !out->error && out->fd->write(out->fd, out->buf, out->used) != (ssize_t)out->used) {
+        out->error = -1;
+    }
+    out->used = 0;
+}
+
+static void
+diff_put(struct diff_out *out, const void *data, size_t length)
+{
+    if (out->used + length > sizeof(out->buf)) {
+        diff_flush(out);
+        if (length > sizeof(out->buf)) {
+            if (!out->error && out->fd->write(out->fd, data, length) != (ssize_t)length) {
+                out->error = -1;
+            }
+            return;
+        }
+    }
+    memcpy(out->buf + out->used, data, length);
+    out->used += length;
+}
+
+static void
+diff_uleb128(struct diff_out *out, uint64_t value)
+{
+    uint8_t tmp[10];
+    size_t n = 0;
+    do {
+        tmp[n] = value & 0x7f;
+        value >>= 7;
+        tmp[n++] |= value ? 0x80 : 0;
+    } while (value);
+    diff_put(out, tmp, n);
+}
+
+int
+patch_diff(const uint8_t *a, const uint8_t *b, size_t size, int binary, FHANDLE fd, uint64_t *changed)
+{
+    size_t (*find_diff)(const uint8_t *, const uint8_t *, size_t, size_t) = find_diff_generic;
+    size_t (*find_same)(const uint8_t *, const uint8_t *, size_t, size_t) = find_same_generic;
+    struct diff_out *out;
+    size_t i, j, end = 0;
+    uint64_t total = 0;
+    int rv;
+
+#ifdef PATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_diff = find_diff_avx2;
+        find_same = find_same_avx2;
+    }
+#elif defined(__aarch64__)
+    find_diff = find_diff_neon;
+#endif
+
+    out = malloc(sizeof(*out));
+    if (!out) {
+        fprintf(stderr, "[e] diff: out of memory\n");
+        return -1;
+    }
+    out->fd = fd;
+    out->used = 0;
+    out->error = 0;
+    if (binary) {
+        diff_put(out, PATCH_MAGIC, PATCH_MAGIC_SIZE);
+    }
+
+    for (i = find_diff(a, b, 0, size); i < size && !out->error; i = find_diff(a, b, j, size)) {
+        j = find_same(a, b, i, size);
+        total += j - i;
+        if (binary) {
+            diff_uleb128(out, i - end);
+            diff_uleb128(out, j - i);
+            diff_put(out, a + i, j - i);
+            diff_put(out, b + i, j - i);
+            end = j;
+            continue;
+        }
+        for (; i < j; i++) {
+            char line[64];
+            int n = snprintf(line, sizeof(line), "0x%llx 0x%02x 0x%02x\n", (unsigned long long)i, a[i], b[i]);
+            diff_put(out, line, n);
+        }
+    }
+    diff_flush(out);
+
+    rv = out->error;
+    free(out);
+    if (rv) {
+        fprintf(stderr, "[e] diff: cannot write patch\n");
+        return rv;
+    }
+    if (changed) {
+        *changed = total;
+    }
+    return 0;
+}
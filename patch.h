@@ -0,0 +1,45 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "libvfs/vfs.h"
+
+/*
+ * a patch set is a list of runs: bytes to check and bytes to put in their
+ * place, sorted by offset and merged where they touch.  patch_load takes
+ * either format:
+ *   text:   one "offset old new" per line, one byte each, '#' or ';' comments
+ *   binary: PATCH_MAGIC, then for every run, in ascending order:
+ *           uleb128 gap since the end of the previous run, uleb128 length,
+ *           'length' old bytes, 'length' new bytes
+ */
+
+#define PATCH_MAGIC "IMG4PTCH"
+#define PATCH_MAGIC_SIZE 8
+
+struct patch_run {
+    uint64_t offset;
+    size_t length;
+    const uint8_t *ov;
+    const uint8_t *nv;
+};
+
+struct patch_set {
+    struct patch_run *runs;
+    size_t count;
+    uint8_t *bytes;             /* old and new values of every run */
+};
+
+int patch_load(struct patch_set *set, const void *data, size_t size, int undo);
+void patch_free(struct patch_set *set);
+
+/*
+ * check every run against buf, then write the new bytes.  a run that is
+ * already patched is left alone; a run that is neither fails the whole set
+ * unless forced.  big sets are checked and applied on nthreads threads
+ */
+int patch_apply(const struct patch_set *set, uint8_t *buf, size_t size, int force, unsigned nthreads);
+
+/*
+ * write the patch that turns a into b, both size bytes, to fd; as text, or
+ * binary runs of consecutive changed bytes.  changed gets the byte count
+ */
+int patch_diff(const uint8_t *a, const uint8_t *b, size_t size, int binary, FHANDLE fd, uint64_t *changed);
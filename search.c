@@ -0,0 +1,627 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SEARCH_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "libvfs/vfs.h"
+#include "search.h"
+
+#define CHUNK_BYTES     (1 << 20)
+#define SAMPLE_EVERY    65536       /* histogram looks at the first SAMPLE_BYTES of every SAMPLE_EVERY */
+#define SAMPLE_BYTES    4096
+#define ANCHOR_MAX      8           /* longest fixed run fed to the automaton */
+#define NONE            ((uint32_t)-1)
+
+/* parsing */
+
+static int
+hexval(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* one token of byte pairs, appended to bytes/mask */
+static int
+parse_token(const char *tok, uint8_t *bytes, uint8_t *mask, size_t *n)
+{
+    size_t len = strlen(tok);
+    if (len & 1) {
+        return -1;
+    }
+    for (; *tok; tok += 2) {
+        int hi = tok[0] == '?' ? 0 : hexval(tok[0]);
+        int lo = tok[1] == '?' ? 0 : hexval(tok[1]);
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+        bytes[*n] = (hi << 4) | lo;
+        mask[*n] = (tok[0] == '?' ? 0 : 0xf0) | (tok[1] == '?' ? 0 : 0x0f);
+        (*n)++;
+    }
+    return 0;
+}
+
+static int
+parse_line(struct search_sig *sig, char *line)
+{
+    char *tok, *save = NULL;
+    const char *name;
+    size_t max = strlen(line) / 2 + 1;
+    size_t n = 0, r = 0, i;
+    int in_repl = 0;
+    uint8_t *tmp;
+
+    name = strtok_r(line, " \t", &save);
+    tmp = malloc(4 * max + strlen(name) + 1);
+    if (!tmp) {
+        fprintf(stderr, "[e] search: out of memory\n");
+        return -1;
+    }
+    sig->bytes = tmp;
+    sig->mask = tmp + max;
+    sig->repl = tmp + 2 * max;
+    sig->rmask = tmp + 3 * max;
+    sig->name = strcpy((char *)tmp + 4 * max, name);
+
+    while ((tok = strtok_r(NULL, " \t", &save)) != NULL) {
+        if (!strcmp(tok, "=>") && !in_repl) {
+            in_repl = 1;
+            continue;
+        }
+        if (in_repl ? parse_token(tok, sig->repl, sig->rmask, &r) : parse_token(tok, sig->bytes, sig->mask, &n)) {
+            fprintf(stderr, "[e] search: malformed signature '%s'\n", sig->name);
+            goto error;
+        }
+    }
+    if (!n || (in_repl && r != n)) {
+        fprintf(stderr, "[e] search: malformed signature '%s'\n", sig->name);
+        goto error;
+    }
+    for (i = 0; i < n && sig->mask[i] != 0xff; i++) {
+        continue;
+    }
+    if (i == n) {
+        fprintf(stderr, "[e] search: '%s' has no fixed bytes\n", sig->name);
+        goto error;
+    }
+    sig->length = n;
+    if (!in_repl) {
+        sig->repl = NULL;
+        sig->rmask = NULL;
+    }
+    return 0;
+
+  error:
+    free(tmp);
+    return -1;
+}
+
+int
+search_load(struct search_set *set, const void *data, size_t size)
+{
+    char *text, *line, *eol;
+    size_t max = 0;
+
+    memset(set, 0, sizeof(*set));
+    text = malloc(size + 1);
+    if (!text) {
+        fprintf(stderr, "[e] search: out of memory\n");
+        return -1;
+    }
+    memcpy(text, data, size);
+    text[size] = '\0';
+
+    for (line = text; line; line = eol) {
+        eol = strchr(line, '\n');
+        if (eol) {
+            *eol++ = '\0';
+        }
+        line[strcspn(line, "#\r")] = '\0';
+        line += strspn(line, " \t");
+        if (*line == '\0') {
+            continue;
+        }
+        if (set->count >= max) {
+            size_t n = max ? max * 2 : 16;
+            struct search_sig *tmp = realloc(set->sigs, n * sizeof(struct search_sig));
+            if (!tmp) {
+                fprintf(stderr, "[e] search: out of memory\n");
+                goto error;
+            }
+            set->sigs = tmp;
+            max = n;
+        }
+        if (parse_line(&set->sigs[set->count], line)) {
+            goto error;
+        }
+        set->count++;
+    }
+    free(text);
+    return 0;
+
+  error:
+    free(text);
+    search_free(set);
+    return -1;
+}
+
+void
+search_free(struct search_set *set)
+{
+    size_t i;
+    for (i = 0; i < set->count; i++) {
+        free(set->sigs[i].bytes);
+    }
+    free(set->sigs);
+    memset(set, 0, sizeof(*set));
+}
+
+void
+search_replace(const struct search_sig *sig, const uint8_t *cur, uint8_t *out)
+{
+    size_t i;
+    for (i = 0; i < sig->length; i++) {
+        out[i] = sig->repl ? (cur[i] & ~sig->rmask[i]) | sig->repl[i] : cur[i];
+    }
+}
+
+/* byte set scan: the next position at or after i holding one of the anchor bytes */
+
+struct byteset {
+    uint8_t member[256];
+    uint8_t lo[2][16];          /* bit h & 7 of lo[h >> 3][l] is set for byte (h << 4) | l */
+    uint8_t bits[16];
+};
+
+static void
+byteset_add(struct byteset *s, uint8_t c)
+{
+    s->member[c] = 1;
+    s->lo[c >> 7][c & 15] |= 1 << ((c >> 4) & 7);
+}
+
+static size_t
+find_member_generic(const struct byteset *s, const uint8_t *buf, size_t i, size_t end)
+{
+    for (; i < end && !s->member[buf[i]]; i++) {
+        continue;
+    }
+    return i;
+}
+
+#ifdef SEARCH_X86
+static size_t __attribute__((target("avx2")))
+find_member_avx2(const struct byteset *s, const uint8_t *buf, size_t i, size_t end)
+{
+    const __m256i t0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s->lo[0]));
+    const __m256i t1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s->lo[1]));
+    const __m256i bits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s->bits));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (; i + 32 <= end; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i lo = _mm256_and_si256(x, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+        /* the top bit of x picks the table for high nibbles 8..15 */
+        __m256i t = _mm256_blendv_epi8(_mm256_shuffle_epi8(t0, lo), _mm256_shuffle_epi8(t1, lo), x);
+        __m256i hit = _mm256_and_si256(t, _mm256_shuffle_epi8(bits, hi));
+        unsigned m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return find_member_generic(s, buf, i, end);
+}
+#elif defined(__aarch64__)
+static size_t
+find_member_neon(const struct byteset *s, const uint8_t *buf, size_t i, size_t end)
+{
+    const uint8x16_t t0 = vld1q_u8(s->lo[0]);
+    const uint8x16_t t1 = vld1q_u8(s->lo[1]);
+    const uint8x16_t bits = vld1q_u8(s->bits);
+    const uint8x16_t nibble = vdupq_n_u8(0x0f);
+    const uint8x16_t top = vdupq_n_u8(0x80);
+
+    for (; i + 16 <= end; i += 16) {
+        uint8x16_t x = vld1q_u8(buf + i);
+        uint8x16_t lo = vandq_u8(x, nibble);
+        uint8x16_t t = vbslq_u8(vcgeq_u8(x, top), vqtbl1q_u8(t1, lo), vqtbl1q_u8(t0, lo));
+        if (vmaxvq_u8(vandq_u8(t, vqtbl1q_u8(bits, vshrq_n_u8(x, 4))))) {
+            break;
+        }
+    }
+    return find_member_generic(s, buf, i, end);
+}
+#endif
+
+/* engine, built for one buffer since anchors depend on its byte frequencies */
+
+struct anchor {
+    size_t offset;              /* into the signature */
+    size_t length;
+    uint32_t next;              /* next signature ending in the same state */
+};
+
+struct engine {
+    const struct search_set *set;
+    const uint8_t *buf;
+    size_t size;
+    int use_ac;
+
+    /* byte set: signatures bucketed by anchor byte */
+    struct byteset bs;
+    size_t (*find_member)(const struct byteset *, const uint8_t *, size_t, size_t);
+    uint32_t start[257];
+    uint32_t *ids;
+    size_t *rare;               /* anchor byte of every signature */
+
+    /* automaton: full transition table, outputs chained through suffix links */
+    struct anchor *anchors;
+    uint32_t *delta;
+    uint32_t *out;              /* first signature ending in a state */
+    uint32_t *out_link;         /* nearest suffix state with outputs */
+    uint8_t *hit;
+    size_t nstates;
+
+    struct search_match **matches;
+    size_t *counts;
+    size_t *maxes;
+    int error;
+};
+
+static void
+sample_histogram(const uint8_t *buf, size_t size, uint64_t hist[256])
+{
+    size_t i, j;
+    memset(hist, 0, 256 * sizeof(uint64_t));
+    for (i = 0; i < size; i += SAMPLE_EVERY) {
+        size_t n = size - i < SAMPLE_BYTES ? size - i : SAMPLE_BYTES;
+        for (j = 0; j < n; j++) {
+            hist[buf[i + j]]++;
+        }
+    }
+}
+
+static size_t
+rarest_byte(const struct search_sig *sig, const uint64_t hist[256])
+{
+    size_t i, best = sig->length;
+    for (i = 0; i < sig->length; i++) {
+        if (sig->mask[i] == 0xff && (best == sig->length || hist[sig->bytes[i]] < hist[sig->bytes[best]])) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/* the longest fixed run, capped at ANCHOR_MAX; the rarer one on ties */
+static void
+best_run(const struct search_sig *sig, const uint64_t hist[256], struct anchor *a)
+{
+    size_t i, j;
+    uint64_t cost = 0;
+
+    a->length = 0;
+    for (i = 0; i < sig->length; i++) {
+        uint64_t c = 0;
+        for (j = i; j < sig->length && j - i < ANCHOR_MAX && sig->mask[j] == 0xff; j++) {
+            c += hist[sig->bytes[j]];
+        }
+        if (j - i > a->length || (j - i == a->length && c < cost)) {
+            a->offset = i;
+            a->length = j - i;
+            cost = c;
+        }
+    }
+}
+
+static int
+build_ac(struct engine *e, const uint64_t hist[256])
+{
+    const struct search_set *set = e->set;
+    size_t i, j, max = 1, head = 0, tail = 0;
+    uint32_t *fail = NULL, *queue = NULL;
+    int rv = -1;
+
+    e->anchors = malloc(set->count * sizeof(struct anchor));
+    if (!e->anchors) {
+        return -1;
+    }
+    for (i = 0; i < set->count; i++) {
+        best_run(&set->sigs[i], hist, &e->anchors[i]);
+        max += e->anchors[i].length;
+    }
+
+    e->delta = malloc(max * 256 * sizeof(uint32_t));
+    e->out = malloc(max * sizeof(uint32_t));
+    e->out_link = malloc(max * sizeof(uint32_t));
+    e->hit = malloc(max);
+    fail = malloc(max * sizeof(uint32_t));
+    queue = malloc(max * sizeof(uint32_t));
+    if (!e->delta || !e->out || !e->out_link || !e->hit || !fail || !queue) {
+        goto done;
+    }
+
+    /* trie */
+    memset(e->delta, 0xff, 256 * sizeof(uint32_t));
+    e->out[0] = NONE;
+    e->nstates = 1;
+    for (i = 0; i < set->count; i++) {
+        const struct search_sig *sig = &set->sigs[i];
+        struct anchor *a = &e->anchors[i];
+        uint32_t s = 0;
+        for (j = 0; j < a->length; j++) {
+            uint32_t *t = &e->delta[s * 256 + sig->bytes[a->offset + j]];
+            if (*t == NONE) {
+                *t = e->nstates;
+                memset(&e->delta[e->nstates * 256], 0xff, 256 * sizeof(uint32_t));
+                e->out[e->nstates++] = NONE;
+            }
+            s = *t;
+        }
+        a->next = e->out[s];
+        e->out[s] = i;
+    }
+
+    /* breadth first: fill the missing transitions from the failure state */
+    for (j = 0; j < 256; j++) {
+        uint32_t t = e->delta[j];
+        if (t == NONE) {
+            e->delta[j] = 0;
+        } else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    e->out_link[0] = NONE;
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        uint32_t f = fail[s];
+        e->out_link[s] = e->out[f] != NONE ? f : e->out_link[f];
+        for (j = 0; j < 256; j++) {
+            uint32_t t = e->delta[s * 256 + j];
+            if (t == NONE) {
+                e->delta[s * 256 + j] = e->delta[f * 256 + j];
+            } else {
+                fail[t] = e->delta[f * 256 + j];
+                queue[tail++] = t;
+            }
+        }
+    }
+    for (i = 0; i < e->nstates; i++) {
+        e->hit[i] = e->out[i] != NONE || e->out_link[i] != NONE;
+    }
+    rv = 0;
+
+  done:
+    free(fail);
+    free(queue);
+    return rv;
+}
+
+static int
+build_byteset(struct engine *e)
+{
+    const struct search_set *set = e->set;
+    size_t i;
+
+    e->ids = malloc(set->count * sizeof(uint32_t));
+    if (!e->ids) {
+        return -1;
+    }
+    memset(e->start, 0, sizeof(e->start));
+    for (i = 0; i < set->count; i++) {
+        e->start[set->sigs[i].bytes[e->rare[i]] + 1]++;
+    }
+    for (i = 0; i < 256; i++) {
+        e->start[i + 1] += e->start[i];
+    }
+    {
+        uint32_t fill[256];
+        memcpy(fill, e->start, sizeof(fill));
+        for (i = 0; i < set->count; i++) {
+            uint8_t c = set->sigs[i].bytes[e->rare[i]];
+            e->ids[fill[c]++] = i;
+            byteset_add(&e->bs, c);
+        }
+    }
+    return 0;
+}
+
+static void
+add_match(struct engine *e, size_t chunk, size_t sig, uint64_t start)
+{
+    const struct search_sig *s = &e->set->sigs[sig];
+    struct search_match *m;
+    size_t i;
+
+    if (start > e->size || s->length > e->size - start) {
+        return;
+    }
+    for (i = 0; i < s->length; i++) {
+        if ((e->buf[start + i] & s->mask[i]) != s->bytes[i]) {
+            return;
+        }
+    }
+    if (e->counts[chunk] >= e->maxes[chunk]) {
+        size_t max = e->maxes[chunk] ? e->maxes[chunk] * 2 : 16;
+        m = realloc(e->matches[chunk], max * sizeof(struct search_match));
+        if (!m) {
+            e->error = -1;
+            return;
+        }
+        e->matches[chunk] = m;
+        e->maxes[chunk] = max;
+    }
+    m = &e->matches[chunk][e->counts[chunk]++];
+    m->offset = start;
+    m->sig = sig;
+}
+
+static void
+scan_chunk(void *arg, size_t chunk)
+{
+    struct engine *e = arg;
+    const uint8_t *buf = e->buf;
+    size_t p = chunk * CHUNK_BYTES;
+    size_t end = p + CHUNK_BYTES < e->size ? p + CHUNK_BYTES : e->size;
+
+    if (e->use_ac) {
+        /* start early enough for anchors ending in this chunk */
+        size_t lo = p;
+        uint32_t s = 0;
+        for (p = lo > ANCHOR_MAX - 1 ? lo - (ANCHOR_MAX - 1) : 0; p < end; p++) {
+            uint32_t t;
+            s = e->delta[s * 256 + buf[p]];
+            if (!e->hit[s] || p < lo) {
+                continue;
+            }
+            for (t = e->out[s] != NONE ? s : e->out_link[s]; t != NONE; t = e->out_link[t]) {
+                uint32_t k;
+                for (k = e->out[t]; k != NONE; k = e->anchors[k].next) {
+                    const struct anchor *a = &e->anchors[k];
+                    if (p + 1 >= a->offset + a->length) {
+                        add_match(e, chunk, k, p + 1 - a->length - a->offset);
+                    }
+                }
+            }
+        }
+        return;
+    }
+
+    for (p = e->find_member(&e->bs, buf, p, end); p < end; p = e->find_member(&e->bs, buf, p + 1, end)) {
+        uint8_t c = buf[p];
+        uint32_t k;
+        for (k = e->start[c]; k < e->start[c + 1]; k++) {
+            size_t sig = e->ids[k];
+            if (p >= e->rare[sig]) {
+                add_match(e, chunk, sig, p - e->rare[sig]);
+            }
+        }
+    }
+}
+
+static int
+by_offset(const void *a, const void *b)
+{
+    const struct search_match *x = a;
+    const struct search_match *y = b;
+    if (x->offset != y->offset) {
+        return (x->offset > y->offset) - (x->offset < y->offset);
+    }
+    return (x->sig > y->sig) - (x->sig < y->sig);
+}
+
+int
+search_run(const struct search_set *set, const uint8_t *buf, size_t size, unsigned nthreads, struct search_match **matches, size_t *count)
+{
+    struct engine *e;
+    uint64_t hist[256], verify = 0, sampled = 0;
+    size_t i, n = 0, chunks = (size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    int rv = -1;
+
+    *matches = NULL;
+    *count = 0;
+    if (!set->count || !size) {
+        return 0;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        fprintf(stderr, "[e] search: out of memory\n");
+        return -1;
+    }
+    e->set = set;
+    e->buf = buf;
+    e->size = size;
+    e->rare = malloc(set->count * sizeof(size_t));
+    e->matches = calloc(chunks, sizeof(struct search_match *));
+    e->counts = calloc(chunks, sizeof(size_t));
+    e->maxes = calloc(chunks, sizeof(size_t));
+    if (!e->rare || !e->matches || !e->counts || !e->maxes) {
+        goto oom;
+    }
+
+    /*
+     * every hit on an anchor byte costs a verification per signature in
+     * its bucket.  past one in 16 positions, the automaton is cheaper
+     */
+    sample_histogram(buf, size, hist);
+    for (i = 0; i < 256; i++) {
+        sampled += hist[i];
+    }
+    for (i = 0; i < set->count; i++) {
+        e->rare[i] = rarest_byte(&set->sigs[i], hist);
+        verify += hist[set->sigs[i].bytes[e->rare[i]]];
+    }
+    e->use_ac = verify * 16 > sampled;
+
+    if (e->use_ac ? build_ac(e, hist) : build_byteset(e)) {
+        goto oom;
+    }
+    for (i = 0; i < 16; i++) {
+        e->bs.bits[i] = 1 << (i & 7);
+    }
+    e->find_member = find_member_generic;
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        e->find_member = find_member_avx2;
+    }
+#elif defined(__aarch64__)
+    e->find_member = find_member_neon;
+#endif
+
+    vfs_parallel_for(chunks, nthreads, scan_chunk, e);
+    if (e->error) {
+        goto oom;
+    }
+
+    for (i = 0; i < chunks; i++) {
+        n += e->counts[i];
+    }
+    *matches = malloc(n * sizeof(struct search_match) + 1);
+    if (!*matches) {
+        goto oom;
+    }
+    for (n = 0, i = 0; i < chunks; i++) {
+        memcpy(*matches + n, e->matches[i], e->counts[i] * sizeof(struct search_match));
+        n += e->counts[i];
+    }
+    qsort(*matches, n, sizeof(struct search_match), by_offset);
+    *count = n;
+    rv = 0;
+    goto done;
+
+  oom:
+    fprintf(stderr, "[e] search: out of memory\n");
+  done:
+    for (i = 0; e->matches && i < chunks; i++) {
+        free(e->matches[i]);
+    }
+    free(e->matches);
+    free(e->counts);
+    free(e->maxes);
+    free(e->rare);
+    free(e->ids);
+    free(e->anchors);
+    free(e->delta);
+    free(e->out);
+    free(e->out_link);
+    free(e->hit);
+    free(e);
+    return rv;
+}
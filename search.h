@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * masked byte signatures, searched for all at once.  a signature file has
+ * one signature per line, '#' starts a comment:
+ *   name  1f2003d5 ?? ?? 0? 94  [=> 1f2003d5 ?? ?? ?? d5]
+ * every byte is two hex digits, '?' for a nibble that does not matter.  the
+ * optional replacement, of the same length, turns matches into patches;
+ * nibbles left as '?' there are kept
+ */
+
+struct search_sig {
+    char *name;
+    size_t length;
+    uint8_t *bytes;             /* already masked */
+    uint8_t *mask;
+    uint8_t *repl;              /* NULL if there is no replacement */
+    uint8_t *rmask;
+};
+
+struct search_set {
+    struct search_sig *sigs;
+    size_t count;
+};
+
+struct search_match {
+    uint64_t offset;
+    size_t sig;
+};
+
+int search_load(struct search_set *set, const void *data, size_t size);
+void search_free(struct search_set *set);
+
+/*
+ * one pass over buf for the whole set.  signatures are anchored on their
+ * rarest fixed byte, and those are found with a SIMD byte-set scan; when the
+ * anchors are too common, the longest fixed runs go through an Aho-Corasick
+ * automaton instead.  matches are sorted by offset; free them when done
+ */
+int search_run(const struct search_set *set, const uint8_t *buf, size_t size, unsigned nthreads, struct search_match **matches, size_t *count);
+
+/* the bytes of a match after replacement */
+void search_replace(const struct search_sig *sig, const uint8_t *cur, uint8_t *out);
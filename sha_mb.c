@@ -0,0 +1,331 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sha_mb.h"
+
+/*
+ * the lanes are GCC/clang vector extensions: 256-bit vectors everywhere (SSE2
+ * pairs, NEON pairs), AVX2 and AVX-512 variants picked at run time on x86-64.
+ * each lane walks its own message; a lane that runs out picks up the next job
+ */
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define LOAD32_BE(p) \
+    (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#define LOAD64_BE(p) (((uint64_t)LOAD32_BE(p) << 32) | LOAD32_BE((p) + 4))
+#define STORE32_BE(p, v) do { \
+        (p)[0] = (unsigned char)((v) >> 24); (p)[1] = (unsigned char)((v) >> 16); \
+        (p)[2] = (unsigned char)((v) >> 8); (p)[3] = (unsigned char)(v); \
+    } while (0)
+#define STORE64_BE(p, v) do { STORE32_BE(p, (uint32_t)((v) >> 32)); STORE32_BE((p) + 4, (uint32_t)(v)); } while (0)
+
+#define SHA1_ROUND(f, k) do { \
+        if (i >= 16) { \
+            t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15]; \
+            w[i & 15] = ROL32(t, 1); \
+        } \
+        t = ROL32(a, 5) + (f) + e + (k) + w[i & 15]; \
+        e = d; d = c; c = ROL32(b, 30); b = a; a = t; \
+    } while (0)
+
+#define MAX_LANES       SHA_MB_MAX_LANES
+#define MAX_BLOCK       128
+
+static const uint64_t K512[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static const uint32_t sha1_iv[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static const uint64_t sha384_iv[8] = {
+    0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+    0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+#define MB_NAME(x)      x##_generic
+#define MB_TARGET
+#define MB_LANES32      8
+#define MB_LANES64      4
+#include "sha_mb_impl.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA_MB_X86
+
+#define MB_NAME(x)      x##_avx2
+#define MB_TARGET       __attribute__((target("avx2")))
+#define MB_LANES32      8
+#define MB_LANES64      4
+#include "sha_mb_impl.h"
+
+#define MB_NAME(x)      x##_avx512
+#define MB_TARGET       __attribute__((target("avx512f,avx512vl")))
+#define MB_LANES32      16
+#define MB_LANES64      8
+#include "sha_mb_impl.h"
+#endif
+
+struct engine {
+    unsigned lanes;
+    void (*compress)(void *state, const unsigned char *const *blocks);
+    void (*qwords)(const unsigned char *msgs, unsigned char *digests);
+};
+
+struct lane {
+    struct sha_mb_job *job;         /* NULL when idle */
+    const unsigned char *data;
+    size_t blocks;                  /* whole blocks left in data */
+    const unsigned char *next;      /* then these, out of pad */
+    unsigned tail;
+    unsigned char pad[2 * MAX_BLOCK];
+};
+
+static const unsigned char zero_block[MAX_BLOCK];
+
+struct engines {
+    struct engine sha1;
+    struct engine sha384;
+    unsigned sha1_useful;
+    unsigned sha384_useful;
+};
+
+static struct engines e;
+static pthread_once_t engines_once = PTHREAD_ONCE_INIT;
+
+static void
+pick_engines(void)
+{
+    e.sha1.lanes = 8;
+    e.sha1.compress = sha1_compress_generic;
+    e.sha1.qwords = sha1_qwords_generic;
+    e.sha384.lanes = 4;
+    e.sha384.compress = sha384_compress_generic;
+    e.sha384.qwords = sha384_qwords_generic;
+#ifdef SHA_MB_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+        e.sha1.lanes = 16;
+        e.sha1.compress = sha1_compress_avx512;
+        e.sha1.qwords = sha1_qwords_avx512;
+        e.sha384.lanes = 8;
+        e.sha384.compress = sha384_compress_avx512;
+        e.sha384.qwords = sha384_qwords_avx512;
+        e.sha1_useful = e.sha384_useful = 1;
+    } else if (__builtin_cpu_supports("avx2")) {
+        e.sha1.compress = sha1_compress_avx2;
+        e.sha1.qwords = sha1_qwords_avx2;
+        e.sha384.compress = sha384_compress_avx2;
+        e.sha384.qwords = sha384_qwords_avx2;
+        e.sha384_useful = 1;
+        /* eight SHA-1 lanes do not keep up with SHA-NI */
+        e.sha1_useful = !__builtin_cpu_supports("sha");
+    }
+#endif
+}
+
+static const struct engines *
+engines(void)
+{
+    pthread_once(&engines_once, pick_engines);
+    return &e;
+}
+
+unsigned
+sha1_mb_lanes(void)
+{
+    const struct engines *e = engines();
+    return e->sha1_useful ? e->sha1.lanes : 0;
+}
+
+unsigned
+sha384_mb_lanes(void)
+{
+    const struct engines *e = engines();
+    return e->sha384_useful ? e->sha384.lanes : 0;
+}
+
+/* scheduler *****************************************************************/
+
+static void
+lane_start(struct lane *lane, struct sha_mb_job *job, unsigned bs)
+{
+    size_t rem = job->length % bs;
+    unsigned lenbytes = bs / 8;     /* 64-bit length for SHA-1, 128-bit for SHA-384 */
+    unsigned n = (rem + 1 + lenbytes > bs) ? 2 : 1;
+    unsigned char *end;
+    uint64_t bits = (uint64_t)job->length << 3;
+    unsigned i;
+
+    lane->job = job;
+    lane->data = job->data;
+    lane->blocks = job->length / bs;
+    lane->next = lane->pad;
+    lane->tail = n;
+    memset(lane->pad, 0, n * bs);
+    memcpy(lane->pad, lane->data + lane->blocks * bs, rem);
+    lane->pad[rem] = 0x80;
+    end = lane->pad + n * bs - 8;
+    for (i = 0; i < 8; i++) {
+        end[i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    if (lenbytes > 8) {
+        end[-1] = (unsigned char)((uint64_t)job->length >> 61);
+    }
+}
+
+static const unsigned char *
+lane_next(struct lane *lane, unsigned bs)
+{
+    const unsigned char *p;
+    if (lane->blocks) {
+        p = lane->data;
+        lane->data += bs;
+        lane->blocks--;
+    } else {
+        p = lane->next;
+        lane->next += bs;
+        lane->tail--;
+    }
+    return p;
+}
+
+static int
+longest_first(const void *a, const void *b)
+{
+    size_t x = (*(struct sha_mb_job *const *)a)->length;
+    size_t y = (*(struct sha_mb_job *const *)b)->length;
+    return (x < y) - (x > y);
+}
+
+/* h[word][lane], words of 'size' bytes */
+static void
+run(const struct engine *e, unsigned bs, const void *iv, unsigned words, unsigned size, unsigned digestlen, struct sha_mb_job *jobs, size_t count)
+{
+    struct lane lanes[MAX_LANES];
+    const unsigned char *blocks[MAX_LANES];
+    unsigned char h[8 * 8 * MAX_LANES] __attribute__((aligned(64)));
+    struct sha_mb_job **order;
+    size_t next = 0;
+    unsigned i, j, active = 0;
+
+    /* long messages go first, so the short ones fill in around them */
+    order = malloc(count * sizeof(*order));
+    if (order) {
+        for (next = 0; next < count; next++) {
+            order[next] = &jobs[next];
+        }
+        qsort(order, count, sizeof(*order), longest_first);
+        next = 0;
+    }
+
+    memset(h, 0, sizeof(h));
+    for (i = 0; i < e->lanes; i++) {
+        lanes[i].job = NULL;
+    }
+    for (;;) {
+        for (i = 0; i < e->lanes && next < count; i++) {
+            if (!lanes[i].job) {
+                lane_start(&lanes[i], order ? order[next] : &jobs[next], bs);
+                for (j = 0; j < words; j++) {
+                    memcpy(h + (j * e->lanes + i) * size, (const unsigned char *)iv + j * size, size);
+                }
+                next++;
+                active++;
+            }
+        }
+        if (!active) {
+            break;
+        }
+        for (i = 0; i < e->lanes; i++) {
+            blocks[i] = lanes[i].job ? lane_next(&lanes[i], bs) : zero_block;
+        }
+        e->compress(h, blocks);
+        for (i = 0; i < e->lanes; i++) {
+            struct sha_mb_job *job = lanes[i].job;
+            if (job && !lanes[i].blocks && !lanes[i].tail) {
+                for (j = 0; j < digestlen; j++) {
+                    const unsigned char *word = h + (j / size * e->lanes + i) * size;
+                    uint64_t v;
+                    if (size == 4) {
+                        uint32_t v32;
+                        memcpy(&v32, word, 4);
+                        v = v32;
+                    } else {
+                        memcpy(&v, word, 8);
+                    }
+                    job->digest[j] = (unsigned char)(v >> (8 * (size - 1 - j % size)));
+                }
+                lanes[i].job = NULL;
+                active--;
+            }
+        }
+    }
+    free(order);
+}
+
+void
+sha1_mb(struct sha_mb_job *jobs, size_t count)
+{
+    run(&engines()->sha1, 64, sha1_iv, 5, 4, 20, jobs, count);
+}
+
+void
+sha384_mb(struct sha_mb_job *jobs, size_t count)
+{
+    run(&engines()->sha384, 128, sha384_iv, 8, 8, 48, jobs, count);
+}
+
+/* 8-byte messages ***********************************************************/
+
+static void
+qwords(const struct engine *e, unsigned digestlen, const void *msgs, size_t count, unsigned char *digests)
+{
+    const unsigned char *p = msgs;
+    unsigned char tmp[MAX_LANES * 8], out[MAX_LANES * 48];
+
+    for (; count >= e->lanes; count -= e->lanes) {
+        e->qwords(p, digests);
+        p += e->lanes * 8;
+        digests += e->lanes * digestlen;
+    }
+    if (count) {
+        memset(tmp, 0, sizeof(tmp));
+        memcpy(tmp, p, count * 8);
+        e->qwords(tmp, out);
+        memcpy(digests, out, count * digestlen);
+    }
+}
+
+void
+sha1_mb_qwords(const void *msgs, size_t count, unsigned char *digests)
+{
+    qwords(&engines()->sha1, 20, msgs, count, digests);
+}
+
+void
+sha384_mb_qwords(const void *msgs, size_t count, unsigned char *digests)
+{
+    qwords(&engines()->sha384, 48, msgs, count, digests);
+}
@@ -0,0 +1,31 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * multi-buffer hashing: independent messages are hashed side by side, one per
+ * vector lane.  it pays off with several messages of similar size; a single
+ * message is better served by the crypto library and its SHA instructions.
+ * sha*_mb_lanes() is how many messages are worth batching up on this CPU,
+ * 0 if hashing them one at a time with the library is faster anyway
+ */
+
+#define SHA_MB_MAX_LANES 16
+
+struct sha_mb_job {
+    const void *data;
+    size_t length;
+    unsigned char *digest;      /* 20 or 48 bytes */
+};
+
+unsigned sha1_mb_lanes(void);
+unsigned sha384_mb_lanes(void);
+void sha1_mb(struct sha_mb_job *jobs, size_t count);
+void sha384_mb(struct sha_mb_job *jobs, size_t count);
+
+/*
+ * count messages of exactly 8 bytes each, laid out back to back in msgs, as
+ * in a brute force search.  always worth the lanes: there is no padding to
+ * schedule and no call overhead per message.  digests gets count * 20 (48)
+ */
+void sha1_mb_qwords(const void *msgs, size_t count, unsigned char *digests);
+void sha384_mb_qwords(const void *msgs, size_t count, unsigned char *digests);
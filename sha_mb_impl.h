@@ -0,0 +1,153 @@
+/*
+ * lane compression functions, included by sha_mb.c once per instruction set.
+ * expects MB_NAME(x), MB_TARGET, MB_LANES32 and MB_LANES64.  state is laid
+ * out as h[word][lane]
+ */
+
+typedef uint32_t MB_NAME(v32) __attribute__((vector_size(4 * MB_LANES32)));
+typedef uint64_t MB_NAME(v64) __attribute__((vector_size(8 * MB_LANES64)));
+
+static inline MB_TARGET __attribute__((always_inline)) void
+MB_NAME(sha1_rounds)(MB_NAME(v32) *h, MB_NAME(v32) *w)
+{
+    MB_NAME(v32) a, b, c, d, e, t;
+    unsigned i;
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for (i = 0; i < 20; i++) {
+        SHA1_ROUND(d ^ (b & (c ^ d)), 0x5A827999);
+    }
+    for (; i < 40; i++) {
+        SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1);
+    }
+    for (; i < 60; i++) {
+        SHA1_ROUND((b & c) | (d & (b | c)), 0x8F1BBCDC);
+    }
+    for (; i < 80; i++) {
+        SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6);
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+static inline MB_TARGET __attribute__((always_inline)) void
+MB_NAME(sha384_rounds)(MB_NAME(v64) *h, MB_NAME(v64) *w)
+{
+    MB_NAME(v64) a, b, c, d, e, f, g, k, t1, t2;
+    unsigned i;
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            MB_NAME(v64) s0 = w[(i + 1) & 15], s1 = w[(i + 14) & 15];
+            s0 = ROR64(s0, 1) ^ ROR64(s0, 8) ^ (s0 >> 7);
+            s1 = ROR64(s1, 19) ^ ROR64(s1, 61) ^ (s1 >> 6);
+            w[i & 15] += s0 + s1 + w[(i + 9) & 15];
+        }
+        t1 = k + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) + (g ^ (e & (f ^ g))) + K512[i] + w[i & 15];
+        t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) + ((a & b) | (c & (a | b)));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static MB_TARGET void
+MB_NAME(sha1_compress)(void *state, const unsigned char *const *blocks)
+{
+    MB_NAME(v32) w[16];
+    uint32_t x[16][MB_LANES32];
+    unsigned i, l;
+
+    /* transpose: word i of every lane's block goes into w[i] */
+    for (l = 0; l < MB_LANES32; l++) {
+        for (i = 0; i < 16; i++) {
+            x[i][l] = LOAD32_BE(blocks[l] + 4 * i);
+        }
+    }
+    memcpy(w, x, sizeof(w));
+    MB_NAME(sha1_rounds)(state, w);
+}
+
+static MB_TARGET void
+MB_NAME(sha384_compress)(void *state, const unsigned char *const *blocks)
+{
+    MB_NAME(v64) w[16];
+    uint64_t x[16][MB_LANES64];
+    unsigned i, l;
+
+    for (l = 0; l < MB_LANES64; l++) {
+        for (i = 0; i < 16; i++) {
+            x[i][l] = LOAD64_BE(blocks[l] + 8 * i);
+        }
+    }
+    memcpy(w, x, sizeof(w));
+    MB_NAME(sha384_rounds)(state, w);
+}
+
+/* one 8-byte message per lane: the rest of the block is padding we know */
+static MB_TARGET void
+MB_NAME(sha1_qwords)(const unsigned char *msgs, unsigned char *digests)
+{
+    MB_NAME(v32) h[5], w[16], zero = { 0 };
+    uint32_t x[5][MB_LANES32];
+    unsigned i, l;
+
+    for (l = 0; l < MB_LANES32; l++) {
+        x[0][l] = LOAD32_BE(msgs + 8 * l);
+        x[1][l] = LOAD32_BE(msgs + 8 * l + 4);
+    }
+    memcpy(&w[0], x[0], sizeof(w[0]));
+    memcpy(&w[1], x[1], sizeof(w[1]));
+    w[2] = zero + 0x80000000;
+    for (i = 3; i < 15; i++) {
+        w[i] = zero;
+    }
+    w[15] = zero + 64;
+    for (i = 0; i < 5; i++) {
+        h[i] = zero + sha1_iv[i];
+    }
+
+    MB_NAME(sha1_rounds)(h, w);
+
+    memcpy(x, h, sizeof(x));
+    for (l = 0; l < MB_LANES32; l++) {
+        for (i = 0; i < 5; i++) {
+            STORE32_BE(digests + 20 * l + 4 * i, x[i][l]);
+        }
+    }
+}
+
+static MB_TARGET void
+MB_NAME(sha384_qwords)(const unsigned char *msgs, unsigned char *digests)
+{
+    MB_NAME(v64) h[8], w[16], zero = { 0 };
+    uint64_t x[8][MB_LANES64];
+    unsigned i, l;
+
+    for (l = 0; l < MB_LANES64; l++) {
+        x[0][l] = LOAD64_BE(msgs + 8 * l);
+    }
+    memcpy(&w[0], x[0], sizeof(w[0]));
+    w[1] = zero + 0x8000000000000000ULL;
+    for (i = 2; i < 15; i++) {
+        w[i] = zero;
+    }
+    w[15] = zero + 64;
+    for (i = 0; i < 8; i++) {
+        h[i] = zero + sha384_iv[i];
+    }
+
+    MB_NAME(sha384_rounds)(h, w);
+
+    memcpy(x, h, sizeof(x));
+    for (l = 0; l < MB_LANES64; l++) {
+        for (i = 0; i < 6; i++) {
+            STORE64_BE(digests + 48 * l + 8 * i, x[i][l]);
+        }
+    }
+}
+
+#undef MB_NAME
+#undef MB_TARGET
+#undef MB_LANES32
+#undef MB_LANES64